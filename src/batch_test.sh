@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# Change to the root directory of the project
+cd "$(dirname "$0")/.." || exit
+
+# Ensure the disk file is created and initialized
+rm -rf bin
+bash script/init_diskfile.sh
+make
+./bin/heartyfs_init
+
+# Create test content
+echo "This is a test file for heartyfs_batch." > external_file.txt
+
+# Test cases
+echo "Test case 1: Run a script from stdin"
+./bin/heartyfs_batch -v <<SCRIPT
+# Build a small tree in one mount
+mkdir /test_dir
+mkdir /test_dir/nested_dir
+creat /test_dir/nested_dir/file.txt
+write /test_dir/nested_dir/file.txt external_file.txt
+read /test_dir/nested_dir/file.txt
+SCRIPT
+echo
+
+echo "Test case 2: Report failing commands and keep going"
+./bin/heartyfs_batch <<SCRIPT
+mkdir /test_dir
+creat /nonexistent_dir/file.txt
+rmdir /test_dir
+bogus /test_dir
+read /test_dir/nested_dir/file.txt
+SCRIPT
+echo "Exit status: $?"
+echo
+
+echo "Test case 3: Stop at the first failing command"
+./bin/heartyfs_batch -e <<SCRIPT
+rm /test_dir/nested_dir/file.txt
+rm /test_dir/nested_dir/file.txt
+rmdir /test_dir/nested_dir
+SCRIPT
+echo "Exit status: $?"
+echo
+
+echo "Test case 4: Run a script file"
+printf 'rmdir /test_dir/nested_dir\nrmdir /test_dir\n' > batch_script.txt
+./bin/heartyfs_batch -v batch_script.txt
+echo
+
+echo "Test case 5: Make every command durable before the next one"
+./bin/heartyfs_batch -v -D sync <<SCRIPT
+creat /durable.txt
+write /durable.txt external_file.txt
+read /durable.txt
+rm /durable.txt
+SCRIPT
+./bin/heartyfs_batch -D eventually < /dev/null
+echo
+
+# Clean up
+rm external_file.txt batch_script.txt
+
+echo "Test completed."
@@ -0,0 +1,157 @@
+#!/bin/bash
+
+# Change to the root directory of the project
+cd "$(dirname "$0")/.." || exit
+
+# Ensure the disk file is created and initialized
+rm -rf bin
+bash script/init_diskfile.sh
+make
+./bin/heartyfs_init -s 16M
+
+WRITERS=8
+FILES=100
+APPENDS=50
+
+# Every writer has its own content, of its own length
+for i in $(seq 1 $WRITERS); do
+    yes "writer $i" | head -c $((200 + i * 150)) > writer_$i.txt
+done
+
+# Create, fill and read back FILES files per writer in one directory
+fill_files() {
+    for n in $(seq 1 $FILES); do
+        echo "creat $2/w$1_$n"
+        echo "write $2/w$1_$n writer_$1.txt"
+    done | ./bin/heartyfs_batch
+}
+
+check_files() {
+    for i in $(seq 1 $WRITERS); do
+        for n in $(seq 1 $FILES); do
+            echo "read $1/w${i}_$n"
+        done | ./bin/heartyfs_batch > read_back.txt
+        for n in $(seq 1 $FILES); do
+            cat writer_$i.txt
+        done | cmp -s - read_back.txt || echo "Writer $i: contents differ"
+    done
+    echo "$(./bin/heartyfs_export "$1" | tar tf - | grep -c /w) files listed"
+}
+
+# Race to make and remove the same directories and files in them
+churn() {
+    for n in $(seq 1 20); do
+        echo "mkdir /shared/d$((n % 5))"
+        echo "creat /shared/d$((n % 5))/f$1"
+        echo "write /shared/d$((n % 5))/f$1 writer_$1.txt"
+        echo "rm /shared/d$((n % 5))/f$1"
+        echo "rmdir /shared/d$((n % 5))"
+    done | ./bin/heartyfs_batch 2> /dev/null
+}
+
+# Run the whole workload on the image as it is now
+run_workload() {
+    ./bin/heartyfs_batch <<< "mkdir /shared"
+    for i in $(seq 1 $WRITERS); do
+        fill_files $i /shared &
+    done
+    wait
+    check_files /shared
+    ./bin/heartyfs_fsck | tail -n 1
+}
+
+# Test cases
+echo "Test case 1: Many writers fill one directory at once"
+run_workload
+echo
+
+echo "Test case 2: Writers race to make and remove the same names"
+for i in $(seq 1 $WRITERS); do
+    churn $i &
+done
+wait
+for n in $(seq 0 4); do
+    echo "rmdir /shared/d$n"
+done | ./bin/heartyfs_batch 2> /dev/null
+check_files /shared
+./bin/heartyfs_fsck | tail -n 1
+echo
+
+echo "Test case 3: Appends from several processes all land"
+./bin/heartyfs_batch <<< "creat /log.txt"
+for i in $(seq 1 $WRITERS); do
+    (
+        for n in $(seq 1 $APPENDS); do
+            echo "writer $i line $n" | ./bin/heartyfs_write --append /log.txt - > /dev/null
+        done
+    ) &
+done
+wait
+./bin/heartyfs_read /log.txt > log.txt
+echo "$(wc -l < log.txt) lines"
+for i in $(seq 1 $WRITERS); do
+    grep "^writer $i line" log.txt | cut -d' ' -f4 | sort -n | uniq |
+        cmp -s - <(seq 1 $APPENDS) || echo "Writer $i: lines lost"
+done
+./bin/heartyfs_fsck | tail -n 1
+echo
+
+echo "Test case 4: Export and fsck while writers run"
+./bin/heartyfs_batch <<< "mkdir /busy"
+for i in $(seq 1 $WRITERS); do
+    fill_files $i /busy &
+done
+./bin/heartyfs_export / | tar tf - > /dev/null
+echo "Export exit status ${PIPESTATUS[0]}"
+./bin/heartyfs_fsck | tail -n 1
+wait
+check_files /busy
+./bin/heartyfs_fsck | tail -n 1
+echo
+
+echo "Test case 5: A writer killed in the middle does not block the others"
+./bin/heartyfs_batch <<< "mkdir /killed"
+# Another mount keeps the lock table, so the dead writer's locks stay in it
+sleep 2 | ./bin/heartyfs_batch &
+HOLDER=$!
+# The writer never runs out of work, so it is always killed mid-stream
+for ((n = 0; ; n++)); do
+    echo "creat /killed/k$((n % 50))"
+    echo "write /killed/k$((n % 50)) writer_1.txt"
+    echo "rm /killed/k$((n % 50))"
+done 2> /dev/null | ./bin/heartyfs_batch 2> /dev/null &
+KILLED=$!
+sleep 0.5
+kill -9 $KILLED
+wait $KILLED 2> /dev/null
+timeout 10 ./bin/heartyfs_batch <<< "creat /after_kill.txt"
+echo "Exit status $?"
+wait $HOLDER
+./bin/heartyfs_fsck -y > /dev/null
+echo
+
+echo "Test case 6: Journaled image"
+./bin/heartyfs_init -s 16M -j 1M > /dev/null
+run_workload
+echo
+
+echo "Test case 7: Image with checksums and snapshots"
+./bin/heartyfs_init -s 16M -C -S > /dev/null
+./bin/heartyfs_batch <<< "snapshot before"
+run_workload
+echo
+
+echo "Test case 8: The last mount removes the lock table"
+SHM_NAME=$(printf "heartyfs.%x.%x" $(stat -c "%d %i" /tmp/heartyfs))
+if [ -e /dev/shm/$SHM_NAME ]; then
+    echo "Lock table left behind"
+    rm -f /dev/shm/$SHM_NAME
+else
+    echo "Lock table removed"
+fi
+echo
+
+# Clean up
+rm -f writer_*.txt read_back.txt log.txt
+
+echo "Test completed."
@@ -35,6 +35,15 @@ echo "Test case 5: Create multiple files in the same directory"
 ./bin/heartyfs_creat /test_dir/file3.txt
 echo
 
+echo "Test case 6: Grow a directory past its 14 inline entries"
+./bin/heartyfs_mkdir /big_dir
+for i in $(seq 1 100); do
+    ./bin/heartyfs_creat /big_dir/file$i.txt > /dev/null || echo "file$i.txt failed"
+done
+./bin/heartyfs_creat /big_dir/file50.txt
+./bin/heartyfs_creat /big_dir/file101.txt
+echo
+
 # Add more test cases as needed
 
 echo "Test completed."
\ No newline at end of file
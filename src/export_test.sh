@@ -0,0 +1,52 @@
+#!/bin/bash
+
+# Change to the root directory of the project
+cd "$(dirname "$0")/.." || exit
+
+# Ensure the disk file is created and initialized
+rm -rf bin
+sh script/init_diskfile.sh
+make
+./bin/heartyfs_init -S
+
+# Create a host tree to load and compare against
+mkdir -p export_src/docs/drafts export_src/empty_dir
+echo "This is the content of the test file." > export_src/notes.txt
+head -c 3000 /dev/zero | tr '\0' 'a' > export_src/docs/long.txt
+head -c 20000 /dev/zero | tr '\0' 'b' > export_src/docs/drafts/longer.txt
+: > export_src/docs/empty.txt
+for i in $(seq 1 20); do
+    echo "file $i" > "export_src/docs/file_$i.txt"
+done
+./bin/heartyfs_import export_src /exported > /dev/null
+
+# Test cases
+echo "Test case 1: Export a directory and list the archive"
+./bin/heartyfs_export /exported/docs/drafts | tar -tf -
+echo
+
+echo "Test case 2: Export a directory and unpack it"
+mkdir export_dst
+./bin/heartyfs_export -v /exported | tar -xf - -C export_dst
+diff -r export_src export_dst/exported && echo "Unpacked tree matches"
+rm -r export_dst
+echo
+
+echo "Test case 3: Export a single file"
+./bin/heartyfs_export /exported/notes.txt | tar -xOf -
+echo
+
+echo "Test case 4: Export a snapshot after the live tree has changed"
+./bin/heartyfs_snapshot first
+./bin/heartyfs_rm /exported/docs/long.txt
+./bin/heartyfs_export /.snapshots/first | tar -tf - | grep long.txt
+echo
+
+echo "Test case 5: Export a path that does not exist"
+./bin/heartyfs_export /missing > /dev/null
+echo
+
+# Clean up
+rm -r export_src
+
+echo "Test completed."
@@ -0,0 +1,115 @@
+#!/bin/bash
+
+# Change to the root directory of the project
+cd "$(dirname "$0")/.." || exit
+
+# Ensure the disk file is created and initialized
+rm -rf bin
+sh script/init_diskfile.sh
+make
+./bin/heartyfs_init
+
+# Set bits in one byte of the bitmap in block 1, marking blocks free
+mark_free() {
+    local offset=$((512 + $1 / 8))
+    local old
+    old=$(od -An -tu1 -j "$offset" -N 1 /tmp/heartyfs)
+    printf "$(printf '\\%03o' $((old | $2)))" |
+        dd of=/tmp/heartyfs bs=1 seek="$offset" conv=notrunc status=none
+}
+
+# Clear bits in one byte of the bitmap, marking blocks in use
+mark_used() {
+    local offset=$((512 + $1 / 8))
+    local old
+    old=$(od -An -tu1 -j "$offset" -N 1 /tmp/heartyfs)
+    printf "$(printf '\\%03o' $((old & ~$2 & 255)))" |
+        dd of=/tmp/heartyfs bs=1 seek="$offset" conv=notrunc status=none
+}
+
+# Create test content
+echo "This is the content of the test file." > external_file.txt
+head -c 3000 /dev/zero | tr '\0' 'x' > external_file_long.txt
+
+# Test cases
+echo "Test case 1: Check a clean tree"
+./bin/heartyfs_batch <<SCRIPT
+mkdir /docs
+creat /docs/a.txt
+write /docs/a.txt external_file_long.txt
+creat /b.txt
+write /b.txt external_file.txt
+SCRIPT
+./bin/heartyfs_fsck
+echo "Exit status $?"
+echo
+
+echo "Test case 2: Find and reclaim a leaked block"
+mark_used 2040 0x80
+./bin/heartyfs_fsck
+echo "Exit status $?"
+./bin/heartyfs_fsck -y > /dev/null
+echo "Exit status $?"
+./bin/heartyfs_fsck
+echo "Exit status $?"
+echo
+
+echo "Test case 3: Mark blocks in use that are marked free"
+mark_free 0 0x0c
+./bin/heartyfs_fsck -y
+echo "Exit status $?"
+./bin/heartyfs_creat /c.txt
+./bin/heartyfs_read /b.txt
+./bin/heartyfs_fsck -t 4
+echo "Exit status $?"
+echo
+
+echo "Test case 4: Drop an entry whose file was overwritten"
+dd if=/dev/zero of=/tmp/heartyfs bs=512 seek=3 count=1 conv=notrunc status=none
+./bin/heartyfs_fsck -y
+echo "Exit status $?"
+./bin/heartyfs_read /docs/a.txt
+./bin/heartyfs_creat /docs/a.txt
+./bin/heartyfs_fsck
+echo "Exit status $?"
+echo
+
+echo "Test case 5: Check snapshots sharing blocks with the live tree"
+./bin/heartyfs_init -S > /dev/null
+./bin/heartyfs_batch <<SCRIPT
+mkdir /docs
+creat /docs/a.txt
+write /docs/a.txt external_file_long.txt
+snapshot first
+write /docs/a.txt external_file.txt
+creat /b.txt
+snapshot second
+rm /b.txt
+SCRIPT
+./bin/heartyfs_fsck -t 4
+echo "Exit status $?"
+echo
+
+echo "Test case 6: Check through a mount that has removed files since its last commit"
+./bin/heartyfs_init -j 64K > /dev/null
+./bin/heartyfs_batch <<SCRIPT
+mkdir /docs
+creat /docs/a.txt
+write /docs/a.txt external_file_long.txt
+creat /b.txt
+write /b.txt external_file.txt
+rm /docs/a.txt
+rmdir /docs
+fsck
+rm /b.txt
+fsck
+SCRIPT
+echo "Exit status $?"
+./bin/heartyfs_fsck
+echo "Exit status $?"
+echo
+
+# Clean up
+rm external_file.txt external_file_long.txt
+
+echo "Test completed."
@@ -6,30 +6,199 @@
 #include <unistd.h>
 
 #define DISK_FILE_PATH "/tmp/heartyfs"
-#define BLOCK_SIZE (1 << 9)
-#define DISK_SIZE (1 << 20)
+#define BLOCK_SIZE (1 << 9)         // Default block size; also struct size
+#define DISK_SIZE (1 << 20)         // Default image size
 #define NUM_BLOCK (DISK_SIZE / BLOCK_SIZE)
+#define MIN_BLOCK_SIZE (1 << 9)
+#define MAX_BLOCK_SIZE (1 << 16)
+#define HEARTYFS_MAGIC 0x59465348   // "HSFY" in little-endian
+#define HEARTYFS_EXT_MAGIC 0x54584548       // "HEXT"
+#define HEARTYFS_JOURNAL_MAGIC 0x4C4E524A   // "JRNL"
+#define HEARTYFS_JDESC_MAGIC 0x4353444A     // "JDSC"
+#define HEARTYFS_JCOMMIT_MAGIC 0x544D434A   // "JCMT"
+#define HEARTYFS_ZMAGIC 0x504D435A          // "ZCMP"
 
 struct heartyfs_dir_entry {
     int block_id;           // 4 bytes
     char file_name[28];     // 28 bytes
 };  // Overall: 32 bytes
 
+/*
+ * A directory starts with its 14 entries inline. Once they are full it
+ * switches to a hash index (index_block != 0): the inline array then only
+ * holds . and .., the other entries live in hashed leaf blocks, and size
+ * still counts every entry including . and ..
+ */
 struct heartyfs_directory {
-    int type;
+    short type;
+    unsigned short flags;   // 0 for directories
     char name[28];
     int size;
     struct heartyfs_dir_entry entries[14];
+    int index_block;        // 4 bytes: struct heartyfs_dir_index, or 0
+};  // Overall: 488 bytes
+
+/*
+ * The hash index is an extendible hash on the FNV-1a hash of the name.
+ * The index block lists the pages of a table of 1 << global_depth leaf
+ * block ids (block_size / 4 ids per page); slot (hash & mask) names the
+ * leaf that holds the entry. A full leaf is split in two, doubling the
+ * table when needed. Once the table cannot grow further, full leaves
+ * chain to overflow leaves instead.
+ */
+struct heartyfs_dir_index {
+    int global_depth;       // 4 bytes: log2 of the number of table slots
+    int num_pages;          // 4 bytes: table pages in use
+    int pages[];            // Block ids of the table pages
+};
+
+struct heartyfs_dir_leaf {
+    int local_depth;        // 4 bytes: hash bits shared by every entry
+    int count;              // 4 bytes: entries in use
+    int overflow;           // 4 bytes: next leaf in the chain, or 0
+    int reserved;           // 4 bytes
+    struct heartyfs_dir_entry entries[];   // (block_size - 16) / 32 entries
 };
 
+/*
+ * The geometry fields are filled in by heartyfs_init and read at mount
+ * time. Blocks 1 .. bitmap_blocks hold the free-block bitmap, and data
+ * blocks start right after it. Inodes and directories keep their 512-byte
+ * layout at the start of whatever block size the image uses. Optional
+ * features are described by an extension block that directly follows the
+ * bitmap; ext_block is 0 on images without one.
+ */
+struct heartyfs_superblock {
+    struct heartyfs_directory root;     // 488 bytes: block 0 is also "/"
+    int alloc_cursor;                   // 4 bytes: next-fit allocation hint
+    int magic;                          // 4 bytes: HEARTYFS_MAGIC
+    int block_size;                     // 4 bytes: bytes per block
+    int num_blocks;                     // 4 bytes: blocks in the image
+    int bitmap_blocks;                  // 4 bytes: blocks used by the bitmap
+    int ext_block;                      // 4 bytes: heartyfs_sb_ext, or 0
+};  // Overall: 512 bytes
+
+/*
+ * The journal occupies journal_blocks blocks right after the extension
+ * block. On images with snapshots the snapshot directory and the share
+ * count table follow it, and the checksum table, if any, comes last, so
+ * data blocks start at ext_block + 1 + journal_blocks, plus 1 + share_blocks
+ * with snapshots, plus csum_blocks with checksums. The journal's first
+ * block is a struct heartyfs_journal_header; transactions follow back to
+ * back, each made of
+ *   - descriptor blocks: a struct heartyfs_journal_desc followed by the
+ *     ids of the count logged blocks and then of the revoked blocks,
+ *   - one image per logged block, in descriptor order,
+ *   - a commit block holding a struct heartyfs_journal_commit,
+ * and replay starts at the first block after the header with start_seq.
+ */
+struct heartyfs_sb_ext {
+    int magic;              // 4 bytes: HEARTYFS_EXT_MAGIC
+    int journal_blocks;     // 4 bytes: blocks in the journal, or 0
+    int snapshot_dir;       // 4 bytes: directory of snapshots, or 0
+    int share_blocks;       // 4 bytes: blocks of the share count table
+    int tail_packing;       // 4 bytes: 1 if file tails may share blocks
+    int tail_block;         // 4 bytes: tail block to pack into next, or 0
+    int csum_blocks;        // 4 bytes: blocks of the checksum table, or 0
+    int csum_valid;         // 4 bytes: 1 once every block in use has its
+                            // checksum
+};  // Overall: 32 bytes
+
+/*
+ * The checksum table holds one CRC32C per block, indexed by block id. It
+ * covers block 0 and every block from the first data block on: inodes,
+ * directories, extent and tail blocks, and file data. The bitmap, the
+ * journal and the two tables are not covered. Only the entries of blocks
+ * in use mean anything. heartyfs_init leaves the table empty with
+ * csum_valid 0, and the first writable mount fills it in.
+ */
+
+/*
+ * A snapshot is a read-only copy of the root directory, listed by name in
+ * the snapshot directory. It shares every other block with the live tree
+ * until one side changes it. The share count table holds one byte per
+ * block: the number of references to the block beyond the first. A block
+ * with a count of zero belongs to a single parent and may be changed in
+ * place, provided that every block on the path to it does too; a shared
+ * block is copied first and the copy takes a reference on its children.
+ */
+struct heartyfs_journal_header {
+    int magic;              // 4 bytes: HEARTYFS_JOURNAL_MAGIC
+    unsigned start_seq;     // 4 bytes: sequence of the first transaction
+};  // Overall: 8 bytes
+
+struct heartyfs_journal_desc {
+    int magic;              // 4 bytes: HEARTYFS_JDESC_MAGIC
+    unsigned seq;           // 4 bytes: transaction sequence number
+    int count;              // 4 bytes: blocks logged
+    int revoked;            // 4 bytes: blocks whose older images are void
+    int blocks[];           // count logged ids, then revoked ids
+};
+
+struct heartyfs_journal_commit {
+    int magic;              // 4 bytes: HEARTYFS_JCOMMIT_MAGIC
+    unsigned seq;           // 4 bytes: sequence of the transaction
+    unsigned checksum;      // 4 bytes: CRC32C of descriptors and images
+};  // Overall: 12 bytes
+
+struct heartyfs_extent {
+    int logical;            // 4 bytes: first file block covered by the run
+    int start;              // 4 bytes: first disk block of the run
+    int length;             // 4 bytes: number of blocks in the run
+};  // Overall: 12 bytes
+
 struct heartyfs_inode {
-    int type;               // 4 bytes
+    short type;             // 2 bytes
+    unsigned short flags;   // 2 bytes: FILE_* flags
     char name[28];          // 28 bytes
-    int size;               // 4 bytes
-    int data_blocks[119];   // 476 bytes
+    int size;               // 4 bytes: number of data blocks
+    int num_extents;        // 4 bytes
+    long long file_size;    // 8 bytes: file length in bytes
+    struct heartyfs_extent extents[38];    // 456 bytes
+    int indirect;           // 4 bytes: block of further extents, or 0
+    int double_indirect;    // 4 bytes: block of extent block ids, or 0
 };  // Overall: 512 bytes
 
-struct heartyfs_data_block {
-    int size;               // 4 bytes
-    char data[508];         // 508 bytes
-};  // Overall: 512 bytes
\ No newline at end of file
+/*
+ * An extent block is an array of block_size / 12 struct heartyfs_extent;
+ * a pointer block is an array of block_size / 4 int block ids.
+ *
+ * A file of at most block_size - 48 bytes (464 with 512-byte blocks) may
+ * keep its data inline instead, in the inode block from extents to the
+ * end of the block. Such a file has size 0 and num_extents 0 but a
+ * non-zero file_size; indirect and double_indirect are then part of the
+ * data.
+ *
+ * On images with tail packing, a file of more than one block may keep
+ * the used part of its last block as a fragment of a tail block shared
+ * with other files. Such a file has file_size > size * block_size, and
+ * the extent slot right after its last extent, always one of the 38 in
+ * the inode, holds a struct heartyfs_tail instead. A tail block is split
+ * into 64 slots of block_size / 64 bytes: the first holds a struct
+ * heartyfs_tail_block and each fragment takes a run of the others.
+ */
+struct heartyfs_tail {
+    int logical;            // 4 bytes: file block the fragment stands for
+    int block;              // 4 bytes: tail block holding the fragment
+    int offset;             // 4 bytes: byte offset of the fragment in it
+};  // Overall: 12 bytes
+
+struct heartyfs_tail_block {
+    unsigned long long used;    // 8 bytes: slots in use; bit 0 is this
+};  // Overall: 8 bytes
+
+/*
+ * A compressed file (FILE_COMPRESSED in flags) stores a container rather
+ * than its contents, and file_size is the length of the container. The
+ * file is cut into chunks of chunk_size bytes, each compressed on its own
+ * or kept as is if that does not make it smaller; a chunk is stored raw
+ * exactly when its stored length equals its length. The container holds
+ * the chunks back to back, then the num_chunks + 1 long long offsets of
+ * the chunks in the container (the last one is the end of the chunks),
+ * then a struct heartyfs_ztrailer.
+ */
+struct heartyfs_ztrailer {
+    long long file_size;    // 8 bytes: length of the file's contents
+    int chunk_size;         // 4 bytes: file bytes per chunk
+    int magic;              // 4 bytes: HEARTYFS_ZMAGIC
+};  // Overall: 16 bytes
@@ -1,69 +1,343 @@
 #include "heartyfs.h"
+#include <limits.h>
 #include <string.h>
+#include <sys/stat.h>
 
 /* Constants for initialization */
 #define ROOT_DIR_NAME "/"
 #define CURRENT_DIR "."
 #define PARENT_DIR ".."
+#define SNAPSHOT_DIR_NAME ".snapshots"
 #define SUPERBLOCK_ID 0
 #define INITIAL_DIR_SIZE 2  // . and .. entries
+#define BITMAP_BLOCK_ID 1
+#define MIN_NUM_BLOCKS 16
+#define MIN_JOURNAL_BLOCKS 8
 
 /**
- * @brief Initialize the superblock (root directory) of the filesystem
- * @param[out] superblock Pointer to the superblock to initialize
- * 
- * Initializes the root directory with . and .. entries both pointing 
- * to itself since root is its own parent.
+ * @brief Layout of an image, derived from its size and block size
  */
-void init_superblock(struct heartyfs_directory *superblock) {
-    // Clear the entire superblock first
-    memset(superblock, 0, sizeof(struct heartyfs_directory));
-    
-    // Initialize directory attributes
-    superblock->type = 1;  // Directory type
-    strncpy(superblock->name, ROOT_DIR_NAME, sizeof(superblock->name) - 1);
-    superblock->size = INITIAL_DIR_SIZE;
+struct geometry {
+    int block_size;         // Bytes per block
+    int num_blocks;         // Blocks in the image
+    int bitmap_blocks;      // Blocks holding the bitmap, starting at block 1
+    int ext_block;          // Extension block after the bitmap, or 0
+    int journal_blocks;     // Blocks in the journal after ext_block, or 0
+    int snapshot_dir;       // Snapshot directory after the journal, or 0
+    int share_blocks;       // Share count table after snapshot_dir, or 0
+    int tail_packing;       // 1 if file tails may share blocks
+    int csum_blocks;        // Checksum table after the share counts, or 0
+    int reserved_blocks;    // Blocks before the first data block
+};
+
+/**
+ * @brief Initialize an empty directory with its . and .. entries
+ * @param[out] dir Directory to initialize
+ * @param[in] name Name recorded in the directory
+ * @param[in] dir_block Block id of the directory itself
+ * @param[in] parent_block Block id of its parent
+ */
+static void init_directory(struct heartyfs_directory *dir, const char *name,
+                           int dir_block, int parent_block) {
+    dir->type = 1;  // Directory type
+    strncpy(dir->name, name, sizeof(dir->name) - 1);
+    dir->size = INITIAL_DIR_SIZE;
 
     // Initialize current directory entry (.)
-    superblock->entries[0].block_id = SUPERBLOCK_ID;
-    strncpy(superblock->entries[0].file_name, CURRENT_DIR, 
-            sizeof(superblock->entries[0].file_name) - 1);
+    dir->entries[0].block_id = dir_block;
+    strncpy(dir->entries[0].file_name, CURRENT_DIR,
+            sizeof(dir->entries[0].file_name) - 1);
 
     // Initialize parent directory entry (..)
-    superblock->entries[1].block_id = SUPERBLOCK_ID;
-    strncpy(superblock->entries[1].file_name, PARENT_DIR, 
-            sizeof(superblock->entries[1].file_name) - 1);
+    dir->entries[1].block_id = parent_block;
+    strncpy(dir->entries[1].file_name, PARENT_DIR,
+            sizeof(dir->entries[1].file_name) - 1);
+}
+
+/**
+ * @brief Initialize the superblock (root directory) of the filesystem
+ * @param[out] sb Pointer to the superblock to initialize
+ * @param[in] geo Geometry to record in the superblock
+ * 
+ * Initializes the root directory with . and .. entries both pointing 
+ * to itself since root is its own parent, records the geometry, and
+ * starts the allocation cursor at the first data block.
+ */
+void init_superblock(struct heartyfs_superblock *sb,
+                     const struct geometry *geo) {
+    struct heartyfs_directory *superblock = &sb->root;
+
+    // Clear the entire superblock first
+    memset(sb, 0, geo->block_size);
+    sb->magic = HEARTYFS_MAGIC;
+    sb->block_size = geo->block_size;
+    sb->num_blocks = geo->num_blocks;
+    sb->bitmap_blocks = geo->bitmap_blocks;
+    sb->ext_block = geo->ext_block;
+    sb->alloc_cursor = geo->reserved_blocks;
+    init_directory(superblock, ROOT_DIR_NAME, SUPERBLOCK_ID, SUPERBLOCK_ID);
 }
 
 /**
  * @brief Initialize the bitmap that tracks free blocks
- * @param[out] bitmap Pointer to the bitmap block to initialize
+ * @param[out] bitmap Pointer to the first bitmap block
+ * @param[in] geo Geometry of the image
  * 
- * Sets all bits to 1 (free) initially, then marks the first two blocks 
- * (superblock and bitmap) as used.
+ * Sets the bits of all blocks to 1 (free), then marks the superblock, the
+ * bitmap blocks themselves and any extension and journal blocks as used.
+ * Bits past the last block stay 0 so they are never handed out.
  */
-void init_bitmap(char *bitmap) {
-    // Set all blocks as free initially
-    memset(bitmap, 0xFF, BLOCK_SIZE);
-    
-    // Mark first two blocks (superblock and bitmap) as used
-    // First byte becomes 11111100
-    bitmap[0] = 0xFC;
+void init_bitmap(char *bitmap, const struct geometry *geo) {
+    // Start with every bit clear, then set one bit per existing block
+    memset(bitmap, 0, (size_t)geo->bitmap_blocks * geo->block_size);
+    memset(bitmap, 0xFF, geo->num_blocks / 8);
+    if (geo->num_blocks % 8) {
+        bitmap[geo->num_blocks / 8] = (1 << (geo->num_blocks % 8)) - 1;
+    }
+
+    // Mark everything before the first data block as used
+    for (int block = 0; block < geo->reserved_blocks; block++) {
+        bitmap[block / 8] &= ~(1 << (block % 8));
+    }
+}
+
+/**
+ * @brief Initialize the extension block and the features it describes
+ * @param[out] disk Mapping of the image up to the first data block
+ * @param[in] geo Geometry of the image; ext_block must be set
+ *
+ * Everything from the extension block on is cleared first, so that no
+ * transaction left over from an earlier image can be replayed and every
+ * block starts with a share count of zero. A journal gets its header and
+ * the snapshot directory starts out empty. The checksum table is left for
+ * the first writable mount to fill in.
+ */
+static void init_extensions(char *disk, const struct geometry *geo) {
+    char *ext_block = disk + (size_t)geo->ext_block * geo->block_size;
+    memset(ext_block, 0, (size_t)(geo->reserved_blocks - geo->ext_block) *
+                         geo->block_size);
+
+    struct heartyfs_sb_ext *ext = (struct heartyfs_sb_ext *)ext_block;
+    ext->magic = HEARTYFS_EXT_MAGIC;
+    ext->journal_blocks = geo->journal_blocks;
+    ext->snapshot_dir = geo->snapshot_dir;
+    ext->share_blocks = geo->share_blocks;
+    ext->tail_packing = geo->tail_packing;
+    ext->csum_blocks = geo->csum_blocks;
+
+    if (geo->journal_blocks) {
+        struct heartyfs_journal_header *header =
+            (struct heartyfs_journal_header *)(ext_block + geo->block_size);
+        header->magic = HEARTYFS_JOURNAL_MAGIC;
+        header->start_seq = 0;
+    }
+    if (geo->snapshot_dir) {
+        init_directory((struct heartyfs_directory *)(disk +
+                           (size_t)geo->snapshot_dir * geo->block_size),
+                       SNAPSHOT_DIR_NAME, geo->snapshot_dir, SUPERBLOCK_ID);
+    }
+}
+
+/**
+ * @brief Parse a size such as 4096, 64K, 16M or 2G
+ * @param[in] text Size as given on the command line
+ * @return Size in bytes, or 0 if the text is not a valid size
+ */
+static unsigned long long parse_size(const char *text) {
+    char *end;
+    unsigned long long size = strtoull(text, &end, 10);
+
+    switch (*end) {
+    case 'K': case 'k':
+        size <<= 10;
+        end++;
+        break;
+    case 'M': case 'm':
+        size <<= 20;
+        end++;
+        break;
+    case 'G': case 'g':
+        size <<= 30;
+        end++;
+        break;
+    }
+    return *end == '\0' ? size : 0;
+}
+
+/**
+ * @brief Work out the layout of an image
+ * @param[out] geo Receives the geometry
+ * @param[in] size Image size in bytes
+ * @param[in] block_size Block size in bytes
+ * @param[in] journal_size Journal size in bytes, or 0 for no journal
+ * @param[in] snapshots 1 to reserve room for snapshots
+ * @param[in] tails 1 to let file tails share blocks
+ * @param[in] checksums 1 to keep a checksum of every block
+ * @return 0 on success, -1 if the combination is not supported
+ */
+static int compute_geometry(struct geometry *geo, unsigned long long size,
+                            int block_size, unsigned long long journal_size,
+                            int snapshots, int tails, int checksums) {
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+        (block_size & (block_size - 1)) != 0) {
+        fprintf(stderr, "Block size must be a power of two from %d to %d\n",
+                MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return -1;
+    }
+
+    unsigned long long num_blocks = size / block_size;
+    if (num_blocks < MIN_NUM_BLOCKS || num_blocks > INT_MAX) {
+        fprintf(stderr, "Image must hold between %d and %d blocks\n",
+                MIN_NUM_BLOCKS, INT_MAX);
+        return -1;
+    }
+
+    long long bits_per_block = (long long)block_size * 8;
+    geo->block_size = block_size;
+    geo->num_blocks = num_blocks;
+    geo->bitmap_blocks = (num_blocks + bits_per_block - 1) / bits_per_block;
+    geo->ext_block = 0;
+    geo->journal_blocks = 0;
+    geo->snapshot_dir = 0;
+    geo->share_blocks = 0;
+    geo->tail_packing = tails;
+    geo->csum_blocks = 0;
+    geo->reserved_blocks = BITMAP_BLOCK_ID + geo->bitmap_blocks;
+    if (journal_size == 0 && !snapshots && !tails && !checksums) {
+        return 0;
+    }
+    geo->ext_block = geo->reserved_blocks++;
+
+    if (journal_size) {
+        unsigned long long journal_blocks = journal_size / block_size;
+        if (journal_blocks < MIN_JOURNAL_BLOCKS ||
+            journal_blocks + geo->reserved_blocks >= num_blocks) {
+            fprintf(stderr, "Journal must hold at least %d blocks and leave "
+                    "room for data\n", MIN_JOURNAL_BLOCKS);
+            return -1;
+        }
+        geo->journal_blocks = journal_blocks;
+        geo->reserved_blocks += journal_blocks;
+    }
+
+    if (snapshots) {
+        // One share count byte per block
+        int share_blocks = (num_blocks + block_size - 1) / block_size;
+        if (geo->reserved_blocks + 1ULL + share_blocks >= num_blocks) {
+            fprintf(stderr, "Image is too small for snapshots\n");
+            return -1;
+        }
+        geo->snapshot_dir = geo->reserved_blocks;
+        geo->share_blocks = share_blocks;
+        geo->reserved_blocks += 1 + share_blocks;
+    }
+
+    if (checksums) {
+        // One CRC32C per block
+        int csum_blocks = (num_blocks * sizeof(unsigned) + block_size - 1) /
+                          block_size;
+        if (geo->reserved_blocks + 1ULL + csum_blocks >= num_blocks) {
+            fprintf(stderr, "Image is too small for checksums\n");
+            return -1;
+        }
+        geo->csum_blocks = csum_blocks;
+        geo->reserved_blocks += csum_blocks;
+    }
+    return 0;
 }
 
 /**
  * @brief Main function to initialize the heartyfs filesystem
+ * @param[in] argc Number of command line arguments
+ * @param[in] argv Array of command line arguments
  * @return 0 on success, 1 on failure
+ *
+ * Usage: heartyfs_init [-s size] [-b block_size] [-j journal_size] [-S]
+ *                      [-T] [-C] [image]
+ * Without -s the current size of the image is used (1 MB if it is empty);
+ * with -s the image is created or resized first. -j reserves a metadata
+ * journal of the given size after the bitmap, and -S the snapshot
+ * directory and share count table that snapshots need. -T lets the last
+ * partial blocks of files share tail blocks, and -C reserves a table with
+ * a checksum of every block.
  */
-int main() {
-    int fd = open(DISK_FILE_PATH, O_RDWR);
+int main(int argc, char *argv[]) {
+    unsigned long long size = 0;
+    int block_size = BLOCK_SIZE;
+    unsigned long long journal_size = 0;
+    int snapshots = 0;
+    int tails = 0;
+    int checksums = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:b:j:STC")) != -1) {
+        switch (opt) {
+        case 's':
+            size = parse_size(optarg);
+            if (size == 0) {
+                fprintf(stderr, "Invalid image size '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            block_size = (int)parse_size(optarg);
+            break;
+        case 'j':
+            journal_size = parse_size(optarg);
+            if (journal_size == 0) {
+                fprintf(stderr, "Invalid journal size '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'S':
+            snapshots = 1;
+            break;
+        case 'T':
+            tails = 1;
+            break;
+        case 'C':
+            checksums = 1;
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-s size] [-b block_size] [-j journal_size] "
+                    "[-S] [-T] [-C] [image]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    const char *image_path = optind < argc ? argv[optind] : DISK_FILE_PATH;
+
+    int fd = open(image_path, size ? O_RDWR | O_CREAT : O_RDWR, 0644);
     if (fd < 0) {
         perror("Cannot open the disk file");
         return 1;
     }
 
-    // Map the disk file into memory
-    void *buffer = mmap(NULL, DISK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    // Size the image: either as requested or as it already is
+    struct stat st;
+    if (size) {
+        if (ftruncate(fd, size) != 0) {
+            perror("Cannot resize the disk file");
+            close(fd);
+            return 1;
+        }
+    } else if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size = st.st_size;
+    } else if (ftruncate(fd, DISK_SIZE) == 0) {
+        size = DISK_SIZE;
+    }
+
+    struct geometry geo;
+    if (compute_geometry(&geo, size, block_size, journal_size, snapshots,
+                         tails, checksums) != 0) {
+        close(fd);
+        return 1;
+    }
+
+    // Only the blocks before the first data block need to be mapped
+    size_t map_size = (size_t)geo.reserved_blocks * geo.block_size;
+    void *buffer = mmap(NULL, map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
     if (buffer == MAP_FAILED) {
         perror("Cannot map the disk file onto memory");
         close(fd);
@@ -71,11 +345,14 @@ int main() {
     }
 
     // Initialize filesystem structures
-    init_superblock((struct heartyfs_directory *)buffer);
-    init_bitmap((char *)(buffer + BLOCK_SIZE));
+    init_superblock((struct heartyfs_superblock *)buffer, &geo);
+    init_bitmap((char *)buffer + BITMAP_BLOCK_ID * geo.block_size, &geo);
+    if (geo.ext_block) {
+        init_extensions(buffer, &geo);
+    }
 
     // Cleanup
-    if (munmap(buffer, DISK_SIZE) == -1) {
+    if (munmap(buffer, map_size) == -1) {
         perror("Error un-mmapping the file");
         close(fd);
         return 1;
@@ -84,4 +361,4 @@ int main() {
     close(fd);
     printf("heartyfs initialized successfully.\n");
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,60 @@
+#ifndef HEARTYFS_PROTO_H
+#define HEARTYFS_PROTO_H
+
+#include <stdint.h>
+
+/*
+ * Wire protocol spoken by heartyfsd over its AF_UNIX stream socket.
+ *
+ * A client may send any number of requests without waiting for replies.
+ * The daemon answers each connection's requests strictly in the order they
+ * arrived, echoing the request id so a client can match replies to
+ * requests. All integers are in host byte order; the socket is local.
+ *
+ * Request:  struct heartyfs_req, then path_len bytes of path (no NUL),
+ *           then (length - path_len) bytes of payload (HFS_OP_WRITE only).
+ * Response: struct heartyfs_resp, then length bytes of payload
+ *           (HFS_OP_READ data or a struct heartyfs_stat_reply).
+ */
+
+#define HEARTYFS_SOCKET_PATH "/tmp/heartyfs.sock"
+#define HEARTYFS_MAX_REQUEST (64 << 20)  // Largest accepted request body
+
+/* Operation codes */
+#define HFS_OP_PING 0
+#define HFS_OP_MKDIR 1
+#define HFS_OP_RMDIR 2
+#define HFS_OP_CREAT 3
+#define HFS_OP_RM 4
+#define HFS_OP_READ 5
+#define HFS_OP_WRITE 6
+#define HFS_OP_STAT 7
+#define HFS_OP_SNAPSHOT 8     // Path field holds the snapshot name
+#define HFS_OP_RMSNAPSHOT 9
+
+struct heartyfs_req {
+    uint32_t length;        // Bytes following this header
+    uint32_t id;            // Echoed back in the response
+    uint16_t op;            // HFS_OP_*
+    uint16_t path_len;      // Length of the path at the start of the body
+    uint32_t reserved;
+    uint64_t offset;        // HFS_OP_READ: file offset
+    uint64_t count;         // HFS_OP_READ: maximum bytes to return
+};  // Overall: 32 bytes
+
+struct heartyfs_resp {
+    uint32_t length;        // Bytes following this header
+    uint32_t id;            // Id of the request being answered
+    int32_t status;         // HEARTYFS_OK or a HEARTYFS_ERR_* code
+    uint32_t reserved;
+};  // Overall: 16 bytes
+
+struct heartyfs_stat_reply {
+    int32_t block;
+    int32_t type;
+    int64_t size;
+    int32_t blocks;
+    int32_t reserved;
+};  // Overall: 24 bytes
+
+#endif
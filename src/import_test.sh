@@ -0,0 +1,55 @@
+#!/bin/bash
+
+# Change to the root directory of the project
+cd "$(dirname "$0")/.." || exit
+
+# Ensure the disk file is created and initialized
+rm -rf bin
+sh script/init_diskfile.sh
+make
+./bin/heartyfs_init
+
+# Create a host tree to import
+mkdir -p import_src/docs/drafts import_src/empty_dir
+echo "This is the content of the test file." > import_src/notes.txt
+head -c 3000 /dev/zero | tr '\0' 'a' > import_src/docs/long.txt
+head -c 20000 /dev/zero | tr '\0' 'b' > import_src/docs/drafts/longer.txt
+: > import_src/docs/empty.txt
+for i in $(seq 1 20); do
+    echo "file $i" > "import_src/docs/file_$i.txt"
+done
+ln -s notes.txt import_src/link.txt
+touch import_src/a_name_far_too_long_for_heartyfs.txt
+
+# Test cases
+echo "Test case 1: Import a host tree into a new directory"
+./bin/heartyfs_import -t 4 import_src /imported
+./bin/heartyfs_read /imported/notes.txt
+./bin/heartyfs_read /imported/docs/file_17.txt
+./bin/heartyfs_read /imported/docs/long.txt | cmp - import_src/docs/long.txt &&
+    echo "long.txt matches"
+./bin/heartyfs_read /imported/docs/drafts/longer.txt |
+    cmp - import_src/docs/drafts/longer.txt && echo "longer.txt matches"
+./bin/heartyfs_read /imported/docs/empty.txt | wc -c
+./bin/heartyfs_rmdir /imported/empty_dir
+echo
+
+echo "Test case 2: Import again over the existing files"
+echo "This is the changed content of the test file." > import_src/notes.txt
+./bin/heartyfs_import -t 2 import_src /imported 2> /dev/null
+./bin/heartyfs_read /imported/notes.txt
+./bin/heartyfs_fsck
+echo
+
+echo "Test case 3: Import into a file"
+./bin/heartyfs_import import_src /imported/notes.txt
+echo
+
+echo "Test case 4: Import a host directory that does not exist"
+./bin/heartyfs_import missing_dir /other
+echo
+
+# Clean up
+rm -r import_src
+
+echo "Test completed."
@@ -0,0 +1,101 @@
+#!/bin/bash
+
+# Change to the root directory of the project
+cd "$(dirname "$0")/.." || exit
+
+# Ensure the disk file is created and initialized with a 64 KB journal.
+# With 512-byte blocks the bitmap is block 1, the extension block is
+# block 2, the journal takes blocks 3 to 130 and data starts at 131.
+# The journal area that crash_image copies starts at the extension block,
+# so it spans blocks 2 to 130.
+rm -rf bin
+sh script/init_diskfile.sh
+make
+./bin/heartyfs_init -j 64K
+
+DISK=/tmp/heartyfs
+AREA_FIRST=2     # Extension block
+AREA_COUNT=129   # Extension block and journal
+DATA_FIRST=131
+
+# Rebuild the disk as it would look after a crash right behind a commit:
+# the superblock and bitmap as in before.img, the journal and the data
+# area as in after.img. With an argument, only that many blocks of the
+# journal made it and the data area stays as in before.img.
+crash_image() {
+    cp before.img $DISK
+    dd if=after.img of=$DISK bs=512 skip=$AREA_FIRST seek=$AREA_FIRST \
+        count="${1:-$AREA_COUNT}" conv=notrunc status=none
+    if [ -z "$1" ]; then
+        dd if=after.img of=$DISK bs=512 skip=$DATA_FIRST seek=$DATA_FIRST \
+            conv=notrunc status=none
+    fi
+}
+
+echo "This is a test file for the heartyfs journal." > external_file.txt
+printf 'creat /file.txt\nwrite /file.txt external_file.txt\nmkdir /dir\n' \
+    > journal_script.txt
+
+echo "Test case 1: Replay a commit whose home writes were lost"
+cp $DISK before.img
+./bin/heartyfs_batch journal_script.txt > /dev/null
+cp $DISK after.img
+crash_image
+./bin/heartyfs_read /file.txt
+./bin/heartyfs_mkdir /dir
+echo
+
+echo "Test case 2: Replay into memory on a read-only mount"
+crash_image
+./bin/heartyfs_read /file.txt
+cmp -s <(head -c 1024 $DISK) <(head -c 1024 before.img) &&
+    echo "Superblock and bitmap on disk are untouched"
+echo
+
+echo "Test case 3: Ignore a transaction without its commit block"
+crash_image 3  # Extension block, header and first descriptor block
+./bin/heartyfs_read /file.txt
+./bin/heartyfs_creat /file.txt
+echo
+
+echo "Test case 4: Replay after the journal has wrapped around"
+cp after.img $DISK
+for i in $(seq 1 40); do
+    ./bin/heartyfs_creat /wrap_$i.txt > /dev/null
+done
+cp $DISK before.img
+./bin/heartyfs_rm /wrap_7.txt
+./bin/heartyfs_write /wrap_40.txt external_file.txt
+cp $DISK after.img
+crash_image
+./bin/heartyfs_read /wrap_7.txt
+./bin/heartyfs_read /wrap_40.txt
+./bin/heartyfs_creat /wrap_39.txt
+echo
+
+echo "Test case 5: Reject a journal that leaves no room for data"
+./bin/heartyfs_init -j 2M
+echo
+
+echo "Test case 6: Reuse blocks freed since the last commit on a full disk"
+./bin/heartyfs_init -s 256K -j 32K > /dev/null
+head -c 224000 /dev/urandom > big_file.bin
+{
+    for i in $(seq 1 60); do
+        echo "mkdir /dir_$i"
+    done
+    for i in $(seq 1 60); do
+        echo "rmdir /dir_$i"
+    done
+    echo "creat /big.bin"
+    echo "write /big.bin big_file.bin"
+} | ./bin/heartyfs_batch
+./bin/heartyfs_read /big.bin | cmp -s - big_file.bin &&
+    echo "File written over the freed directories reads back intact"
+./bin/heartyfs_fsck | tail -n 1
+echo
+
+# Clean up
+rm external_file.txt journal_script.txt before.img after.img big_file.bin
+
+echo "Test completed."
@@ -0,0 +1,547 @@
+#include "heartyfs_internal.h"
+#include <endian.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * The bitmap keeps one bit per block, least significant bit first, with 1
+ * meaning free. Reading it as little-endian 64-bit words keeps that order,
+ * so the first free block in a word is its count of trailing zeros.
+ *
+ * Other processes may allocate from the same image at the same time, so
+ * bits only ever change through atomic operations on whole words, and an
+ * allocation claims its run word by word with compare and swap, starting
+ * over if some block of it was taken in the meantime.
+ */
+#define BITS_PER_WORD 64
+#define WORDS_PER_SCAN 4  // Words tested per SIMD step
+#define MAX_RUN_SCAN_BLOCKS (1 << 16)  // Give up looking for a longer run
+#define MAX_ALLOC_TRIES 64  // Runs lost to other writers before giving up
+
+/**
+ * @brief Load one 64-bit word of the bitmap
+ * @param[in] fs Mounted filesystem
+ * @param[in] index Word index
+ * @return Word with block (index * 64 + i) in bit i
+ */
+static inline uint64_t bitmap_word(const struct heartyfs *fs, int index) {
+    return le64toh(__atomic_load_n((const uint64_t *)fs->bitmap + index,
+                                   __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Skip over words whose blocks are all in use
+ * @param[in] fs Mounted filesystem
+ * @param[in] index First word to examine
+ * @param[in] last Last word that may be examined
+ * @return Index of the first word at or after index that may hold a free
+ *         block, or last if every word before it is full
+ *
+ * Long stretches of a well-used disk are all zeros; with SSE2 four words
+ * are tested per step instead of one.
+ */
+static int skip_used_words(const struct heartyfs *fs, int index, int last) {
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const char *base = fs->bitmap;
+
+    while (index + WORDS_PER_SCAN - 1 <= last) {
+        const __m128i *p = (const __m128i *)(base + index * sizeof(uint64_t));
+        __m128i any = _mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xFFFF) {
+            break;
+        }
+        index += WORDS_PER_SCAN;
+    }
+#endif
+    while (index < last && bitmap_word(fs, index) == 0) {
+        index++;
+    }
+    return index;
+}
+
+/**
+ * @brief Find the first free block in [from, to)
+ * @param[in] fs Mounted filesystem
+ * @param[in] from First block to consider
+ * @param[in] to One past the last block to consider
+ * @return Block id, or -1 if every block in the range is used
+ */
+static int find_free_in_range(const struct heartyfs *fs, int from, int to) {
+    if (from >= to) {
+        return -1;
+    }
+
+    int index = from / BITS_PER_WORD;
+    int last = (to - 1) / BITS_PER_WORD;
+    uint64_t word = bitmap_word(fs, index) & (~0ULL << (from % BITS_PER_WORD));
+
+    while (word == 0) {
+        if (index == last) {
+            return -1;
+        }
+        index = skip_used_words(fs, index + 1, last);
+        word = bitmap_word(fs, index);
+    }
+
+    int block = index * BITS_PER_WORD + __builtin_ctzll(word);
+    return block < to ? block : -1;
+}
+
+/**
+ * @brief Count the free blocks in a run that starts at a free block
+ * @param[in] fs Mounted filesystem
+ * @param[in] block First block of the run; must be free
+ * @param[in] limit Stop counting after this many blocks
+ * @return Length of the run, at most limit
+ */
+static int free_run_length(const struct heartyfs *fs, int block, int limit) {
+    int length = 0;
+
+    while (length < limit && block < fs->num_blocks) {
+        int bit = block % BITS_PER_WORD;
+        uint64_t used = ~(bitmap_word(fs, block / BITS_PER_WORD) >> bit);
+        int run = used ? __builtin_ctzll(used) : BITS_PER_WORD;
+
+        length += run;
+        block += run;
+        if (run < BITS_PER_WORD - bit) {
+            break;  // Hit a used block inside this word
+        }
+    }
+
+    if (block > fs->num_blocks) {
+        length -= block - fs->num_blocks;
+    }
+    return length < limit ? length : limit;
+}
+
+/**
+ * @brief Mask of the bits of a run that lie in its first word
+ * @param[in] start First block of the run
+ * @param[in] length Number of blocks in the run
+ * @param[out] count Receives the number of blocks covered
+ * @return Mask in disk byte order
+ */
+static uint64_t run_mask(int start, int length, int *count) {
+    int bit = start % BITS_PER_WORD;
+    *count = BITS_PER_WORD - bit < length ? BITS_PER_WORD - bit : length;
+    uint64_t mask = *count == BITS_PER_WORD ? ~0ULL : (1ULL << *count) - 1;
+    return htole64(mask << bit);
+}
+
+/**
+ * @brief Note that the bitmap blocks covering a run are about to change
+ */
+static void dirty_run(struct heartyfs *fs, int start, int length) {
+    int first = (start / 8) >> fs->block_shift;
+    int last = ((start + length - 1) / 8) >> fs->block_shift;
+    for (int b = first; b <= last; b++) {
+        hfs_dirty_block(fs, BITMAP_BLOCK_ID + b);
+    }
+}
+
+/**
+ * @brief Mark a run of blocks as used or free
+ * @param[in] fs Mounted filesystem
+ * @param[in] start First block of the run
+ * @param[in] length Number of blocks in the run
+ * @param[in] make_free 1 to free the run, 0 to mark it used
+ */
+static void update_run(struct heartyfs *fs, int start, int length,
+                       int make_free) {
+    uint64_t *words = (uint64_t *)fs->bitmap;
+    dirty_run(fs, start, length);
+
+    while (length > 0) {
+        int count;
+        uint64_t mask = run_mask(start, length, &count);
+        uint64_t *word = &words[start / BITS_PER_WORD];
+
+        if (make_free) {
+            __atomic_fetch_or(word, mask, __ATOMIC_RELEASE);
+        } else {
+            __atomic_fetch_and(word, ~mask, __ATOMIC_ACQUIRE);
+        }
+        start += count;
+        length -= count;
+    }
+}
+
+/**
+ * @brief Claim a run of blocks that were free a moment ago
+ * @param[in] fs Mounted filesystem
+ * @param[in] start First block of the run
+ * @param[in] length Number of blocks in the run
+ * @return 1 if every block of the run is now ours, 0 if another writer
+ *         got to one first, in which case nothing was claimed
+ */
+static int take_run(struct heartyfs *fs, int start, int length) {
+    uint64_t *words = (uint64_t *)fs->bitmap;
+    dirty_run(fs, start, length);
+
+    int pos = start;
+    int left = length;
+    while (left > 0) {
+        int count;
+        uint64_t mask = run_mask(pos, left, &count);
+        uint64_t *word = &words[pos / BITS_PER_WORD];
+        uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+
+        do {
+            if ((old & mask) != mask) {
+                // Give back what was claimed so far
+                if (pos > start) {
+                    update_run(fs, start, pos - start, 1);
+                }
+                return 0;
+            }
+        } while (!__atomic_compare_exchange_n(word, &old, old & ~mask, 1,
+                                              __ATOMIC_ACQUIRE,
+                                              __ATOMIC_RELAXED));
+        pos += count;
+        left -= count;
+    }
+    return 1;
+}
+
+/**
+ * @brief Check whether a block id may be handed out or freed
+ * @param[in] fs Mounted filesystem
+ * @param[in] block Block id to check
+ * @return 1 if the block lies in the allocatable range, 0 otherwise
+ */
+int hfs_block_in_range(const struct heartyfs *fs, int block) {
+    return block >= fs->first_data_block && block < fs->num_blocks;
+}
+
+/**
+ * @brief Find the best free run for an allocation, without claiming it
+ * @param[in] fs Mounted filesystem
+ * @param[in] lo First block of the region to search
+ * @param[in] hi End of the region, exclusive
+ * @param[in] goal Block to start searching at; lo if outside the region
+ * @param[in] want Number of blocks the caller would like
+ * @param[out] length Receives the length of the run found
+ * @return First block of the run, or -1 if every block of the region is
+ *         used
+ *
+ * The search wraps around the region once. It stops at the first run of
+ * want blocks; otherwise the longest run seen is returned, and after
+ * MAX_RUN_SCAN_BLOCKS blocks the search settles for the best run found
+ * so far.
+ */
+static int find_run(const struct heartyfs *fs, int lo, int hi, int goal,
+                    int want, int *length) {
+    int cursor = goal;
+    if (cursor < lo || cursor >= hi) {
+        cursor = lo;
+    }
+
+    int best_start = -1;
+    int best_length = 0;
+    int pos = cursor;
+    int end = hi;
+    int scanned = 0;
+
+    while (best_length < want && scanned < MAX_RUN_SCAN_BLOCKS) {
+        int block = find_free_in_range(fs, pos, end);
+        if (block < 0) {
+            if (end == cursor) {
+                break;  // Already wrapped around
+            }
+            pos = lo;
+            end = cursor;
+            continue;
+        }
+
+        int limit = want < hi - block ? want : hi - block;
+        int run = free_run_length(fs, block, limit);
+        if (run > best_length) {
+            best_start = block;
+            best_length = run;
+        }
+        scanned += block + run - pos;
+        pos = block + run;
+    }
+
+    *length = best_length;
+    return best_start;
+}
+
+/**
+ * @brief Allocate a run of contiguous blocks inside a region of the disk
+ * @param[in] fs Mounted filesystem
+ * @param[in] lo First block of the region
+ * @param[in] hi End of the region, exclusive
+ * @param[in] goal Block to start searching at
+ * @param[in] want Number of blocks the caller would like
+ * @param[out] length Receives the number of blocks actually allocated
+ * @return First block of the run, or HEARTYFS_ERR_NO_SPACE if the region
+ *         is full
+ *
+ * See find_run() for the search. The next-fit cursor is left just past
+ * the run. If another writer takes part of the run first, the search
+ * starts over from there, up to MAX_ALLOC_TRIES times.
+ */
+int hfs_alloc_run_in(struct heartyfs *fs, int lo, int hi, int goal, int want,
+                     int *length) {
+    if (lo < fs->first_data_block) {
+        lo = fs->first_data_block;
+    }
+    if (hi > fs->num_blocks) {
+        hi = fs->num_blocks;
+    }
+    for (int tries = 0; tries < MAX_ALLOC_TRIES; tries++) {
+        int run;
+        int start = find_run(fs, lo, hi, goal, want, &run);
+        if (start < 0) {
+            // Blocks freed since the last commit are the last resort
+            if (hfs_journal_release_frees(fs) > 0) {
+                continue;
+            }
+            return HEARTYFS_ERR_NO_SPACE;
+        }
+        if (!take_run(fs, start, run)) {
+            goal = start;
+            continue;
+        }
+
+        hfs_dirty(fs, fs->sb);
+        int next = start + run;
+        __atomic_store_n(&fs->sb->alloc_cursor,
+                         next < fs->num_blocks ? next : fs->first_data_block,
+                         __ATOMIC_RELAXED);
+        *length = run;
+        return start;
+    }
+    return HEARTYFS_ERR_NO_SPACE;
+}
+
+/**
+ * @brief Allocate a run of contiguous blocks, searching from a goal block
+ * @param[in] fs Mounted filesystem
+ * @param[in] goal Block to start searching at, e.g. just past the end of
+ *                 the file being grown
+ * @param[in] want Number of blocks the caller would like
+ * @param[out] length Receives the number of blocks actually allocated
+ * @return First block of the run, or HEARTYFS_ERR_NO_SPACE if the disk
+ *         is full
+ */
+int hfs_alloc_run_near(struct heartyfs *fs, int goal, int want, int *length) {
+    return hfs_alloc_run_in(fs, fs->first_data_block, fs->num_blocks, goal,
+                            want, length);
+}
+
+/**
+ * @brief Allocate a run of contiguous blocks with next-fit search
+ * @param[in] fs Mounted filesystem
+ * @param[in] want Number of blocks the caller would like
+ * @param[out] length Receives the number of blocks actually allocated
+ * @return First block of the run, or HEARTYFS_ERR_NO_SPACE if the disk
+ *         is full
+ *
+ * The search resumes at the cursor persisted in the superblock, so
+ * consecutive allocations cost amortized O(1) per run instead of
+ * rescanning the used prefix of the disk every time.
+ */
+int hfs_alloc_run(struct heartyfs *fs, int want, int *length) {
+    return hfs_alloc_run_near(
+        fs, __atomic_load_n(&fs->sb->alloc_cursor, __ATOMIC_RELAXED), want,
+        length);
+}
+
+/**
+ * @brief Allocate a single block
+ * @param[in] fs Mounted filesystem
+ * @return Block id, or HEARTYFS_ERR_NO_SPACE if the disk is full
+ */
+int hfs_alloc_block(struct heartyfs *fs) {
+    int length;
+    return hfs_alloc_run(fs, 1, &length);
+}
+
+/**
+ * @brief Mark a run of blocks as free in the bitmap right away
+ * @param[in] fs Mounted filesystem
+ * @param[in] start First block of the run
+ * @param[in] length Number of blocks in the run
+ */
+void hfs_release_run(struct heartyfs *fs, int start, int length) {
+    update_run(fs, start, length, 1);
+}
+
+/**
+ * @brief Mark a run of blocks as used in the bitmap
+ * @param[in] fs Mounted filesystem
+ * @param[in] start First block of the run
+ * @param[in] length Number of blocks in the run
+ *
+ * Unlike an allocation the run may lie anywhere in the image; fsck uses
+ * this to take back blocks that are in use but marked free.
+ */
+void hfs_claim_run(struct heartyfs *fs, int start, int length) {
+    update_run(fs, start, length, 0);
+}
+
+/**
+ * @brief Mark a run of blocks as free
+ * @param[in] fs Mounted filesystem
+ * @param[in] start First block of the run
+ * @param[in] length Number of blocks in the run
+ *
+ * On a journaled image the run only becomes free when the running
+ * transaction commits.
+ */
+void hfs_free_run(struct heartyfs *fs, int start, int length) {
+    if (!hfs_block_in_range(fs, start) || length <= 0 ||
+        !hfs_block_in_range(fs, start + length - 1)) {
+        return;
+    }
+    if (fs->journal) {
+        hfs_journal_free(fs, start, length);
+        return;
+    }
+    update_run(fs, start, length, 1);
+}
+
+/**
+ * @brief Mark a block as free in the bitmap
+ * @param[in] fs Mounted filesystem
+ * @param[in] block Block id to release
+ */
+void hfs_free_block(struct heartyfs *fs, int block) {
+    if (!hfs_block_in_range(fs, block)) {
+        return;
+    }
+    if (fs->journal) {
+        hfs_journal_free(fs, block, 1);
+        return;
+    }
+    update_run(fs, block, 1, 1);
+}
+
+/**
+ * @brief Allocate a block for use by the caller
+ * @param[in] fs Mounted filesystem
+ * @return Block id, or a HEARTYFS_ERR_* code on failure
+ */
+int heartyfs_alloc_block(struct heartyfs *fs) {
+    if (!fs) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    if (!hfs_writable(fs)) {
+        return HEARTYFS_ERR_RDONLY;
+    }
+    int ret = hfs_op_begin(fs, 0);
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_journal_begin_op(fs);
+    }
+    int block = ret != HEARTYFS_OK ? ret : hfs_alloc_block(fs);
+    if (block >= 0) {
+        ret = hfs_end_op(fs);
+    }
+    return hfs_op_end(fs, ret != HEARTYFS_OK ? ret : block);
+}
+
+/**
+ * @brief Allocate up to want contiguous blocks for use by the caller
+ * @param[in] fs Mounted filesystem
+ * @param[in] want Number of blocks requested
+ * @param[out] length Receives the length of the run actually allocated
+ * @return First block of the run, or a HEARTYFS_ERR_* code on failure
+ */
+int heartyfs_alloc_run(struct heartyfs *fs, int want, int *length) {
+    if (!fs || want <= 0 || !length) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    if (!hfs_writable(fs)) {
+        return HEARTYFS_ERR_RDONLY;
+    }
+    int ret = hfs_op_begin(fs, 0);
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_journal_begin_op(fs);
+    }
+    int start = ret != HEARTYFS_OK ? ret : hfs_alloc_run(fs, want, length);
+    if (start >= 0) {
+        ret = hfs_end_op(fs);
+    }
+    return hfs_op_end(fs, ret != HEARTYFS_OK ? ret : start);
+}
+
+/**
+ * @brief Return a block obtained from heartyfs_alloc_block()
+ * @param[in] fs Mounted filesystem
+ * @param[in] block Block id to release
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int heartyfs_free_block(struct heartyfs *fs, int block) {
+    if (!fs || !hfs_block_in_range(fs, block)) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    if (!hfs_writable(fs)) {
+        return HEARTYFS_ERR_RDONLY;
+    }
+    int ret = hfs_op_begin(fs, 0);
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_journal_begin_op(fs);
+    }
+    if (ret == HEARTYFS_OK) {
+        hfs_free_block(fs, block);
+        ret = hfs_end_op(fs);
+    }
+    return hfs_op_end(fs, ret);
+}
+
+/**
+ * @brief Return a run obtained from heartyfs_alloc_run()
+ * @param[in] fs Mounted filesystem
+ * @param[in] start First block of the run
+ * @param[in] length Number of blocks in the run
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int heartyfs_free_run(struct heartyfs *fs, int start, int length) {
+    if (!fs || length <= 0 || !hfs_block_in_range(fs, start) ||
+        !hfs_block_in_range(fs, start + length - 1)) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    if (!hfs_writable(fs)) {
+        return HEARTYFS_ERR_RDONLY;
+    }
+    int ret = hfs_op_begin(fs, 0);
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_journal_begin_op(fs);
+    }
+    if (ret == HEARTYFS_OK) {
+        hfs_free_run(fs, start, length);
+        ret = hfs_end_op(fs);
+    }
+    return hfs_op_end(fs, ret);
+}
+
+/**
+ * @brief Report the geometry and free space of a mounted image
+ * @param[in] fs Mounted filesystem
+ * @param[out] sfs Receives the result
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_INVALID on bad arguments
+ */
+int heartyfs_statfs(struct heartyfs *fs, struct heartyfs_statfs *sfs) {
+    if (!fs || !sfs) {
+        return HEARTYFS_ERR_INVALID;
+    }
+
+    // Bits past num_blocks are always 0, so whole words can be counted
+    int words = (fs->num_blocks + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    int free_blocks = 0;
+    for (int i = 0; i < words; i++) {
+        free_blocks += __builtin_popcountll(bitmap_word(fs, i));
+    }
+
+    sfs->block_size = fs->block_size;
+    sfs->num_blocks = fs->num_blocks;
+    sfs->free_blocks = free_blocks + hfs_journal_pending_frees(fs);
+    sfs->journal_blocks = hfs_journal_blocks(fs);
+    return HEARTYFS_OK;
+}
@@ -0,0 +1,212 @@
+#include "heartyfs_internal.h"
+
+/*
+ * Block checksums; see heartyfs.h for the table.
+ *
+ * Writers never compute checksums themselves. Every block changed through
+ * hfs_dirty() or hfs_dirty_data() is remembered along with the mapping it
+ * was changed through, and hfs_csum_update() checksums each of them once
+ * at the end of the operation, however many times it was touched. The
+ * table lives in the metadata mapping, so on a journaled image its
+ * entries commit together with the metadata they cover. Blocks whose
+ * checksum is still pending are trusted by readers, since this mount is
+ * the one writing them.
+ *
+ * Readers check the blocks they are about to use: directories as a path
+ * is walked, an inode when a file is resolved, and every block a read
+ * returns data from. A block that does not match fails the call with
+ * HEARTYFS_ERR_CHECKSUM.
+ */
+#define MIN_PENDING 64
+
+struct hfs_csum {
+    unsigned char *how;     // CSUM_* per block; 0 if up to date
+    int *blocks;            // Blocks with a nonzero how, in order changed
+    int count;
+    int capacity;
+    int all;                // Could not track; recompute every block in use
+};
+
+/**
+ * @brief Check whether a block has a checksum
+ */
+static int covered(const struct heartyfs *fs, int block) {
+    return block == SUPERBLOCK_ID ||
+           (block >= fs->first_data_block && block < fs->num_blocks);
+}
+
+/**
+ * @brief Check whether a block is allocated in the bitmap
+ */
+static int in_use(const struct heartyfs *fs, int block) {
+    return !(fs->bitmap[block / 8] & (1 << (block % 8)));
+}
+
+/**
+ * @brief Set up checksums for a mount
+ * @param[in,out] fs Mounted filesystem whose image has a checksum table
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_NO_MEMORY on failure
+ *
+ * A writable mount also gets a tracker, and fills in the table if
+ * heartyfs_init left it empty. A read-only mount of such an image checks
+ * nothing.
+ */
+int hfs_csum_open(struct heartyfs *fs) {
+    struct heartyfs_sb_ext *ext = hfs_block(fs, fs->sb->ext_block);
+    if (!hfs_writable(fs)) {
+        fs->csums = ext->csum_valid ? hfs_block(fs, fs->csum_table) : NULL;
+        return HEARTYFS_OK;
+    }
+
+    fs->csum = calloc(1, sizeof(struct hfs_csum));
+    if (!fs->csum || !(fs->csum->how = calloc(fs->num_blocks, 1))) {
+        hfs_csum_close(fs);
+        return HEARTYFS_ERR_NO_MEMORY;
+    }
+    fs->csums = hfs_block(fs, fs->csum_table);
+    if (!ext->csum_valid) {
+        fs->csum->all = 1;
+        hfs_dirty(fs, ext);
+        ext->csum_valid = 1;
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Release the tracker of a mount handle
+ * @param[in,out] fs Filesystem being unmounted
+ */
+void hfs_csum_close(struct heartyfs *fs) {
+    if (fs->csum) {
+        free(fs->csum->how);
+        free(fs->csum->blocks);
+        free(fs->csum);
+        fs->csum = NULL;
+    }
+    fs->csums = NULL;
+}
+
+/**
+ * @brief Record that a run of blocks has changed
+ * @param[in] fs Mounted filesystem with a tracker
+ * @param[in] start First block of the run
+ * @param[in] length Number of blocks in the run
+ * @param[in] how CSUM_META or CSUM_DATA: the mapping they changed through
+ */
+void hfs_csum_dirty(struct heartyfs *fs, int start, int length, int how) {
+    struct hfs_csum *cs = fs->csum;
+    for (int block = start; block < start + length; block++) {
+        if (cs->all || !covered(fs, block)) {
+            continue;
+        }
+        if (!cs->how[block]) {
+            if (cs->count == cs->capacity) {
+                int capacity = cs->capacity ? 2 * cs->capacity : MIN_PENDING;
+                int *blocks = realloc(cs->blocks, capacity * sizeof(int));
+                if (!blocks) {
+                    cs->all = 1;
+                    continue;
+                }
+                cs->blocks = blocks;
+                cs->capacity = capacity;
+            }
+            cs->blocks[cs->count++] = block;
+        }
+        cs->how[block] |= how;
+    }
+}
+
+/**
+ * @brief Compute the checksum of a block as it now stands
+ * @param[in] fs Mounted filesystem
+ * @param[in] block Block id
+ * @param[in] how Mapping the block changed through; metadata wins, since
+ *                on a journaled image the data mapping lags behind it
+ */
+static uint32_t block_csum(const struct heartyfs *fs, int block, int how) {
+    const void *ptr = how & CSUM_META ? hfs_block(fs, block)
+                                      : hfs_data(fs, block);
+    return hfs_crc32c(0, ptr, fs->block_size);
+}
+
+/**
+ * @brief Store the checksum of one block
+ */
+static void store_csum(struct heartyfs *fs, int block, int how) {
+    uint32_t crc = block_csum(fs, block, how);
+    if (fs->csums[block] != crc) {
+        hfs_dirty(fs, &fs->csums[block]);
+        fs->csums[block] = crc;
+    }
+}
+
+/**
+ * @brief Bring the checksums of every changed block up to date
+ * @param[in] fs Mounted filesystem
+ * @return HEARTYFS_OK
+ *
+ * Called at the end of every operation and before a commit. If tracking
+ * ran out of memory, every block in use is checksummed again.
+ */
+int hfs_csum_update(struct heartyfs *fs) {
+    struct hfs_csum *cs = fs->csum;
+    if (!cs) {
+        return HEARTYFS_OK;
+    }
+
+    if (cs->all) {
+        cs->all = 0;
+        for (int block = 0; block < fs->num_blocks; block++) {
+            if (covered(fs, block) && in_use(fs, block)) {
+                store_csum(fs, block, CSUM_META | CSUM_DATA);
+            }
+            cs->how[block] = 0;
+        }
+    } else {
+        for (int i = 0; i < cs->count; i++) {
+            int block = cs->blocks[i];
+            if (in_use(fs, block)) {
+                store_csum(fs, block, cs->how[block]);
+            }
+            cs->how[block] = 0;
+        }
+    }
+    cs->count = 0;
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Verify the blocks under a span of either mapping
+ * @param[in] fs Mounted filesystem
+ * @param[in] ptr Start of the span, in the data or the metadata mapping
+ * @param[in] len Length of the span
+ * @return HEARTYFS_OK if every block matches its checksum or has none,
+ *         HEARTYFS_ERR_CHECKSUM otherwise
+ *
+ * Whole blocks are checked, even if the span covers only part of one.
+ */
+int hfs_csum_check(const struct heartyfs *fs, const void *ptr, size_t len) {
+    if (!fs->csums || len == 0) {
+        return HEARTYFS_OK;
+    }
+
+    const char *base = fs->disk;
+    if ((const char *)ptr >= (const char *)fs->data &&
+        (const char *)ptr < (const char *)fs->data + fs->disk_size) {
+        base = fs->data;
+    }
+    size_t offset = (const char *)ptr - base;
+    int first = offset >> fs->block_shift;
+    int last = (offset + len - 1) >> fs->block_shift;
+    for (int block = first; block <= last; block++) {
+        if (!covered(fs, block) ||
+            (fs->csum && (fs->csum->all || fs->csum->how[block]))) {
+            continue;
+        }
+        const void *data = base + ((size_t)block << fs->block_shift);
+        if (hfs_crc32c(0, data, fs->block_size) != fs->csums[block]) {
+            return HEARTYFS_ERR_CHECKSUM;
+        }
+    }
+    return HEARTYFS_OK;
+}
@@ -0,0 +1,370 @@
+#include "heartyfs_internal.h"
+
+/*
+ * Compressed files; see heartyfs.h for the container layout.
+ *
+ * Files are compressed only when written as a whole on a mount with
+ * HEARTYFS_COMPRESS. Each chunk is compressed into a buffer and appended
+ * to the file with hfs_file_pwrite(), so the container is built in place
+ * and never held in memory; the chunk table and trailer follow once the
+ * input ends. Reads load the trailer and the two offsets of each chunk
+ * they touch and decompress just those chunks, straight from the mapping
+ * when a chunk is contiguous there. Any other write expands the file back
+ * to plain data first.
+ */
+
+/**
+ * @brief Where the parts of a container are
+ */
+struct zinfo {
+    long long file_size;    // Length of the file's contents
+    int chunk_size;         // File bytes per chunk
+    long long table;        // Container offset of the chunk table
+};
+
+/**
+ * @brief Read and check the trailer of a compressed file
+ * @param[in] fs Mounted filesystem
+ * @param[in] inode Compressed file inode
+ * @param[out] z Receives the layout of the container
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_CORRUPT otherwise
+ */
+static int load_trailer(const struct heartyfs *fs,
+                        const struct heartyfs_inode *inode, struct zinfo *z) {
+    struct heartyfs_ztrailer t;
+    long long stored = inode->file_size - (long long)sizeof(t);
+    if (stored < 0 ||
+        hfs_file_read(fs, inode, &t, sizeof(t), stored) != sizeof(t)) {
+        return HEARTYFS_ERR_CORRUPT;
+    }
+    if (t.magic != HEARTYFS_ZMAGIC || t.chunk_size <= 0 ||
+        t.chunk_size > COMPRESS_CHUNK_SIZE || t.file_size < 0) {
+        return HEARTYFS_ERR_CORRUPT;
+    }
+
+    long long chunks = (t.file_size + t.chunk_size - 1) / t.chunk_size;
+    if (chunks + 1 > stored / (long long)sizeof(long long)) {
+        return HEARTYFS_ERR_CORRUPT;
+    }
+    z->file_size = t.file_size;
+    z->chunk_size = t.chunk_size;
+    z->table = stored - (chunks + 1) * (long long)sizeof(long long);
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Report the length of a file's contents
+ * @param[in] fs Mounted filesystem
+ * @param[in] inode File inode
+ * @return Length in bytes, or HEARTYFS_ERR_CORRUPT
+ */
+long long hfs_file_length(const struct heartyfs *fs,
+                          const struct heartyfs_inode *inode) {
+    if (!(inode->flags & FILE_COMPRESSED)) {
+        return inode->file_size;
+    }
+
+    struct zinfo z;
+    int ret = load_trailer(fs, inode, &z);
+    return ret == HEARTYFS_OK ? z.file_size : ret;
+}
+
+/**
+ * @brief Decompress one chunk of a compressed file
+ * @param[in] fs Mounted filesystem
+ * @param[in] inode Compressed file inode
+ * @param[in] z Layout of the container
+ * @param[in] index Chunk to read
+ * @param[out] dst Receives the chunk
+ * @param[out] scratch chunk_size bytes for a chunk that is not contiguous
+ *                     in the mapping
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_CORRUPT otherwise
+ */
+static int read_chunk(const struct heartyfs *fs,
+                      const struct heartyfs_inode *inode,
+                      const struct zinfo *z, long long index, char *dst,
+                      char *scratch) {
+    long long range[2];
+    if (hfs_file_read(fs, inode, range, sizeof(range),
+                      z->table + index * (long long)sizeof(long long)) !=
+        sizeof(range)) {
+        return HEARTYFS_ERR_CORRUPT;
+    }
+
+    long long want = z->file_size - index * z->chunk_size;
+    if (want > z->chunk_size) {
+        want = z->chunk_size;
+    }
+    long long stored = range[1] - range[0];
+    if (range[0] < 0 || range[1] > z->table || stored <= 0 ||
+        stored > want) {
+        return HEARTYFS_ERR_CORRUPT;
+    }
+    if (stored == want) {
+        return hfs_file_read(fs, inode, dst, want, range[0]) == want
+                   ? HEARTYFS_OK
+                   : HEARTYFS_ERR_CORRUPT;
+    }
+
+    const char *src = scratch;
+    struct iovec iov;
+    size_t mapped;
+    if (hfs_file_map(fs, inode, range[0], stored, &iov, 1, &mapped) == 1 &&
+        (long long)mapped == stored) {
+        int ret = hfs_csum_check(fs, iov.iov_base, iov.iov_len);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+        src = iov.iov_base;
+    } else if (hfs_file_read(fs, inode, scratch, stored, range[0]) !=
+               stored) {
+        return HEARTYFS_ERR_CORRUPT;
+    }
+    return hfs_lz_decompress(src, stored, dst, want) == want
+               ? HEARTYFS_OK
+               : HEARTYFS_ERR_CORRUPT;
+}
+
+/**
+ * @brief Read part of a compressed file
+ * @param[in] fs Mounted filesystem
+ * @param[in] inode Compressed file inode
+ * @param[out] buf Destination buffer
+ * @param[in] len Maximum number of bytes to read
+ * @param[in] offset Offset in the file's contents
+ * @return Number of bytes read (0 at end of file), or a HEARTYFS_ERR_* code
+ *
+ * Chunks read in full are decompressed straight into buf.
+ */
+ssize_t hfs_zread(const struct heartyfs *fs,
+                  const struct heartyfs_inode *inode, void *buf, size_t len,
+                  off_t offset) {
+    struct zinfo z;
+    int ret = load_trailer(fs, inode, &z);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+    if (offset >= z.file_size || len == 0) {
+        return 0;
+    }
+    if (len > (size_t)(z.file_size - offset)) {
+        len = z.file_size - offset;
+    }
+
+    char *chunk = malloc(2 * (size_t)z.chunk_size);
+    if (!chunk) {
+        return HEARTYFS_ERR_NO_MEMORY;
+    }
+    char *scratch = chunk + z.chunk_size;
+
+    size_t done = 0;
+    while (done < len && ret == HEARTYFS_OK) {
+        long long pos = offset + done;
+        long long index = pos / z.chunk_size;
+        long long skip = pos - index * z.chunk_size;
+        long long chunk_len = z.file_size - index * z.chunk_size;
+        if (chunk_len > z.chunk_size) {
+            chunk_len = z.chunk_size;
+        }
+        size_t n = chunk_len - skip;
+        if (n > len - done) {
+            n = len - done;
+        }
+
+        if (skip == 0 && (long long)n == chunk_len) {
+            ret = read_chunk(fs, inode, &z, index, (char *)buf + done,
+                             scratch);
+        } else {
+            ret = read_chunk(fs, inode, &z, index, chunk, scratch);
+            memcpy((char *)buf + done, chunk + skip, n);
+        }
+        done += n;
+    }
+
+    free(chunk);
+    return ret == HEARTYFS_OK ? (ssize_t)done : ret;
+}
+
+/**
+ * @brief Start building a compressed file
+ * @param[in] fs Mounted filesystem
+ * @param[out] inode File inode; its old blocks are released
+ * @param[out] z Stream state
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_NO_MEMORY on failure
+ */
+int hfs_zstream_begin(struct heartyfs *fs, struct heartyfs_inode *inode,
+                      struct hfs_zstream *z) {
+    memset(z, 0, sizeof(*z));
+    z->out = malloc(COMPRESS_CHUNK_SIZE);
+    if (!z->out) {
+        return HEARTYFS_ERR_NO_MEMORY;
+    }
+    hfs_free_file_blocks(fs, inode);
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Record where the next chunk, or the chunk table, starts
+ * @param[in,out] z Stream state
+ * @param[in] offset Container offset
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_NO_MEMORY on failure
+ */
+static int add_offset(struct hfs_zstream *z, long long offset) {
+    if (z->count == z->capacity) {
+        int capacity = z->capacity ? 2 * z->capacity : 64;
+        long long *offsets = realloc(z->offsets, capacity * sizeof(*offsets));
+        if (!offsets) {
+            return HEARTYFS_ERR_NO_MEMORY;
+        }
+        z->offsets = offsets;
+        z->capacity = capacity;
+    }
+    z->offsets[z->count++] = offset;
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Compress one chunk and append it to the container
+ * @param[in] fs Mounted filesystem
+ * @param[in,out] inode File being built
+ * @param[in,out] z Stream state
+ * @param[in] data Chunk contents
+ * @param[in] len Chunk length; COMPRESS_CHUNK_SIZE for every chunk but the
+ *                last
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int hfs_zstream_add(struct heartyfs *fs, struct heartyfs_inode *inode,
+                    struct hfs_zstream *z, const void *data, size_t len) {
+    int ret = add_offset(z, inode->file_size);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    // Keep the chunk as is unless compressing makes it smaller
+    size_t n = len > 1 ? hfs_lz_compress(data, len, z->out, len - 1) : 0;
+    ssize_t written = hfs_file_pwrite(fs, inode, n ? z->out : data,
+                                      n ? n : len, inode->file_size);
+    if (written < 0) {
+        return written;
+    }
+    z->file_size += len;
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Release the buffers of a stream
+ * @param[in,out] z Stream state
+ */
+static void release_stream(struct hfs_zstream *z) {
+    free(z->offsets);
+    free(z->out);
+    memset(z, 0, sizeof(*z));
+}
+
+/**
+ * @brief Finish a compressed file with its chunk table and trailer
+ * @param[in] fs Mounted filesystem
+ * @param[in,out] inode File being built
+ * @param[in,out] z Stream state; released either way
+ * @param[in] status HEARTYFS_OK to finish the file, or the error that
+ *                   ended the stream, which leaves the file empty
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int hfs_zstream_end(struct heartyfs *fs, struct heartyfs_inode *inode,
+                    struct hfs_zstream *z, int status) {
+    if (status == HEARTYFS_OK) {
+        status = add_offset(z, inode->file_size);
+    }
+    if (status == HEARTYFS_OK) {
+        ssize_t written = hfs_file_pwrite(fs, inode, z->offsets,
+                                          z->count * sizeof(*z->offsets),
+                                          inode->file_size);
+        status = written < 0 ? (int)written : HEARTYFS_OK;
+    }
+    if (status == HEARTYFS_OK) {
+        struct heartyfs_ztrailer t = {z->file_size, COMPRESS_CHUNK_SIZE,
+                                      HEARTYFS_ZMAGIC};
+        ssize_t written = hfs_file_pwrite(fs, inode, &t, sizeof(t),
+                                          inode->file_size);
+        status = written < 0 ? (int)written : HEARTYFS_OK;
+    }
+    release_stream(z);
+
+    if (status != HEARTYFS_OK) {
+        hfs_free_file_blocks(fs, inode);
+        return status;
+    }
+    hfs_dirty(fs, inode);
+    inode->flags |= FILE_COMPRESSED;
+    hfs_file_pack(fs, inode);
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Replace the contents of a file with a compressed buffer
+ * @param[in] fs Mounted filesystem
+ * @param[out] inode File inode
+ * @param[in] buf New file contents
+ * @param[in] len Length of buf in bytes
+ * @return 1 if the file was stored compressed, 0 if that would not have
+ *         saved a block and the file was left empty, or a HEARTYFS_ERR_*
+ *         code on failure
+ */
+int hfs_zwrite(struct heartyfs *fs, struct heartyfs_inode *inode,
+               const void *buf, size_t len) {
+    struct hfs_zstream z;
+    int ret = hfs_zstream_begin(fs, inode, &z);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+    for (size_t done = 0; done < len && ret == HEARTYFS_OK;
+         done += COMPRESS_CHUNK_SIZE) {
+        size_t n = len - done < COMPRESS_CHUNK_SIZE ? len - done
+                                                    : COMPRESS_CHUNK_SIZE;
+        ret = hfs_zstream_add(fs, inode, &z, (const char *)buf + done, n);
+    }
+    ret = hfs_zstream_end(fs, inode, &z, ret);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    long long stored = (inode->file_size + fs->block_size - 1) >>
+                       fs->block_shift;
+    if (stored >= (long long)((len + fs->block_size - 1) >> fs->block_shift)) {
+        hfs_free_file_blocks(fs, inode);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Turn a compressed file back into plain data
+ * @param[in] fs Mounted filesystem
+ * @param[out] inode Compressed file inode
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * The contents are decompressed into memory and written back as a whole.
+ */
+int hfs_zexpand(struct heartyfs *fs, struct heartyfs_inode *inode) {
+    long long len = hfs_file_length(fs, inode);
+    if (len < 0) {
+        return len;
+    }
+    if (len > (long long)fs->num_blocks << fs->block_shift) {
+        return HEARTYFS_ERR_CORRUPT;
+    }
+
+    char *buf = malloc(len > 0 ? len : 1);
+    if (!buf) {
+        return HEARTYFS_ERR_NO_MEMORY;
+    }
+    ssize_t n = hfs_zread(fs, inode, buf, len, 0);
+    if (n == len) {
+        hfs_free_file_blocks(fs, inode);
+        n = len > 0 ? hfs_file_pwrite(fs, inode, buf, len, 0) : 0;
+    } else if (n >= 0) {
+        n = HEARTYFS_ERR_CORRUPT;
+    }
+    free(buf);
+    return n < 0 ? (int)n : HEARTYFS_OK;
+}
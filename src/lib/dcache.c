@@ -0,0 +1,259 @@
+#include "heartyfs_internal.h"
+
+/*
+ * In-memory dentry cache. Two tables live in the mount handle:
+ *
+ *   - a 4-way set-associative table of (parent block, name) -> block id,
+ *     where block id -1 records that the name is known to be absent;
+ *   - a direct-mapped table of full path -> block id, positive only.
+ *
+ * Entries carry the generation they were filled in. Creating a name
+ * overwrites its entry in place, removing one turns it negative, and
+ * bumping a generation drops every older entry at once: rm bumps the path
+ * generation, rmdir bumps both since the freed directory block may come
+ * back as something else. Copying a block shared with a snapshot points
+ * its entry at the copy and bumps the path generation. A change made by
+ * another process drops everything. . and .. are never
+ * cached; path walks handle them without looking at the directory.
+ */
+#define DCACHE_SETS 4096
+#define DCACHE_WAYS 4
+#define PCACHE_SLOTS 1024
+#define PARENT_HASH_MULT 0x9E3779B1u  // Spreads parent ids across sets
+
+struct dentry {
+    uint32_t hash;                  // Hash of (parent, name)
+    unsigned gen;                   // Generation; stale unless current
+    int parent;                     // Block id of the parent directory
+    int block;                      // Block id of the entry, or -1
+    char name[MAX_NAME_LENGTH + 1];
+};
+
+struct path_entry {
+    uint32_t hash;                  // Hash of the path
+    unsigned gen;                   // Path generation it was filled in
+    int block;                      // Block id the path resolves to
+    char path[MAX_PATH_LENGTH];
+};
+
+struct hfs_dcache {
+    unsigned gen;                   // Generation of the dentry table
+    unsigned path_gen;              // Generation of the path table
+    unsigned char victim[DCACHE_SETS];  // Next way to evict in each set
+    struct dentry sets[DCACHE_SETS][DCACHE_WAYS];
+    struct path_entry paths[PCACHE_SLOTS];
+};
+
+/**
+ * @brief Allocate an empty cache for a mount handle
+ * @param[in,out] fs Filesystem being mounted
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_NO_MEMORY on failure
+ */
+int hfs_dcache_init(struct heartyfs *fs) {
+    fs->dcache = calloc(1, sizeof(struct hfs_dcache));
+    if (!fs->dcache) {
+        return HEARTYFS_ERR_NO_MEMORY;
+    }
+    fs->dcache->gen = 1;  // Zeroed entries are never current
+    fs->dcache->path_gen = 1;
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Release the cache of a mount handle
+ * @param[in,out] fs Filesystem being unmounted
+ */
+void hfs_dcache_destroy(struct heartyfs *fs) {
+    free(fs->dcache);
+    fs->dcache = NULL;
+}
+
+/**
+ * @brief Drop every entry, for when another process changed the tree
+ * @param[in,out] fs Mounted filesystem
+ */
+void hfs_dcache_invalidate(struct heartyfs *fs) {
+    if (fs->dcache) {
+        fs->dcache->gen++;
+        fs->dcache->path_gen++;
+    }
+}
+
+/**
+ * @brief Hash a (parent, name) pair
+ */
+static uint32_t dentry_hash(int parent, const char *name) {
+    return hfs_name_hash(name) ^ ((uint32_t)parent * PARENT_HASH_MULT);
+}
+
+/**
+ * @brief Find the cached entry for a (parent, name) pair
+ * @param[in] cache Dentry cache
+ * @param[in] hash Hash of the pair
+ * @param[in] parent Block id of the parent directory
+ * @param[in] name Entry name
+ * @return Current entry, or NULL on a miss
+ */
+static struct dentry *dentry_find(struct hfs_dcache *cache, uint32_t hash,
+                                  int parent, const char *name) {
+    struct dentry *set = cache->sets[hash % DCACHE_SETS];
+
+    for (int way = 0; way < DCACHE_WAYS; way++) {
+        struct dentry *d = &set[way];
+        if (d->gen == cache->gen && d->hash == hash && d->parent == parent &&
+            strcmp(d->name, name) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Look up a (parent, name) pair in the cache
+ * @param[in] fs Mounted filesystem
+ * @param[in] parent Block id of the parent directory
+ * @param[in] name Entry name
+ * @param[out] block Receives the cached block id, or -1 if the name is
+ *                   known to be absent
+ * @return 1 on a hit, 0 on a miss
+ */
+int hfs_dcache_lookup(struct heartyfs *fs, int parent, const char *name,
+                      int *block) {
+    if (!fs->dcache) {
+        return 0;
+    }
+
+    struct dentry *d =
+        dentry_find(fs->dcache, dentry_hash(parent, name), parent, name);
+    if (!d) {
+        return 0;
+    }
+    *block = d->block;
+    return 1;
+}
+
+/**
+ * @brief Record a (parent, name) pair, replacing any older entry for it
+ * @param[in] fs Mounted filesystem
+ * @param[in] parent Block id of the parent directory
+ * @param[in] name Entry name
+ * @param[in] block Block id of the entry, or -1 if the name is absent
+ */
+void hfs_dcache_insert(struct heartyfs *fs, int parent, const char *name,
+                       int block) {
+    struct hfs_dcache *cache = fs->dcache;
+    if (!cache || strcmp(name, CURRENT_DIR) == 0 ||
+        strcmp(name, PARENT_DIR) == 0) {
+        return;
+    }
+
+    uint32_t hash = dentry_hash(parent, name);
+    struct dentry *d = dentry_find(cache, hash, parent, name);
+    if (!d) {
+        // Prefer a stale way; otherwise evict round-robin
+        unsigned index = hash % DCACHE_SETS;
+        struct dentry *set = cache->sets[index];
+        int way = 0;
+        while (way < DCACHE_WAYS && set[way].gen == cache->gen) {
+            way++;
+        }
+        if (way == DCACHE_WAYS) {
+            way = cache->victim[index]++ % DCACHE_WAYS;
+        }
+
+        d = &set[way];
+        d->hash = hash;
+        d->gen = cache->gen;
+        d->parent = parent;
+        strcpy(d->name, name);
+    }
+    d->block = block;
+}
+
+/**
+ * @brief Look up a full path in the cache
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path exactly as passed to the library
+ * @param[out] block Receives the cached block id
+ * @return 1 on a hit, 0 on a miss
+ */
+int hfs_dcache_path_lookup(struct heartyfs *fs, const char *path,
+                           int *block) {
+    struct hfs_dcache *cache = fs->dcache;
+    if (!cache) {
+        return 0;
+    }
+
+    uint32_t hash = hfs_name_hash(path);
+    struct path_entry *p = &cache->paths[hash % PCACHE_SLOTS];
+    if (p->gen != cache->path_gen || p->hash != hash ||
+        strcmp(p->path, path) != 0) {
+        return 0;
+    }
+    *block = p->block;
+    return 1;
+}
+
+/**
+ * @brief Record the block a full path resolves to
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path exactly as passed to the library
+ * @param[in] block Block id the path resolves to
+ */
+void hfs_dcache_path_insert(struct heartyfs *fs, const char *path, int block) {
+    struct hfs_dcache *cache = fs->dcache;
+    if (!cache || strlen(path) >= MAX_PATH_LENGTH) {
+        return;
+    }
+
+    uint32_t hash = hfs_name_hash(path);
+    struct path_entry *p = &cache->paths[hash % PCACHE_SLOTS];
+    p->hash = hash;
+    p->gen = cache->path_gen;
+    p->block = block;
+    strcpy(p->path, path);
+}
+
+/**
+ * @brief Keep the cache coherent after a name has been removed
+ * @param[in] fs Mounted filesystem
+ * @param[in] parent Block id of the parent directory
+ * @param[in] name Name that was removed
+ * @param[in] was_dir 1 if the removed entry was a directory
+ */
+void hfs_dcache_remove(struct heartyfs *fs, int parent, const char *name,
+                       int was_dir) {
+    struct hfs_dcache *cache = fs->dcache;
+    if (!cache) {
+        return;
+    }
+
+    // Any cached path may run through the removed name
+    cache->path_gen++;
+    if (was_dir) {
+        // Entries keyed by the freed directory block are stale too
+        cache->gen++;
+    }
+    hfs_dcache_insert(fs, parent, name, -1);
+}
+
+/**
+ * @brief Keep the cache coherent after an entry now names another block
+ * @param[in] fs Mounted filesystem
+ * @param[in] parent Block id of the parent directory
+ * @param[in] name Name whose entry changed
+ * @param[in] block New block id of the entry
+ *
+ * Used when the live tree takes its own copy of a block it shared with a
+ * snapshot. Entries keyed by the old block still describe the snapshot.
+ */
+void hfs_dcache_relink(struct heartyfs *fs, int parent, const char *name,
+                       int block) {
+    struct hfs_dcache *cache = fs->dcache;
+    if (!cache) {
+        return;
+    }
+
+    cache->path_gen++;
+    hfs_dcache_insert(fs, parent, name, block);
+}
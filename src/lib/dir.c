@@ -0,0 +1,510 @@
+#include "heartyfs_internal.h"
+
+/**
+ * @brief Initialize a new directory structure
+ * @param[out] dir Pointer to the directory structure to initialize
+ * @param[in] name Name of the directory
+ * @param[in] dir_block Block number of this directory
+ * @param[in] parent_block Block number of the parent directory
+ */
+void hfs_init_directory(struct heartyfs_directory *dir, const char *name,
+                        int dir_block, int parent_block) {
+    memset(dir, 0, sizeof(struct heartyfs_directory));
+
+    // Set directory attributes
+    dir->type = DIR_TYPE;
+    strncpy(dir->name, name, sizeof(dir->name) - 1);
+    dir->size = MIN_DIR_ENTRIES;
+
+    // Initialize current directory entry (.)
+    dir->entries[0].block_id = dir_block;
+    strncpy(dir->entries[0].file_name, CURRENT_DIR,
+            sizeof(dir->entries[0].file_name) - 1);
+
+    // Initialize parent directory entry (..)
+    dir->entries[1].block_id = parent_block;
+    strncpy(dir->entries[1].file_name, PARENT_DIR,
+            sizeof(dir->entries[1].file_name) - 1);
+}
+
+/**
+ * @brief Look up a named entry in a directory
+ * @param[in] fs Mounted filesystem
+ * @param[in] dir Directory to search
+ * @param[in] name Entry name
+ * @param[out] block Receives the block id the entry points to
+ * @return HEARTYFS_OK, HEARTYFS_ERR_NOT_FOUND or HEARTYFS_ERR_CORRUPT
+ *
+ * Small directories are scanned inline; hashed ones probe their index,
+ * except for . and .. which always stay inline.
+ */
+int hfs_dir_lookup(const struct heartyfs *fs,
+                   const struct heartyfs_directory *dir, const char *name,
+                   int *block) {
+    int size = dir->size < MAX_DIR_ENTRIES ? dir->size : MAX_DIR_ENTRIES;
+    if (dir->index_block) {
+        if (strcmp(name, CURRENT_DIR) != 0 && strcmp(name, PARENT_DIR) != 0) {
+            return hfs_htree_lookup(fs, dir, name, block);
+        }
+        size = MIN_DIR_ENTRIES;
+    }
+
+    for (int i = 0; i < size; i++) {
+        if (strcmp(dir->entries[i].file_name, name) == 0) {
+            *block = dir->entries[i].block_id;
+            return HEARTYFS_OK;
+        }
+    }
+    return HEARTYFS_ERR_NOT_FOUND;
+}
+
+/**
+ * @brief Add an entry; see hfs_dir_add()
+ */
+static int dir_add(struct heartyfs *fs, struct heartyfs_directory *dir,
+                   const char *name, int block) {
+    hfs_dirty(fs, dir);
+    if (!dir->index_block && dir->size >= MAX_DIR_ENTRIES) {
+        int ret = hfs_htree_create(fs, dir);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+    }
+
+    if (dir->index_block) {
+        int ret = hfs_htree_insert(fs, dir, name, block);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+        dir->size++;
+        return HEARTYFS_OK;
+    }
+
+    struct heartyfs_dir_entry *entry = &dir->entries[dir->size];
+    memset(entry, 0, sizeof(*entry));
+    entry->block_id = block;
+    strncpy(entry->file_name, name, sizeof(entry->file_name) - 1);
+    dir->size++;
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Add an entry to a directory
+ * @param[in] fs Mounted filesystem
+ * @param[out] dir Directory to modify
+ * @param[in] name Entry name (at most MAX_NAME_LENGTH characters)
+ * @param[in] block Block id the entry points to
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * A directory whose inline array is full is converted to a hashed one.
+ * The caller holds the directory's lock; lookups in other processes that
+ * overlap the change are done again.
+ */
+int hfs_dir_add(struct heartyfs *fs, struct heartyfs_directory *dir,
+                const char *name, int block) {
+    int head = hfs_block_id(fs, dir);
+    hfs_dir_write_begin(fs, head);
+    int ret = dir_add(fs, dir, name, block);
+    hfs_dir_write_end(fs, head);
+    return ret;
+}
+
+/**
+ * @brief Remove an entry; see hfs_dir_remove()
+ */
+static int dir_remove(struct heartyfs *fs, struct heartyfs_directory *dir,
+                      const char *name) {
+    hfs_dirty(fs, dir);
+    if (dir->index_block) {
+        int ret = hfs_htree_remove(fs, dir, name);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+        if (--dir->size <= MIN_DIR_ENTRIES) {
+            hfs_htree_free(fs, dir);
+        }
+        return HEARTYFS_OK;
+    }
+
+    int size = dir->size < MAX_DIR_ENTRIES ? dir->size : MAX_DIR_ENTRIES;
+    for (int i = MIN_DIR_ENTRIES; i < size; i++) {
+        if (strcmp(dir->entries[i].file_name, name) == 0) {
+            dir->entries[i] = dir->entries[size - 1];
+            dir->size = size - 1;
+            memset(&dir->entries[dir->size], 0,
+                   sizeof(struct heartyfs_dir_entry));
+            return HEARTYFS_OK;
+        }
+    }
+    return HEARTYFS_ERR_NOT_FOUND;
+}
+
+/**
+ * @brief Remove a named entry from a directory
+ * @param[in] fs Mounted filesystem
+ * @param[out] dir Directory to modify
+ * @param[in] name Entry name
+ * @return HEARTYFS_OK, HEARTYFS_ERR_NOT_FOUND or HEARTYFS_ERR_CORRUPT
+ *
+ * Inline, the last entry is moved into the gap, so entry order is not
+ * preserved. A hashed directory drops its index once it is empty again.
+ */
+int hfs_dir_remove(struct heartyfs *fs, struct heartyfs_directory *dir,
+                   const char *name) {
+    int head = hfs_block_id(fs, dir);
+    hfs_dir_write_begin(fs, head);
+    int ret = dir_remove(fs, dir, name);
+    hfs_dir_write_end(fs, head);
+    return ret;
+}
+
+/**
+ * @brief Call a function on every entry of a directory but . and ..
+ * @param[in] fs Mounted filesystem
+ * @param[in] dir Directory head
+ * @param[in] fn Called once per entry; a non-zero return stops the walk
+ * @param[in] arg Passed to fn
+ * @return HEARTYFS_OK, the first non-zero return of fn, or another
+ *         HEARTYFS_ERR_* code if the directory cannot be read
+ *
+ * Entries come in no particular order.
+ */
+int hfs_dir_foreach(const struct heartyfs *fs,
+                    const struct heartyfs_directory *dir,
+                    int (*fn)(void *arg,
+                              const struct heartyfs_dir_entry *entry),
+                    void *arg) {
+    if (dir->index_block) {
+        return hfs_htree_foreach(fs, dir, fn, arg);
+    }
+
+    int size = dir->size < MAX_DIR_ENTRIES ? dir->size : MAX_DIR_ENTRIES;
+    for (int i = MIN_DIR_ENTRIES; i < size; i++) {
+        int ret = fn(arg, &dir->entries[i]);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Repoint an entry; see hfs_dir_relink()
+ */
+static int dir_relink(struct heartyfs *fs, struct heartyfs_directory *dir,
+                      const char *name, int block) {
+    if (dir->index_block) {
+        return hfs_htree_relink(fs, dir, name, block);
+    }
+
+    int size = dir->size < MAX_DIR_ENTRIES ? dir->size : MAX_DIR_ENTRIES;
+    for (int i = MIN_DIR_ENTRIES; i < size; i++) {
+        if (strcmp(dir->entries[i].file_name, name) == 0) {
+            hfs_dirty(fs, &dir->entries[i]);
+            dir->entries[i].block_id = block;
+            return HEARTYFS_OK;
+        }
+    }
+    return HEARTYFS_ERR_NOT_FOUND;
+}
+
+/**
+ * @brief Point an existing entry at another block
+ * @param[in] fs Mounted filesystem
+ * @param[out] dir Directory holding the entry
+ * @param[in] name Entry name
+ * @param[in] block New block id of the entry
+ * @return HEARTYFS_OK, HEARTYFS_ERR_NOT_FOUND or another HEARTYFS_ERR_* code
+ */
+int hfs_dir_relink(struct heartyfs *fs, struct heartyfs_directory *dir,
+                   const char *name, int block) {
+    int head = hfs_block_id(fs, dir);
+    hfs_dir_write_begin(fs, head);
+    int ret = dir_relink(fs, dir, name, block);
+    hfs_dir_write_end(fs, head);
+    return ret;
+}
+
+/**
+ * @brief Resolve the parent of a new entry and make sure the name is free
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path of the entry to create
+ * @param[out] parent Receives the parent directory
+ * @param[out] name Receives the final path component
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+static int prepare_create(struct heartyfs *fs, const char *path,
+                          struct heartyfs_directory **parent, char *name) {
+    if (!fs || !path) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    if (!hfs_writable(fs)) {
+        return HEARTYFS_ERR_RDONLY;
+    }
+
+    int parent_block;
+    int ret = hfs_journal_begin_op(fs);
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_resolve_parent(fs, path, &parent_block, name);
+    }
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    *parent = hfs_block(fs, parent_block);
+    if (hfs_snapshot_name(fs, parent_block, name)) {
+        return HEARTYFS_ERR_EXISTS;
+    }
+    int existing;
+    ret = hfs_lookup(fs, parent_block, name, &existing);
+    if (ret == HEARTYFS_OK) {
+        return HEARTYFS_ERR_EXISTS;
+    }
+    return ret == HEARTYFS_ERR_NOT_FOUND ? HEARTYFS_OK : ret;
+}
+
+/**
+ * @brief Resolve an existing entry together with its parent directory
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path of the entry to remove
+ * @param[out] parent Receives the parent directory
+ * @param[out] name Receives the final path component
+ * @param[out] block Receives the block id of the entry
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * The entry is locked along with its parent, so nobody else is still
+ * using it when it goes.
+ */
+static int prepare_remove(struct heartyfs *fs, const char *path,
+                          struct heartyfs_directory **parent, char *name,
+                          int *block) {
+    if (!fs || !path) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    if (!hfs_writable(fs)) {
+        return HEARTYFS_ERR_RDONLY;
+    }
+
+    int parent_block;
+    int ret = hfs_journal_begin_op(fs);
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_resolve_parent(fs, path, &parent_block, name);
+    }
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    *parent = hfs_block(fs, parent_block);
+    if (hfs_snapshot_name(fs, parent_block, name)) {
+        return HEARTYFS_ERR_RDONLY;
+    }
+    ret = hfs_lookup(fs, parent_block, name, block);
+    while (ret == HEARTYFS_OK) {
+        if (!hfs_block_in_range(fs, *block)) {
+            return HEARTYFS_ERR_CORRUPT;
+        }
+        const struct heartyfs_directory *node = hfs_block(fs, *block);
+        if (node->type != DIR_TYPE) {
+            return hfs_lock_inode(fs, *block);
+        }
+        int relocked;
+        ret = hfs_lock_child_dir(fs, parent_block, *block, &relocked);
+        if (ret != HEARTYFS_OK || !relocked) {
+            return ret;
+        }
+
+        // The parent was let go for a moment; the name may have moved on
+        hfs_locks_sync(fs);
+        int again;
+        ret = hfs_lookup(fs, parent_block, name, &again);
+        if (ret == HEARTYFS_OK && again == *block) {
+            return HEARTYFS_OK;
+        }
+        hfs_unlock_dir(fs, *block);
+        *block = again;
+    }
+    return ret;
+}
+
+/**
+ * @brief Create a directory with the operation's locks held
+ */
+static int make_directory(struct heartyfs *fs, const char *path) {
+    struct heartyfs_directory *parent;
+    char name[MAX_NAME_LENGTH + 1];
+    int ret = prepare_create(fs, path, &parent, name);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    int new_block = hfs_alloc_block(fs);
+    if (new_block < 0) {
+        return new_block;
+    }
+
+    hfs_dirty(fs, hfs_block(fs, new_block));
+    hfs_init_directory(hfs_block(fs, new_block), name, new_block,
+                       hfs_block_id(fs, parent));
+    ret = hfs_dir_add(fs, parent, name, new_block);
+    if (ret != HEARTYFS_OK) {
+        hfs_free_block(fs, new_block);
+        return ret;
+    }
+    hfs_dcache_insert(fs, hfs_block_id(fs, parent), name, new_block);
+    return hfs_end_op(fs);
+}
+
+/**
+ * @brief Remove a directory with the operation's locks held
+ */
+static int remove_directory(struct heartyfs *fs, const char *path) {
+    struct heartyfs_directory *parent;
+    char name[MAX_NAME_LENGTH + 1];
+    int dir_block;
+    int ret = prepare_remove(fs, path, &parent, name, &dir_block);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    struct heartyfs_directory *dir = hfs_block(fs, dir_block);
+    if (dir->type != DIR_TYPE) {
+        return HEARTYFS_ERR_NOT_DIR;
+    }
+    if (dir->size > MIN_DIR_ENTRIES) {
+        return HEARTYFS_ERR_NOT_EMPTY;
+    }
+
+    ret = hfs_dir_remove(fs, parent, name);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+    hfs_dcache_remove(fs, hfs_block_id(fs, parent), name, 1);
+    hfs_drop_node(fs, dir_block);  // Also drops an index left when emptied
+    return hfs_end_op(fs);
+}
+
+/**
+ * @brief Create a file with the operation's locks held
+ */
+static int create_file(struct heartyfs *fs, const char *path) {
+    struct heartyfs_directory *parent;
+    char name[MAX_NAME_LENGTH + 1];
+    int ret = prepare_create(fs, path, &parent, name);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    int inode_block = hfs_alloc_block(fs);
+    if (inode_block < 0) {
+        return inode_block;
+    }
+
+    struct heartyfs_inode *inode = hfs_block(fs, inode_block);
+    hfs_dirty(fs, inode);
+    memset(inode, 0, sizeof(struct heartyfs_inode));
+    inode->type = FILE_TYPE;
+    strcpy(inode->name, name);
+    inode->size = 0;
+
+    ret = hfs_dir_add(fs, parent, name, inode_block);
+    if (ret != HEARTYFS_OK) {
+        hfs_free_block(fs, inode_block);
+        return ret;
+    }
+    hfs_dcache_insert(fs, hfs_block_id(fs, parent), name, inode_block);
+    return hfs_end_op(fs);
+}
+
+/**
+ * @brief Remove a file with the operation's locks held
+ */
+static int remove_file(struct heartyfs *fs, const char *path) {
+    struct heartyfs_directory *parent;
+    char name[MAX_NAME_LENGTH + 1];
+    int inode_block;
+    int ret = prepare_remove(fs, path, &parent, name, &inode_block);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    struct heartyfs_inode *inode = hfs_block(fs, inode_block);
+    if (inode->type != FILE_TYPE) {
+        return HEARTYFS_ERR_NOT_FILE;
+    }
+
+    ret = hfs_dir_remove(fs, parent, name);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+    hfs_dcache_remove(fs, hfs_block_id(fs, parent), name, 0);
+    hfs_drop_node(fs, inode_block);  // A snapshot may still hold it
+    return hfs_end_op(fs);
+}
+
+/**
+ * @brief Create a new, empty directory
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path of the directory to create
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int heartyfs_mkdir(struct heartyfs *fs, const char *path) {
+    if (!fs) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    int ret = hfs_op_begin(fs, 0);
+    if (ret == HEARTYFS_OK) {
+        ret = make_directory(fs, path);
+    }
+    return hfs_op_end(fs, ret);
+}
+
+/**
+ * @brief Remove an empty directory
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path of the directory to remove
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int heartyfs_rmdir(struct heartyfs *fs, const char *path) {
+    if (!fs) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    int ret = hfs_op_begin(fs, 0);
+    if (ret == HEARTYFS_OK) {
+        ret = remove_directory(fs, path);
+    }
+    return hfs_op_end(fs, ret);
+}
+
+/**
+ * @brief Create a new, empty regular file
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path of the file to create
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int heartyfs_creat(struct heartyfs *fs, const char *path) {
+    if (!fs) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    int ret = hfs_op_begin(fs, 0);
+    if (ret == HEARTYFS_OK) {
+        ret = create_file(fs, path);
+    }
+    return hfs_op_end(fs, ret);
+}
+
+/**
+ * @brief Remove a regular file and release its blocks
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path of the file to remove
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int heartyfs_rm(struct heartyfs *fs, const char *path) {
+    if (!fs) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    int ret = hfs_op_begin(fs, 0);
+    if (ret == HEARTYFS_OK) {
+        ret = remove_file(fs, path);
+    }
+    return hfs_op_end(fs, ret);
+}
@@ -0,0 +1,817 @@
+#include "heartyfs_internal.h"
+
+/*
+ * Hash index for large directories; see struct heartyfs_dir_index in
+ * heartyfs.h for the on-disk layout. Lookups read one table slot and scan
+ * one leaf, so their cost does not grow with the directory. Inserting into
+ * a full leaf splits it on the next hash bit, which touches at most the
+ * table slots that pointed at the old leaf.
+ *
+ * Under snapshots the index block and its table pages are copied as one
+ * unit, whose share count is the index block's; each table copy holds one
+ * reference on every leaf it points to. Leaves are copied one at a time,
+ * and an overflow leaf belongs to the leaf before it in the chain.
+ */
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+/**
+ * @brief Hash an entry name with 32-bit FNV-1a
+ * @param[in] name NUL-terminated entry name
+ * @return Hash of the name
+ */
+uint32_t hfs_name_hash(const char *name) {
+    uint32_t hash = FNV_OFFSET_BASIS;
+
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash ^= *p;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * @brief Number of entries that fit in one leaf block
+ */
+static int leaf_capacity(const struct heartyfs *fs) {
+    return (fs->block_size - sizeof(struct heartyfs_dir_leaf)) /
+           sizeof(struct heartyfs_dir_entry);
+}
+
+/**
+ * @brief Largest global depth the index block can describe
+ */
+static int max_global_depth(const struct heartyfs *fs) {
+    long long max_pages = (fs->block_size - sizeof(struct heartyfs_dir_index)) /
+                          sizeof(int);
+    long long max_slots = max_pages * fs->pointers_per_block;
+    int depth = 0;
+
+    while ((2LL << depth) <= max_slots && depth < 30) {
+        depth++;
+    }
+    return depth;
+}
+
+/**
+ * @brief Fetch the index block of a hashed directory
+ * @param[in] fs Mounted filesystem
+ * @param[in] dir Directory head
+ * @return Index block, or NULL if it is corrupted
+ */
+static struct heartyfs_dir_index *dir_index(const struct heartyfs *fs,
+                                            const struct heartyfs_directory *dir) {
+    if (!hfs_block_in_range(fs, dir->index_block)) {
+        return NULL;
+    }
+
+    struct heartyfs_dir_index *index = hfs_block(fs, dir->index_block);
+    int max_pages = (fs->block_size - sizeof(struct heartyfs_dir_index)) /
+                    sizeof(int);
+    if (index->global_depth < 0 || index->global_depth > max_global_depth(fs) ||
+        index->num_pages < 1 || index->num_pages > max_pages) {
+        return NULL;
+    }
+    return index;
+}
+
+/**
+ * @brief Locate a slot of the hash table
+ * @param[in] fs Mounted filesystem
+ * @param[in] index Index block
+ * @param[in] slot Slot number, below 1 << global_depth
+ * @return Pointer to the slot, or NULL if its page is missing
+ */
+static int *table_slot(const struct heartyfs *fs,
+                       const struct heartyfs_dir_index *index, uint32_t slot) {
+    uint32_t page = slot / fs->pointers_per_block;
+    if ((int)page >= index->num_pages ||
+        !hfs_block_in_range(fs, index->pages[page])) {
+        return NULL;
+    }
+
+    int *slots = hfs_block(fs, index->pages[page]);
+    return &slots[slot % fs->pointers_per_block];
+}
+
+/**
+ * @brief Fetch a leaf block by id
+ * @param[in] fs Mounted filesystem
+ * @param[in] block Block id of the leaf
+ * @return Leaf, or NULL if the id is out of range or the leaf is corrupted
+ */
+static struct heartyfs_dir_leaf *dir_leaf(const struct heartyfs *fs,
+                                          int block) {
+    if (!hfs_block_in_range(fs, block)) {
+        return NULL;
+    }
+
+    struct heartyfs_dir_leaf *leaf = hfs_block(fs, block);
+    if (leaf->count < 0 || leaf->count > leaf_capacity(fs)) {
+        return NULL;
+    }
+    return leaf;
+}
+
+/**
+ * @brief Find the first leaf of the chain a hash maps to
+ * @param[in] fs Mounted filesystem
+ * @param[in] index Index block
+ * @param[in] hash Hash of the entry name
+ * @param[out] leaf_block Receives the block id of the leaf
+ * @return Leaf, or NULL if the index is corrupted
+ */
+static struct heartyfs_dir_leaf *leaf_for_hash(
+    const struct heartyfs *fs, const struct heartyfs_dir_index *index,
+    uint32_t hash, int *leaf_block) {
+    uint32_t mask = (1u << index->global_depth) - 1;
+    int *slot = table_slot(fs, index, hash & mask);
+    if (!slot) {
+        return NULL;
+    }
+
+    *leaf_block = *slot;
+    return dir_leaf(fs, *slot);
+}
+
+/**
+ * @brief Fetch the index block of a hashed directory for checking
+ * @param[in] fs Mounted filesystem
+ * @param[in] dir Directory head
+ * @return Index block, or NULL if it is corrupted
+ */
+const struct heartyfs_dir_index *hfs_htree_index(
+    const struct heartyfs *fs, const struct heartyfs_directory *dir) {
+    return dir_index(fs, dir);
+}
+
+/**
+ * @brief Read one slot of the hash table
+ * @param[in] fs Mounted filesystem
+ * @param[in] index Index block from hfs_htree_index()
+ * @param[in] slot Slot number, below 1 << global_depth
+ * @return Block id the slot names, or -1 if its page is missing
+ */
+int hfs_htree_slot(const struct heartyfs *fs,
+                   const struct heartyfs_dir_index *index, uint32_t slot) {
+    const int *entry = table_slot(fs, index, slot);
+    return entry ? *entry : -1;
+}
+
+/**
+ * @brief Fetch a leaf block for checking
+ * @param[in] fs Mounted filesystem
+ * @param[in] block Block id of the leaf
+ * @return Leaf, or NULL if the id is out of range or the leaf is corrupted
+ */
+const struct heartyfs_dir_leaf *hfs_htree_leaf(const struct heartyfs *fs,
+                                               int block) {
+    return dir_leaf(fs, block);
+}
+
+/**
+ * @brief Allocate and clear a block for the index
+ * @param[in] fs Mounted filesystem
+ * @return Block id, or HEARTYFS_ERR_NO_SPACE if the disk is full
+ */
+static int alloc_index_block(struct heartyfs *fs) {
+    int block = hfs_alloc_block(fs);
+    if (block >= 0) {
+        hfs_dirty(fs, hfs_block(fs, block));
+        memset(hfs_block(fs, block), 0, fs->block_size);
+    }
+    return block;
+}
+
+/**
+ * @brief Copy a shared leaf into a new block
+ * @param[in] fs Mounted filesystem
+ * @param[in] block Leaf to copy
+ * @return Block id of the copy, or HEARTYFS_ERR_NO_SPACE
+ *
+ * The copy takes a reference on each of its entries and on its overflow
+ * leaf, and the original gives up one.
+ */
+static int copy_leaf(struct heartyfs *fs, int block) {
+    int copy = hfs_alloc_block(fs);
+    if (copy < 0) {
+        return copy;
+    }
+
+    struct heartyfs_dir_leaf *leaf = hfs_block(fs, copy);
+    hfs_dirty(fs, leaf);
+    memcpy(leaf, hfs_block(fs, block), fs->block_size);
+    for (int i = 0; i < leaf->count; i++) {
+        hfs_ref_run(fs, leaf->entries[i].block_id, 1);
+    }
+    hfs_ref_run(fs, leaf->overflow, 1);
+    hfs_unref_run(fs, block, 1);
+    return copy;
+}
+
+/**
+ * @brief Fetch the index of a hashed directory, copying it if it is shared
+ * @param[in] fs Mounted filesystem
+ * @param[in,out] dir Unshared directory head
+ * @param[out] index Receives the index block
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+static int writable_index(struct heartyfs *fs, struct heartyfs_directory *dir,
+                          struct heartyfs_dir_index **index) {
+    struct heartyfs_dir_index *old = dir_index(fs, dir);
+    if (!old) {
+        return HEARTYFS_ERR_CORRUPT;
+    }
+    if (!hfs_shared(fs, dir->index_block)) {
+        *index = old;
+        return HEARTYFS_OK;
+    }
+
+    int copy = alloc_index_block(fs);
+    if (copy < 0) {
+        return copy;
+    }
+    struct heartyfs_dir_index *new = hfs_block(fs, copy);
+    memcpy(new, old, fs->block_size);
+    for (int i = 0; i < old->num_pages; i++) {
+        int page = alloc_index_block(fs);
+        if (page < 0 || !hfs_block_in_range(fs, old->pages[i])) {
+            if (page >= 0) {
+                hfs_free_block(fs, page);
+            }
+            while (--i >= 0) {
+                hfs_free_block(fs, new->pages[i]);
+            }
+            hfs_free_block(fs, copy);
+            return page < 0 ? page : HEARTYFS_ERR_CORRUPT;
+        }
+        memcpy(hfs_block(fs, page), hfs_block(fs, old->pages[i]),
+               fs->block_size);
+        new->pages[i] = page;
+    }
+
+    // The new table references each leaf once, from its lowest slot
+    uint32_t slots = 1u << new->global_depth;
+    for (uint32_t s = 0; s < slots; s++) {
+        int *slot = table_slot(fs, new, s);
+        struct heartyfs_dir_leaf *leaf = slot ? dir_leaf(fs, *slot) : NULL;
+        if (leaf && s < 1u << leaf->local_depth) {
+            hfs_ref_run(fs, *slot, 1);
+        }
+    }
+
+    hfs_unref_run(fs, dir->index_block, 1);
+    hfs_dirty(fs, dir);
+    dir->index_block = copy;
+    *index = new;
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Fetch the first leaf a hash maps to, copying it if it is shared
+ * @param[in] fs Mounted filesystem
+ * @param[in] index Unshared index block
+ * @param[in] hash Hash of the entry name
+ * @param[out] leaf Receives the leaf
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+static int writable_leaf(struct heartyfs *fs, struct heartyfs_dir_index *index,
+                         uint32_t hash, struct heartyfs_dir_leaf **leaf) {
+    int block;
+    struct heartyfs_dir_leaf *old = leaf_for_hash(fs, index, hash, &block);
+    if (!old) {
+        return HEARTYFS_ERR_CORRUPT;
+    }
+    if (!hfs_shared(fs, block)) {
+        *leaf = old;
+        return HEARTYFS_OK;
+    }
+
+    int copy = copy_leaf(fs, block);
+    if (copy < 0) {
+        return copy;
+    }
+
+    // Every slot that pointed at the old leaf moves to the copy
+    uint32_t slots = 1u << index->global_depth;
+    uint32_t step = 1u << old->local_depth;
+    for (uint32_t s = hash & (step - 1); s < slots; s += step) {
+        int *slot = table_slot(fs, index, s);
+        if (slot) {
+            hfs_dirty(fs, slot);
+            *slot = copy;
+        }
+    }
+    *leaf = hfs_block(fs, copy);
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Fetch the overflow leaf of a leaf, copying it if it is shared
+ * @param[in] fs Mounted filesystem
+ * @param[in,out] leaf Unshared leaf with an overflow leaf
+ * @return Overflow leaf, or NULL if it is corrupted or the disk is full
+ */
+static struct heartyfs_dir_leaf *writable_overflow(
+    struct heartyfs *fs, struct heartyfs_dir_leaf *leaf) {
+    if (!dir_leaf(fs, leaf->overflow)) {
+        return NULL;
+    }
+    if (hfs_shared(fs, leaf->overflow)) {
+        int copy = copy_leaf(fs, leaf->overflow);
+        if (copy < 0) {
+            return NULL;
+        }
+        hfs_dirty(fs, leaf);
+        leaf->overflow = copy;
+    }
+    return hfs_block(fs, leaf->overflow);
+}
+
+/**
+ * @brief Find an entry in a hashed directory
+ * @param[in] fs Mounted filesystem
+ * @param[in] dir Directory head
+ * @param[in] name Entry name
+ * @param[out] leaf Receives the leaf holding the entry
+ * @param[out] slot Receives the entry's index inside the leaf
+ * @return HEARTYFS_OK, HEARTYFS_ERR_NOT_FOUND, HEARTYFS_ERR_CORRUPT or
+ *         HEARTYFS_ERR_CHECKSUM
+ */
+static int find_entry(const struct heartyfs *fs,
+                      const struct heartyfs_directory *dir, const char *name,
+                      struct heartyfs_dir_leaf **leaf, int *slot) {
+    struct heartyfs_dir_index *index = dir_index(fs, dir);
+    if (!index) {
+        return HEARTYFS_ERR_CORRUPT;
+    }
+
+    int block;
+    struct heartyfs_dir_leaf *cur =
+        leaf_for_hash(fs, index, hfs_name_hash(name), &block);
+
+    // Bound the chain walk so that a corrupted loop cannot hang us
+    for (int hops = 0; hops < fs->num_blocks; hops++) {
+        if (!cur) {
+            return HEARTYFS_ERR_CORRUPT;
+        }
+        if (hfs_csum_check(fs, cur, fs->block_size) != HEARTYFS_OK) {
+            return HEARTYFS_ERR_CHECKSUM;
+        }
+        for (int i = 0; i < cur->count; i++) {
+            if (strcmp(cur->entries[i].file_name, name) == 0) {
+                *leaf = cur;
+                *slot = i;
+                return HEARTYFS_OK;
+            }
+        }
+        if (!cur->overflow) {
+            return HEARTYFS_ERR_NOT_FOUND;
+        }
+        cur = dir_leaf(fs, cur->overflow);
+    }
+    return HEARTYFS_ERR_CORRUPT;
+}
+
+/**
+ * @brief Look up an entry in a hashed directory
+ * @param[in] fs Mounted filesystem
+ * @param[in] dir Directory head
+ * @param[in] name Entry name
+ * @param[out] block Receives the block id the entry points to
+ * @return HEARTYFS_OK, HEARTYFS_ERR_NOT_FOUND or HEARTYFS_ERR_CORRUPT
+ */
+int hfs_htree_lookup(const struct heartyfs *fs,
+                     const struct heartyfs_directory *dir, const char *name,
+                     int *block) {
+    struct heartyfs_dir_leaf *leaf;
+    int slot;
+    int ret = find_entry(fs, dir, name, &leaf, &slot);
+    if (ret == HEARTYFS_OK) {
+        *block = leaf->entries[slot].block_id;
+    }
+    return ret;
+}
+
+/**
+ * @brief Call a function on every entry of a hashed directory
+ * @param[in] fs Mounted filesystem
+ * @param[in] dir Directory head
+ * @param[in] fn Called once per entry; a non-zero return stops the walk
+ * @param[in] arg Passed to fn
+ * @return HEARTYFS_OK, the first non-zero return of fn, or
+ *         HEARTYFS_ERR_CORRUPT / HEARTYFS_ERR_CHECKSUM
+ *
+ * Entries come in hash order. Each leaf is visited from its lowest slot
+ * only, followed by its overflow chain.
+ */
+int hfs_htree_foreach(const struct heartyfs *fs,
+                      const struct heartyfs_directory *dir,
+                      int (*fn)(void *arg,
+                                const struct heartyfs_dir_entry *entry),
+                      void *arg) {
+    struct heartyfs_dir_index *index = dir_index(fs, dir);
+    if (!index) {
+        return HEARTYFS_ERR_CORRUPT;
+    }
+
+    uint32_t slots = 1u << index->global_depth;
+    for (uint32_t s = 0; s < slots; s++) {
+        int *slot = table_slot(fs, index, s);
+        struct heartyfs_dir_leaf *leaf = slot ? dir_leaf(fs, *slot) : NULL;
+        if (!leaf) {
+            return HEARTYFS_ERR_CORRUPT;
+        }
+        if (s >= 1u << leaf->local_depth) {
+            continue;
+        }
+
+        for (int hops = 0; leaf; hops++) {
+            if (hops == fs->num_blocks) {
+                return HEARTYFS_ERR_CORRUPT;
+            }
+            if (hfs_csum_check(fs, leaf, fs->block_size) != HEARTYFS_OK) {
+                return HEARTYFS_ERR_CHECKSUM;
+            }
+            for (int i = 0; i < leaf->count; i++) {
+                int ret = fn(arg, &leaf->entries[i]);
+                if (ret != 0) {
+                    return ret;
+                }
+            }
+            int next = leaf->overflow;
+            leaf = next ? dir_leaf(fs, next) : NULL;
+            if (next && !leaf) {
+                return HEARTYFS_ERR_CORRUPT;
+            }
+        }
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Find an entry that is about to change, copying shared blocks
+ * @param[in] fs Mounted filesystem
+ * @param[in,out] dir Unshared directory head
+ * @param[in] name Entry name
+ * @param[out] leaf Receives the unshared leaf holding the entry
+ * @param[out] slot Receives the entry's index inside the leaf
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+static int find_writable_entry(struct heartyfs *fs,
+                               struct heartyfs_directory *dir,
+                               const char *name,
+                               struct heartyfs_dir_leaf **leaf, int *slot) {
+    struct heartyfs_dir_index *index;
+    int ret = writable_index(fs, dir, &index);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    struct heartyfs_dir_leaf *cur;
+    ret = writable_leaf(fs, index, hfs_name_hash(name), &cur);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+    for (int hops = 0; hops < fs->num_blocks; hops++) {
+        for (int i = 0; i < cur->count; i++) {
+            if (strcmp(cur->entries[i].file_name, name) == 0) {
+                *leaf = cur;
+                *slot = i;
+                return HEARTYFS_OK;
+            }
+        }
+        if (!cur->overflow) {
+            return HEARTYFS_ERR_NOT_FOUND;
+        }
+        cur = writable_overflow(fs, cur);
+        if (!cur) {
+            return HEARTYFS_ERR_CORRUPT;
+        }
+    }
+    return HEARTYFS_ERR_CORRUPT;
+}
+
+/**
+ * @brief Store an entry in a leaf known to have room
+ */
+static void leaf_append(struct heartyfs *fs, struct heartyfs_dir_leaf *leaf,
+                        const char *name, int block) {
+    hfs_dirty(fs, leaf);
+    struct heartyfs_dir_entry *entry = &leaf->entries[leaf->count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->block_id = block;
+    strncpy(entry->file_name, name, sizeof(entry->file_name) - 1);
+}
+
+/**
+ * @brief Split a full leaf on its next hash bit
+ * @param[in] fs Mounted filesystem
+ * @param[in] index Index block
+ * @param[in] leaf Leaf to split; its local depth is below the global depth
+ * @param[in] hash Hash of any name that maps to the leaf
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_NO_SPACE if the disk is full
+ */
+static int split_leaf(struct heartyfs *fs, struct heartyfs_dir_index *index,
+                      struct heartyfs_dir_leaf *leaf, uint32_t hash) {
+    int new_block = alloc_index_block(fs);
+    if (new_block < 0) {
+        return new_block;
+    }
+
+    int depth = leaf->local_depth;
+    struct heartyfs_dir_leaf *sibling = hfs_block(fs, new_block);
+    sibling->local_depth = depth + 1;
+    hfs_dirty(fs, leaf);
+    leaf->local_depth = depth + 1;
+
+    // Entries with hash bit 'depth' set move to the new leaf
+    int i = 0;
+    while (i < leaf->count) {
+        if ((hfs_name_hash(leaf->entries[i].file_name) >> depth) & 1) {
+            sibling->entries[sibling->count++] = leaf->entries[i];
+            leaf->entries[i] = leaf->entries[--leaf->count];
+            memset(&leaf->entries[leaf->count], 0,
+                   sizeof(struct heartyfs_dir_entry));
+        } else {
+            i++;
+        }
+    }
+
+    // Every slot that shared the old leaf and has that bit set follows
+    uint32_t slots = 1u << index->global_depth;
+    uint32_t step = 1u << depth;
+    for (uint32_t s = hash & (step - 1); s < slots; s += step) {
+        if ((s >> depth) & 1) {
+            int *slot = table_slot(fs, index, s);
+            if (!slot) {
+                return HEARTYFS_ERR_CORRUPT;
+            }
+            hfs_dirty(fs, slot);
+            *slot = new_block;
+        }
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Double the hash table, adding pages as needed
+ * @param[in] fs Mounted filesystem
+ * @param[in,out] index Index block
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+static int double_table(struct heartyfs *fs, struct heartyfs_dir_index *index) {
+    uint32_t old_slots = 1u << index->global_depth;
+    int pages_needed = (2 * old_slots + fs->pointers_per_block - 1) /
+                       fs->pointers_per_block;
+    hfs_dirty(fs, index);
+
+    while (index->num_pages < pages_needed) {
+        int page = alloc_index_block(fs);
+        if (page < 0) {
+            return page;
+        }
+        index->pages[index->num_pages++] = page;
+    }
+
+    // Slot s + old_slots shares the leaf of slot s until that leaf splits
+    for (uint32_t s = 0; s < old_slots; s++) {
+        int *from = table_slot(fs, index, s);
+        int *to = table_slot(fs, index, s + old_slots);
+        if (!from || !to) {
+            return HEARTYFS_ERR_CORRUPT;
+        }
+        hfs_dirty(fs, to);
+        *to = *from;
+    }
+    index->global_depth++;
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Add an entry to a chain of leaves at the maximum depth
+ * @param[in] fs Mounted filesystem
+ * @param[in] leaf First leaf of the chain; it is not shared
+ * @param[in] name Entry name
+ * @param[in] block Block id the entry points to
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+static int chain_insert(struct heartyfs *fs, struct heartyfs_dir_leaf *leaf,
+                        const char *name, int block) {
+    for (int hops = 0; hops < fs->num_blocks; hops++) {
+        if (leaf->count < leaf_capacity(fs)) {
+            leaf_append(fs, leaf, name, block);
+            return HEARTYFS_OK;
+        }
+        if (!leaf->overflow) {
+            int next = alloc_index_block(fs);
+            if (next < 0) {
+                return next;
+            }
+            hfs_dirty(fs, leaf);
+            leaf->overflow = next;
+            struct heartyfs_dir_leaf *tail = hfs_block(fs, next);
+            tail->local_depth = leaf->local_depth;
+        }
+        leaf = writable_overflow(fs, leaf);
+        if (!leaf) {
+            return HEARTYFS_ERR_CORRUPT;
+        }
+    }
+    return HEARTYFS_ERR_CORRUPT;
+}
+
+/**
+ * @brief Insert an entry into a hashed directory
+ * @param[in] fs Mounted filesystem
+ * @param[in] dir Directory head
+ * @param[in] name Entry name; the caller has checked it is not present
+ * @param[in] block Block id the entry points to
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int hfs_htree_insert(struct heartyfs *fs, struct heartyfs_directory *dir,
+                     const char *name, int block) {
+    struct heartyfs_dir_index *index;
+    int ret = writable_index(fs, dir, &index);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    uint32_t hash = hfs_name_hash(name);
+    for (;;) {
+        struct heartyfs_dir_leaf *leaf;
+        ret = writable_leaf(fs, index, hash, &leaf);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+        if (!leaf->overflow && leaf->count < leaf_capacity(fs)) {
+            leaf_append(fs, leaf, name, block);
+            return HEARTYFS_OK;
+        }
+
+        if (leaf->local_depth < index->global_depth) {
+            ret = split_leaf(fs, index, leaf, hash);
+        } else if (index->global_depth < max_global_depth(fs)) {
+            ret = double_table(fs, index);
+        } else {
+            return chain_insert(fs, leaf, name, block);
+        }
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+    }
+}
+
+/**
+ * @brief Remove an entry from a hashed directory
+ * @param[in] fs Mounted filesystem
+ * @param[in] dir Directory head
+ * @param[in] name Entry name
+ * @return HEARTYFS_OK, HEARTYFS_ERR_NOT_FOUND or HEARTYFS_ERR_CORRUPT
+ *
+ * The last entry of the leaf is moved into the gap. Leaves are not merged
+ * back; the whole index is released once the directory is empty.
+ */
+int hfs_htree_remove(struct heartyfs *fs, struct heartyfs_directory *dir,
+                     const char *name) {
+    struct heartyfs_dir_leaf *leaf;
+    int slot;
+    int ret = find_writable_entry(fs, dir, name, &leaf, &slot);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    hfs_dirty(fs, leaf);
+    leaf->entries[slot] = leaf->entries[--leaf->count];
+    memset(&leaf->entries[leaf->count], 0, sizeof(struct heartyfs_dir_entry));
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Copy the shared parts of a hashed directory that lead to an entry
+ * @param[in] fs Mounted filesystem
+ * @param[in,out] dir Unshared directory head
+ * @param[in] name Entry name
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int hfs_htree_unshare(struct heartyfs *fs, struct heartyfs_directory *dir,
+                      const char *name) {
+    struct heartyfs_dir_leaf *leaf;
+    int slot;
+    return find_writable_entry(fs, dir, name, &leaf, &slot);
+}
+
+/**
+ * @brief Point an entry of a hashed directory at another block
+ * @param[in] fs Mounted filesystem
+ * @param[in] dir Directory head
+ * @param[in] name Entry name
+ * @param[in] block New block id of the entry
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int hfs_htree_relink(struct heartyfs *fs, struct heartyfs_directory *dir,
+                     const char *name, int block) {
+    struct heartyfs_dir_leaf *leaf;
+    int slot;
+    int ret = find_writable_entry(fs, dir, name, &leaf, &slot);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    hfs_dirty(fs, &leaf->entries[slot]);
+    leaf->entries[slot].block_id = block;
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Convert a directory with a full inline array to a hashed one
+ * @param[in] fs Mounted filesystem
+ * @param[in,out] dir Directory head
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_NO_SPACE if the disk is full
+ *
+ * Every inline entry except . and .. moves to a single leaf, which always
+ * has room for them.
+ */
+int hfs_htree_create(struct heartyfs *fs, struct heartyfs_directory *dir) {
+    int blocks[3];  // Index, first table page, first leaf
+    for (int i = 0; i < 3; i++) {
+        blocks[i] = alloc_index_block(fs);
+        if (blocks[i] < 0) {
+            while (--i >= 0) {
+                hfs_free_block(fs, blocks[i]);
+            }
+            return HEARTYFS_ERR_NO_SPACE;
+        }
+    }
+
+    struct heartyfs_dir_index *index = hfs_block(fs, blocks[0]);
+    index->global_depth = 0;
+    index->num_pages = 1;
+    index->pages[0] = blocks[1];
+    ((int *)hfs_block(fs, blocks[1]))[0] = blocks[2];
+
+    struct heartyfs_dir_leaf *leaf = hfs_block(fs, blocks[2]);
+    for (int i = MIN_DIR_ENTRIES; i < dir->size; i++) {
+        leaf->entries[leaf->count++] = dir->entries[i];
+    }
+    memset(&dir->entries[MIN_DIR_ENTRIES], 0,
+           sizeof(dir->entries) - MIN_DIR_ENTRIES * sizeof(dir->entries[0]));
+    dir->index_block = blocks[0];
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Release every block of a directory's hash index
+ * @param[in] fs Mounted filesystem
+ * @param[in,out] dir Directory head; it goes back to inline entries
+ *
+ * Entries still in the index lose a reference, so dropping the head of a
+ * directory that is not empty releases everything below it. Parts of the
+ * index shared with a snapshot just lose a reference.
+ */
+void hfs_htree_free(struct heartyfs *fs, struct heartyfs_directory *dir) {
+    struct heartyfs_dir_index *index = dir_index(fs, dir);
+    if (index && hfs_shared(fs, dir->index_block)) {
+        hfs_unref_run(fs, dir->index_block, 1);
+        index = NULL;
+    }
+    if (!index) {
+        dir->index_block = 0;
+        return;
+    }
+
+    // A leaf of depth d is shared by every slot with the same low d bits;
+    // free it only from the lowest of them, slot < 2^d
+    uint32_t slots = 1u << index->global_depth;
+    for (uint32_t s = 0; s < slots; s++) {
+        int *slot = table_slot(fs, index, s);
+        struct heartyfs_dir_leaf *leaf = slot ? dir_leaf(fs, *slot) : NULL;
+        if (!leaf || s >= 1u << leaf->local_depth) {
+            continue;
+        }
+
+        int block = *slot;
+        for (int hops = 0; leaf && hops < fs->num_blocks; hops++) {
+            if (hfs_shared(fs, block)) {
+                hfs_unref_run(fs, block, 1);  // Its chain stays referenced
+                break;
+            }
+            int next = leaf->overflow;
+            for (int i = 0; i < leaf->count; i++) {
+                hfs_drop_node(fs, leaf->entries[i].block_id);
+            }
+            hfs_dirty(fs, leaf);
+            memset(leaf, 0, fs->block_size);
+            hfs_free_block(fs, block);
+            block = next;
+            leaf = next ? dir_leaf(fs, next) : NULL;
+        }
+    }
+
+    for (int i = 0; i < index->num_pages; i++) {
+        hfs_free_block(fs, index->pages[i]);
+    }
+    hfs_free_block(fs, dir->index_block);
+    dir->index_block = 0;
+}
@@ -0,0 +1,669 @@
+#include "heartyfs_internal.h"
+#include <sys/uio.h>
+#include <time.h>
+
+/*
+ * Export of a subtree as a POSIX tar archive.
+ *
+ * The subtree is walked once, depth first and in name order, and the
+ * archive is written as the walk goes. Headers are built in a small pool
+ * of blocks, and file data is never copied: each header, the spans of the
+ * disk mapping that hold the file and the padding after it are queued as
+ * one vector, and the vector goes out with writev() whenever it or the
+ * pool fills up. Only compressed files pass through a buffer, a chunk at
+ * a time. Memory use is bounded by the entries of the directories on the
+ * current path, which are sorted before they are visited.
+ *
+ * Other processes may keep changing the tree. A directory is locked only
+ * while its entries are collected, and a file from before its header is
+ * queued until its data has gone out; locked nodes are checked to still
+ * be linked where the walk found them, and skipped if not. Directories
+ * are never waited for while files are locked: the queue is written out
+ * and the files let go first.
+ */
+#define TAR_BLOCK_SIZE 512
+#define TAR_DIR_MODE 0755
+#define TAR_FILE_MODE 0644
+#define EXPORT_IOV_BATCH 1024       // Spans handed to one writev()
+#define EXPORT_HEADERS 128          // Headers built before a writev()
+#define EXPORT_NAME_MAX 4096        // Longest name in the archive
+#define PAX_HEADER_NAME "././@PaxHeader"
+
+/**
+ * @brief ustar header block, as POSIX.1-1988 lays it out
+ *
+ * Numbers are octal text, NUL terminated. A name that does not fit in
+ * name is split at a slash, the leading part going to prefix.
+ */
+struct tar_header {
+    char name[100];         // 100 bytes
+    char mode[8];           // 8 bytes
+    char uid[8];            // 8 bytes
+    char gid[8];            // 8 bytes
+    char size[12];          // 12 bytes
+    char mtime[12];         // 12 bytes
+    char chksum[8];         // 8 bytes: sum of the block, taken as spaces
+    char typeflag;          // 1 byte
+    char linkname[100];     // 100 bytes
+    char magic[6];          // 6 bytes: "ustar"
+    char version[2];        // 2 bytes: "00"
+    char uname[32];         // 32 bytes
+    char gname[32];         // 32 bytes
+    char devmajor[8];       // 8 bytes
+    char devminor[8];       // 8 bytes
+    char prefix[155];       // 155 bytes
+    char pad[12];           // 12 bytes
+};  // Overall: 512 bytes
+
+/* Type flags */
+#define TAR_FILE '0'
+#define TAR_DIR '5'
+#define TAR_PAX 'x'
+
+/**
+ * @brief State of one export
+ */
+struct export {
+    struct heartyfs *fs;
+    int fd;
+    long long mtime;                        // Time stamp of every entry
+    struct iovec iov[EXPORT_IOV_BATCH];     // Spans waiting to go out
+    int count;
+    struct tar_header headers[EXPORT_HEADERS];  // Pool the spans point into
+    int used;
+    char name[EXPORT_NAME_MAX];             // Archive name of the node
+    const char *path;                       // Path being exported
+    int flushed;                            // Written out since files were
+                                            // last let go
+    struct heartyfs_export_report *report;
+};
+
+struct export_child {
+    char name[MAX_NAME_LENGTH + 1];
+    int block;
+};
+
+struct export_children {
+    struct export_child *items;
+    int count;
+    int capacity;
+};
+
+static const char zero_blocks[2 * TAR_BLOCK_SIZE];
+
+/**
+ * @brief Write out every span queued so far
+ * @param[in,out] ex Export
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_IO on failure
+ *
+ * Headers are reused after this, so spans are never spliced.
+ */
+static int flush(struct export *ex) {
+    int use_splice = 0;
+    int ret = hfs_write_spans(ex->fd, ex->iov, ex->count, &use_splice);
+    ex->count = 0;
+    ex->used = 0;
+    ex->flushed = 1;
+    return ret;
+}
+
+/**
+ * @brief Write out the queue and let go of the files it came from
+ * @param[in,out] ex Export
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_IO on failure
+ */
+static int release(struct export *ex) {
+    int ret = flush(ex);
+    if (ret == HEARTYFS_OK) {
+        hfs_unlock_held(ex->fs);
+        ex->flushed = 0;
+    }
+    return ret;
+}
+
+/**
+ * @brief Check that a locked node is still linked where the walk found it
+ * @param[in] ex Export
+ * @param[in] parent Directory the node was found in, or -1 for the node
+ *                   ex->path names
+ * @param[in] name Name of the node in parent
+ * @param[in] block Block id of the node
+ * @return 1 if it is, 0 if it was removed meanwhile
+ */
+static int still_linked(struct export *ex, int parent, const char *name,
+                        int block) {
+    hfs_locks_sync(ex->fs);
+    int now;
+    int ret = parent < 0 ? hfs_resolve(ex->fs, ex->path, &now)
+                         : hfs_lookup(ex->fs, parent, name, &now);
+    return ret == HEARTYFS_OK && now == block;
+}
+
+/**
+ * @brief Queue a span
+ * @param[in,out] ex Export
+ * @param[in] base Start of the span
+ * @param[in] len Length of the span
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_IO on failure
+ */
+static int push(struct export *ex, const void *base, size_t len) {
+    if (len == 0) {
+        return HEARTYFS_OK;
+    }
+    if (ex->count == EXPORT_IOV_BATCH) {
+        int ret = flush(ex);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+    }
+    ex->iov[ex->count].iov_base = (void *)base;
+    ex->iov[ex->count].iov_len = len;
+    ex->count++;
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Queue the padding that ends a member at a block boundary
+ * @param[in,out] ex Export
+ * @param[in] size Length of the member's data
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_IO on failure
+ */
+static int push_padding(struct export *ex, long long size) {
+    int rest = size % TAR_BLOCK_SIZE;
+    return rest ? push(ex, zero_blocks, TAR_BLOCK_SIZE - rest) : HEARTYFS_OK;
+}
+
+/**
+ * @brief Store a number as octal text
+ * @param[out] field Header field
+ * @param[in] width Width of the field, including the NUL
+ * @param[in] value Number to store
+ * @return 0 on success, -1 if the number needs more digits than fit
+ */
+static int put_octal(char *field, int width, long long value) {
+    if (value < 0 || value >> (3 * (width - 1)) != 0) {
+        return -1;
+    }
+    for (int i = width - 2; i >= 0; i--) {
+        field[i] = '0' + (value & 7);
+        value >>= 3;
+    }
+    field[width - 1] = '\0';
+    return 0;
+}
+
+/**
+ * @brief Fill in a header, leaving the name fields to the caller
+ * @param[in] ex Export
+ * @param[out] h Header, cleared
+ * @param[in] type Type flag
+ * @param[in] mode Permission bits
+ * @param[in] size Length of the member's data; must fit the field
+ */
+static void fill_header(const struct export *ex, struct tar_header *h,
+                        char type, int mode, long long size) {
+    put_octal(h->mode, sizeof(h->mode), mode);
+    put_octal(h->uid, sizeof(h->uid), 0);
+    put_octal(h->gid, sizeof(h->gid), 0);
+    put_octal(h->size, sizeof(h->size), size);
+    put_octal(h->mtime, sizeof(h->mtime), ex->mtime);
+    h->typeflag = type;
+    memcpy(h->magic, "ustar", 6);
+    memcpy(h->version, "00", 2);
+}
+
+/**
+ * @brief Compute and store the checksum of a finished header
+ * @param[in,out] h Header
+ */
+static void seal_header(struct tar_header *h) {
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    const unsigned char *p = (const unsigned char *)h;
+    unsigned int sum = 0;
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+        sum += p[i];
+    }
+    put_octal(h->chksum, 7, sum);   // Six digits, a NUL and a space
+}
+
+/**
+ * @brief Split a name into the name and prefix fields of a header
+ * @param[out] h Header
+ * @param[in] name Archive name
+ * @param[in] len Length of name
+ * @return 0 on success, -1 if the name fits neither way
+ */
+static int put_name(struct tar_header *h, const char *name, size_t len) {
+    if (len <= sizeof(h->name)) {
+        memcpy(h->name, name, len);
+        return 0;
+    }
+    // Split at the last slash that leaves both parts short enough
+    for (size_t i = len - 1; i > 0; i--) {
+        if (name[i] != '/' || i == len - 1) {
+            continue;
+        }
+        if (len - i - 1 > sizeof(h->name)) {
+            break;
+        }
+        if (i <= sizeof(h->prefix)) {
+            memcpy(h->prefix, name, i);
+            memcpy(h->name, name + i + 1, len - i - 1);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Append one record to an extended header
+ * @param[out] buf Records so far
+ * @param[in,out] used Length of buf
+ * @param[in] key Keyword
+ * @param[in] value Value, as text
+ * @param[in] value_len Length of value
+ *
+ * A record reads "<length> <key>=<value>\n", where the length counts its
+ * own digits too.
+ */
+static void pax_record(char *buf, size_t *used, const char *key,
+                       const char *value, size_t value_len) {
+    size_t body = 1 + strlen(key) + 1 + value_len + 1;
+    size_t len = body + 1;
+    while (snprintf(NULL, 0, "%zu", len) + body > len) {
+        len++;
+    }
+    *used += sprintf(buf + *used, "%zu %s=%.*s\n", len, key, (int)value_len,
+                     value);
+}
+
+/**
+ * @brief Write an extended header for what a ustar header cannot hold
+ * @param[in,out] ex Export
+ * @param[in] len Length of the archive name in ex->name
+ * @param[in] long_name 1 to record the name
+ * @param[in] size Length of the member's data, recorded if too large
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Rarely needed, so it bypasses the pool and writes straight away.
+ */
+static int write_pax(struct export *ex, size_t len, int long_name,
+                     long long size) {
+    size_t cap = len + 2 * TAR_BLOCK_SIZE;
+    char *data = calloc(1, cap);
+    if (!data) {
+        return HEARTYFS_ERR_NO_MEMORY;
+    }
+
+    size_t used = 0;
+    if (long_name) {
+        pax_record(data, &used, "path", ex->name, len);
+    }
+    struct tar_header h = {0};
+    if (put_octal(h.size, sizeof(h.size), size) != 0) {
+        char text[32];
+        int n = snprintf(text, sizeof(text), "%lld", size);
+        pax_record(data, &used, "size", text, n);
+    }
+
+    memset(&h, 0, sizeof(h));
+    fill_header(ex, &h, TAR_PAX, TAR_FILE_MODE, used);
+    memcpy(h.name, PAX_HEADER_NAME, strlen(PAX_HEADER_NAME));
+    seal_header(&h);
+
+    int ret = flush(ex);
+    if (ret == HEARTYFS_OK) {
+        int use_splice = 0;
+        size_t padded = (used + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE *
+                        TAR_BLOCK_SIZE;
+        struct iovec iov[2] = {{&h, sizeof(h)}, {data, padded}};
+        ret = hfs_write_spans(ex->fd, iov, 2, &use_splice);
+    }
+    free(data);
+    return ret;
+}
+
+/**
+ * @brief Queue the header of a member named by ex->name
+ * @param[in,out] ex Export
+ * @param[in] len Length of the name
+ * @param[in] type Type flag
+ * @param[in] size Length of the member's data
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+static int push_header(struct export *ex, size_t len, char type,
+                       long long size) {
+    if (ex->used == EXPORT_HEADERS) {
+        int ret = flush(ex);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+    }
+    struct tar_header *h = &ex->headers[ex->used];
+    memset(h, 0, sizeof(*h));
+
+    int long_name = put_name(h, ex->name, len) != 0;
+    int large = put_octal(h->size, sizeof(h->size), size) != 0;
+    if (long_name || large) {
+        int ret = write_pax(ex, len, long_name, size);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+        // The extended header overrides these; keep what fits
+        h = &ex->headers[0];
+        memset(h, 0, sizeof(*h));
+        if (long_name) {
+            size_t keep = len < sizeof(h->name) ? len : sizeof(h->name);
+            memcpy(h->name, ex->name + len - keep, keep);
+        } else {
+            put_name(h, ex->name, len);
+        }
+    }
+    ex->used++;
+
+    fill_header(ex, h, type, type == TAR_DIR ? TAR_DIR_MODE : TAR_FILE_MODE,
+                large ? 0 : size);
+    seal_header(h);
+    return push(ex, h, sizeof(*h));
+}
+
+/**
+ * @brief Archive a file named by ex->name
+ * @param[in,out] ex Export
+ * @param[in] len Length of the name
+ * @param[in] inode File inode, checksum already verified
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+static int export_file(struct export *ex, size_t len,
+                       const struct heartyfs_inode *inode) {
+    if (!hfs_extents_valid(ex->fs, inode)) {
+        return HEARTYFS_ERR_CORRUPT;
+    }
+    long long size = hfs_file_length(ex->fs, inode);
+    if (size < 0) {
+        return size;
+    }
+    int ret = push_header(ex, len, TAR_FILE, size);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    if (inode->flags & FILE_COMPRESSED) {
+        ret = flush(ex);
+        if (ret == HEARTYFS_OK) {
+            ret = hfs_read_compressed_to_fd(ex->fs, inode, ex->fd, 0, size);
+        }
+    } else {
+        for (off_t offset = 0; offset < size && ret == HEARTYFS_OK;) {
+            if (ex->count == EXPORT_IOV_BATCH) {
+                ret = flush(ex);
+                if (ret != HEARTYFS_OK) {
+                    break;
+                }
+            }
+            struct iovec *iov = &ex->iov[ex->count];
+            size_t mapped;
+            int count = hfs_file_map(ex->fs, inode, offset, size - offset,
+                                     iov, EXPORT_IOV_BATCH - ex->count,
+                                     &mapped);
+            if (count <= 0) {
+                ret = count < 0 ? count : HEARTYFS_ERR_CORRUPT;
+                break;
+            }
+            for (int i = 0; i < count && ret == HEARTYFS_OK; i++) {
+                ret = hfs_csum_check(ex->fs, iov[i].iov_base, iov[i].iov_len);
+            }
+            ex->count += count;
+            offset += mapped;
+        }
+    }
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    ex->report->files++;
+    ex->report->bytes += size;
+    return push_padding(ex, size);
+}
+
+/**
+ * @brief Collect one directory entry
+ * @param[in,out] arg Children collected so far
+ * @param[in] entry Entry
+ * @return HEARTYFS_OK, or HEARTYFS_ERR_NO_MEMORY
+ */
+static int collect_child(void *arg, const struct heartyfs_dir_entry *entry) {
+    struct export_children *c = arg;
+    if (c->count == c->capacity) {
+        int capacity = c->capacity ? 2 * c->capacity : 64;
+        struct export_child *items =
+            realloc(c->items, capacity * sizeof(*items));
+        if (!items) {
+            return HEARTYFS_ERR_NO_MEMORY;
+        }
+        c->items = items;
+        c->capacity = capacity;
+    }
+    struct export_child *child = &c->items[c->count++];
+    memcpy(child->name, entry->file_name, MAX_NAME_LENGTH);
+    child->name[MAX_NAME_LENGTH] = '\0';
+    child->block = entry->block_id;
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Order children by name, as qsort() wants
+ * @param[in] a First child
+ * @param[in] b Second child
+ * @return Negative, zero or positive as a sorts before, with or after b
+ */
+static int compare_children(const void *a, const void *b) {
+    return strcmp(((const struct export_child *)a)->name,
+                  ((const struct export_child *)b)->name);
+}
+
+static int export_node(struct export *ex, size_t len, int parent,
+                       const char *name, int block);
+
+/**
+ * @brief Archive a directory named by ex->name and everything below it
+ * @param[in,out] ex Export
+ * @param[in] len Length of the name; 0 for the root, which gets no entry
+ * @param[in] block Directory head, locked and checksum already verified
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * The lock is let go once the entries are collected.
+ */
+static int export_dir(struct export *ex, size_t len, int block) {
+    struct export_children c = {0};
+    int ret = hfs_dir_foreach(ex->fs, hfs_block(ex->fs, block),
+                              collect_child, &c);
+    hfs_unlock_dir(ex->fs, block);
+    if (ret == HEARTYFS_OK) {
+        qsort(c.items, c.count, sizeof(*c.items), compare_children);
+    }
+
+    if (ret == HEARTYFS_OK && len > 0) {
+        if (len + 1 >= EXPORT_NAME_MAX) {
+            ret = HEARTYFS_ERR_NAME_TOO_LONG;
+        } else {
+            ex->name[len++] = '/';
+            ret = push_header(ex, len, TAR_DIR, 0);
+        }
+        if (ret == HEARTYFS_OK) {
+            ex->report->dirs++;
+        }
+    }
+    for (int i = 0; i < c.count && ret == HEARTYFS_OK; i++) {
+        size_t name_len = strlen(c.items[i].name);
+        if (len + name_len >= EXPORT_NAME_MAX) {
+            ret = HEARTYFS_ERR_NAME_TOO_LONG;
+            break;
+        }
+        memcpy(ex->name + len, c.items[i].name, name_len + 1);
+        ret = export_node(ex, len + name_len, block, c.items[i].name,
+                          c.items[i].block);
+    }
+    free(c.items);
+    return ret;
+}
+
+/**
+ * @brief Lock a node for the walk
+ * @param[in,out] ex Export
+ * @param[in] block Block id of the node
+ * @param[in] dir 1 for a directory, 0 for a file
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Files already written out are let go first if the queue has been
+ * flushed since, and all of them before waiting for a directory.
+ */
+static int lock_node(struct export *ex, int block, int dir) {
+    int ret = ex->flushed ? release(ex) : HEARTYFS_OK;
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+    if (!dir) {
+        return hfs_lock_inode(ex->fs, block);
+    }
+    if (hfs_trylock_dir(ex->fs, block)) {
+        return HEARTYFS_OK;
+    }
+    ret = release(ex);
+    return ret == HEARTYFS_OK ? hfs_lock_dir(ex->fs, block) : ret;
+}
+
+/**
+ * @brief Archive a node named by ex->name
+ * @param[in,out] ex Export
+ * @param[in] len Length of the name
+ * @param[in] parent Directory the node was found in, or -1 for the node
+ *                   ex->path names
+ * @param[in] name Name of the node in parent
+ * @param[in] block Block id of the node
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * A node removed since its parent was read is left out.
+ */
+static int export_node(struct export *ex, size_t len, int parent,
+                       const char *name, int block) {
+    if (block != SUPERBLOCK_ID && block != ex->fs->snapshot_dir &&
+        !hfs_block_in_range(ex->fs, block)) {
+        return HEARTYFS_ERR_CORRUPT;
+    }
+    const struct heartyfs_inode *node = hfs_block(ex->fs, block);
+
+    int type;
+    for (;;) {
+        type = node->type;
+        int ret = lock_node(ex, block, type == DIR_TYPE);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+        if (!still_linked(ex, parent, name, block)) {
+            return parent < 0 ? HEARTYFS_ERR_NOT_FOUND : HEARTYFS_OK;
+        }
+        if (node->type == type) {
+            break;
+        }
+        // Removed and made again as the other kind before it was locked
+        if (type == DIR_TYPE) {
+            hfs_unlock_dir(ex->fs, block);
+        }
+    }
+
+    int ret = hfs_csum_check(ex->fs, node, ex->fs->block_size);
+    if (ret != HEARTYFS_OK) {
+        if (type == DIR_TYPE) {
+            hfs_unlock_dir(ex->fs, block);
+        }
+        return ret;
+    }
+
+    switch (type) {
+    case DIR_TYPE:
+        return export_dir(ex, len, block);
+    case FILE_TYPE:
+        return export_file(ex, len, node);
+    default:
+        return HEARTYFS_ERR_CORRUPT;
+    }
+}
+
+/**
+ * @brief Archive the node a path names, with the image lock held
+ */
+static int export_tree(struct heartyfs *fs, const char *path, int out_fd,
+                       struct heartyfs_export_report *report) {
+    int block;
+    int ret = hfs_resolve(fs, path, &block);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    struct export *ex = calloc(1, sizeof(*ex));
+    if (!ex) {
+        return HEARTYFS_ERR_NO_MEMORY;
+    }
+    struct heartyfs_export_report scratch;
+    ex->fs = fs;
+    ex->fd = out_fd;
+    ex->path = path;
+    ex->mtime = time(NULL);
+    ex->report = report ? report : &scratch;
+    memset(ex->report, 0, sizeof(*ex->report));
+
+    // The root has no name of its own; anything else keeps its last
+    // component, without trailing slashes
+    size_t len = 0;
+    if (block != SUPERBLOCK_ID) {
+        size_t end = strlen(path);
+        while (end > 0 && path[end - 1] == '/') {
+            end--;
+        }
+        size_t start = end;
+        while (start > 0 && path[start - 1] != '/') {
+            start--;
+        }
+        len = end - start;
+        memcpy(ex->name, path + start, len);
+    }
+
+    ret = export_node(ex, len, -1, NULL, block);
+    if (ret == HEARTYFS_OK) {
+        ret = push(ex, zero_blocks, sizeof(zero_blocks));
+    }
+    if (ret == HEARTYFS_OK) {
+        ret = flush(ex);
+    }
+    free(ex);
+    return ret;
+}
+
+/**
+ * @brief Stream a subtree to a host file descriptor as a tar archive
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Directory or file to export
+ * @param[in] out_fd Destination descriptor, e.g. STDOUT_FILENO
+ * @param[out] report Receives what was archived; may be NULL
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Names in the archive start with the last component of path, so
+ * exporting /docs gives docs/, docs/a.txt and so on; exporting / gives
+ * the entries of the root. The archive is POSIX ustar, with an extended
+ * header for names of more than 255 characters and files of 8 GB or
+ * more. Entries carry mode 0755 or 0644, owner 0 and the time of the
+ * export, since heartyfs keeps none of these. On failure the archive is
+ * left without its end marker, so readers see it as truncated.
+ */
+int heartyfs_export(struct heartyfs *fs, const char *path, int out_fd,
+                    struct heartyfs_export_report *report) {
+    if (!fs || !path) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    int ret = hfs_op_begin(fs, 1);
+    if (ret == HEARTYFS_OK) {
+        ret = export_tree(fs, path, out_fd, report);
+    }
+    return hfs_op_end(fs, ret);
+}
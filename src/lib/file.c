@@ -0,0 +1,844 @@
+#include "heartyfs_internal.h"
+#include <sys/uio.h>
+
+/* Constants */
+#define FILE_MAP_BATCH 64  // Spans mapped per hfs_file_map() call
+
+/**
+ * @brief Resolve a path and make sure it names a regular file
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path of the file
+ * @param[in] writable 1 if the caller is about to change the file; see
+ *                     hfs_resolve_writable()
+ * @param[out] inode Receives the file's inode
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * The file stays locked against other writers until the operation ends.
+ */
+int hfs_resolve_file(struct heartyfs *fs, const char *path, int writable,
+                     struct heartyfs_inode **inode) {
+    int block;
+    int ret = hfs_resolve_locked(fs, path, writable, &block);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    *inode = hfs_block(fs, block);
+    ret = hfs_csum_check(fs, *inode, fs->block_size);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+    if ((*inode)->type != FILE_TYPE) {
+        return HEARTYFS_ERR_NOT_FILE;
+    }
+    if (!hfs_extents_valid(fs, *inode)) {
+        return HEARTYFS_ERR_CORRUPT;
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Describe a byte range of a file as spans of the disk mapping
+ * @param[in] fs Mounted filesystem
+ * @param[in] inode File inode, already validated by hfs_resolve_file()
+ * @param[in] offset File offset of the range
+ * @param[in] len Length of the range; clipped at end of file
+ * @param[out] iov Receives one span per extent touched
+ * @param[in] max_iov Capacity of iov
+ * @param[out] mapped Receives the number of bytes described
+ * @return Number of spans filled in, or HEARTYFS_ERR_CORRUPT
+ *
+ * Fewer than len bytes are described when the range needs more than
+ * max_iov spans or runs past end of file; callers loop on *mapped. The
+ * data of an inline file is a single span inside the inode block, and the
+ * tail fragment of a packed file one inside its tail block.
+ */
+int hfs_file_map(const struct heartyfs *fs, const struct heartyfs_inode *inode,
+                 off_t offset, size_t len, struct iovec *iov, int max_iov,
+                 size_t *mapped) {
+    *mapped = 0;
+    if (offset >= inode->file_size || len == 0) {
+        return 0;
+    }
+    if (len > (size_t)(inode->file_size - offset)) {
+        len = inode->file_size - offset;
+    }
+    if (hfs_file_inline(inode)) {
+        iov[0].iov_base = hfs_inline_data(inode) + offset;
+        iov[0].iov_len = len;
+        *mapped = len;
+        return 1;
+    }
+
+    int count = 0;
+    long long tail_start = (long long)inode->size << fs->block_shift;
+    int i = inode->num_extents;
+    if (offset < tail_start) {
+        i = hfs_extent_find(fs, inode, offset >> fs->block_shift);
+        if (i < 0) {
+            return HEARTYFS_ERR_CORRUPT;  // Extents end before file_size
+        }
+    }
+    for (; i < inode->num_extents && *mapped < len && count < max_iov; i++) {
+        const struct heartyfs_extent *ext = hfs_extent_at(fs, inode, i);
+        if (!ext || ext->length <= 0 || !hfs_block_in_range(fs, ext->start) ||
+            !hfs_block_in_range(fs, ext->start + ext->length - 1)) {
+            return HEARTYFS_ERR_CORRUPT;
+        }
+
+        off_t run_offset = offset - ((off_t)ext->logical << fs->block_shift);
+        off_t run_size = (off_t)ext->length << fs->block_shift;
+        if (run_offset < 0 || run_offset >= run_size) {
+            return HEARTYFS_ERR_CORRUPT;  // Extents out of order
+        }
+        size_t chunk = run_size - run_offset;
+        if (chunk > len - *mapped) {
+            chunk = len - *mapped;
+        }
+
+        iov[count].iov_base = (char *)hfs_data(fs, ext->start) + run_offset;
+        iov[count].iov_len = chunk;
+        count++;
+        *mapped += chunk;
+        offset += chunk;
+    }
+    if (*mapped < len && count < max_iov && hfs_file_packed(fs, inode)) {
+        const struct heartyfs_tail *tail = hfs_file_tail(inode);
+        iov[count].iov_base = (char *)hfs_block(fs, tail->block) +
+                              tail->offset + (offset - tail_start);
+        iov[count].iov_len = len - *mapped;
+        count++;
+        *mapped = len;
+    }
+    if (count == 0 || (*mapped < len && count < max_iov)) {
+        return HEARTYFS_ERR_CORRUPT;  // Extents end before file_size
+    }
+    return count;
+}
+
+/**
+ * @brief Note that part of a file's data is about to change
+ * @param[in] fs Mounted filesystem
+ * @param[in] inode File inode
+ * @param[in] ptr Start of a span returned by hfs_file_map()
+ * @param[in] len Length of the span
+ *
+ * Inline data and tail fragments are metadata: they change with the
+ * inode or tail block.
+ */
+void hfs_file_dirty(struct heartyfs *fs, const struct heartyfs_inode *inode,
+                    const void *ptr, size_t len) {
+    const char *tail = hfs_file_packed(fs, inode)
+                           ? hfs_block(fs, hfs_file_tail(inode)->block)
+                           : NULL;
+    if (hfs_file_inline(inode) ||
+        (tail && (const char *)ptr >= tail &&
+         (const char *)ptr < tail + fs->block_size)) {
+        hfs_dirty(fs, ptr);
+    } else {
+        hfs_dirty_data(fs, ptr, len);
+    }
+}
+
+/**
+ * @brief Body of heartyfs_stat(), run under the operation's locks
+ */
+static int stat_path(struct heartyfs *fs, const char *path,
+                     struct heartyfs_stat *st) {
+    int block;
+    int ret = hfs_resolve(fs, path, &block);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    memset(st, 0, sizeof(*st));
+    st->block = block;
+
+    struct heartyfs_directory *dir = hfs_block(fs, block);
+    if (dir->type == DIR_TYPE) {
+        st->type = HEARTYFS_TYPE_DIR;
+        st->size = dir->size;
+        return HEARTYFS_OK;
+    }
+
+    struct heartyfs_inode *inode;
+    ret = hfs_resolve_file(fs, path, 0, &inode);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+    st->block = hfs_block_id(fs, inode);
+
+    long long size = hfs_file_length(fs, inode);
+    if (size < 0) {
+        return size;
+    }
+    st->type = HEARTYFS_TYPE_FILE;
+    st->size = size;
+    st->blocks = inode->size;
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Report the type and size of a file or directory
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path to inspect
+ * @param[out] st Receives the result
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int heartyfs_stat(struct heartyfs *fs, const char *path,
+                  struct heartyfs_stat *st) {
+    if (!fs || !path || !st) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    int ret = hfs_op_begin(fs, 0);
+    if (ret == HEARTYFS_OK) {
+        ret = stat_path(fs, path, st);
+    }
+    return hfs_op_end(fs, ret);
+}
+
+/**
+ * @brief Read part of a file into a caller-supplied buffer
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path of the file
+ * @param[out] buf Destination buffer
+ * @param[in] len Maximum number of bytes to read
+ * @param[in] offset File offset to start reading from
+ * @return Number of bytes read (0 at end of file), or a HEARTYFS_ERR_* code
+ */
+ssize_t heartyfs_pread(struct heartyfs *fs, const char *path, void *buf,
+                       size_t len, off_t offset) {
+    if (!fs || !path || (!buf && len > 0) || offset < 0) {
+        return HEARTYFS_ERR_INVALID;
+    }
+
+    struct heartyfs_inode *inode;
+    ssize_t ret = hfs_op_begin(fs, 0);
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_resolve_file(fs, path, 0, &inode);
+    }
+    if (ret == HEARTYFS_OK) {
+        ret = inode->flags & FILE_COMPRESSED
+                  ? hfs_zread(fs, inode, buf, len, offset)
+                  : hfs_file_read(fs, inode, buf, len, offset);
+    }
+    return hfs_op_end(fs, ret);
+}
+
+/**
+ * @brief Read part of a file's stored data into a buffer
+ * @param[in] fs Mounted filesystem
+ * @param[in] inode File inode
+ * @param[out] buf Destination buffer
+ * @param[in] len Maximum number of bytes to read
+ * @param[in] offset File offset to start reading from
+ * @return Number of bytes read (0 at end of file), or a HEARTYFS_ERR_* code
+ *
+ * For a compressed file this reads the container, not the contents.
+ */
+ssize_t hfs_file_read(const struct heartyfs *fs,
+                      const struct heartyfs_inode *inode, void *buf,
+                      size_t len, off_t offset) {
+    /* One memcpy per extent: each run is contiguous in the mapping */
+    size_t copied = 0;
+    while (copied < len) {
+        struct iovec iov[FILE_MAP_BATCH];
+        size_t mapped;
+        int count = hfs_file_map(fs, inode, offset + copied, len - copied,
+                                 iov, FILE_MAP_BATCH, &mapped);
+        if (count <= 0) {
+            return count < 0 ? count : (ssize_t)copied;
+        }
+
+        for (int i = 0; i < count; i++) {
+            int ret = hfs_csum_check(fs, iov[i].iov_base, iov[i].iov_len);
+            if (ret != HEARTYFS_OK) {
+                return ret;
+            }
+            memcpy((char *)buf + copied, iov[i].iov_base, iov[i].iov_len);
+            copied += iov[i].iov_len;
+        }
+    }
+
+    return copied;
+}
+
+/**
+ * @brief Copy a buffer into a byte range of a file
+ * @param[in] fs Mounted filesystem
+ * @param[in] inode File inode; the range must lie within file_size
+ * @param[in] buf Data to copy, or NULL to zero the range
+ * @param[in] len Length of the range
+ * @param[in] offset File offset of the range
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_CORRUPT on a bad extent
+ */
+static int copy_into_file(struct heartyfs *fs,
+                          const struct heartyfs_inode *inode, const void *buf,
+                          size_t len, off_t offset) {
+    /* One memcpy per extent, straight into the mapping */
+    size_t done = 0;
+    while (done < len) {
+        struct iovec iov[FILE_MAP_BATCH];
+        size_t mapped;
+        int count = hfs_file_map(fs, inode, offset + done, len - done, iov,
+                                 FILE_MAP_BATCH, &mapped);
+        if (count <= 0) {
+            return HEARTYFS_ERR_CORRUPT;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (buf) {
+                memcpy(iov[i].iov_base, (const char *)buf + done,
+                       iov[i].iov_len);
+            } else {
+                memset(iov[i].iov_base, 0, iov[i].iov_len);
+            }
+            hfs_file_dirty(fs, inode, iov[i].iov_base, iov[i].iov_len);
+            done += iov[i].iov_len;
+        }
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Give a file freshly allocated blocks for len bytes of data, all
+ *        inside a region of the disk
+ * @param[in] fs Mounted filesystem
+ * @param[out] inode File inode; its old blocks are released
+ * @param[in] len New length of the file in bytes
+ * @param[in] lo First block of the region
+ * @param[in] hi End of the region, exclusive
+ * @param[in] goal Block to start searching for free runs at
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_NO_SPACE if the region is
+ *         too full, or another HEARTYFS_ERR_* code
+ *
+ * The new blocks are not initialized; the caller fills them through
+ * hfs_file_map(). A file that fits in its inode block gets no blocks and
+ * keeps its data inline. On failure the file is left empty. The next-fit
+ * cursor ends up just past the last run allocated.
+ */
+int hfs_file_reserve_in(struct heartyfs *fs, struct heartyfs_inode *inode,
+                        size_t len, int lo, int hi, int goal) {
+    if (len > (size_t)fs->num_blocks << fs->block_shift) {
+        return HEARTYFS_ERR_TOO_LARGE;
+    }
+
+    hfs_free_file_blocks(fs, inode);
+    if ((long long)len <= hfs_inline_capacity(fs)) {
+        hfs_dirty(fs, inode);
+        inode->file_size = len;
+        return HEARTYFS_OK;
+    }
+
+    /* Ask for everything at once; the allocator hands back the longest run */
+    int remaining = (len + fs->block_size - 1) >> fs->block_shift;
+    while (remaining > 0) {
+        int length;
+        int start = hfs_alloc_run_in(fs, lo, hi, goal, remaining, &length);
+        if (start < 0) {
+            hfs_free_file_blocks(fs, inode);
+            return start;
+        }
+
+        int ret = hfs_extent_append(fs, inode, start, length);
+        if (ret != HEARTYFS_OK) {
+            hfs_free_run(fs, start, length);
+            hfs_free_file_blocks(fs, inode);
+            return ret;
+        }
+        remaining -= length;
+        goal = start + length;
+    }
+    hfs_dirty(fs, inode);
+    inode->file_size = len;
+
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Give a file freshly allocated blocks for len bytes of data
+ * @param[in] fs Mounted filesystem
+ * @param[out] inode File inode; its old blocks are released
+ * @param[in] len New length of the file in bytes
+ * @param[in] goal Block to start searching for free runs at, usually the
+ *                 next-fit cursor
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Same as hfs_file_reserve_in() over the whole disk.
+ */
+int hfs_file_reserve(struct heartyfs *fs, struct heartyfs_inode *inode,
+                     size_t len, int goal) {
+    return hfs_file_reserve_in(fs, inode, len, fs->first_data_block,
+                               fs->num_blocks, goal);
+}
+
+/**
+ * @brief Move the last partial block of a file into a tail block
+ * @param[in] fs Mounted filesystem
+ * @param[out] inode File inode with at least two blocks
+ *
+ * Does nothing if the fragment would be too large, the extent slot after
+ * the last extent lies outside the inode, or no fragment can be had; the
+ * file then simply keeps its last block.
+ */
+static void pack_tail(struct heartyfs *fs, struct heartyfs_inode *inode) {
+    long long len = inode->file_size & (fs->block_size - 1);
+    if (len == 0 || len > hfs_tail_max(fs) || inode->size < 2 ||
+        inode->num_extents >= MAX_DIRECT_EXTENTS) {
+        return;
+    }
+    const struct heartyfs_extent *last =
+        hfs_extent_at(fs, inode, inode->num_extents - 1);
+    if (!last || !hfs_block_in_range(fs, last->start + last->length - 1)) {
+        return;
+    }
+
+    struct heartyfs_tail tail;
+    if (hfs_tail_alloc(fs, len, &tail) != HEARTYFS_OK) {
+        return;
+    }
+    memcpy((char *)hfs_block(fs, tail.block) + tail.offset,
+           hfs_data(fs, last->start + last->length - 1), len);
+
+    long long file_size = inode->file_size;
+    hfs_extent_truncate(fs, inode, inode->size - 1);
+    tail.logical = inode->size;
+    *hfs_file_tail(inode) = tail;
+    inode->file_size = file_size;
+}
+
+/**
+ * @brief Move the data of a freshly written file to where it packs best
+ * @param[in] fs Mounted filesystem
+ * @param[out] inode File inode
+ *
+ * A file that fits in its inode block and sits in a single extent, with
+ * no extent blocks, moves there; the extent is copied before its blocks
+ * are released, since another writer may reuse them right away.
+ * Otherwise the last partial block moves to a tail block if the image
+ * packs tails.
+ */
+void hfs_file_pack(struct heartyfs *fs, struct heartyfs_inode *inode) {
+    if (inode->size == 0 || hfs_file_packed(fs, inode)) {
+        return;
+    }
+    if (inode->num_extents != 1 || inode->indirect ||
+        inode->double_indirect ||
+        inode->file_size > hfs_inline_capacity(fs) ||
+        !hfs_block_in_range(fs, inode->extents[0].start)) {
+        pack_tail(fs, inode);
+        return;
+    }
+
+    // The inline data overlays the extent, so keep a copy of it
+    struct heartyfs_extent ext = inode->extents[0];
+    long long len = inode->file_size;
+    char *data = hfs_inline_data(inode);
+    hfs_dirty(fs, inode);
+    memcpy(data, hfs_data(fs, ext.start), len);
+    memset(data + len, 0, hfs_inline_capacity(fs) - len);
+    inode->num_extents = 0;
+    inode->size = 0;
+    hfs_unref_run(fs, ext.start, ext.length);
+}
+
+/**
+ * @brief Move inline data or a tail fragment out to a data block
+ * @param[in] fs Mounted filesystem
+ * @param[out] inode Inline or packed file inode
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+static int unpack_file(struct heartyfs *fs, struct heartyfs_inode *inode) {
+    int goal = hfs_block_id(fs, inode) + 1;
+    long long len = inode->file_size;
+    const char *data = hfs_inline_data(inode);
+    struct heartyfs_tail tail = {0};
+    if (hfs_file_packed(fs, inode)) {
+        const struct heartyfs_extent *last =
+            hfs_extent_at(fs, inode, inode->num_extents - 1);
+        if (!last) {
+            return HEARTYFS_ERR_CORRUPT;
+        }
+        goal = last->start + last->length;
+        tail = *hfs_file_tail(inode);
+        len = hfs_tail_length(fs, inode);
+        data = (const char *)hfs_block(fs, tail.block) + tail.offset;
+    }
+
+    int length;
+    int block = hfs_alloc_run_near(fs, goal, 1, &length);
+    if (block < 0) {
+        return block;
+    }
+    memcpy(hfs_data(fs, block), data, len);
+    hfs_dirty_data(fs, hfs_data(fs, block), len);
+
+    // The new extent lands on the inline data or the tail slot, so they
+    // are only cleared once it is in place
+    int slot = inode->num_extents;
+    hfs_dirty(fs, inode);
+    int ret = hfs_extent_append(fs, inode, block, 1);
+    if (ret != HEARTYFS_OK) {
+        hfs_free_run(fs, block, length);
+        return ret;
+    }
+    if (tail.block) {
+        hfs_tail_free(fs, &tail, len);
+        if (inode->num_extents == slot) {
+            memset(&inode->extents[slot], 0, sizeof(tail));  // Merged
+        }
+    } else {
+        memset(&inode->extents[1], 0,
+               hfs_inline_capacity(fs) - sizeof(inode->extents[0]));
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Body of heartyfs_write_file(), run under the operation's locks
+ */
+static int write_file(struct heartyfs *fs, const char *path, const void *buf,
+                      size_t len) {
+    struct heartyfs_inode *inode;
+    int ret = hfs_journal_begin_op(fs);
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_resolve_file(fs, path, 1, &inode);
+    }
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+    if ((fs->flags & HEARTYFS_COMPRESS) &&
+        (long long)len > hfs_inline_capacity(fs)) {
+        ret = hfs_zwrite(fs, inode, buf, len);
+        if (ret != 0) {
+            return ret < 0 ? ret : hfs_end_op(fs);
+        }
+    }
+    ret = hfs_file_reserve(fs, inode, len, fs->sb->alloc_cursor);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    ret = copy_into_file(fs, inode, buf, len, 0);
+    if (ret != HEARTYFS_OK) {
+        hfs_free_file_blocks(fs, inode);
+        return ret;
+    }
+    hfs_file_pack(fs, inode);
+    return hfs_end_op(fs);
+}
+
+/**
+ * @brief Replace the contents of a file
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path of the file
+ * @param[in] buf New file contents
+ * @param[in] len Length of buf in bytes
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * On failure the file is left empty.
+ */
+int heartyfs_write_file(struct heartyfs *fs, const char *path,
+                        const void *buf, size_t len) {
+    if (!fs || !path || (!buf && len > 0)) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    if (!hfs_writable(fs)) {
+        return HEARTYFS_ERR_RDONLY;
+    }
+    int ret = hfs_op_begin(fs, 0);
+    if (ret == HEARTYFS_OK) {
+        ret = write_file(fs, path, buf, len);
+    }
+    return hfs_op_end(fs, ret);
+}
+
+/**
+ * @brief Give a file the blocks it needs to reach a new size
+ * @param[in] fs Mounted filesystem
+ * @param[out] inode File inode
+ * @param[in] new_size New length in bytes; at least inode->file_size
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Only the missing blocks are allocated, searching from just past the
+ * last extent so that the file grows in place when it can. file_size is
+ * not changed. On failure the file keeps exactly the blocks it had.
+ */
+static int grow_file(struct heartyfs *fs, struct heartyfs_inode *inode,
+                     long long new_size) {
+    long long need = (new_size + fs->block_size - 1) >> fs->block_shift;
+    if (need > fs->num_blocks) {
+        return HEARTYFS_ERR_TOO_LARGE;
+    }
+
+    int have = inode->size;
+    while (inode->size < need) {
+        int goal = 0;
+        if (inode->num_extents > 0) {
+            struct heartyfs_extent *last =
+                hfs_extent_at(fs, inode, inode->num_extents - 1);
+            if (!last) {
+                return HEARTYFS_ERR_CORRUPT;
+            }
+            goal = last->start + last->length;
+        }
+
+        int length;
+        int start = hfs_alloc_run_near(fs, goal, need - inode->size, &length);
+        if (start < 0) {
+            hfs_extent_truncate(fs, inode, have);
+            return start;
+        }
+
+        int ret = hfs_extent_append(fs, inode, start, length);
+        if (ret != HEARTYFS_OK) {
+            hfs_free_run(fs, start, length);
+            hfs_extent_truncate(fs, inode, have);
+            return ret;
+        }
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Give a file its own copy of the blocks a write is about to change
+ * @param[in] fs Mounted filesystem
+ * @param[out] inode Unshared file inode
+ * @param[in] from First byte that may change, including zero fill
+ * @param[in] offset First byte of the write itself
+ * @param[in] end End of the write in bytes
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Each run of blocks shared with a snapshot moves to new blocks next to
+ * the last ones moved, so a file rewritten in order stays contiguous.
+ * Blocks the write covers entirely are not copied first.
+ */
+static int unshare_range(struct heartyfs *fs, struct heartyfs_inode *inode,
+                         long long from, long long offset, long long end) {
+    int block = from >> fs->block_shift;
+    long long stop = (end + fs->block_size - 1) >> fs->block_shift;
+    if (stop > inode->size) {
+        stop = inode->size;
+    }
+
+    int goal = 0;
+    while (block < stop) {
+        int i = hfs_extent_find(fs, inode, block);
+        struct heartyfs_extent *ext = i >= 0 ? hfs_extent_at(fs, inode, i)
+                                             : NULL;
+        if (!ext) {
+            return HEARTYFS_ERR_CORRUPT;
+        }
+        int old = ext->start + (block - ext->logical);
+        int avail = ext->logical + ext->length - block;
+        if (avail > stop - block) {
+            avail = stop - block;
+        }
+        if (!hfs_shared(fs, old)) {
+            block++;
+            continue;
+        }
+
+        int run = 1;
+        while (run < avail && hfs_shared(fs, old + run)) {
+            run++;
+        }
+        int length;
+        int start = hfs_alloc_run_near(fs, goal ? goal : old, run, &length);
+        if (start < 0) {
+            return start;
+        }
+        for (int b = 0; b < length; b++) {
+            long long pos = (long long)(block + b) << fs->block_shift;
+            if (pos < offset || pos + fs->block_size > end) {
+                memcpy(hfs_data(fs, start + b), hfs_data(fs, old + b),
+                       fs->block_size);
+                hfs_dirty_data(fs, hfs_data(fs, start + b), fs->block_size);
+            }
+        }
+
+        int ret = hfs_extent_remap(fs, inode, block, start, length);
+        if (ret != HEARTYFS_OK) {
+            hfs_free_run(fs, start, length);
+            return ret;
+        }
+        hfs_unref_run(fs, old, length);
+        block += length;
+        goal = start + length;
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Write into a file at an offset, growing it if needed
+ * @param[in] fs Mounted filesystem
+ * @param[out] inode File inode
+ * @param[in] buf Data to write
+ * @param[in] len Length of buf in bytes
+ * @param[in] offset File offset to write at; may be past end of file
+ * @return Number of bytes written, or a HEARTYFS_ERR_* code
+ *
+ * Only the blocks covering [offset, offset + len) are touched, plus any
+ * gap between the old end of file and offset, which reads back as zeros.
+ * The file must not be compressed, and the operation is left open.
+ */
+ssize_t hfs_file_pwrite(struct heartyfs *fs, struct heartyfs_inode *inode,
+                        const void *buf, size_t len, off_t offset) {
+    long long disk_bytes = (long long)fs->num_blocks << fs->block_shift;
+    if (offset > disk_bytes || len > (size_t)(disk_bytes - offset)) {
+        return HEARTYFS_ERR_TOO_LARGE;
+    }
+
+    long long old_size = inode->file_size;
+    long long end = offset + len;
+    if (len == 0) {
+        return 0;  // Like pwrite(2), an empty write never grows the file
+    }
+    if (inode->size == 0 && end <= hfs_inline_capacity(fs)) {
+        // Small enough to stay, or become, inline
+        char *data = hfs_inline_data(inode);
+        hfs_dirty(fs, inode);
+        if (offset > old_size) {
+            memset(data + old_size, 0, offset - old_size);
+        }
+        memcpy(data + offset, buf, len);
+        if (end > old_size) {
+            inode->file_size = end;
+        }
+        return len;
+    }
+    if (hfs_file_inline(inode) ||
+        (hfs_file_packed(fs, inode) &&
+         (end > old_size || hfs_has_snapshots(fs)))) {
+        // A fragment cannot grow in place, nor stay put while
+        // unshare_range() rewrites the extents next to it
+        int ret = unpack_file(fs, inode);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+    }
+    if (fs->shares) {
+        int ret = unshare_range(fs, inode, offset < old_size ? offset : old_size,
+                                offset, end);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+    }
+    if (end > old_size) {
+        int ret = grow_file(fs, inode, end);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+        hfs_dirty(fs, inode);
+        inode->file_size = end;
+
+        if (offset > old_size) {
+            ret = copy_into_file(fs, inode, NULL, offset - old_size, old_size);
+            if (ret != HEARTYFS_OK) {
+                return ret;
+            }
+        }
+    }
+
+    int ret = copy_into_file(fs, inode, buf, len, offset);
+    return ret == HEARTYFS_OK ? (ssize_t)len : ret;
+}
+
+/**
+ * @brief Write into a file and end the operation
+ * @param[in] fs Mounted filesystem
+ * @param[out] inode File inode
+ * @param[in] buf Data to write
+ * @param[in] len Length of buf in bytes
+ * @param[in] offset File offset to write at, or -1 to append
+ * @return Number of bytes written, or a HEARTYFS_ERR_* code
+ *
+ * A compressed file is expanded first, since its container cannot be
+ * patched in place.
+ */
+static ssize_t pwrite_file(struct heartyfs *fs, struct heartyfs_inode *inode,
+                           const void *buf, size_t len, off_t offset) {
+    if ((inode->flags & FILE_COMPRESSED) && len > 0) {
+        int ret = hfs_zexpand(fs, inode);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+    }
+
+    ssize_t written = hfs_file_pwrite(fs, inode, buf, len,
+                                      offset < 0 ? inode->file_size : offset);
+    if (written >= 0) {
+        int ret = hfs_end_op(fs);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+    }
+    return written;
+}
+
+/**
+ * @brief Write part of a file from a caller-supplied buffer
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path of the file
+ * @param[in] buf Data to write
+ * @param[in] len Number of bytes to write
+ * @param[in] offset File offset to start writing at
+ * @return Number of bytes written, or a HEARTYFS_ERR_* code
+ *
+ * The rest of the file is left alone. Writing past end of file grows it;
+ * new blocks are allocated only for the growth, and a gap before offset
+ * reads back as zeros.
+ */
+ssize_t heartyfs_pwrite(struct heartyfs *fs, const char *path,
+                        const void *buf, size_t len, off_t offset) {
+    if (!fs || !path || (!buf && len > 0) || offset < 0) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    if (!hfs_writable(fs)) {
+        return HEARTYFS_ERR_RDONLY;
+    }
+
+    struct heartyfs_inode *inode;
+    ssize_t ret = hfs_op_begin(fs, 0);
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_journal_begin_op(fs);
+    }
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_resolve_file(fs, path, 1, &inode);
+    }
+    if (ret == HEARTYFS_OK) {
+        ret = pwrite_file(fs, inode, buf, len, offset);
+    }
+    return hfs_op_end(fs, ret);
+}
+
+/**
+ * @brief Append data to the end of a file
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path of the file
+ * @param[in] buf Data to append
+ * @param[in] len Number of bytes to append
+ * @return Number of bytes written, or a HEARTYFS_ERR_* code
+ */
+ssize_t heartyfs_append(struct heartyfs *fs, const char *path,
+                        const void *buf, size_t len) {
+    if (!fs || !path || (!buf && len > 0)) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    if (!hfs_writable(fs)) {
+        return HEARTYFS_ERR_RDONLY;
+    }
+
+    struct heartyfs_inode *inode;
+    ssize_t ret = hfs_op_begin(fs, 0);
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_journal_begin_op(fs);
+    }
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_resolve_file(fs, path, 1, &inode);
+    }
+    if (ret == HEARTYFS_OK) {
+        ret = pwrite_file(fs, inode, buf, len, -1);
+    }
+    return hfs_op_end(fs, ret);
+}
@@ -0,0 +1,1243 @@
+#include "heartyfs_internal.h"
+#include <pthread.h>
+#include <stdarg.h>
+
+/*
+ * Offline consistency check.
+ *
+ * The walk starts at the root and the snapshot directory and follows
+ * every reference on a pool of threads. Each block has an atomic count of
+ * the references found to it and the role it was first reached in; the
+ * thread that finds the first reference to a directory, inode, index or
+ * leaf is the one that walks it. Threads work off their own stacks and
+ * hand half of one to the shared queue whenever another thread runs dry,
+ * so the lock is only taken to spread the work out. A second pass, split
+ * into ranges across as many threads, compares the counts with the bitmap
+ * and the share count table. Repairs are then made by the calling thread,
+ * as one operation.
+ *
+ * References are counted the way snapshots take them: once per parent
+ * block, however many paths lead to it, so the share count of a block is
+ * its number of references less one. Extent blocks and table pages belong
+ * to one owner, and a tail block is referenced once per fragment but is
+ * never shared. The .. entries are not checked: path walks never read
+ * them, and copies made for snapshots leave them stale on purpose.
+ *
+ * Leaked blocks are only reclaimed if every node could be walked in full,
+ * since a node that could not be might still use them.
+ */
+#define FSCK_MAX_THREADS 64
+#define RUN_CHUNK 256           // Data blocks checksummed per work item
+#define MIN_VECTOR 64
+#define NOTE_LENGTH 96
+
+/* What a block was first reached as */
+#define ROLE_NONE 0
+#define ROLE_NODE 1             // Directory or inode
+#define ROLE_INDEX 2            // Hash index block
+#define ROLE_PAGE 3             // Hash table page
+#define ROLE_LEAF 4             // Hash leaf
+#define ROLE_EXTENT 5           // Indirect, double-indirect or extent block
+#define ROLE_DATA 6             // File data
+#define ROLE_TAIL 7             // Tail block
+#define ROLE_CONFLICT 0x80      // Also reached in another role
+
+/* Repairs found by the walk */
+#define FIX_DOT 1               // Point . back at the directory
+#define FIX_ENTRY 2             // Drop a dangling entry
+#define FIX_SIZE 3              // Set the size of an inline directory
+#define FIX_HEAD 4              // Recount the size of a hashed directory
+#define FIX_SHARE 5             // Set a share count
+#define FIX_TAIL 6              // Set the slot map of a tail block
+
+static const char *const role_names[] = {
+    "nothing", "a node", "a hash index", "a table page", "a hash leaf",
+    "an extent block", "file data", "a tail block"};
+
+struct fsck_item {
+    int block;              // Node to walk, or first block of a data run
+    int length;             // Blocks in the data run, 0 for a node
+    int role;               // ROLE_* the node was reached as
+};
+
+struct fsck_note {
+    int block;
+    char text[NOTE_LENGTH];
+};
+
+struct fsck_fix {
+    int kind;               // FIX_*
+    int block;              // Block to change
+    int slot;               // Entry index for FIX_ENTRY
+    int in_leaf;            // 1 if a FIX_ENTRY block is a leaf
+    long long value;        // New value
+};
+
+struct fsck_frag {
+    int block;              // Tail block
+    int inode;              // Inode the fragment belongs to
+    unsigned long long mask;    // Slots it takes
+};
+
+struct fsck_run {
+    int start;
+    int length;
+};
+
+struct fsck_vector {
+    void *items;
+    int count;
+    int capacity;
+};
+
+/**
+ * @brief State shared by every thread of a check
+ */
+struct fsck {
+    struct heartyfs *fs;
+    uint32_t *refs;         // References found to each block
+    unsigned char *roles;   // ROLE_* each block was first reached as
+    int verify;             // 1 to verify checksums
+    int unsafe;             // Set once a node could not be walked in full
+    int threads;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct fsck_vector queue;   // struct fsck_item waiting for a thread
+    int idle;               // Threads waiting on the queue
+};
+
+/**
+ * @brief What one thread found
+ */
+struct fsck_worker {
+    struct fsck *f;
+    pthread_t thread;
+    int lo, hi;             // Block range of the bitmap pass
+    int error;              // HEARTYFS_ERR_NO_MEMORY once a vector is full
+    struct fsck_vector stack;   // struct fsck_item still to walk
+    struct fsck_vector notes;   // struct fsck_note
+    struct fsck_vector fixes;   // struct fsck_fix
+    struct fsck_vector frags;   // struct fsck_frag
+    struct fsck_vector leaks;   // struct fsck_run in use but unreachable
+    struct fsck_vector lost;    // struct fsck_run reachable but free
+    struct heartyfs_fsck_report counts;
+};
+
+/**
+ * @brief Make room for one more item at the end of a vector
+ * @return Pointer to the new item, or NULL if memory ran out
+ */
+static void *vector_push(struct fsck_vector *v, size_t size) {
+    if (v->count == v->capacity) {
+        int capacity = v->capacity ? 2 * v->capacity : MIN_VECTOR;
+        void *items = realloc(v->items, capacity * size);
+        if (!items) {
+            return NULL;
+        }
+        v->items = items;
+        v->capacity = capacity;
+    }
+    return (char *)v->items + (size_t)v->count++ * size;
+}
+
+/**
+ * @brief Append the items of one vector to another
+ * @return HEARTYFS_OK, or HEARTYFS_ERR_NO_MEMORY
+ */
+static int vector_append(struct fsck_vector *dst, const struct fsck_vector *src,
+                         size_t size) {
+    for (int i = 0; i < src->count; i++) {
+        void *item = vector_push(dst, size);
+        if (!item) {
+            return HEARTYFS_ERR_NO_MEMORY;
+        }
+        memcpy(item, (const char *)src->items + (size_t)i * size, size);
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Record a problem
+ * @param[in,out] w Worker that found it
+ * @param[in] block Block the problem is about
+ * @param[in] fmt printf() format of the description
+ */
+static void note(struct fsck_worker *w, int block, const char *fmt, ...) {
+    struct fsck_note *n = vector_push(&w->notes, sizeof(*n));
+    if (!n) {
+        w->error = HEARTYFS_ERR_NO_MEMORY;
+        return;
+    }
+    n->block = block;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(n->text, sizeof(n->text), fmt, ap);
+    va_end(ap);
+}
+
+/**
+ * @brief Record a repair to make once the walk is over
+ */
+static void add_fix(struct fsck_worker *w, int kind, int block, int slot,
+                    int in_leaf, long long value) {
+    struct fsck_fix *fix = vector_push(&w->fixes, sizeof(*fix));
+    if (!fix) {
+        w->error = HEARTYFS_ERR_NO_MEMORY;
+        return;
+    }
+    *fix = (struct fsck_fix){kind, block, slot, in_leaf, value};
+}
+
+/**
+ * @brief Record that a node could not be walked in full
+ */
+static void mark_corrupt(struct fsck_worker *w, int block, const char *what) {
+    __atomic_store_n(&w->f->unsafe, 1, __ATOMIC_RELAXED);
+    w->counts.corrupt++;
+    note(w, block, "%s", what);
+}
+
+/**
+ * @brief Queue an item on the worker's own stack
+ */
+static void push_item(struct fsck_worker *w, int block, int length,
+                      int role) {
+    struct fsck_item *item = vector_push(&w->stack, sizeof(*item));
+    if (!item) {
+        w->error = HEARTYFS_ERR_NO_MEMORY;
+        return;
+    }
+    *item = (struct fsck_item){block, length, role};
+}
+
+/**
+ * @brief Count a reference to a block
+ * @param[in,out] w Worker that found the reference
+ * @param[in] block Block referenced; must be in range
+ * @param[in] role ROLE_* the reference reaches it as
+ * @return 1 if this is the first reference to the block, 0 otherwise
+ */
+static int add_ref(struct fsck_worker *w, int block, int role) {
+    struct fsck *f = w->f;
+    uint32_t seen = __atomic_fetch_add(&f->refs[block], 1, __ATOMIC_RELAXED);
+    unsigned char old = ROLE_NONE;
+    if (!__atomic_compare_exchange_n(&f->roles[block], &old, role, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED) &&
+        (old & ~ROLE_CONFLICT) != role) {
+        __atomic_fetch_or(&f->roles[block], ROLE_CONFLICT, __ATOMIC_RELAXED);
+    }
+    return seen == 0;
+}
+
+/**
+ * @brief Verify the checksums of a run of blocks
+ * @param[in,out] w Worker
+ * @param[in] block First block of the run
+ * @param[in] length Blocks in the run
+ * @param[in] data 1 for file data, 0 for metadata
+ */
+static void verify_run(struct fsck_worker *w, int block, int length,
+                       int data) {
+    const struct heartyfs *fs = w->f->fs;
+    if (!w->f->verify) {
+        return;
+    }
+    for (int b = block; b < block + length; b++) {
+        const void *ptr = data ? hfs_data(fs, b) : hfs_block(fs, b);
+        if (hfs_csum_check(fs, ptr, fs->block_size) != HEARTYFS_OK) {
+            w->counts.bad_checksums++;
+            note(w, b, "checksum mismatch");
+        }
+    }
+}
+
+/**
+ * @brief Check that a directory entry names a directory or file
+ * @param[in] fs Mounted filesystem
+ * @param[in] entry Entry to check
+ * @return 1 if it does, 0 if the entry is dangling
+ *
+ * Every node records the name it was created under, which is the name of
+ * the entry that links it, so a block that was freed and reused by
+ * something else no longer matches.
+ */
+static int entry_valid(const struct heartyfs *fs,
+                       const struct heartyfs_dir_entry *entry) {
+    if (!hfs_block_in_range(fs, entry->block_id)) {
+        return 0;
+    }
+    const struct heartyfs_directory *node = hfs_block(fs, entry->block_id);
+    return (node->type == DIR_TYPE || node->type == FILE_TYPE) &&
+           strncmp(node->name, entry->file_name, sizeof(node->name)) == 0;
+}
+
+/**
+ * @brief Follow one directory entry
+ * @param[in,out] w Worker
+ * @param[in] container Directory head or leaf holding the entry
+ * @param[in] slot Index of the entry in it
+ * @param[in] in_leaf 1 if container is a leaf
+ */
+static void visit_entry(struct fsck_worker *w, int container, int slot,
+                        int in_leaf) {
+    const struct heartyfs *fs = w->f->fs;
+    const struct heartyfs_dir_entry *entry =
+        in_leaf ? &((const struct heartyfs_dir_leaf *)hfs_block(fs, container))
+                       ->entries[slot]
+                : &((const struct heartyfs_directory *)hfs_block(fs, container))
+                       ->entries[slot];
+    if (!entry_valid(fs, entry)) {
+        w->counts.dangling++;
+        note(w, container, "entry '%.27s' names no file or directory (%d)",
+             entry->file_name, entry->block_id);
+        add_fix(w, FIX_ENTRY, container, slot, in_leaf, 0);
+        return;
+    }
+    if (add_ref(w, entry->block_id, ROLE_NODE)) {
+        push_item(w, entry->block_id, 0, ROLE_NODE);
+    }
+}
+
+/**
+ * @brief Count the entries of a hashed directory
+ * @param[in] fs Mounted filesystem
+ * @param[in] dir Directory head
+ * @return Entries in its leaves, or -1 if the index is corrupted
+ */
+static long long count_hashed(const struct heartyfs *fs,
+                              const struct heartyfs_directory *dir) {
+    const struct heartyfs_dir_index *index = hfs_htree_index(fs, dir);
+    if (!index) {
+        return -1;
+    }
+
+    long long count = 0;
+    uint32_t slots = 1u << index->global_depth;
+    for (uint32_t s = 0; s < slots; s++) {
+        int block = hfs_htree_slot(fs, index, s);
+        const struct heartyfs_dir_leaf *leaf = hfs_htree_leaf(fs, block);
+        if (!leaf) {
+            return -1;
+        }
+        if (s >= 1u << leaf->local_depth) {
+            continue;  // Counted from its lowest slot
+        }
+        for (int hops = 0; leaf; hops++) {
+            if (hops == fs->num_blocks) {
+                return -1;
+            }
+            count += leaf->count;
+            leaf = leaf->overflow ? hfs_htree_leaf(fs, leaf->overflow)
+                                  : NULL;
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Walk a directory head
+ * @param[in,out] w Worker
+ * @param[in] block Block id of the directory
+ */
+static void walk_dir(struct fsck_worker *w, int block) {
+    const struct heartyfs *fs = w->f->fs;
+    const struct heartyfs_directory *dir = hfs_block(fs, block);
+
+    if (dir->entries[0].block_id != block) {
+        w->counts.bad_dirs++;
+        note(w, block, "directory . names block %d",
+             dir->entries[0].block_id);
+        add_fix(w, FIX_DOT, block, 0, 0, block);
+    }
+
+    if (dir->index_block) {
+        long long count = count_hashed(fs, dir);
+        if (count < 0) {
+            mark_corrupt(w, block, "hash index is corrupted");
+            return;
+        }
+        if (dir->size != count + MIN_DIR_ENTRIES) {
+            w->counts.bad_dirs++;
+            note(w, block, "directory size %d, but it holds %lld entries",
+                 dir->size, count + MIN_DIR_ENTRIES);
+        }
+        add_fix(w, FIX_HEAD, block, 0, 0, 0);
+        if (add_ref(w, dir->index_block, ROLE_INDEX)) {
+            push_item(w, dir->index_block, 0, ROLE_INDEX);
+        }
+        return;
+    }
+
+    int size = dir->size;
+    if (size < MIN_DIR_ENTRIES || size > MAX_DIR_ENTRIES) {
+        size = size < MIN_DIR_ENTRIES ? MIN_DIR_ENTRIES : MAX_DIR_ENTRIES;
+        w->counts.bad_dirs++;
+        note(w, block, "directory size %d is out of range", dir->size);
+        add_fix(w, FIX_SIZE, block, 0, 0, size);
+    }
+    for (int i = MIN_DIR_ENTRIES; i < size; i++) {
+        visit_entry(w, block, i, 0);
+    }
+}
+
+/**
+ * @brief Walk a hash index block and its table
+ * @param[in,out] w Worker
+ * @param[in] block Block id of the index, already checked by its directory
+ *
+ * Each leaf is referenced once, from the lowest of the slots naming it,
+ * as snapshots count them.
+ */
+static void walk_index(struct fsck_worker *w, int block) {
+    const struct heartyfs *fs = w->f->fs;
+    const struct heartyfs_dir_index *index = hfs_block(fs, block);
+
+    for (int i = 0; i < index->num_pages; i++) {
+        if (!hfs_block_in_range(fs, index->pages[i])) {
+            mark_corrupt(w, block, "hash table page is out of range");
+            return;
+        }
+        if (add_ref(w, index->pages[i], ROLE_PAGE)) {
+            verify_run(w, index->pages[i], 1, 0);
+        }
+    }
+
+    uint32_t slots = 1u << index->global_depth;
+    for (uint32_t s = 0; s < slots; s++) {
+        int leaf_block = hfs_htree_slot(fs, index, s);
+        const struct heartyfs_dir_leaf *leaf = hfs_htree_leaf(fs, leaf_block);
+        if (!leaf || leaf->local_depth > index->global_depth) {
+            mark_corrupt(w, block, "hash table names a bad leaf");
+            continue;
+        }
+        uint32_t lowest = s & ((1u << leaf->local_depth) - 1);
+        if (s != lowest) {
+            if (hfs_htree_slot(fs, index, lowest) != leaf_block) {
+                mark_corrupt(w, block, "hash table slots disagree");
+            }
+            continue;
+        }
+        if (add_ref(w, leaf_block, ROLE_LEAF)) {
+            push_item(w, leaf_block, 0, ROLE_LEAF);
+        }
+    }
+}
+
+/**
+ * @brief Walk a hash leaf
+ * @param[in,out] w Worker
+ * @param[in] block Block id of the leaf
+ */
+static void walk_leaf(struct fsck_worker *w, int block) {
+    const struct heartyfs *fs = w->f->fs;
+    const struct heartyfs_dir_leaf *leaf = hfs_htree_leaf(fs, block);
+    if (!leaf) {
+        mark_corrupt(w, block, "hash leaf entry count is out of range");
+        return;
+    }
+
+    for (int i = 0; i < leaf->count; i++) {
+        visit_entry(w, block, i, 1);
+    }
+    if (leaf->overflow) {
+        if (!hfs_htree_leaf(fs, leaf->overflow)) {
+            mark_corrupt(w, block, "overflow leaf is corrupted");
+        } else if (add_ref(w, leaf->overflow, ROLE_LEAF)) {
+            push_item(w, leaf->overflow, 0, ROLE_LEAF);
+        }
+    }
+}
+
+/**
+ * @brief Count the references of a file to its data blocks
+ * @param[in,out] w Worker
+ * @param[in] start First block of an extent, in range
+ * @param[in] length Blocks in the extent, in range
+ *
+ * Long extents are checksummed as separate work items, so one large file
+ * is spread over the pool too.
+ */
+static void add_data(struct fsck_worker *w, int start, int length) {
+    for (int b = start; b < start + length; b++) {
+        add_ref(w, b, ROLE_DATA);
+    }
+    if (!w->f->verify) {
+        return;
+    }
+    for (int done = 0; done < length; done += RUN_CHUNK) {
+        int n = length - done < RUN_CHUNK ? length - done : RUN_CHUNK;
+        if (n == length) {
+            verify_run(w, start, n, 1);
+        } else {
+            push_item(w, start + done, n, ROLE_DATA);
+        }
+    }
+}
+
+/**
+ * @brief Walk the extent blocks of a file
+ * @param[in,out] w Worker
+ * @param[in] block Block id of the inode
+ * @return 1 if every extent block is readable, 0 otherwise
+ */
+static int walk_extent_blocks(struct fsck_worker *w, int block) {
+    const struct heartyfs *fs = w->f->fs;
+    const struct heartyfs_inode *inode = hfs_block(fs, block);
+    int count = inode->num_extents;
+    int first_double = MAX_DIRECT_EXTENTS + fs->extents_per_block;
+
+    if (count > MAX_DIRECT_EXTENTS &&
+        add_ref(w, inode->indirect, ROLE_EXTENT)) {
+        verify_run(w, inode->indirect, 1, 0);
+    }
+    if (count <= first_double) {
+        return 1;
+    }
+
+    if (add_ref(w, inode->double_indirect, ROLE_EXTENT)) {
+        verify_run(w, inode->double_indirect, 1, 0);
+    }
+    const int *ptrs = hfs_block(fs, inode->double_indirect);
+    int per_block = fs->extents_per_block;
+    int used = (count - first_double + per_block - 1) / per_block;
+    for (int i = 0; i < used; i++) {
+        if (!hfs_block_in_range(fs, ptrs[i])) {
+            mark_corrupt(w, block, "extent block is out of range");
+            return 0;
+        }
+        if (add_ref(w, ptrs[i], ROLE_EXTENT)) {
+            verify_run(w, ptrs[i], 1, 0);
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Walk an inode
+ * @param[in,out] w Worker
+ * @param[in] block Block id of the inode
+ */
+static void walk_inode(struct fsck_worker *w, int block) {
+    const struct heartyfs *fs = w->f->fs;
+    const struct heartyfs_inode *inode = hfs_block(fs, block);
+
+    if (!hfs_extents_valid(fs, inode)) {
+        mark_corrupt(w, block, "inode extent header is corrupted");
+        return;
+    }
+    if ((inode->flags & FILE_COMPRESSED) && hfs_file_length(fs, inode) < 0) {
+        w->counts.corrupt++;
+        note(w, block, "compressed file has no valid trailer");
+    }
+    if (hfs_file_inline(inode) || !walk_extent_blocks(w, block)) {
+        return;
+    }
+
+    long long logical = 0;
+    for (int i = 0; i < inode->num_extents; i++) {
+        const struct heartyfs_extent *ext = hfs_extent_at(fs, inode, i);
+        if (!ext) {
+            mark_corrupt(w, block, "extent block is out of range");
+            return;
+        }
+        int start = ext->start;
+        long long end = (long long)ext->start + ext->length;
+        if (ext->logical != logical || ext->length <= 0 ||
+            !hfs_block_in_range(fs, start) || end > fs->num_blocks) {
+            // Keep whatever part of the run is in range allocated
+            mark_corrupt(w, block, "extent is out of order or out of range");
+            start = start < fs->first_data_block ? fs->first_data_block
+                                                 : start;
+            end = end > fs->num_blocks ? fs->num_blocks : end;
+        }
+        if (end > start) {
+            add_data(w, start, end - start);
+        }
+        logical += ext->length > 0 ? ext->length : 0;
+    }
+    if (logical != inode->size) {
+        w->counts.corrupt++;
+        note(w, block, "inode size %d, but its extents hold %lld blocks",
+             inode->size, logical);
+    }
+
+    if (hfs_file_packed(fs, inode)) {
+        const struct heartyfs_tail *tail = hfs_file_tail(inode);
+        int slot_size = fs->block_size / TAIL_SLOTS;
+        int slot = tail->offset / slot_size;
+        int slots = (hfs_tail_length(fs, inode) + slot_size - 1) / slot_size;
+        struct fsck_frag *frag = vector_push(&w->frags, sizeof(*frag));
+        if (!frag) {
+            w->error = HEARTYFS_ERR_NO_MEMORY;
+            return;
+        }
+        *frag = (struct fsck_frag){tail->block, block,
+                                   ((1ULL << slots) - 1) << slot};
+        if (add_ref(w, tail->block, ROLE_TAIL)) {
+            verify_run(w, tail->block, 1, 0);
+        }
+    }
+}
+
+/**
+ * @brief Walk one work item
+ * @param[in,out] w Worker
+ * @param[in] item Item taken off the stack
+ */
+static void walk_item(struct fsck_worker *w, const struct fsck_item *item) {
+    const struct heartyfs *fs = w->f->fs;
+    if (item->length > 0) {
+        verify_run(w, item->block, item->length, 1);
+        return;
+    }
+
+    verify_run(w, item->block, 1, 0);
+    if (item->role == ROLE_INDEX) {
+        walk_index(w, item->block);
+        return;
+    }
+    if (item->role == ROLE_LEAF) {
+        walk_leaf(w, item->block);
+        return;
+    }
+
+    w->counts.nodes++;
+    const struct heartyfs_directory *node = hfs_block(fs, item->block);
+    if (node->type == DIR_TYPE) {
+        walk_dir(w, item->block);
+    } else if (node->type == FILE_TYPE) {
+        walk_inode(w, item->block);
+    } else {
+        mark_corrupt(w, item->block, "node has an unknown type");
+    }
+}
+
+/**
+ * @brief Wait for work from the shared queue
+ * @param[in,out] w Worker whose stack is empty
+ * @return 1 if items were moved onto its stack, 0 once the walk is over
+ *
+ * The walk is over when the queue is empty and every thread is waiting.
+ */
+static int take_work(struct fsck_worker *w) {
+    struct fsck *f = w->f;
+    pthread_mutex_lock(&f->lock);
+    __atomic_add_fetch(&f->idle, 1, __ATOMIC_RELAXED);
+    while (f->queue.count == 0 && f->idle < f->threads) {
+        pthread_cond_wait(&f->wake, &f->lock);
+    }
+    if (f->queue.count == 0) {
+        pthread_cond_broadcast(&f->wake);
+        pthread_mutex_unlock(&f->lock);
+        return 0;
+    }
+
+    __atomic_sub_fetch(&f->idle, 1, __ATOMIC_RELAXED);
+    int take = (f->queue.count + f->threads - 1) / f->threads;
+    struct fsck_item *items = f->queue.items;
+    for (int i = 0; i < take; i++) {
+        struct fsck_item item = items[--f->queue.count];
+        push_item(w, item.block, item.length, item.role);
+    }
+    pthread_mutex_unlock(&f->lock);
+    return 1;
+}
+
+/**
+ * @brief Hand the older half of a worker's stack to idle threads
+ * @param[in,out] w Worker with more than one item
+ *
+ * The oldest items are the highest in the tree, so they carry the most
+ * work with them.
+ */
+static void share_work(struct fsck_worker *w) {
+    struct fsck *f = w->f;
+    struct fsck_item *items = w->stack.items;
+    int give = w->stack.count / 2;
+
+    pthread_mutex_lock(&f->lock);
+    for (int i = 0; i < give; i++) {
+        struct fsck_item *slot = vector_push(&f->queue, sizeof(*slot));
+        if (!slot) {
+            give = i;
+            break;
+        }
+        *slot = items[i];
+    }
+    pthread_cond_broadcast(&f->wake);
+    pthread_mutex_unlock(&f->lock);
+
+    memmove(items, items + give, (w->stack.count - give) * sizeof(*items));
+    w->stack.count -= give;
+}
+
+/**
+ * @brief Thread body of the walk
+ */
+static void *walk_worker(void *arg) {
+    struct fsck_worker *w = arg;
+    while (take_work(w)) {
+        while (w->stack.count > 0) {
+            struct fsck_item item =
+                ((struct fsck_item *)w->stack.items)[--w->stack.count];
+            walk_item(w, &item);
+            if (w->stack.count > 1 &&
+                __atomic_load_n(&w->f->idle, __ATOMIC_RELAXED) > 0) {
+                share_work(w);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Extend the last run of a vector or start a new one
+ */
+static void add_to_run(struct fsck_worker *w, struct fsck_vector *runs,
+                       int block) {
+    struct fsck_run *last =
+        runs->count ? &((struct fsck_run *)runs->items)[runs->count - 1]
+                    : NULL;
+    if (last && last->start + last->length == block) {
+        last->length++;
+        return;
+    }
+    struct fsck_run *run = vector_push(runs, sizeof(*run));
+    if (!run) {
+        w->error = HEARTYFS_ERR_NO_MEMORY;
+        return;
+    }
+    *run = (struct fsck_run){block, 1};
+}
+
+/**
+ * @brief Check one range of blocks against the bitmap and share counts
+ */
+static void *bitmap_worker(void *arg) {
+    struct fsck_worker *w = arg;
+    struct fsck *f = w->f;
+    const struct heartyfs *fs = f->fs;
+
+    for (int b = w->lo; b < w->hi; b++) {
+        int used = !(fs->bitmap[b / 8] & (1 << (b % 8)));
+        uint32_t refs = f->refs[b];
+        int role = f->roles[b] & ~ROLE_CONFLICT;
+        if (refs == 0) {
+            if (used) {
+                add_to_run(w, &w->leaks, b);
+            }
+            if (fs->shares && fs->shares[b] != 0) {
+                w->counts.bad_shares++;
+                note(w, b, "unreferenced block has share count %d",
+                     fs->shares[b]);
+                add_fix(w, FIX_SHARE, b, 0, 0, 0);
+            }
+            continue;
+        }
+
+        w->counts.blocks++;
+        if (!used) {
+            add_to_run(w, &w->lost, b);
+        }
+        if (f->roles[b] & ROLE_CONFLICT) {
+            w->counts.cross_linked++;
+            note(w, b, "reached as %s and as something else",
+                 role_names[role]);
+            continue;
+        }
+
+        // Blocks that are never shared, and every block without snapshots
+        int single = role == ROLE_PAGE || role == ROLE_EXTENT ||
+                     role == ROLE_TAIL;
+        if ((single || !fs->shares) && refs > 1 && role != ROLE_TAIL) {
+            w->counts.cross_linked++;
+            note(w, b, "%s referenced %u times", role_names[role], refs);
+            continue;
+        }
+        if (!fs->shares) {
+            continue;
+        }
+        uint32_t expected = single ? 0 : refs - 1;
+        if (expected > MAX_SNAPSHOTS) {
+            w->counts.cross_linked++;
+            note(w, b, "%s referenced %u times", role_names[role], refs);
+        } else if (fs->shares[b] != expected) {
+            w->counts.bad_shares++;
+            note(w, b, "share count %d, but %u references", fs->shares[b],
+                 expected + 1);
+            add_fix(w, FIX_SHARE, b, 0, 0, expected);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Run one phase of the check on every worker
+ * @param[in,out] workers Workers; the first runs on the calling thread
+ * @param[in] count Number of workers
+ * @param[in] body Thread body
+ * @return Number of workers that ran
+ *
+ * If a thread cannot be started its share is simply left to the others,
+ * which for the bitmap pass means running it here.
+ */
+static int run_workers(struct fsck_worker *workers, int count,
+                       void *(*body)(void *)) {
+    int started = 1;
+    for (int i = 1; i < count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, body, &workers[i]) != 0) {
+            workers[i].thread = 0;
+            if (body == bitmap_worker) {
+                body(&workers[i]);
+            }
+            continue;
+        }
+        started++;
+    }
+    body(&workers[0]);
+    for (int i = 1; i < count; i++) {
+        if (workers[i].thread) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+    return started;
+}
+
+/**
+ * @brief Order fragments by tail block
+ */
+static int compare_frags(const void *a, const void *b) {
+    const struct fsck_frag *x = a;
+    const struct fsck_frag *y = b;
+    if (x->block != y->block) {
+        return x->block < y->block ? -1 : 1;
+    }
+    return x->mask < y->mask ? -1 : x->mask > y->mask;
+}
+
+/**
+ * @brief Check the slot map of every tail block against its fragments
+ * @param[in,out] w Worker collecting the results
+ * @param[in] f Check state
+ */
+static void check_tails(struct fsck_worker *w, const struct fsck *f) {
+    const struct heartyfs *fs = f->fs;
+    struct fsck_frag *frags = w->frags.items;
+    qsort(frags, w->frags.count, sizeof(*frags), compare_frags);
+
+    for (int i = 0; i < w->frags.count;) {
+        int block = frags[i].block;
+        unsigned long long used = 1;  // The header
+        for (; i < w->frags.count && frags[i].block == block; i++) {
+            if (used & frags[i].mask) {
+                w->counts.cross_linked++;
+                note(w, block, "fragment of inode %d overlaps another",
+                     frags[i].inode);
+            }
+            used |= frags[i].mask;
+        }
+        const struct heartyfs_tail_block *tb = hfs_block(fs, block);
+        if (tb->used != used) {
+            w->counts.bad_tails++;
+            note(w, block, "slot map %016llx, but fragments use %016llx",
+                 tb->used, used);
+            add_fix(w, FIX_TAIL, block, 0, 0, (long long)used);
+        }
+    }
+
+    if (fs->sb->ext_block) {
+        const struct heartyfs_sb_ext *ext = hfs_block(fs, fs->sb->ext_block);
+        int block = ext->tail_block;
+        if (block && (!hfs_block_in_range(fs, block) ||
+                      (f->roles[block] & ~ROLE_CONFLICT) != ROLE_TAIL)) {
+            w->counts.bad_tails++;
+            note(w, fs->sb->ext_block, "tail block to pack into (%d) is not "
+                 "a tail block", block);
+            add_fix(w, FIX_TAIL, fs->sb->ext_block, 0, 0, 0);
+        }
+    }
+}
+
+/**
+ * @brief Check the blocks before the first data block
+ * @param[in,out] w Worker collecting the results
+ * @param[in] fs Mounted filesystem
+ *
+ * The superblock, bitmap, extension block, journal and tables must all be
+ * marked in use.
+ */
+static void check_reserved(struct fsck_worker *w, const struct heartyfs *fs) {
+    for (int b = 0; b < fs->first_data_block; b++) {
+        if (fs->bitmap[b / 8] & (1 << (b % 8))) {
+            add_to_run(w, &w->lost, b);
+        }
+    }
+}
+
+/**
+ * @brief Order fixes by block, then entries from the last one down
+ */
+static int compare_fixes(const void *a, const void *b) {
+    const struct fsck_fix *x = a;
+    const struct fsck_fix *y = b;
+    if (x->block != y->block) {
+        return x->block < y->block ? -1 : 1;
+    }
+    if (x->kind != y->kind) {
+        return x->kind < y->kind ? -1 : 1;
+    }
+    return y->slot - x->slot;
+}
+
+/**
+ * @brief Drop an entry from a directory head or leaf, in place
+ *
+ * A dangling entry is broken for every directory that shares the block,
+ * so it is removed without copying anything.
+ */
+static void drop_entry(struct heartyfs *fs, const struct fsck_fix *fix) {
+    if (fix->in_leaf) {
+        struct heartyfs_dir_leaf *leaf = hfs_block(fs, fix->block);
+        hfs_dirty(fs, leaf);
+        leaf->entries[fix->slot] = leaf->entries[--leaf->count];
+        memset(&leaf->entries[leaf->count], 0,
+               sizeof(struct heartyfs_dir_entry));
+        return;
+    }
+
+    struct heartyfs_directory *dir = hfs_block(fs, fix->block);
+    int size = dir->size < MAX_DIR_ENTRIES ? dir->size : MAX_DIR_ENTRIES;
+    hfs_dirty(fs, dir);
+    dir->entries[fix->slot] = dir->entries[size - 1];
+    dir->size = size - 1;
+    memset(&dir->entries[dir->size], 0, sizeof(struct heartyfs_dir_entry));
+}
+
+/**
+ * @brief Make one repair found by the walk
+ * @param[in] fs Mounted filesystem
+ * @param[in] fix Repair to make
+ * @return 1 if anything changed, 0 otherwise
+ */
+static int apply_fix(struct heartyfs *fs, const struct fsck_fix *fix) {
+    struct heartyfs_directory *dir = hfs_block(fs, fix->block);
+    switch (fix->kind) {
+    case FIX_DOT:
+        hfs_dirty(fs, dir);
+        dir->entries[0].block_id = fix->value;
+        break;
+    case FIX_ENTRY:
+        drop_entry(fs, fix);
+        break;
+    case FIX_SIZE:
+        hfs_dirty(fs, dir);
+        dir->size = fix->value;
+        break;
+    case FIX_HEAD: {
+        long long count = count_hashed(fs, dir);
+        if (count < 0 || dir->size == count + MIN_DIR_ENTRIES) {
+            return 0;
+        }
+        hfs_dirty(fs, dir);
+        dir->size = count + MIN_DIR_ENTRIES;
+        break;
+    }
+    case FIX_SHARE:
+        hfs_dirty(fs, &fs->shares[fix->block]);
+        fs->shares[fix->block] = fix->value;
+        break;
+    case FIX_TAIL:
+        if (fix->block == fs->sb->ext_block) {
+            struct heartyfs_sb_ext *ext = hfs_block(fs, fix->block);
+            hfs_dirty(fs, ext);
+            ext->tail_block = 0;
+        } else {
+            struct heartyfs_tail_block *tb = hfs_block(fs, fix->block);
+            hfs_dirty(fs, tb);
+            tb->used = fix->value;
+        }
+        break;
+    }
+    return 1;
+}
+
+/**
+ * @brief Make every repair the check found
+ * @param[in] fs Writable mount
+ * @param[in,out] all Results of every worker, merged
+ * @param[in] unsafe 1 if some node could not be walked in full
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Every hashed directory is recounted once dangling entries are gone, but
+ * only those whose size changes count as repaired.
+ */
+static int repair(struct heartyfs *fs, struct fsck_worker *all, int unsafe) {
+    int ret = hfs_journal_begin_op(fs);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    // Entries first: the directory sizes recounted after them depend on it
+    struct fsck_fix *fixes = all->fixes.items;
+    qsort(fixes, all->fixes.count, sizeof(*fixes), compare_fixes);
+    for (int i = 0; i < all->fixes.count; i++) {
+        if (fixes[i].kind != FIX_HEAD) {
+            apply_fix(fs, &fixes[i]);
+            all->counts.repaired++;
+        }
+    }
+    for (int i = 0; i < all->fixes.count; i++) {
+        if (fixes[i].kind == FIX_HEAD) {
+            all->counts.repaired += apply_fix(fs, &fixes[i]);
+        }
+    }
+
+    const struct fsck_run *lost = all->lost.items;
+    for (int i = 0; i < all->lost.count; i++) {
+        hfs_claim_run(fs, lost[i].start, lost[i].length);
+        all->counts.repaired++;
+    }
+    if (!unsafe) {
+        const struct fsck_run *leaks = all->leaks.items;
+        for (int i = 0; i < all->leaks.count; i++) {
+            hfs_free_run(fs, leaks[i].start, leaks[i].length);
+            all->counts.repaired++;
+        }
+    }
+
+    if (fs->dcache) {
+        // Entries may have gone; start the cache afresh
+        hfs_dcache_destroy(fs);
+        hfs_dcache_init(fs);
+    }
+    return hfs_end_op(fs);
+}
+
+/**
+ * @brief Order notes by block
+ */
+static int compare_notes(const void *a, const void *b) {
+    const struct fsck_note *x = a;
+    const struct fsck_note *y = b;
+    if (x->block != y->block) {
+        return x->block < y->block ? -1 : 1;
+    }
+    return strcmp(x->text, y->text);
+}
+
+/**
+ * @brief Describe runs of blocks whose bitmap bit is wrong
+ */
+static void note_runs(struct fsck_worker *w, const struct fsck_vector *runs,
+                      const char *what) {
+    const struct fsck_run *run = runs->items;
+    for (int i = 0; i < runs->count; i++) {
+        if (run[i].length == 1) {
+            note(w, run[i].start, "%s", what);
+        } else {
+            note(w, run[i].start, "%d blocks from here %s", run[i].length,
+                 what);
+        }
+    }
+}
+
+/**
+ * @brief Fold the results of every worker into the first one
+ * @return HEARTYFS_OK, or HEARTYFS_ERR_NO_MEMORY
+ */
+static int merge_workers(struct fsck_worker *workers, int count) {
+    struct fsck_worker *all = &workers[0];
+    for (int i = 1; i < count; i++) {
+        struct fsck_worker *w = &workers[i];
+        if (w->error != HEARTYFS_OK ||
+            vector_append(&all->notes, &w->notes, sizeof(struct fsck_note)) ||
+            vector_append(&all->fixes, &w->fixes, sizeof(struct fsck_fix)) ||
+            vector_append(&all->frags, &w->frags, sizeof(struct fsck_frag))) {
+            return HEARTYFS_ERR_NO_MEMORY;
+        }
+
+        // Ranges are in block order, so runs can only join at the seams
+        const struct fsck_run *runs[2] = {w->leaks.items, w->lost.items};
+        struct fsck_vector *into[2] = {&all->leaks, &all->lost};
+        int counts[2] = {w->leaks.count, w->lost.count};
+        for (int k = 0; k < 2; k++) {
+            for (int j = 0; j < counts[k]; j++) {
+                for (int b = 0; b < runs[k][j].length; b++) {
+                    add_to_run(all, into[k], runs[k][j].start + b);
+                }
+            }
+        }
+
+        const int *src = (const int *)&w->counts;
+        int *dst = (int *)&all->counts;
+        for (size_t k = 0; k < sizeof(all->counts) / sizeof(int); k++) {
+            dst[k] += src[k];
+        }
+    }
+    return all->error;
+}
+
+/**
+ * @brief Release what the workers collected
+ */
+static void free_workers(struct fsck_worker *workers, int count) {
+    for (int i = 0; i < count; i++) {
+        free(workers[i].stack.items);
+        free(workers[i].notes.items);
+        free(workers[i].fixes.items);
+        free(workers[i].frags.items);
+        free(workers[i].leaks.items);
+        free(workers[i].lost.items);
+    }
+    free(workers);
+}
+
+/**
+ * @brief Check and repair the image once nobody else can change it
+ */
+static int check_image(struct heartyfs *fs, int threads, int flags,
+                       void (*note)(void *arg, int block,
+                                    const char *problem),
+                       void *arg, struct heartyfs_fsck_report *report) {
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    threads = threads < 1 ? 1 : threads;
+    threads = threads > FSCK_MAX_THREADS ? FSCK_MAX_THREADS : threads;
+
+    struct fsck f = {0};
+    f.fs = fs;
+    f.verify = fs->csums != NULL;
+    f.threads = threads;
+    f.refs = calloc(fs->num_blocks, sizeof(*f.refs));
+    f.roles = calloc(fs->num_blocks, 1);
+    struct fsck_worker *workers = calloc(threads, sizeof(*workers));
+    struct fsck_item *roots = NULL;
+    if (f.refs && f.roles && workers) {
+        roots = vector_push(&f.queue, sizeof(*roots));
+    }
+    if (!roots) {
+        free(f.refs);
+        free(f.roles);
+        free(workers);
+        return HEARTYFS_ERR_NO_MEMORY;
+    }
+    pthread_mutex_init(&f.lock, NULL);
+    pthread_cond_init(&f.wake, NULL);
+
+    // The root and the snapshot directory are referenced by the image itself
+    *roots = (struct fsck_item){SUPERBLOCK_ID, 0, ROLE_NODE};
+    f.refs[SUPERBLOCK_ID] = 1;
+    f.roles[SUPERBLOCK_ID] = ROLE_NODE;
+    if (fs->snapshot_dir) {
+        struct fsck_item *item = vector_push(&f.queue, sizeof(*item));
+        if (item) {
+            *item = (struct fsck_item){fs->snapshot_dir, 0, ROLE_NODE};
+            f.refs[fs->snapshot_dir] = 1;
+            f.roles[fs->snapshot_dir] = ROLE_NODE;
+        }
+    }
+
+    int span = (fs->num_blocks - fs->first_data_block + threads - 1) / threads;
+    span = (span + 63) & ~63;
+    for (int i = 0; i < threads; i++) {
+        workers[i].f = &f;
+        workers[i].lo = fs->first_data_block + i * span;
+        workers[i].hi = workers[i].lo + span;
+        if (workers[i].lo > fs->num_blocks) {
+            workers[i].lo = fs->num_blocks;
+        }
+        if (workers[i].hi > fs->num_blocks) {
+            workers[i].hi = fs->num_blocks;
+        }
+    }
+
+    // The walk ends when every thread is idle, so all must be counted in
+    f.threads = run_workers(workers, threads, walk_worker);
+    run_workers(workers, threads, bitmap_worker);
+
+    struct fsck_worker *all = &workers[0];
+    int ret = merge_workers(workers, threads);
+    if (ret == HEARTYFS_OK) {
+        check_reserved(all, fs);
+        check_tails(all, &f);
+        all->counts.leaked = 0;
+        all->counts.unmarked = 0;
+        for (int i = 0; i < all->leaks.count; i++) {
+            all->counts.leaked +=
+                ((struct fsck_run *)all->leaks.items)[i].length;
+        }
+        for (int i = 0; i < all->lost.count; i++) {
+            all->counts.unmarked +=
+                ((struct fsck_run *)all->lost.items)[i].length;
+        }
+        note_runs(all, &all->leaks, "allocated but unreachable");
+        note_runs(all, &all->lost, "in use but marked free");
+        ret = all->error;
+    }
+    if (ret == HEARTYFS_OK && (flags & HEARTYFS_FSCK_REPAIR)) {
+        ret = repair(fs, all, f.unsafe);
+    }
+
+    if (ret == HEARTYFS_OK) {
+        struct fsck_note *notes = all->notes.items;
+        qsort(notes, all->notes.count, sizeof(*notes), compare_notes);
+        for (int i = 0; note && i < all->notes.count; i++) {
+            note(arg, notes[i].block, notes[i].text);
+        }
+        *report = all->counts;
+        report->threads = f.threads;
+    }
+
+    pthread_cond_destroy(&f.wake);
+    pthread_mutex_destroy(&f.lock);
+    free(f.queue.items);
+    free(f.refs);
+    free(f.roles);
+    free_workers(workers, threads);
+    return ret;
+}
+
+/**
+ * @brief Check, and optionally repair, the consistency of an image
+ * @param[in] fs Mounted filesystem; nothing else may use it meanwhile
+ * @param[in] threads Threads to use; 0 for one per online CPU
+ * @param[in] flags HEARTYFS_FSCK_REPAIR to fix what can be fixed, which
+ *                  needs a writable mount
+ * @param[in] note Called for every problem found, in block order, or NULL
+ * @param[in] arg Passed to note
+ * @param[out] report Receives the counts of what was found
+ * @return HEARTYFS_OK once the check has run, whatever it found, or a
+ *         HEARTYFS_ERR_* code if it could not
+ *
+ * Every block reachable from the root or a snapshot is accounted for and
+ * compared with the bitmap, the share count table and the slot maps of
+ * tail blocks. Checksums are verified along the way on images that have
+ * them. Repairs reclaim leaked blocks, mark blocks in use that are marked
+ * free, drop dangling entries and correct share counts, slot maps and
+ * directory heads. Cross-linked blocks, corrupted nodes and checksum
+ * mismatches are only reported. Other processes using the image wait
+ * until the check is over. On a journaled image the changes made through
+ * fs are committed first, so the blocks it freed count as free.
+ */
+int heartyfs_fsck(struct heartyfs *fs, int threads, int flags,
+                  void (*note)(void *arg, int block, const char *problem),
+                  void *arg, struct heartyfs_fsck_report *report) {
+    if (!fs || !report) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    if ((flags & HEARTYFS_FSCK_REPAIR) && !hfs_writable(fs)) {
+        return HEARTYFS_ERR_RDONLY;
+    }
+    int ret = hfs_op_begin(fs, 1);
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_lock_all(fs);
+    }
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_journal_commit(fs);
+    }
+    if (ret == HEARTYFS_OK) {
+        ret = check_image(fs, threads, flags, note, arg, report);
+    }
+    return hfs_op_end(fs, ret);
+}
@@ -0,0 +1,411 @@
+#ifndef HEARTYFS_INTERNAL_H
+#define HEARTYFS_INTERNAL_H
+
+#include "../heartyfs.h"
+#include "../libheartyfs.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* On-disk constants */
+#define FILE_TYPE 0
+#define DIR_TYPE 1
+#define FILE_COMPRESSED 0x1  // Inode flag: the data is a compressed container
+#define SUPERBLOCK_ID 0
+#define BITMAP_BLOCK_ID 1  // First block of the bitmap region
+#define MAX_DIR_ENTRIES 14
+#define MIN_DIR_ENTRIES 2  // . and ..
+#define MAX_DIRECT_EXTENTS 38
+#define MAX_NAME_LENGTH 27
+#define MAX_PATH_LENGTH 256
+#define ROOT_DIR_NAME "/"
+#define CURRENT_DIR "."
+#define PARENT_DIR ".."
+#define SNAPSHOT_DIR_NAME ".snapshots"  // Where the root lists snapshots
+#define MAX_SNAPSHOTS 255  // Keeps every share count within one byte
+#define TAIL_SLOTS 64      // Slots of a tail block, one bit each in used
+#define COMPRESS_CHUNK_SIZE (1 << 16)  // File bytes per compressed chunk
+
+/**
+ * @brief A mounted heartyfs image
+ */
+struct heartyfs {
+    int fd;                          // Open disk file
+    void *data;                      // Mapping of the disk file used for
+                                     // file contents
+    void *disk;                      // Mapping used for metadata; a private
+                                     // copy of data on journaled images
+    size_t disk_size;                // Length of the mapping
+    int flags;                       // HEARTYFS_* mount flags
+    struct heartyfs_superblock *sb;  // Superblock (block 0)
+    char *bitmap;                    // Free-block bitmap (from block 1)
+    int block_size;                  // Bytes per block
+    int block_shift;                 // log2(block_size)
+    int num_blocks;                  // Blocks in the image
+    int first_data_block;            // First block after the bitmap and
+                                     // the journal
+    int extents_per_block;           // Extents in an extent block
+    int pointers_per_block;          // Block ids in a pointer block
+    int max_extents;                 // Extents a file may have
+    struct hfs_dcache *dcache;       // Dentry cache, or NULL if disabled
+    struct hfs_journal *journal;     // Metadata journal, or NULL
+    struct hfs_writeback *writeback; // Dirty ranges, or NULL if read-only
+    int durability;                  // HEARTYFS_DURABLE_* after each op
+    int snapshot_dir;                // Directory of snapshots, or 0
+    unsigned char *shares;           // Share count table, or NULL
+    int tail_packing;                // 1 if file tails may share blocks
+    int csum_table;                  // First block of the checksum
+                                     // table, or 0
+    uint32_t *csums;                 // Checksum table, or NULL if the image
+                                     // has none or it is not filled in yet
+    struct hfs_csum *csum;           // Blocks whose checksum is out of
+                                     // date, or NULL if read-only
+    struct hfs_locks *locks;         // Locks shared with other processes,
+                                     // or NULL if the image needs none
+};
+
+/**
+ * @brief Translate a block id into its address inside the mapping
+ */
+static inline void *hfs_block(const struct heartyfs *fs, int block) {
+    return (char *)fs->disk + ((size_t)block << fs->block_shift);
+}
+
+/**
+ * @brief Translate an address inside the mapping back into a block id
+ */
+static inline int hfs_block_id(const struct heartyfs *fs, const void *ptr) {
+    return (int)(((const char *)ptr - (const char *)fs->disk) >>
+                 fs->block_shift);
+}
+
+/**
+ * @brief Translate a block id into its address in the file data mapping
+ */
+static inline void *hfs_data(const struct heartyfs *fs, int block) {
+    return (char *)fs->data + ((size_t)block << fs->block_shift);
+}
+
+static inline int hfs_writable(const struct heartyfs *fs) {
+    return !(fs->flags & HEARTYFS_RDONLY);
+}
+
+/* journal.c */
+void hfs_journal_dirty(struct heartyfs *fs, int block);
+void hfs_journal_free(struct heartyfs *fs, int start, int length);
+long long hfs_journal_release_frees(struct heartyfs *fs);
+long long hfs_journal_pending_frees(const struct heartyfs *fs);
+int hfs_journal_blocks(const struct heartyfs *fs);
+int hfs_journal_commit(struct heartyfs *fs);
+int hfs_journal_begin_op(struct heartyfs *fs);
+int hfs_journal_open(struct heartyfs *fs, int start, int blocks);
+void hfs_journal_close(struct heartyfs *fs);
+
+/* lock.c */
+int hfs_lock_image_file(struct heartyfs *fs);
+int hfs_locks_open(struct heartyfs *fs);
+void hfs_locks_close(struct heartyfs *fs);
+unsigned hfs_locks_sync(struct heartyfs *fs);
+int hfs_locks_unchanged(const struct heartyfs *fs, unsigned gen);
+int hfs_op_begin(struct heartyfs *fs, int exclusive);
+ssize_t hfs_op_end(struct heartyfs *fs, ssize_t ret);
+int hfs_lock_dir(struct heartyfs *fs, int block);
+void hfs_unlock_dir(struct heartyfs *fs, int block);
+int hfs_trylock_dir(struct heartyfs *fs, int block);
+int hfs_lock_child_dir(struct heartyfs *fs, int parent, int block,
+                       int *relocked);
+int hfs_lock_inode(struct heartyfs *fs, int block);
+void hfs_unlock_inode(struct heartyfs *fs, int block);
+int hfs_lock_tail(struct heartyfs *fs);
+void hfs_unlock_tail(struct heartyfs *fs);
+int hfs_lock_all(struct heartyfs *fs);
+void hfs_unlock_held(struct heartyfs *fs);
+unsigned hfs_dir_read_begin(const struct heartyfs *fs, int block);
+int hfs_dir_read_retry(const struct heartyfs *fs, int block, unsigned seq);
+void hfs_dir_write_begin(struct heartyfs *fs, int block);
+void hfs_dir_write_end(struct heartyfs *fs, int block);
+
+/* writeback.c */
+int hfs_writeback_init(struct heartyfs *fs);
+void hfs_writeback_destroy(struct heartyfs *fs);
+void hfs_writeback_mark(struct heartyfs *fs, int start, int length);
+void hfs_dirty_data(struct heartyfs *fs, const void *ptr, size_t len);
+int hfs_flush(struct heartyfs *fs, int level);
+int hfs_end_op(struct heartyfs *fs);
+
+/* checksum.c */
+#define CSUM_META 0x1  // Changed through the metadata mapping
+#define CSUM_DATA 0x2  // Changed through the file data mapping
+
+int hfs_csum_open(struct heartyfs *fs);
+void hfs_csum_close(struct heartyfs *fs);
+void hfs_csum_dirty(struct heartyfs *fs, int start, int length, int how);
+int hfs_csum_update(struct heartyfs *fs);
+int hfs_csum_check(const struct heartyfs *fs, const void *ptr, size_t len);
+
+/**
+ * @brief Note that a metadata block is about to change
+ *
+ * The block joins the running journal transaction, or on an image
+ * without a journal the ranges written back by the next flush. Its
+ * checksum is brought up to date at the end of the operation.
+ */
+static inline void hfs_dirty_block(struct heartyfs *fs, int block) {
+    if (fs->journal) {
+        hfs_journal_dirty(fs, block);
+    } else {
+        hfs_writeback_mark(fs, block, 1);
+    }
+    if (fs->csum) {
+        hfs_csum_dirty(fs, block, 1, CSUM_META);
+    }
+}
+
+/**
+ * @brief Note that the metadata block holding ptr is about to change
+ *
+ * Must be called for every block an operation modifies through the
+ * metadata mapping.
+ */
+static inline void hfs_dirty(struct heartyfs *fs, const void *ptr) {
+    hfs_dirty_block(fs, hfs_block_id(fs, ptr));
+}
+
+/**
+ * @brief Check whether a file keeps its data inside its inode block
+ */
+static inline int hfs_file_inline(const struct heartyfs_inode *inode) {
+    return inode->size == 0 && inode->file_size > 0;
+}
+
+/**
+ * @brief Start of the inline data area of an inode
+ */
+static inline char *hfs_inline_data(const struct heartyfs_inode *inode) {
+    return (char *)inode->extents;
+}
+
+/**
+ * @brief Largest file that fits inline in an inode block
+ */
+static inline long long hfs_inline_capacity(const struct heartyfs *fs) {
+    return fs->block_size - (long long)offsetof(struct heartyfs_inode,
+                                                extents);
+}
+
+/**
+ * @brief Check whether a file keeps its last partial block in a tail block
+ */
+static inline int hfs_file_packed(const struct heartyfs *fs,
+                                  const struct heartyfs_inode *inode) {
+    return inode->size > 0 &&
+           inode->file_size > (long long)inode->size << fs->block_shift;
+}
+
+/**
+ * @brief Tail fragment descriptor of a packed file
+ *
+ * Only valid once num_extents is known to be below MAX_DIRECT_EXTENTS;
+ * see hfs_tail_valid().
+ */
+static inline struct heartyfs_tail *
+hfs_file_tail(const struct heartyfs_inode *inode) {
+    return (struct heartyfs_tail *)&inode->extents[inode->num_extents];
+}
+
+/**
+ * @brief Length of the tail fragment of a packed file
+ */
+static inline long long hfs_tail_length(const struct heartyfs *fs,
+                                        const struct heartyfs_inode *inode) {
+    return inode->file_size - ((long long)inode->size << fs->block_shift);
+}
+
+/**
+ * @brief Check whether a block is referenced from more than one parent
+ *
+ * Only meaningful once every block above it on the live path is known to
+ * be unshared; see hfs_resolve_writable().
+ */
+static inline int hfs_shared(const struct heartyfs *fs, int block) {
+    return fs->shares && block >= 0 && block < fs->num_blocks &&
+           fs->shares[block] > 0;
+}
+
+/* snapshot.c */
+void hfs_ref_run(struct heartyfs *fs, int start, int length);
+void hfs_unref_run(struct heartyfs *fs, int start, int length);
+int hfs_has_snapshots(const struct heartyfs *fs);
+int hfs_unshare_entry(struct heartyfs *fs, int parent, const char *name,
+                      int *block);
+void hfs_drop_node(struct heartyfs *fs, int block);
+
+/* tail.c */
+long long hfs_tail_max(const struct heartyfs *fs);
+int hfs_tail_alloc(struct heartyfs *fs, long long len,
+                   struct heartyfs_tail *tail);
+void hfs_tail_free(struct heartyfs *fs, const struct heartyfs_tail *tail,
+                   long long len);
+int hfs_tail_valid(const struct heartyfs *fs,
+                   const struct heartyfs_inode *inode);
+int hfs_tail_copy(struct heartyfs *fs, struct heartyfs_inode *inode);
+
+/* lz.c */
+size_t hfs_lz_compress(const void *src, size_t len, void *dst, size_t cap);
+ssize_t hfs_lz_decompress(const void *src, size_t len, void *dst,
+                          size_t cap);
+
+/* compress.c */
+struct hfs_zstream {
+    long long *offsets;     // Container offset of each chunk written
+    int count;              // Chunks written
+    int capacity;           // Room in offsets
+    long long file_size;    // File bytes taken in so far
+    char *out;              // One compressed chunk
+};
+
+int hfs_zstream_begin(struct heartyfs *fs, struct heartyfs_inode *inode,
+                      struct hfs_zstream *z);
+int hfs_zstream_add(struct heartyfs *fs, struct heartyfs_inode *inode,
+                    struct hfs_zstream *z, const void *data, size_t len);
+int hfs_zstream_end(struct heartyfs *fs, struct heartyfs_inode *inode,
+                    struct hfs_zstream *z, int status);
+int hfs_zwrite(struct heartyfs *fs, struct heartyfs_inode *inode,
+               const void *buf, size_t len);
+ssize_t hfs_zread(const struct heartyfs *fs,
+                  const struct heartyfs_inode *inode, void *buf, size_t len,
+                  off_t offset);
+long long hfs_file_length(const struct heartyfs *fs,
+                          const struct heartyfs_inode *inode);
+int hfs_zexpand(struct heartyfs *fs, struct heartyfs_inode *inode);
+
+/* crc32c.c */
+uint32_t hfs_crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* bitmap.c */
+int hfs_alloc_run_in(struct heartyfs *fs, int lo, int hi, int goal, int want,
+                     int *length);
+int hfs_alloc_run_near(struct heartyfs *fs, int goal, int want, int *length);
+int hfs_alloc_run(struct heartyfs *fs, int want, int *length);
+int hfs_alloc_block(struct heartyfs *fs);
+void hfs_free_run(struct heartyfs *fs, int start, int length);
+void hfs_release_run(struct heartyfs *fs, int start, int length);
+void hfs_claim_run(struct heartyfs *fs, int start, int length);
+void hfs_free_block(struct heartyfs *fs, int block);
+int hfs_block_in_range(const struct heartyfs *fs, int block);
+
+/* path.c */
+int hfs_lookup(struct heartyfs *fs, int dir_block, const char *name,
+               int *block);
+int hfs_resolve(struct heartyfs *fs, const char *path, int *block);
+int hfs_resolve_writable(struct heartyfs *fs, const char *path, int *block);
+int hfs_resolve_locked(struct heartyfs *fs, const char *path, int writable,
+                       int *block);
+int hfs_snapshot_name(const struct heartyfs *fs, int parent, const char *name);
+int hfs_resolve_parent(struct heartyfs *fs, const char *path, int *parent,
+                       char *name);
+
+/* dir.c */
+void hfs_init_directory(struct heartyfs_directory *dir, const char *name,
+                        int dir_block, int parent_block);
+int hfs_dir_lookup(const struct heartyfs *fs,
+                   const struct heartyfs_directory *dir, const char *name,
+                   int *block);
+int hfs_dir_add(struct heartyfs *fs, struct heartyfs_directory *dir,
+                const char *name, int block);
+int hfs_dir_remove(struct heartyfs *fs, struct heartyfs_directory *dir,
+                   const char *name);
+int hfs_dir_relink(struct heartyfs *fs, struct heartyfs_directory *dir,
+                   const char *name, int block);
+int hfs_dir_foreach(const struct heartyfs *fs,
+                    const struct heartyfs_directory *dir,
+                    int (*fn)(void *arg,
+                              const struct heartyfs_dir_entry *entry),
+                    void *arg);
+
+/* dir_hash.c */
+uint32_t hfs_name_hash(const char *name);
+int hfs_htree_lookup(const struct heartyfs *fs,
+                     const struct heartyfs_directory *dir, const char *name,
+                     int *block);
+int hfs_htree_insert(struct heartyfs *fs, struct heartyfs_directory *dir,
+                     const char *name, int block);
+int hfs_htree_remove(struct heartyfs *fs, struct heartyfs_directory *dir,
+                     const char *name);
+int hfs_htree_unshare(struct heartyfs *fs, struct heartyfs_directory *dir,
+                      const char *name);
+int hfs_htree_relink(struct heartyfs *fs, struct heartyfs_directory *dir,
+                     const char *name, int block);
+int hfs_htree_foreach(const struct heartyfs *fs,
+                      const struct heartyfs_directory *dir,
+                      int (*fn)(void *arg,
+                                const struct heartyfs_dir_entry *entry),
+                      void *arg);
+int hfs_htree_create(struct heartyfs *fs, struct heartyfs_directory *dir);
+void hfs_htree_free(struct heartyfs *fs, struct heartyfs_directory *dir);
+const struct heartyfs_dir_index *hfs_htree_index(
+    const struct heartyfs *fs, const struct heartyfs_directory *dir);
+int hfs_htree_slot(const struct heartyfs *fs,
+                   const struct heartyfs_dir_index *index, uint32_t slot);
+const struct heartyfs_dir_leaf *hfs_htree_leaf(const struct heartyfs *fs,
+                                               int block);
+
+/* dcache.c */
+int hfs_dcache_init(struct heartyfs *fs);
+void hfs_dcache_destroy(struct heartyfs *fs);
+void hfs_dcache_invalidate(struct heartyfs *fs);
+int hfs_dcache_lookup(struct heartyfs *fs, int parent, const char *name,
+                      int *block);
+void hfs_dcache_insert(struct heartyfs *fs, int parent, const char *name,
+                       int block);
+int hfs_dcache_path_lookup(struct heartyfs *fs, const char *path, int *block);
+void hfs_dcache_path_insert(struct heartyfs *fs, const char *path, int block);
+void hfs_dcache_remove(struct heartyfs *fs, int parent, const char *name,
+                       int was_dir);
+void hfs_dcache_relink(struct heartyfs *fs, int parent, const char *name,
+                       int block);
+
+/* file.c */
+int hfs_resolve_file(struct heartyfs *fs, const char *path, int writable,
+                     struct heartyfs_inode **inode);
+int hfs_file_map(const struct heartyfs *fs, const struct heartyfs_inode *inode,
+                 off_t offset, size_t len, struct iovec *iov, int max_iov,
+                 size_t *mapped);
+int hfs_file_reserve_in(struct heartyfs *fs, struct heartyfs_inode *inode,
+                        size_t len, int lo, int hi, int goal);
+int hfs_file_reserve(struct heartyfs *fs, struct heartyfs_inode *inode,
+                     size_t len, int goal);
+void hfs_file_dirty(struct heartyfs *fs, const struct heartyfs_inode *inode,
+                    const void *ptr, size_t len);
+void hfs_file_pack(struct heartyfs *fs, struct heartyfs_inode *inode);
+ssize_t hfs_file_read(const struct heartyfs *fs,
+                      const struct heartyfs_inode *inode, void *buf,
+                      size_t len, off_t offset);
+ssize_t hfs_file_pwrite(struct heartyfs *fs, struct heartyfs_inode *inode,
+                        const void *buf, size_t len, off_t offset);
+
+/* io.c */
+int hfs_write_spans(int fd, struct iovec *iov, int count, int *use_splice);
+int hfs_read_compressed_to_fd(const struct heartyfs *fs,
+                              const struct heartyfs_inode *inode, int out_fd,
+                              off_t offset, off_t end);
+int hfs_read_spans(int fd, struct iovec *iov, int count, off_t offset);
+
+/* extent.c */
+struct heartyfs_extent *hfs_extent_at(const struct heartyfs *fs,
+                                      const struct heartyfs_inode *inode,
+                                      int index);
+int hfs_extent_find(const struct heartyfs *fs,
+                    const struct heartyfs_inode *inode, int logical);
+int hfs_extent_append(struct heartyfs *fs, struct heartyfs_inode *inode,
+                      int start, int length);
+int hfs_extent_remap(struct heartyfs *fs, struct heartyfs_inode *inode,
+                     int logical, int start, int length);
+int hfs_extents_clone(struct heartyfs *fs, struct heartyfs_inode *inode);
+int hfs_extents_valid(const struct heartyfs *fs,
+                      const struct heartyfs_inode *inode);
+void hfs_extent_truncate(struct heartyfs *fs, struct heartyfs_inode *inode,
+                         int blocks);
+void hfs_free_file_blocks(struct heartyfs *fs, struct heartyfs_inode *inode);
+
+#endif
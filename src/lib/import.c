@@ -0,0 +1,474 @@
+#include "heartyfs_internal.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/*
+ * Bulk import of a host directory tree.
+ *
+ * The host tree is walked once, in name order, and every directory and
+ * file is created as it is reached, so entries go in through the usual
+ * operations in a single ordered pass. Files small enough to live in
+ * their inode, and every file on a compressing mount, are written there
+ * and then. The others are queued, and once a batch has built up one
+ * operation reserves the blocks of all of them and a pool of threads
+ * reads their contents straight into the mapping. The data area is split
+ * into one slice per thread, and each thread's files are reserved inside
+ * its slice, so what one thread writes lies together on disk and never
+ * interleaves with another thread's files. Only once a slice is full do
+ * its files spill over into the rest of the image. The threads touch
+ * neither the bitmap nor any metadata: the calling thread reserves the
+ * blocks up front, and when the threads are done it marks what they
+ * wrote and packs the tails, and the operation ends.
+ */
+#define IMPORT_MAX_THREADS 64
+#define IMPORT_BATCH_FILES 4096         // Files queued before a batch runs
+#define IMPORT_BATCH_BYTES (256 << 20)  // Bytes queued before a batch runs
+#define IMPORT_IOV_BATCH 256            // Spans read per preadv()
+
+struct import_file {
+    char *host;             // Path on the host
+    char *path;             // Path in heartyfs
+    long long size;         // Length when the tree was walked
+    int inode;              // Inode block once its blocks are reserved
+    int worker;             // Thread that copies it
+    int error;              // HEARTYFS_ERR_* code of the copy
+};
+
+/**
+ * @brief State of one import
+ */
+struct import {
+    struct heartyfs *fs;
+    int threads;
+    int bounds[IMPORT_MAX_THREADS + 1]; // Slice w is bounds[w] to bounds[w + 1]
+    int cursors[IMPORT_MAX_THREADS];    // Where each thread allocates next
+    struct import_file *files;          // Batch waiting to be copied
+    int count;
+    int capacity;
+    long long queued;                   // Bytes in the batch
+    int error;                          // First copy error, if any
+    void (*skip)(void *arg, const char *host_path, int err);
+    void *arg;
+    struct heartyfs_import_report *report;
+};
+
+struct import_worker {
+    struct import *im;
+    int id;
+    pthread_t thread;
+};
+
+/**
+ * @brief Report a host entry that was left out
+ */
+static void skip_entry(struct import *im, const char *host, int err) {
+    im->report->skipped++;
+    if (im->skip) {
+        im->skip(im->arg, host, err);
+    }
+}
+
+/**
+ * @brief Copy one file's contents from the host into its reserved blocks
+ * @param[in] fs Mounted filesystem
+ * @param[in] file File with its blocks reserved
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+static int copy_file(const struct heartyfs *fs,
+                     const struct import_file *file) {
+    int fd = open(file->host, O_RDONLY);
+    if (fd < 0) {
+        return HEARTYFS_ERR_IO;
+    }
+
+    const struct heartyfs_inode *inode = hfs_block(fs, file->inode);
+    int ret = HEARTYFS_OK;
+    off_t offset = 0;
+    while (ret == HEARTYFS_OK && offset < file->size) {
+        struct iovec iov[IMPORT_IOV_BATCH];
+        size_t mapped;
+        int count = hfs_file_map(fs, inode, offset, file->size - offset, iov,
+                                 IMPORT_IOV_BATCH, &mapped);
+        ret = count > 0 ? hfs_read_spans(fd, iov, count, offset)
+                        : HEARTYFS_ERR_CORRUPT;
+        offset += mapped;
+    }
+    close(fd);
+    return ret;
+}
+
+/**
+ * @brief Thread body: copy every file of the batch given to this thread
+ */
+static void *copy_worker(void *arg) {
+    struct import_worker *w = arg;
+    struct import *im = w->im;
+    for (int i = 0; i < im->count; i++) {
+        struct import_file *file = &im->files[i];
+        if (file->worker == w->id && file->error == HEARTYFS_OK) {
+            file->error = copy_file(im->fs, file);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reserve blocks for every file of the batch
+ * @param[in,out] im Import state
+ *
+ * Files go to the thread with the fewest bytes so far, and are reserved
+ * inside that thread's slice, from its cursor. A file that no longer fits
+ * there is reserved anywhere on the disk. A file that cannot be reserved
+ * keeps its error and is left empty.
+ */
+static void reserve_batch(struct import *im) {
+    struct heartyfs *fs = im->fs;
+    long long load[IMPORT_MAX_THREADS] = {0};
+
+    for (int i = 0; i < im->count; i++) {
+        struct import_file *file = &im->files[i];
+        int w = 0;
+        for (int k = 1; k < im->threads; k++) {
+            if (load[k] < load[w]) {
+                w = k;
+            }
+        }
+        file->worker = w;
+        load[w] += file->size;
+
+        struct heartyfs_inode *inode;
+        file->error = hfs_resolve_file(fs, file->path, 1, &inode);
+        if (file->error == HEARTYFS_OK) {
+            file->error = hfs_file_reserve_in(fs, inode, file->size,
+                                              im->bounds[w],
+                                              im->bounds[w + 1],
+                                              im->cursors[w]);
+        }
+        if (file->error == HEARTYFS_ERR_NO_SPACE) {
+            file->error = hfs_file_reserve(fs, inode, file->size,
+                                           fs->sb->alloc_cursor);
+        }
+        if (file->error == HEARTYFS_OK) {
+            file->inode = hfs_block_id(fs, inode);
+            im->cursors[w] = fs->sb->alloc_cursor;
+        }
+    }
+}
+
+/**
+ * @brief Record what the threads wrote into one file, or empty it
+ * @param[in,out] im Import state
+ * @param[in] file File of the batch
+ */
+static void finish_file(struct import *im, const struct import_file *file) {
+    struct heartyfs *fs = im->fs;
+    if (!file->inode) {
+        // Reservation failed and already left the file empty
+        im->error = im->error ? im->error : file->error;
+        return;
+    }
+
+    struct heartyfs_inode *inode = hfs_block(fs, file->inode);
+    if (file->error != HEARTYFS_OK) {
+        hfs_free_file_blocks(fs, inode);
+        im->error = im->error ? im->error : file->error;
+        return;
+    }
+
+    off_t offset = 0;
+    while (offset < file->size) {
+        struct iovec iov[IMPORT_IOV_BATCH];
+        size_t mapped;
+        int count = hfs_file_map(fs, inode, offset, file->size - offset, iov,
+                                 IMPORT_IOV_BATCH, &mapped);
+        if (count <= 0) {
+            break;  // Reserved just now, so this cannot happen
+        }
+        for (int i = 0; i < count; i++) {
+            hfs_file_dirty(fs, inode, iov[i].iov_base, iov[i].iov_len);
+        }
+        offset += mapped;
+    }
+    hfs_file_pack(fs, inode);
+    im->report->files++;
+    im->report->bytes += file->size;
+}
+
+/**
+ * @brief Copy the queued files in parallel
+ * @param[in,out] im Import state; the queue is emptied
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code if the operation
+ *         could not run
+ *
+ * If a thread cannot be started, the calling thread copies its files.
+ * The batch has the image to itself, so that it may lock all its files
+ * at once.
+ */
+static int run_batch(struct import *im) {
+    if (im->count == 0) {
+        return HEARTYFS_OK;
+    }
+    int ret = hfs_op_begin(im->fs, 1);
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_journal_begin_op(im->fs);
+    }
+    if (ret != HEARTYFS_OK) {
+        return hfs_op_end(im->fs, ret);
+    }
+    reserve_batch(im);
+
+    struct import_worker workers[IMPORT_MAX_THREADS];
+    for (int w = 0; w < im->threads; w++) {
+        workers[w] = (struct import_worker){im, w, 0};
+        if (w > 0 && pthread_create(&workers[w].thread, NULL, copy_worker,
+                                    &workers[w]) != 0) {
+            workers[w].thread = 0;
+            copy_worker(&workers[w]);
+        }
+    }
+    copy_worker(&workers[0]);
+    for (int w = 1; w < im->threads; w++) {
+        if (workers[w].thread) {
+            pthread_join(workers[w].thread, NULL);
+        }
+    }
+
+    for (int i = 0; i < im->count; i++) {
+        finish_file(im, &im->files[i]);
+        free(im->files[i].host);
+        free(im->files[i].path);
+    }
+    im->count = 0;
+    im->queued = 0;
+    return hfs_op_end(im->fs, hfs_end_op(im->fs));
+}
+
+/**
+ * @brief Queue a file to be copied by the next batch
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+static int queue_file(struct import *im, const char *host, const char *path,
+                      long long size) {
+    if (im->count == im->capacity) {
+        int capacity = im->capacity ? 2 * im->capacity : 64;
+        struct import_file *files =
+            realloc(im->files, capacity * sizeof(*files));
+        if (!files) {
+            return HEARTYFS_ERR_NO_MEMORY;
+        }
+        im->files = files;
+        im->capacity = capacity;
+    }
+
+    struct import_file *file = &im->files[im->count];
+    *file = (struct import_file){strdup(host), strdup(path), size, 0, 0,
+                                 HEARTYFS_OK};
+    if (!file->host || !file->path) {
+        free(file->host);
+        free(file->path);
+        return HEARTYFS_ERR_NO_MEMORY;
+    }
+    im->count++;
+    im->queued += size;
+    if (im->count >= IMPORT_BATCH_FILES || im->queued >= IMPORT_BATCH_BYTES) {
+        return run_batch(im);
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Create a node unless one of the same type is already there
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path of the node
+ * @param[in] type HEARTYFS_TYPE_DIR or HEARTYFS_TYPE_FILE
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+static int create_node(struct heartyfs *fs, const char *path, int type) {
+    int ret = type == HEARTYFS_TYPE_DIR ? heartyfs_mkdir(fs, path)
+                                        : heartyfs_creat(fs, path);
+    if (ret != HEARTYFS_ERR_EXISTS) {
+        return ret;
+    }
+
+    struct heartyfs_stat st;
+    ret = heartyfs_stat(fs, path, &st);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+    if (st.type != type) {
+        return type == HEARTYFS_TYPE_DIR ? HEARTYFS_ERR_NOT_DIR
+                                         : HEARTYFS_ERR_NOT_FILE;
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Import one regular file
+ * @param[in,out] im Import state
+ * @param[in] host Path on the host
+ * @param[in] path Path in heartyfs, already created
+ * @param[in] size Length of the host file
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Inline files and compressed ones are written right away.
+ */
+static int import_file(struct import *im, const char *host, const char *path,
+                       long long size) {
+    struct heartyfs *fs = im->fs;
+    if (size > hfs_inline_capacity(fs) && !(fs->flags & HEARTYFS_COMPRESS)) {
+        return queue_file(im, host, path, size);
+    }
+
+    int fd = open(host, O_RDONLY);
+    if (fd < 0) {
+        return HEARTYFS_ERR_IO;
+    }
+    int ret = heartyfs_write_from_fd(fs, path, fd);
+    close(fd);
+    if (ret == HEARTYFS_OK) {
+        im->report->files++;
+        im->report->bytes += size;
+    }
+    return ret;
+}
+
+/**
+ * @brief Skip . and .. when listing a host directory
+ */
+static int not_dots(const struct dirent *entry) {
+    return strcmp(entry->d_name, CURRENT_DIR) != 0 &&
+           strcmp(entry->d_name, PARENT_DIR) != 0;
+}
+
+/**
+ * @brief Import the contents of one host directory, depth first
+ * @param[in,out] im Import state
+ * @param[in] host Host directory
+ * @param[in] path Existing heartyfs directory to fill
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Entries are taken in name order. Names too long for heartyfs, and
+ * anything but directories and regular files, are skipped.
+ */
+static int import_dir(struct import *im, const char *host, const char *path) {
+    struct dirent **names;
+    int count = scandir(host, &names, not_dots, alphasort);
+    if (count < 0) {
+        return HEARTYFS_ERR_IO;
+    }
+
+    int ret = HEARTYFS_OK;
+    for (int i = 0; i < count; i++) {
+        const char *name = names[i]->d_name;
+        char child_host[PATH_MAX];
+        char child[MAX_PATH_LENGTH];
+        int host_len = snprintf(child_host, sizeof(child_host), "%s/%s",
+                                host, name);
+        int len = snprintf(child, sizeof(child), "%s/%s",
+                           strcmp(path, "/") == 0 ? "" : path, name);
+
+        struct stat st;
+        if (ret != HEARTYFS_OK) {
+            // Keep freeing the names
+        } else if (host_len >= (int)sizeof(child_host) ||
+                   lstat(child_host, &st) != 0) {
+            skip_entry(im, child_host, HEARTYFS_ERR_IO);
+        } else if (strlen(name) > MAX_NAME_LENGTH ||
+                   len >= (int)sizeof(child)) {
+            skip_entry(im, child_host, HEARTYFS_ERR_NAME_TOO_LONG);
+        } else if (S_ISDIR(st.st_mode)) {
+            ret = create_node(im->fs, child, HEARTYFS_TYPE_DIR);
+            if (ret == HEARTYFS_OK) {
+                im->report->dirs++;
+                ret = import_dir(im, child_host, child);
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            ret = create_node(im->fs, child, HEARTYFS_TYPE_FILE);
+            if (ret == HEARTYFS_OK) {
+                ret = import_file(im, child_host, child, st.st_size);
+            }
+        } else {
+            skip_entry(im, child_host, HEARTYFS_ERR_NOT_FILE);
+        }
+        free(names[i]);
+    }
+    free(names);
+    return ret;
+}
+
+/**
+ * @brief Copy a host directory tree into heartyfs
+ * @param[in] fs Mounted filesystem; nothing else may use it meanwhile
+ * @param[in] host_dir Host directory to copy
+ * @param[in] path heartyfs directory to copy its contents into; created
+ *                 if missing
+ * @param[in] threads Threads copying file contents; 0 for one per CPU
+ * @param[in] skip Called for every host entry left out, or NULL
+ * @param[in] arg Passed to skip
+ * @param[out] report Receives the counts of what was imported
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Directories that already exist are merged into and files that already
+ * exist are replaced. Symbolic links and special files are skipped, as
+ * are names longer than heartyfs allows. A file whose contents could not
+ * be copied is left empty, and the import carries on and returns the
+ * first such error at the end; anything else stops it where it is.
+ */
+int heartyfs_import(struct heartyfs *fs, const char *host_dir,
+                    const char *path, int threads,
+                    void (*skip)(void *arg, const char *host_path, int err),
+                    void *arg, struct heartyfs_import_report *report) {
+    if (!fs || !host_dir || !path || !report) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    if (!hfs_writable(fs)) {
+        return HEARTYFS_ERR_RDONLY;
+    }
+    struct stat st;
+    if (stat(host_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return HEARTYFS_ERR_IO;
+    }
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    threads = threads < 1 ? 1 : threads;
+    threads = threads > IMPORT_MAX_THREADS ? IMPORT_MAX_THREADS : threads;
+
+    memset(report, 0, sizeof(*report));
+    report->threads = threads;
+    int ret = strcmp(path, "/") == 0 ? HEARTYFS_OK
+                                     : create_node(fs, path, HEARTYFS_TYPE_DIR);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    // Split the data area into equal slices, one per thread
+    struct import im = {0};
+    im.fs = fs;
+    im.threads = threads;
+    im.skip = skip;
+    im.arg = arg;
+    im.report = report;
+    long long span = (fs->num_blocks - fs->first_data_block) / threads;
+    for (int w = 0; w < threads; w++) {
+        im.bounds[w] = fs->first_data_block + w * span;
+        im.cursors[w] = im.bounds[w];
+    }
+    im.bounds[threads] = fs->num_blocks;
+
+    ret = import_dir(&im, host_dir, path);
+    int batch_ret = run_batch(&im);
+    for (int i = 0; i < im.count; i++) {
+        free(im.files[i].host);
+        free(im.files[i].path);
+    }
+    free(im.files);
+    if (ret == HEARTYFS_OK) {
+        ret = batch_ret;
+    }
+    return ret == HEARTYFS_OK ? im.error : ret;
+}
@@ -0,0 +1,491 @@
+#define _GNU_SOURCE  // vmsplice(), F_SETPIPE_SZ
+#include "heartyfs_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/* Constants */
+#define IOV_BATCH 256             // Spans handed to one writev()/vmsplice()
+#define PIPE_BUFFER_SIZE (1 << 20)  // Requested pipe capacity for splicing
+#define STREAM_RUN_MIN (1 << 20)    // First run allocated for a stream
+#define STREAM_RUN_MAX (64 << 20)   // Largest run allocated for a stream
+
+/**
+ * @brief Write a set of spans to a descriptor, handling short writes
+ * @param[in] fd Destination descriptor
+ * @param[in,out] iov Spans to write; advanced as data goes out
+ * @param[in] count Number of spans
+ * @param[in,out] use_splice 1 to try vmsplice() first; cleared if the
+ *                           kernel refuses it for this descriptor
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_IO on failure
+ */
+int hfs_write_spans(int fd, struct iovec *iov, int count, int *use_splice) {
+    while (count > 0) {
+        ssize_t n = *use_splice ? vmsplice(fd, iov, count, 0)
+                                : writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (*use_splice && (errno == EINVAL || errno == ENOSYS)) {
+                *use_splice = 0;
+                continue;
+            }
+            return HEARTYFS_ERR_IO;
+        }
+
+        // Drop fully written spans and trim a partially written one
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Copy a byte range of a compressed file to a host file descriptor
+ * @param[in] fs Mounted filesystem
+ * @param[in] inode Compressed file inode
+ * @param[in] out_fd Destination descriptor
+ * @param[in] offset Offset of the first byte to copy
+ * @param[in] end Offset just past the last byte to copy
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Chunks are decompressed into a buffer that is reused, so they go out
+ * with writev() rather than being spliced.
+ */
+int hfs_read_compressed_to_fd(const struct heartyfs *fs,
+                              const struct heartyfs_inode *inode, int out_fd,
+                              off_t offset, off_t end) {
+    char *buf = malloc(COMPRESS_CHUNK_SIZE);
+    if (!buf) {
+        return HEARTYFS_ERR_NO_MEMORY;
+    }
+
+    int use_splice = 0;
+    int ret = HEARTYFS_OK;
+    while (offset < end && ret == HEARTYFS_OK) {
+        size_t want = end - offset < COMPRESS_CHUNK_SIZE ? end - offset
+                                                         : COMPRESS_CHUNK_SIZE;
+        ssize_t n = hfs_zread(fs, inode, buf, want, offset);
+        if (n <= 0) {
+            ret = n < 0 ? n : HEARTYFS_ERR_CORRUPT;
+            break;
+        }
+
+        struct iovec iov = {buf, n};
+        ret = hfs_write_spans(out_fd, &iov, 1, &use_splice);
+        offset += n;
+    }
+    free(buf);
+    return ret;
+}
+
+/**
+ * @brief Copy a byte range out while the file is locked
+ */
+static int read_range(struct heartyfs *fs, const char *path, int out_fd,
+                      off_t offset, size_t length) {
+    struct heartyfs_inode *inode;
+    int ret = hfs_resolve_file(fs, path, 0, &inode);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+    long long file_size = hfs_file_length(fs, inode);
+    if (file_size < 0) {
+        return file_size;
+    }
+    if (offset >= file_size) {
+        return HEARTYFS_OK;
+    }
+    if (length > (size_t)(file_size - offset)) {
+        length = file_size - offset;
+    }
+    if (inode->flags & FILE_COMPRESSED) {
+        return hfs_read_compressed_to_fd(fs, inode, out_fd, offset,
+                                         offset + length);
+    }
+
+    struct stat st;
+    int use_splice = fstat(out_fd, &st) == 0 && S_ISFIFO(st.st_mode);
+    if (use_splice) {
+        fcntl(out_fd, F_SETPIPE_SZ, PIPE_BUFFER_SIZE);  // Best effort
+    }
+
+    off_t end = offset + length;
+    while (offset < end) {
+        struct iovec iov[IOV_BATCH];
+        size_t mapped;
+        int count = hfs_file_map(fs, inode, offset, end - offset, iov,
+                                 IOV_BATCH, &mapped);
+        if (count < 0) {
+            return count;
+        }
+        for (int i = 0; i < count && ret == HEARTYFS_OK; i++) {
+            ret = hfs_csum_check(fs, iov[i].iov_base, iov[i].iov_len);
+        }
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+
+        ret = hfs_write_spans(out_fd, iov, count, &use_splice);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+        offset += mapped;
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Copy a byte range of a heartyfs file to a host file descriptor
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path of the file inside heartyfs
+ * @param[in] out_fd Destination descriptor, e.g. STDOUT_FILENO
+ * @param[in] offset File offset of the first byte to copy
+ * @param[in] length Number of bytes to copy; clipped at end of file
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * The extent holding offset is found by binary search, so the cost
+ * depends on the length of the range rather than on where it starts.
+ * Data goes out straight from the disk mapping, one span per extent,
+ * without an intermediate buffer. writev() is used in general; when out_fd
+ * is a pipe the pages are spliced in with vmsplice() instead, so they are
+ * not copied at all. The pipe then references the mapping, so a reader
+ * may see later changes to the file if it is rewritten before the pipe
+ * is drained. A compressed file is decompressed a chunk at a time.
+ */
+int heartyfs_read_range_to_fd(struct heartyfs *fs, const char *path,
+                              int out_fd, off_t offset, size_t length) {
+    if (!fs || !path || offset < 0) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    int ret = hfs_op_begin(fs, 0);
+    if (ret == HEARTYFS_OK) {
+        ret = read_range(fs, path, out_fd, offset, length);
+    }
+    return hfs_op_end(fs, ret);
+}
+
+/**
+ * @brief Copy the contents of a heartyfs file to a host file descriptor
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path of the file inside heartyfs
+ * @param[in] out_fd Destination descriptor, e.g. STDOUT_FILENO
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int heartyfs_read_to_fd(struct heartyfs *fs, const char *path, int out_fd) {
+    return heartyfs_read_range_to_fd(fs, path, out_fd, 0, SIZE_MAX);
+}
+
+/**
+ * @brief Read a set of spans from a descriptor, handling short reads
+ * @param[in] fd Source descriptor
+ * @param[in,out] iov Spans to fill; advanced as data comes in
+ * @param[in] count Number of spans
+ * @param[in] offset Source offset of the first span
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_IO on failure or if the
+ *         source ends early
+ */
+int hfs_read_spans(int fd, struct iovec *iov, int count, off_t offset) {
+    while (count > 0) {
+        ssize_t n = preadv(fd, iov, count, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return HEARTYFS_ERR_IO;
+        }
+        offset += n;
+
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Fill a heartyfs file by reading a host descriptor into its blocks
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path of the file inside heartyfs
+ * @param[in] in_fd Source descriptor
+ * @param[in] len Number of bytes to read
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Fallback for sources that cannot be mapped: preadv() lands the data
+ * directly in the allocated runs, one span per extent.
+ */
+static int read_into_file(struct heartyfs *fs, const char *path, int in_fd,
+                          size_t len) {
+    if (!hfs_writable(fs)) {
+        return HEARTYFS_ERR_RDONLY;
+    }
+
+    struct heartyfs_inode *inode;
+    int ret = hfs_journal_begin_op(fs);
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_resolve_file(fs, path, 1, &inode);
+    }
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+    ret = hfs_file_reserve(fs, inode, len, fs->sb->alloc_cursor);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    off_t offset = 0;
+    while ((size_t)offset < len) {
+        struct iovec iov[IOV_BATCH];
+        size_t mapped;
+        int count = hfs_file_map(fs, inode, offset, len - offset, iov,
+                                 IOV_BATCH, &mapped);
+        ret = count > 0 ? hfs_read_spans(in_fd, iov, count, offset)
+                        : HEARTYFS_ERR_CORRUPT;
+        if (ret != HEARTYFS_OK) {
+            hfs_free_file_blocks(fs, inode);
+            return ret;
+        }
+        for (int i = 0; i < count; i++) {
+            hfs_file_dirty(fs, inode, iov[i].iov_base, iov[i].iov_len);
+        }
+        offset += mapped;
+    }
+    hfs_file_pack(fs, inode);
+    return hfs_end_op(fs);
+}
+
+/**
+ * @brief Read from a descriptor until a buffer is full or input ends
+ * @param[in] fd Source descriptor
+ * @param[out] buf Destination buffer
+ * @param[in] len Size of buf
+ * @return Number of bytes read (less than len only at end of input), or
+ *         HEARTYFS_ERR_IO on failure
+ */
+static ssize_t read_full(int fd, char *buf, size_t len) {
+    size_t filled = 0;
+    while (filled < len) {
+        ssize_t n = read(fd, buf + filled, len - filled);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return HEARTYFS_ERR_IO;
+        }
+        if (n == 0) {
+            break;
+        }
+        filled += n;
+    }
+    return filled;
+}
+
+/**
+ * @brief Fill a compressed file from a descriptor of unknown length
+ * @param[in] fs Mounted filesystem
+ * @param[out] inode File inode
+ * @param[in] in_fd Source descriptor
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Input is read a chunk at a time and compressed as it arrives. If the
+ * container turns out no smaller than the data, the file is expanded.
+ */
+static int stream_compressed(struct heartyfs *fs, struct heartyfs_inode *inode,
+                             int in_fd) {
+    char *buf = malloc(COMPRESS_CHUNK_SIZE);
+    if (!buf) {
+        return HEARTYFS_ERR_NO_MEMORY;
+    }
+    struct hfs_zstream z;
+    int ret = hfs_zstream_begin(fs, inode, &z);
+    if (ret != HEARTYFS_OK) {
+        free(buf);
+        return ret;
+    }
+
+    for (;;) {
+        ssize_t n = read_full(in_fd, buf, COMPRESS_CHUNK_SIZE);
+        if (n < 0) {
+            ret = n;
+            break;
+        }
+        if (n > 0) {
+            ret = hfs_zstream_add(fs, inode, &z, buf, n);
+        }
+        if (ret != HEARTYFS_OK || n < COMPRESS_CHUNK_SIZE) {
+            break;
+        }
+    }
+    free(buf);
+    long long len = z.file_size;
+    ret = hfs_zstream_end(fs, inode, &z, ret);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    if (((inode->file_size + fs->block_size - 1) >> fs->block_shift) >=
+        ((len + fs->block_size - 1) >> fs->block_shift)) {
+        ret = hfs_zexpand(fs, inode);
+        if (ret != HEARTYFS_OK) {
+            hfs_free_file_blocks(fs, inode);
+            return ret;
+        }
+        hfs_file_pack(fs, inode);
+    }
+    return hfs_end_op(fs);
+}
+
+/**
+ * @brief Fill a heartyfs file from a descriptor of unknown length
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path of the file inside heartyfs
+ * @param[in] in_fd Source descriptor, e.g. a pipe
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Runs are allocated as data arrives, starting at STREAM_RUN_MIN bytes
+ * and doubling up to STREAM_RUN_MAX, and input is read straight into
+ * them. A run joins the file only once it is full or input ends; at end
+ * of input the unused tail of the last run goes back to the allocator
+ * and the file size is set. On failure the file is left empty. On a
+ * mount with HEARTYFS_COMPRESS the input is compressed instead.
+ */
+static int stream_into_file(struct heartyfs *fs, const char *path,
+                            int in_fd) {
+    if (!hfs_writable(fs)) {
+        return HEARTYFS_ERR_RDONLY;
+    }
+
+    struct heartyfs_inode *inode;
+    int ret = hfs_journal_begin_op(fs);
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_resolve_file(fs, path, 1, &inode);
+    }
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+    if (fs->flags & HEARTYFS_COMPRESS) {
+        return stream_compressed(fs, inode, in_fd);
+    }
+    hfs_free_file_blocks(fs, inode);
+
+    long long total = 0;
+    size_t run_bytes = STREAM_RUN_MIN;
+    for (;;) {
+        int want = run_bytes >> fs->block_shift;
+        int length;
+        int start = hfs_alloc_run(fs, want > 0 ? want : 1, &length);
+        if (start < 0) {
+            ret = start;
+            break;
+        }
+
+        size_t capacity = (size_t)length << fs->block_shift;
+        ssize_t n = read_full(in_fd, hfs_data(fs, start), capacity);
+        if (n < 0) {
+            hfs_free_run(fs, start, length);
+            ret = n;
+            break;
+        }
+        hfs_dirty_data(fs, hfs_data(fs, start), n);
+
+        // Hand back the blocks the input did not reach
+        int used = (n + fs->block_size - 1) >> fs->block_shift;
+        if (used < length) {
+            hfs_free_run(fs, start + used, length - used);
+            int cursor = start + length;
+            __atomic_compare_exchange_n(&fs->sb->alloc_cursor, &cursor,
+                                        start + used, 0, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED);
+        }
+        if (used > 0) {
+            ret = hfs_extent_append(fs, inode, start, used);
+            if (ret != HEARTYFS_OK) {
+                hfs_free_run(fs, start, used);
+                break;
+            }
+        }
+        total += n;
+
+        if ((size_t)n < capacity) {
+            hfs_dirty(fs, inode);
+            inode->file_size = total;  // End of input
+            hfs_file_pack(fs, inode);
+            return hfs_end_op(fs);
+        }
+        if (run_bytes < STREAM_RUN_MAX) {
+            run_bytes *= 2;
+        }
+    }
+
+    hfs_free_file_blocks(fs, inode);
+    return ret;
+}
+
+/**
+ * @brief Pick the fastest way to copy in_fd into the file
+ */
+static int write_from_fd(struct heartyfs *fs, const char *path, int in_fd) {
+    struct stat st;
+    if (fstat(in_fd, &st) != 0) {
+        return HEARTYFS_ERR_IO;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        return stream_into_file(fs, path, in_fd);
+    }
+    if (st.st_size > (off_t)fs->num_blocks << fs->block_shift) {
+        return HEARTYFS_ERR_TOO_LARGE;
+    }
+    if (st.st_size == 0) {
+        return heartyfs_write_file(fs, path, NULL, 0);  // Nothing to map
+    }
+
+    void *src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+    if (src == MAP_FAILED) {
+        return read_into_file(fs, path, in_fd, st.st_size);
+    }
+    madvise(src, st.st_size, MADV_SEQUENTIAL);
+
+    int ret = heartyfs_write_file(fs, path, src, st.st_size);
+    munmap(src, st.st_size);
+    return ret;
+}
+
+/**
+ * @brief Replace a heartyfs file with the contents of a host file descriptor
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path of the file inside heartyfs
+ * @param[in] in_fd Source descriptor: a regular file, pipe, socket or tty
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * A regular file is mapped and copied straight into the allocated runs,
+ * so it is never staged in an intermediate buffer; if it cannot be mapped
+ * it is read into the runs with preadv() instead. It must not be
+ * truncated while the copy is in progress. Any other descriptor is read
+ * until end of input with stream_into_file().
+ */
+int heartyfs_write_from_fd(struct heartyfs *fs, const char *path, int in_fd) {
+    if (!fs || !path) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    int ret = hfs_op_begin(fs, 0);
+    if (ret == HEARTYFS_OK) {
+        ret = write_from_fd(fs, path, in_fd);
+    }
+    return hfs_op_end(fs, ret);
+}
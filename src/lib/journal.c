@@ -0,0 +1,837 @@
+#include "heartyfs_internal.h"
+#include <errno.h>
+
+/*
+ * Metadata journal: a redo log with group commit, in the spirit of ext4's
+ * jbd2. On a journaled image the superblock, bitmap, directories, inodes
+ * and extent blocks are reached through a private mapping, so changes to
+ * them stay in memory until a commit. Every operation marks the blocks
+ * it changes with hfs_dirty(); a commit then
+ *
+ *   1. writes the images of all dirty blocks to the journal, followed by a
+ *      commit block carrying a CRC32C of the whole transaction,
+ *   2. flushes the image once with fdatasync(), which also covers file data
+ *      written through the shared mapping, and
+ *   3. writes the same images to their home locations, unflushed.
+ *
+ * Any number of operations share one commit: the tools commit when they
+ * unmount, batch mode when a quarter of the journal is dirty, and the
+ * daemon once per round of requests. A crash loses at most the operations
+ * since the last commit and never leaves half of one on disk. On mount,
+ * every transaction whose commit block checks out is copied home again.
+ *
+ * The journal is a ring. Home writes are only flushed when it wraps: the
+ * log restarts after the header once an fdatasync() has made every older
+ * transaction redundant. Blocks freed by an operation stay allocated
+ * until its commit, so file data written to a reused block never lands
+ * on top of something a crash could bring back. A freed block that still
+ * has an image in the live log is revoked, so replay does not copy that
+ * image over whatever the block holds later.
+ */
+#define MIN_JOURNAL_BLOCKS 8
+#define COMMIT_FRACTION 4      // Commit once this share of the log is dirty
+#define MIN_SET_CAPACITY 64
+#define SET_HASH_MULT 0x9E3779B1u
+
+/**
+ * @brief Set of block ids with insertion-ordered iteration
+ */
+struct block_set {
+    int *slots;             // Open addressing; holds id + 1, 0 if empty
+    int *ids;               // Members in insertion order
+    int capacity;           // Slots, a power of two
+    int count;              // Members
+};
+
+struct free_run {
+    int start;              // First block of the run
+    int length;             // Blocks in the run
+};
+
+struct hfs_journal {
+    int start;              // Header block of the journal
+    int blocks;             // Blocks in the journal, header included
+    unsigned seq;           // Sequence number of the next transaction
+    int pos;                // Next free log block, counted after the header
+    int error;              // Sticky HEARTYFS_ERR_* code, or HEARTYFS_OK
+    struct block_set dirty;     // Blocks changed since the last commit
+    struct block_set logged;    // Blocks with an image in the live log
+    struct free_run *frees;     // Runs freed since the last commit
+    int num_frees;
+    int cap_frees;
+    long long free_blocks;      // Blocks held in frees
+    int *revoked;               // Blocks to revoke in the next commit
+    int num_revoked;
+    int cap_revoked;
+};
+
+/**
+ * @brief Locate the slot for a block id
+ * @param[in] set Set to probe; must have a table
+ * @param[in] block Block id
+ * @return Slot holding the id, or the empty slot where it would go
+ */
+static int *set_slot(const struct block_set *set, int block) {
+    uint32_t mask = set->capacity - 1;
+    uint32_t i = ((uint32_t)block * SET_HASH_MULT) & mask;
+
+    while (set->slots[i] != 0 && set->slots[i] != block + 1) {
+        i = (i + 1) & mask;
+    }
+    return &set->slots[i];
+}
+
+/**
+ * @brief Check whether a block id is in a set
+ */
+static int set_contains(const struct block_set *set, int block) {
+    return set->count > 0 && *set_slot(set, block) != 0;
+}
+
+/**
+ * @brief Add a block id to a set
+ * @param[in,out] set Set to extend
+ * @param[in] block Block id
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_NO_MEMORY on failure
+ */
+static int set_add(struct block_set *set, int block) {
+    if (set->capacity > 0 && *set_slot(set, block) != 0) {
+        return HEARTYFS_OK;
+    }
+
+    // Keep the table at most half full; ids grows along with it
+    if (2 * (set->count + 1) > set->capacity) {
+        int capacity = set->capacity ? 2 * set->capacity : MIN_SET_CAPACITY;
+        int *slots = calloc(capacity, sizeof(int));
+        int *ids = realloc(set->ids, capacity / 2 * sizeof(int));
+        if (!slots || !ids) {
+            free(slots);
+            if (ids) {
+                set->ids = ids;
+            }
+            return HEARTYFS_ERR_NO_MEMORY;
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->ids = ids;
+        set->capacity = capacity;
+        for (int i = 0; i < set->count; i++) {
+            *set_slot(set, ids[i]) = ids[i] + 1;
+        }
+    }
+
+    *set_slot(set, block) = block + 1;
+    set->ids[set->count++] = block;
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Empty a set, keeping its memory
+ */
+static void set_clear(struct block_set *set) {
+    if (set->count > 0) {
+        memset(set->slots, 0, set->capacity * sizeof(int));
+        set->count = 0;
+    }
+}
+
+/**
+ * @brief Rebuild the table of a set whose ids were cut down in place
+ * @param[in,out] set Set whose first count ids are the members to keep
+ * @param[in] count Number of members left
+ */
+static void set_truncate(struct block_set *set, int count) {
+    if (count == set->count) {
+        return;
+    }
+    memset(set->slots, 0, set->capacity * sizeof(int));
+    set->count = count;
+    for (int i = 0; i < count; i++) {
+        *set_slot(set, set->ids[i]) = set->ids[i] + 1;
+    }
+}
+
+static void set_destroy(struct block_set *set) {
+    free(set->slots);
+    free(set->ids);
+}
+
+/**
+ * @brief Append an entry to a growable int array
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_NO_MEMORY on failure
+ */
+static int array_push(int **array, int *count, int *capacity, int value) {
+    if (*count == *capacity) {
+        int grown_cap = *capacity ? 2 * *capacity : MIN_SET_CAPACITY;
+        int *grown = realloc(*array, grown_cap * sizeof(int));
+        if (!grown) {
+            return HEARTYFS_ERR_NO_MEMORY;
+        }
+        *array = grown;
+        *capacity = grown_cap;
+    }
+    (*array)[(*count)++] = value;
+    return HEARTYFS_OK;
+}
+
+static int compare_ints(const void *a, const void *b) {
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+static int compare_runs(const void *a, const void *b) {
+    return compare_ints(&((const struct free_run *)a)->start,
+                        &((const struct free_run *)b)->start);
+}
+
+/**
+ * @brief Check whether a block lies in one of a sorted array of runs
+ */
+static int in_runs(const struct free_run *runs, int count, int block) {
+    int lo = 0;
+    int hi = count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (runs[mid].start + runs[mid].length <= block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < count && runs[lo].start <= block;
+}
+
+/**
+ * @brief Write a buffer to the disk file, handling short writes
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_IO on failure
+ */
+static int pwrite_full(int fd, const void *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return HEARTYFS_ERR_IO;
+        }
+        buf = (const char *)buf + n;
+        len -= n;
+        offset += n;
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Write the current images of sorted blocks to consecutive places
+ * @param[in] fs Mounted filesystem
+ * @param[in] ids Sorted block ids
+ * @param[in] count Number of ids
+ * @param[in] dest First destination block, or -1 to write each block home
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_IO on failure
+ *
+ * Runs of consecutive ids are contiguous in the mapping and go out in one
+ * pwrite() each.
+ */
+static int write_images(struct heartyfs *fs, const int *ids, int count,
+                        int dest) {
+    int i = 0;
+    while (i < count) {
+        int run = 1;
+        while (i + run < count && ids[i + run] == ids[i] + run) {
+            run++;
+        }
+
+        int target = dest < 0 ? ids[i] : dest + i;
+        int ret = pwrite_full(fs->fd, hfs_block(fs, ids[i]),
+                              (size_t)run << fs->block_shift,
+                              (off_t)target << fs->block_shift);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+        i += run;
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Number of descriptor blocks needed for a transaction
+ */
+static int desc_blocks(const struct heartyfs *fs, int entries) {
+    size_t bytes = sizeof(struct heartyfs_journal_desc) +
+                   (size_t)entries * sizeof(int);
+    return (bytes + fs->block_size - 1) >> fs->block_shift;
+}
+
+/**
+ * @brief Make every transaction in the log redundant and restart it
+ * @param[in] fs Mounted filesystem
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_IO on failure
+ *
+ * Home writes of earlier commits are flushed first. The new header needs
+ * no flush of its own: it reaches the disk with the next transaction, and
+ * until then either header leads replay to nothing that is not home yet.
+ */
+static int checkpoint(struct heartyfs *fs) {
+    struct hfs_journal *j = fs->journal;
+    if (fdatasync(fs->fd) != 0) {
+        return HEARTYFS_ERR_IO;
+    }
+
+    char *header = calloc(1, fs->block_size);
+    if (!header) {
+        return HEARTYFS_ERR_NO_MEMORY;
+    }
+    struct heartyfs_journal_header *h = (void *)header;
+    h->magic = HEARTYFS_JOURNAL_MAGIC;
+    h->start_seq = j->seq;
+    int ret = pwrite_full(fs->fd, header, fs->block_size,
+                          (off_t)j->start << fs->block_shift);
+    free(header);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    j->pos = 0;
+    set_clear(&j->logged);
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Log one transaction, flush it, and write its blocks home
+ * @param[in] fs Mounted filesystem
+ * @param[in] ids Sorted ids of the blocks to log
+ * @param[in] count Number of ids
+ * @param[in] revoked Ids of blocks to revoke
+ * @param[in] num_revoked Number of revoked ids
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+static int write_transaction(struct heartyfs *fs, const int *ids, int count,
+                             const int *revoked, int num_revoked) {
+    struct hfs_journal *j = fs->journal;
+    int ndesc = desc_blocks(fs, count + num_revoked);
+    int need = ndesc + count + 1;
+    if (j->pos + need > j->blocks - 1) {
+        int ret = checkpoint(fs);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+    }
+
+    size_t desc_size = (size_t)ndesc << fs->block_shift;
+    char *desc = calloc(1, desc_size + fs->block_size);
+    if (!desc) {
+        return HEARTYFS_ERR_NO_MEMORY;
+    }
+    struct heartyfs_journal_desc *d = (void *)desc;
+    d->magic = HEARTYFS_JDESC_MAGIC;
+    d->seq = j->seq;
+    d->count = count;
+    d->revoked = num_revoked;
+    memcpy(d->blocks, ids, count * sizeof(int));
+    memcpy(d->blocks + count, revoked, num_revoked * sizeof(int));
+
+    uint32_t crc = hfs_crc32c(0, desc, desc_size);
+    for (int i = 0; i < count; i++) {
+        crc = hfs_crc32c(crc, hfs_block(fs, ids[i]), fs->block_size);
+    }
+    struct heartyfs_journal_commit *c = (void *)(desc + desc_size);
+    c->magic = HEARTYFS_JCOMMIT_MAGIC;
+    c->seq = j->seq;
+    c->checksum = crc;
+
+    int first = j->start + 1 + j->pos;
+    int ret = pwrite_full(fs->fd, desc, desc_size,
+                          (off_t)first << fs->block_shift);
+    if (ret == HEARTYFS_OK) {
+        ret = write_images(fs, ids, count, first + ndesc);
+    }
+    if (ret == HEARTYFS_OK) {
+        ret = pwrite_full(fs->fd, c, fs->block_size,
+                          (off_t)(first + ndesc + count) << fs->block_shift);
+    }
+    free(desc);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    // The transaction is durable once this returns; home can follow lazily
+    if (fdatasync(fs->fd) != 0) {
+        return HEARTYFS_ERR_IO;
+    }
+    j->seq++;
+    j->pos += need;
+
+    for (int i = 0; i < count; i++) {
+        if (set_add(&j->logged, ids[i]) != HEARTYFS_OK) {
+            return HEARTYFS_ERR_NO_MEMORY;
+        }
+    }
+    return write_images(fs, ids, count, -1);
+}
+
+/**
+ * @brief Record that an operation has changed a metadata block
+ * @param[in] fs Mounted filesystem with a journal
+ * @param[in] block Block id
+ */
+void hfs_journal_dirty(struct heartyfs *fs, int block) {
+    struct hfs_journal *j = fs->journal;
+    if (set_add(&j->dirty, block) != HEARTYFS_OK) {
+        j->error = HEARTYFS_ERR_NO_MEMORY;  // The change would be lost
+    }
+}
+
+/**
+ * @brief Free a run of blocks once the running transaction commits
+ * @param[in] fs Mounted filesystem with a journal
+ * @param[in] start First block of the run
+ * @param[in] length Number of blocks in the run
+ */
+void hfs_journal_free(struct heartyfs *fs, int start, int length) {
+    struct hfs_journal *j = fs->journal;
+
+    if (j->num_frees > 0) {
+        struct free_run *last = &j->frees[j->num_frees - 1];
+        if (last->start + last->length == start) {
+            last->length += length;
+            j->free_blocks += length;
+            return;
+        }
+    }
+    if (j->num_frees == j->cap_frees) {
+        int cap = j->cap_frees ? 2 * j->cap_frees : MIN_SET_CAPACITY;
+        struct free_run *grown = realloc(j->frees, cap * sizeof(*grown));
+        if (!grown) {
+            hfs_release_run(fs, start, length);  // Unprotected, but not lost
+            return;
+        }
+        j->frees = grown;
+        j->cap_frees = cap;
+    }
+    j->frees[j->num_frees++] = (struct free_run){start, length};
+    j->free_blocks += length;
+}
+
+/**
+ * @brief Check whether the log holds, or is about to hold, a block's image
+ */
+static int has_image(const struct hfs_journal *j, int block) {
+    return set_contains(&j->logged, block) || set_contains(&j->dirty, block);
+}
+
+/**
+ * @brief Revoke the logged blocks inside a freed run
+ * @param[in,out] j Journal
+ * @param[in] run Freed run
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_NO_MEMORY on failure
+ *
+ * Blocks changed by the transaction that frees them are revoked too,
+ * since the commit logs their images. Walks whichever is shorter, the run
+ * or the sets of logged and dirty blocks.
+ */
+static int revoke_run(struct hfs_journal *j, const struct free_run *run) {
+    int images = j->logged.count + j->dirty.count;
+    if (images == 0) {
+        return HEARTYFS_OK;
+    }
+
+    if (run->length <= images) {
+        for (int b = run->start; b < run->start + run->length; b++) {
+            if (has_image(j, b) &&
+                array_push(&j->revoked, &j->num_revoked, &j->cap_revoked,
+                           b) != HEARTYFS_OK) {
+                return HEARTYFS_ERR_NO_MEMORY;
+            }
+        }
+        return HEARTYFS_OK;
+    }
+
+    for (int i = 0; i < j->logged.count; i++) {
+        int b = j->logged.ids[i];
+        if (b >= run->start && b < run->start + run->length &&
+            array_push(&j->revoked, &j->num_revoked, &j->cap_revoked, b) !=
+                HEARTYFS_OK) {
+            return HEARTYFS_ERR_NO_MEMORY;
+        }
+    }
+    for (int i = 0; i < j->dirty.count; i++) {
+        int b = j->dirty.ids[i];
+        if (b >= run->start && b < run->start + run->length &&
+            !set_contains(&j->logged, b) &&
+            array_push(&j->revoked, &j->num_revoked, &j->cap_revoked, b) !=
+                HEARTYFS_OK) {
+            return HEARTYFS_ERR_NO_MEMORY;
+        }
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Drop the changes to freed blocks from the running transaction
+ * @param[in] fs Mounted filesystem with a journal
+ *
+ * A freed block may be handed out again as file data, which is written
+ * through the shared mapping. Left in the dirty set, the commit would log
+ * the block's stale metadata image and write it home over that data. The
+ * private copy is refreshed from the disk too, so that a block reused as
+ * metadata starts from what it holds rather than from the dropped image.
+ */
+static void forget_freed(struct heartyfs *fs) {
+    struct hfs_journal *j = fs->journal;
+    if (j->dirty.count == 0 || j->num_frees == 0) {
+        return;
+    }
+
+    qsort(j->frees, j->num_frees, sizeof(*j->frees), compare_runs);
+    int kept = 0;
+    for (int i = 0; i < j->dirty.count; i++) {
+        int b = j->dirty.ids[i];
+        if (in_runs(j->frees, j->num_frees, b)) {
+            memcpy(hfs_block(fs, b), hfs_data(fs, b), fs->block_size);
+        } else {
+            j->dirty.ids[kept++] = b;
+        }
+    }
+    set_truncate(&j->dirty, kept);
+}
+
+/**
+ * @brief Hand the runs freed since the last commit back to the allocator
+ * @param[in] fs Mounted filesystem
+ * @return Number of blocks released
+ *
+ * Called by the commit, and by the allocator when the disk is otherwise
+ * full. In the second case the protection described at the top of this
+ * file is given up for those runs rather than failing the operation.
+ * Either way the freed blocks are neither logged nor written home.
+ */
+long long hfs_journal_release_frees(struct heartyfs *fs) {
+    struct hfs_journal *j = fs->journal;
+    if (!j) {
+        return 0;
+    }
+
+    long long released = j->free_blocks;
+    for (int i = 0; i < j->num_frees; i++) {
+        if (revoke_run(j, &j->frees[i]) != HEARTYFS_OK) {
+            j->error = HEARTYFS_ERR_NO_MEMORY;
+        }
+    }
+    forget_freed(fs);
+    for (int i = 0; i < j->num_frees; i++) {
+        hfs_release_run(fs, j->frees[i].start, j->frees[i].length);
+    }
+    j->num_frees = 0;
+    j->free_blocks = 0;
+    return released;
+}
+
+/**
+ * @brief Blocks freed by the running transaction but not yet reusable
+ */
+long long hfs_journal_pending_frees(const struct heartyfs *fs) {
+    return fs->journal ? fs->journal->free_blocks : 0;
+}
+
+/**
+ * @brief Size of the journal, or 0 if the image has none
+ */
+int hfs_journal_blocks(const struct heartyfs *fs) {
+    return fs->journal ? fs->journal->blocks : 0;
+}
+
+/**
+ * @brief Commit every change made since the last commit
+ * @param[in] fs Mounted filesystem
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Must be called between operations. If the changes do not fit in the
+ * journal they are split over several transactions, which are then only
+ * atomic one by one.
+ */
+int hfs_journal_commit(struct heartyfs *fs) {
+    struct hfs_journal *j = fs->journal;
+    if (!j || !hfs_writable(fs)) {
+        return HEARTYFS_OK;
+    }
+
+    hfs_csum_update(fs);  // Operations that failed skipped it
+    hfs_journal_release_frees(fs);
+    if (j->error != HEARTYFS_OK) {
+        return j->error;
+    }
+    if (j->dirty.count == 0 && j->num_revoked == 0) {
+        return HEARTYFS_OK;
+    }
+
+    int *ids = j->dirty.ids;
+    int remaining = j->dirty.count;
+    qsort(ids, remaining, sizeof(int), compare_ints);
+
+    int space = j->blocks - 1;
+    int revoked = j->num_revoked;
+    int ret = HEARTYFS_OK;
+    do {
+        int count = remaining;
+        while (count > 0 && desc_blocks(fs, count + revoked) + count + 1 > space) {
+            count = space - 1 - desc_blocks(fs, count + revoked);
+        }
+        if (count < 0) {
+            count = 0;
+        }
+
+        ret = write_transaction(fs, ids, count, j->revoked, revoked);
+        if (ret != HEARTYFS_OK) {
+            j->error = ret;
+            break;
+        }
+        ids += count;
+        remaining -= count;
+        revoked = 0;
+    } while (remaining > 0);
+
+    set_clear(&j->dirty);
+    j->num_revoked = 0;
+    return ret;
+}
+
+/**
+ * @brief Commit early when the running transaction has grown large
+ * @param[in] fs Mounted filesystem
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Called at the start of every operation that changes the image, which is
+ * the last point where the previous operations are known to be complete.
+ */
+int hfs_journal_begin_op(struct heartyfs *fs) {
+    struct hfs_journal *j = fs->journal;
+    if (!j || j->dirty.count < (j->blocks - 1) / COMMIT_FRACTION) {
+        return HEARTYFS_OK;
+    }
+    return hfs_journal_commit(fs);
+}
+
+/**
+ * @brief Check one logged transaction
+ * @param[in] fs Mounted filesystem
+ * @param[in] j Journal
+ * @param[in] pos Log block the transaction would start at
+ * @param[in] seq Sequence number it must carry
+ * @param[out] need Receives the number of log blocks it spans
+ * @return Its descriptor, or NULL if there is no intact transaction there
+ */
+static const struct heartyfs_journal_desc *check_transaction(
+    const struct heartyfs *fs, const struct hfs_journal *j, int pos,
+    unsigned seq, int *need) {
+    int space = j->blocks - 1 - pos;
+    if (space < 3) {
+        return NULL;
+    }
+
+    int first = j->start + 1 + pos;
+    const struct heartyfs_journal_desc *d = hfs_data(fs, first);
+    int max_entries = space << (fs->block_shift - 2);
+    if (d->magic != HEARTYFS_JDESC_MAGIC || d->seq != seq || d->count < 0 ||
+        d->revoked < 0 || d->count > max_entries ||
+        d->revoked > max_entries - d->count) {
+        return NULL;
+    }
+
+    int ndesc = desc_blocks(fs, d->count + d->revoked);
+    if (ndesc + d->count + 1 > space) {
+        return NULL;
+    }
+    for (int i = 0; i < d->count + d->revoked; i++) {
+        // Never let replay touch the journal itself
+        int b = d->blocks[i];
+        if (b < 0 || b >= fs->num_blocks ||
+            (b >= j->start && b < j->start + j->blocks)) {
+            return NULL;
+        }
+    }
+
+    const struct heartyfs_journal_commit *c =
+        hfs_data(fs, first + ndesc + d->count);
+    if (c->magic != HEARTYFS_JCOMMIT_MAGIC || c->seq != seq) {
+        return NULL;
+    }
+    uint32_t crc = hfs_crc32c(0, d, (size_t)ndesc << fs->block_shift);
+    crc = hfs_crc32c(crc, hfs_data(fs, first + ndesc),
+                     (size_t)d->count << fs->block_shift);
+    if (crc != c->checksum) {
+        return NULL;
+    }
+
+    *need = ndesc + d->count + 1;
+    return d;
+}
+
+/**
+ * @brief Find the newest transaction that revokes a block
+ * @param[in] revokes Sorted (block, seq) pairs
+ * @param[in] count Number of pairs
+ * @param[in] block Block id
+ * @return Offset of that transaction from start_seq plus one, or 0
+ */
+static unsigned newest_revoke(const int (*revokes)[2], int count, int block) {
+    int lo = 0;
+    int hi = count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (revokes[mid][0] < block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    unsigned newest = 0;
+    for (; lo < count && revokes[lo][0] == block; lo++) {
+        if ((unsigned)revokes[lo][1] > newest) {
+            newest = revokes[lo][1];
+        }
+    }
+    return newest;
+}
+
+/**
+ * @brief Copy every intact transaction in the log to its home blocks
+ * @param[in] fs Mounted filesystem; writes go to the data mapping
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * A first pass finds the intact transactions and collects their revoke
+ * records; the second copies images, oldest first, skipping any image
+ * revoked by the same or a later transaction. Blocks already equal to
+ * their image are left alone, so replaying a clean log writes nothing.
+ */
+static int replay(struct heartyfs *fs) {
+    struct hfs_journal *j = fs->journal;
+    const struct heartyfs_journal_header *h = hfs_data(fs, j->start);
+    unsigned first_seq = h->start_seq;
+
+    int pos = 0;
+    int num_tx = 0;
+    int num_revokes = 0;
+    int need;
+    const struct heartyfs_journal_desc *d;
+    while ((d = check_transaction(fs, j, pos, first_seq + num_tx, &need))) {
+        num_revokes += d->revoked;
+        pos += need;
+        num_tx++;
+    }
+
+    int (*revokes)[2] = malloc((num_revokes + 1) * sizeof(*revokes));
+    if (!revokes) {
+        return HEARTYFS_ERR_NO_MEMORY;
+    }
+    num_revokes = 0;
+    pos = 0;
+    for (int t = 0; t < num_tx; t++) {
+        d = check_transaction(fs, j, pos, first_seq + t, &need);
+        for (int i = 0; i < d->revoked; i++) {
+            revokes[num_revokes][0] = d->blocks[d->count + i];
+            revokes[num_revokes][1] = t + 1;
+            num_revokes++;
+        }
+        pos += need;
+    }
+    qsort(revokes, num_revokes, sizeof(*revokes), compare_ints);  // By block
+
+    int ret = HEARTYFS_OK;
+    int writable_view = hfs_writable(fs);
+    pos = 0;
+    for (int t = 0; t < num_tx && ret == HEARTYFS_OK; t++) {
+        d = check_transaction(fs, j, pos, first_seq + t, &need);
+        const char *image = hfs_data(fs, j->start + 1 + pos +
+                                             desc_blocks(fs, d->count +
+                                                             d->revoked));
+        for (int i = 0; i < d->count; i++, image += fs->block_size) {
+            int b = d->blocks[i];
+            if (newest_revoke((const int (*)[2])revokes, num_revokes, b) >
+                    (unsigned)t ||
+                memcmp(hfs_data(fs, b), image, fs->block_size) == 0) {
+                continue;
+            }
+            // A read-only mount replays into its private copy of the image
+            if (!writable_view &&
+                mprotect(fs->data, fs->disk_size, PROT_READ | PROT_WRITE) == 0) {
+                writable_view = 1;
+            }
+            if (!writable_view) {
+                ret = HEARTYFS_ERR_IO;
+                break;
+            }
+            memcpy(hfs_data(fs, b), image, fs->block_size);
+        }
+        for (int i = 0; i < d->count && ret == HEARTYFS_OK; i++) {
+            ret = set_add(&j->logged, d->blocks[i]);
+        }
+        pos += need;
+    }
+    free(revokes);
+
+    j->seq = first_seq + num_tx;
+    j->pos = pos;
+    return ret;
+}
+
+/**
+ * @brief Set up the journal of a mounted image and replay it
+ * @param[in,out] fs Filesystem with its data mapping and geometry loaded
+ * @param[in] start First block of the journal
+ * @param[in] blocks Blocks in the journal
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * A writable mount first waits until no other one holds the image.
+ */
+int hfs_journal_open(struct heartyfs *fs, int start, int blocks) {
+    if (blocks < MIN_JOURNAL_BLOCKS) {
+        return HEARTYFS_ERR_NOT_INIT;
+    }
+    const struct heartyfs_journal_header *h = hfs_data(fs, start);
+    if (h->magic != HEARTYFS_JOURNAL_MAGIC) {
+        return HEARTYFS_ERR_NOT_INIT;
+    }
+
+    struct hfs_journal *j = calloc(1, sizeof(struct hfs_journal));
+    if (!j) {
+        return HEARTYFS_ERR_NO_MEMORY;
+    }
+    j->start = start;
+    j->blocks = blocks;
+    fs->journal = j;
+
+    // Changes stay in a private mapping until they commit, so writers
+    // of a journaled image take turns for as long as they are mounted
+    int ret = HEARTYFS_OK;
+    if (hfs_writable(fs)) {
+        ret = hfs_lock_image_file(fs);
+    }
+    if (ret == HEARTYFS_OK) {
+        ret = replay(fs);
+    }
+    if (ret != HEARTYFS_OK) {
+        hfs_journal_close(fs);
+    }
+    return ret;
+}
+
+/**
+ * @brief Release the journal state of a mount handle
+ * @param[in,out] fs Filesystem being unmounted
+ *
+ * Uncommitted changes are dropped; unmount commits first.
+ */
+void hfs_journal_close(struct heartyfs *fs) {
+    struct hfs_journal *j = fs->journal;
+    if (!j) {
+        return;
+    }
+    set_destroy(&j->dirty);
+    set_destroy(&j->logged);
+    free(j->frees);
+    free(j->revoked);
+    free(j);
+    fs->journal = NULL;
+}
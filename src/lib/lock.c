@@ -0,0 +1,737 @@
+#include "heartyfs_internal.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+/*
+ * Locking between processes that share an image.
+ *
+ * Every process that mounts an image maps the same lock table, a POSIX
+ * shared memory object named after the device and inode of the image.
+ * Each mount holds a shared flock() on it, so a mount that can take an
+ * exclusive one is alone: it sets the table up afresh, and the last to
+ * unmount removes it. The table holds robust, process-shared mutexes in
+ * four classes, always taken in this order:
+ *
+ *   1. the image lock, held for a whole operation by the few that need
+ *      the image to themselves: import batches, export, fsck, and every
+ *      operation on images with snapshots or checksums, whose share
+ *      counts and checksum table are global state;
+ *   2. directory locks, striped by block id, held while a directory is
+ *      changed; rmdir holds the parent's and the victim's, lower stripe
+ *      first;
+ *   3. inode locks, striped the same way, held while a file is read or
+ *      written and by rm;
+ *   4. the tail lock, held while a tail block's slot map changes.
+ *
+ * An operation takes at most one inode lock unless it holds the image
+ * lock, and the locks it takes are kept until it ends. Blocks are
+ * allocated without any lock: free bits are claimed with compare and
+ * swap, and a run whose bits were taken meanwhile is searched for again.
+ *
+ * Paths are walked without locks. Each directory stripe carries a
+ * sequence count that is odd while a directory is being changed, so a
+ * lookup that raced with a change is simply done again. Every change also
+ * bumps a generation shared by the whole image. A mount that sees the
+ * generation move without its doing drops its dentry cache, and an
+ * operation that locked a block it reached through a walk checks that no
+ * directory changed meanwhile, or else walks the path again and keeps the
+ * lock only if it still leads to the same block. Once a directory or
+ * inode is locked it cannot be removed, since rm and rmdir lock what they
+ * remove.
+ *
+ * A process that dies holding a lock leaves the next owner to find
+ * EOWNERDEAD; the lock is made consistent again and the generation is
+ * bumped, and whatever it guarded may need heartyfs_fsck.
+ *
+ * Journaled images are not covered: their metadata lives in a private
+ * mapping until it commits, so a writable mount takes an exclusive
+ * flock() on the image for as long as it lasts. The same flock() stands
+ * in for the table if it cannot be created.
+ */
+#define LOCK_TABLE_MAGIC 0x4B434F4C          // "LOCK"
+#define LOCK_TABLE_VERSION 1
+#define LOCK_STRIPE_BITS 10
+#define LOCK_STRIPES (1 << LOCK_STRIPE_BITS) // Stripes per class
+#define LOCK_IMAGE 0                         // Whole-image lock
+#define LOCK_DIRS 1                          // First directory stripe
+#define LOCK_INODES (LOCK_DIRS + LOCK_STRIPES)  // First inode stripe
+#define LOCK_TAIL (LOCK_INODES + LOCK_STRIPES)  // Tail block lock
+#define LOCK_COUNT (LOCK_TAIL + 1)
+#define LOCK_HASH_MULT 0x9E3779B1u           // Spreads block ids over stripes
+#define MIN_HELD 16
+#define MAX_ATTACH_TRIES 16  // Tables removed under us before giving up
+#define SHM_NAME_LENGTH 64
+
+/**
+ * @brief Lock table shared by every process that mounts an image
+ */
+struct lock_table {
+    int magic;                          // LOCK_TABLE_MAGIC once set up
+    int version;                        // LOCK_TABLE_VERSION
+    int count;                          // LOCK_COUNT
+    unsigned gen;                       // Bumped by every directory change
+    unsigned seqs[LOCK_STRIPES];        // Odd while a directory changes
+    pthread_mutex_t locks[LOCK_COUNT];
+};
+
+/**
+ * @brief Locks held by one mount
+ */
+struct hfs_locks {
+    struct lock_table *table;
+    int fd;                 // Shared memory object, flock()ed shared
+    char name[SHM_NAME_LENGTH];  // Its name, to remove it
+    int global;             // Every operation takes the image lock
+    int depth;              // Operations begun and not yet ended
+    int image;              // 1 while the image lock is held
+    int all;                // 1 while every directory is being changed
+    unsigned gen;           // Last generation this mount has seen
+    int held[LOCK_COUNT];   // Times each lock was taken in this operation
+    int *order;             // Locks in the order taken; may repeat
+    int num_order;
+    int cap_order;
+};
+
+/**
+ * @brief Stripe of a block id
+ */
+static int stripe(int block) {
+    return ((uint32_t)block * LOCK_HASH_MULT) >> (32 - LOCK_STRIPE_BITS);
+}
+
+/**
+ * @brief Finish taking a mutex, recovering it if its owner died
+ * @param[in] table Lock table
+ * @param[in] index Lock taken
+ * @param[in] err Result of pthread_mutex_lock() or _trylock()
+ * @return HEARTYFS_OK if the lock is held, HEARTYFS_ERR_IO otherwise
+ */
+static int recover(struct lock_table *table, int index, int err) {
+    if (err == EOWNERDEAD) {
+        // Whatever it guarded may be half changed; make readers look again
+        if (index >= LOCK_DIRS && index < LOCK_INODES) {
+            unsigned *seq = &table->seqs[index - LOCK_DIRS];
+            if (__atomic_load_n(seq, __ATOMIC_RELAXED) & 1) {
+                __atomic_fetch_add(seq, 1, __ATOMIC_SEQ_CST);
+            }
+        }
+        __atomic_fetch_add(&table->gen, 1, __ATOMIC_SEQ_CST);
+        err = pthread_mutex_consistent(&table->locks[index]);
+    }
+    if (err != 0) {
+        errno = err;
+        return HEARTYFS_ERR_IO;
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Lock a mutex of the table, waiting for it if need be
+ * @param[in] table Lock table
+ * @param[in] index Lock to take
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_IO on failure
+ */
+static int acquire(struct lock_table *table, int index) {
+    return recover(table, index, pthread_mutex_lock(&table->locks[index]));
+}
+
+/**
+ * @brief Set up the mutexes of a fresh table
+ * @param[out] table Table that no mount is using
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_IO on failure
+ */
+static int init_table(struct lock_table *table) {
+    memset(table, 0, sizeof(*table));
+    pthread_mutexattr_t attr;
+    if (pthread_mutexattr_init(&attr) != 0) {
+        return HEARTYFS_ERR_IO;
+    }
+    int ret = HEARTYFS_OK;
+    if (pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0 ||
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) != 0) {
+        ret = HEARTYFS_ERR_IO;
+    }
+    for (int i = 0; i < LOCK_COUNT && ret == HEARTYFS_OK; i++) {
+        if (pthread_mutex_init(&table->locks[i], &attr) != 0) {
+            ret = HEARTYFS_ERR_IO;
+        }
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    table->version = LOCK_TABLE_VERSION;
+    table->count = LOCK_COUNT;
+    __atomic_store_n(&table->magic, LOCK_TABLE_MAGIC, __ATOMIC_RELEASE);
+    return ret;
+}
+
+/**
+ * @brief Take a flock(), waiting for it if need be
+ * @return 0 on success, -1 on failure
+ */
+static int flock_wait(int fd, int operation) {
+    int ret;
+    while ((ret = flock(fd, operation)) != 0 && errno == EINTR) {
+    }
+    return ret;
+}
+
+/**
+ * @brief Attach to the lock table behind an open shared memory object
+ * @param[in] fd Shared memory object; holds a shared flock() on success
+ * @return Table, or NULL if it cannot be used
+ *
+ * A mount that finds itself alone sets the table up, whatever a mount
+ * that crashed or an earlier image with the same device and inode left
+ * in it. The table is only used once the shared flock() is held and the
+ * object still has its name, since the last mount to leave may have
+ * removed it in the meantime.
+ */
+static struct lock_table *attach_table(int fd) {
+    struct lock_table *table = NULL;
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+        if (ftruncate(fd, sizeof(*table)) != 0) {
+            return NULL;
+        }
+        table = mmap(NULL, sizeof(*table), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+        if (table == MAP_FAILED) {
+            return NULL;
+        }
+        if (init_table(table) != HEARTYFS_OK) {
+            munmap(table, sizeof(*table));
+            return NULL;
+        }
+    }
+
+    struct stat st;
+    if (flock_wait(fd, LOCK_SH) != 0 || fstat(fd, &st) != 0 ||
+        st.st_nlink == 0 || st.st_size != sizeof(*table)) {
+        if (table) {
+            munmap(table, sizeof(*table));
+        }
+        return NULL;
+    }
+    if (!table) {
+        table = mmap(NULL, sizeof(*table), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+        if (table == MAP_FAILED) {
+            return NULL;
+        }
+    }
+    if (__atomic_load_n(&table->magic, __ATOMIC_ACQUIRE) != LOCK_TABLE_MAGIC ||
+        table->version != LOCK_TABLE_VERSION || table->count != LOCK_COUNT) {
+        munmap(table, sizeof(*table));
+        return NULL;
+    }
+    return table;
+}
+
+/**
+ * @brief Map the lock table of an image, creating it if needed
+ * @param[in] st Status of the image file
+ * @param[out] l Receives the table, its descriptor and its name
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_IO if there is no table
+ */
+static int map_table(const struct stat *st, struct hfs_locks *l) {
+    snprintf(l->name, sizeof(l->name), "/heartyfs.%llx.%llx",
+             (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+    for (int tries = 0; tries < MAX_ATTACH_TRIES; tries++) {
+        int fd = shm_open(l->name, O_RDWR | O_CREAT, st->st_mode & 0666);
+        if (fd < 0) {
+            return HEARTYFS_ERR_IO;
+        }
+        l->table = attach_table(fd);
+        if (l->table) {
+            l->fd = fd;
+            return HEARTYFS_OK;
+        }
+        close(fd);  // Also drops the flock()
+    }
+    return HEARTYFS_ERR_IO;
+}
+
+/**
+ * @brief Keep other writers off the image for as long as it is mounted
+ * @param[in] fs Mounted filesystem
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_IO on failure
+ *
+ * Blocks until every other writable mount holding it is gone.
+ */
+int hfs_lock_image_file(struct heartyfs *fs) {
+    while (flock(fs->fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            return HEARTYFS_ERR_IO;
+        }
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Attach a mount to the lock table of its image
+ * @param[in,out] fs Mounted filesystem without a journal
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Without a table a writable mount falls back to hfs_lock_image_file(),
+ * and a read-only one goes without locks.
+ */
+int hfs_locks_open(struct heartyfs *fs) {
+    struct stat st;
+    if (fstat(fs->fd, &st) != 0) {
+        return HEARTYFS_ERR_IO;
+    }
+    struct hfs_locks *l = calloc(1, sizeof(*l));
+    if (!l) {
+        return HEARTYFS_ERR_NO_MEMORY;
+    }
+    if (map_table(&st, l) != HEARTYFS_OK) {
+        free(l);
+        return hfs_writable(fs) ? hfs_lock_image_file(fs) : HEARTYFS_OK;
+    }
+    l->global = fs->snapshot_dir || fs->csum_table;
+    l->gen = __atomic_load_n(&l->table->gen, __ATOMIC_ACQUIRE);
+    fs->locks = l;
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Make room to note one more lock taken
+ * @param[in,out] l Locks of the mount
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_NO_MEMORY on failure
+ */
+static int reserve(struct hfs_locks *l) {
+    if (l->num_order == l->cap_order) {
+        int capacity = l->cap_order ? 2 * l->cap_order : MIN_HELD;
+        int *order = realloc(l->order, capacity * sizeof(int));
+        if (!order) {
+            return HEARTYFS_ERR_NO_MEMORY;
+        }
+        l->order = order;
+        l->cap_order = capacity;
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Note that a lock was taken for the running operation
+ */
+static void record(struct hfs_locks *l, int index) {
+    l->held[index] = 1;
+    l->order[l->num_order++] = index;
+}
+
+/**
+ * @brief Take a lock for the running operation
+ * @param[in] fs Mounted filesystem with a lock table
+ * @param[in] index Lock to take
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_* code on failure
+ *
+ * A lock the operation already holds is only counted again.
+ */
+static int take(struct heartyfs *fs, int index) {
+    struct hfs_locks *l = fs->locks;
+    if (l->held[index] > 0) {
+        l->held[index]++;
+        return HEARTYFS_OK;
+    }
+    int ret = reserve(l);
+    if (ret == HEARTYFS_OK) {
+        ret = acquire(l->table, index);
+    }
+    if (ret == HEARTYFS_OK) {
+        record(l, index);
+    }
+    return ret;
+}
+
+/**
+ * @brief Give back one count of a lock
+ */
+static void give(struct heartyfs *fs, int index) {
+    struct hfs_locks *l = fs->locks;
+    if (l->held[index] > 0 && --l->held[index] == 0) {
+        pthread_mutex_unlock(&l->table->locks[index]);
+        if (l->num_order > 0 && l->order[l->num_order - 1] == index) {
+            l->num_order--;
+        }
+    }
+}
+
+/**
+ * @brief Note that a directory changed: bump the generation
+ * @param[in] l Locks of the mount making the change
+ *
+ * The mount keeps its cache if nobody else changed anything since it
+ * last looked.
+ */
+static void bump_gen(struct hfs_locks *l) {
+    unsigned old = __atomic_fetch_add(&l->table->gen, 1, __ATOMIC_SEQ_CST);
+    if (old == l->gen) {
+        l->gen = old + 1;
+    }
+}
+
+/**
+ * @brief Release every lock of the running operation but the image lock
+ * @param[in] fs Mounted filesystem
+ *
+ * Lets a long operation that holds the image lock, like an export, give
+ * up the files it is done with.
+ */
+void hfs_unlock_held(struct heartyfs *fs) {
+    struct hfs_locks *l = fs->locks;
+    if (!l) {
+        return;
+    }
+    if (l->all) {
+        for (int s = 0; s < LOCK_STRIPES; s++) {
+            __atomic_fetch_add(&l->table->seqs[s], 1, __ATOMIC_SEQ_CST);
+        }
+        bump_gen(l);
+        l->all = 0;
+    }
+    for (int i = 0; i < l->num_order; i++) {
+        int index = l->order[i];
+        if (l->held[index] > 0) {
+            l->held[index] = 0;
+            pthread_mutex_unlock(&l->table->locks[index]);
+        }
+    }
+    l->num_order = 0;
+}
+
+/**
+ * @brief Detach a mount from its lock table
+ * @param[in,out] fs Filesystem being unmounted
+ *
+ * The last mount to leave removes the table.
+ */
+void hfs_locks_close(struct heartyfs *fs) {
+    struct hfs_locks *l = fs->locks;
+    if (!l) {
+        return;
+    }
+    hfs_unlock_held(fs);
+    if (l->image) {
+        pthread_mutex_unlock(&l->table->locks[LOCK_IMAGE]);
+    }
+    munmap(l->table, sizeof(*l->table));
+
+    // Nobody else holds the table if the flock() can be had exclusively
+    if (flock(l->fd, LOCK_EX | LOCK_NB) == 0) {
+        shm_unlink(l->name);
+    }
+    close(l->fd);
+    free(l->order);
+    free(l);
+    fs->locks = NULL;
+}
+
+/**
+ * @brief Catch up with directory changes made by other processes
+ * @param[in] fs Mounted filesystem
+ * @return Generation seen, for hfs_locks_unchanged()
+ *
+ * The dentry cache is dropped if anything changed.
+ */
+unsigned hfs_locks_sync(struct heartyfs *fs) {
+    struct hfs_locks *l = fs->locks;
+    if (!l) {
+        return 0;
+    }
+    unsigned gen = __atomic_load_n(&l->table->gen, __ATOMIC_ACQUIRE);
+    if (gen != l->gen) {
+        hfs_dcache_invalidate(fs);
+        l->gen = gen;
+    }
+    return gen;
+}
+
+/**
+ * @brief Check that no directory changed since hfs_locks_sync()
+ * @param[in] fs Mounted filesystem
+ * @param[in] gen Generation returned by hfs_locks_sync()
+ * @return 1 if nothing changed, 0 otherwise
+ */
+int hfs_locks_unchanged(const struct heartyfs *fs, unsigned gen) {
+    const struct hfs_locks *l = fs->locks;
+    return !l || __atomic_load_n(&l->table->gen, __ATOMIC_ACQUIRE) == gen;
+}
+
+/**
+ * @brief Begin an operation
+ * @param[in] fs Mounted filesystem
+ * @param[in] exclusive 1 to hold the image lock for the whole operation
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Operations nest: only the outermost one takes and releases locks.
+ */
+int hfs_op_begin(struct heartyfs *fs, int exclusive) {
+    struct hfs_locks *l = fs->locks;
+    if (!l || l->depth++ > 0) {
+        return HEARTYFS_OK;
+    }
+    if (l->global || exclusive) {
+        int ret = acquire(l->table, LOCK_IMAGE);
+        if (ret != HEARTYFS_OK) {
+            l->depth--;
+            return ret;
+        }
+        l->image = 1;
+    }
+    hfs_locks_sync(fs);
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief End an operation and release its locks
+ * @param[in] fs Mounted filesystem
+ * @param[in] ret Result of the operation
+ * @return ret, or the error of bringing checksums up to date
+ *
+ * Checksums are updated before the locks go, even if the operation
+ * failed half way, so other processes never see a stale one.
+ */
+ssize_t hfs_op_end(struct heartyfs *fs, ssize_t ret) {
+    struct hfs_locks *l = fs->locks;
+    if (!l || --l->depth > 0) {
+        return ret;
+    }
+    if (fs->csum) {
+        int csum_ret = hfs_csum_update(fs);
+        if (ret >= 0 && csum_ret != HEARTYFS_OK) {
+            ret = csum_ret;
+        }
+    }
+    // Changes made under the image lock need not go through a directory
+    if (l->image && hfs_writable(fs)) {
+        bump_gen(l);
+    }
+    hfs_unlock_held(fs);
+    if (l->image) {
+        l->image = 0;
+        pthread_mutex_unlock(&l->table->locks[LOCK_IMAGE]);
+    }
+    return ret;
+}
+
+/**
+ * @brief Lock a directory for the running operation
+ * @param[in] fs Mounted filesystem
+ * @param[in] block Directory head
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Must not be called while an inode or the tail lock is held.
+ */
+int hfs_lock_dir(struct heartyfs *fs, int block) {
+    return fs->locks ? take(fs, LOCK_DIRS + stripe(block)) : HEARTYFS_OK;
+}
+
+void hfs_unlock_dir(struct heartyfs *fs, int block) {
+    if (fs->locks) {
+        give(fs, LOCK_DIRS + stripe(block));
+    }
+}
+
+/**
+ * @brief Lock a directory if nobody else holds it
+ * @param[in] fs Mounted filesystem
+ * @param[in] block Directory head
+ * @return 1 if the directory is now locked, 0 if it is busy
+ *
+ * Never waits, so it may be called with any other lock held.
+ */
+int hfs_trylock_dir(struct heartyfs *fs, int block) {
+    struct hfs_locks *l = fs->locks;
+    if (!l) {
+        return 1;
+    }
+    int index = LOCK_DIRS + stripe(block);
+    if (l->held[index] > 0) {
+        l->held[index]++;
+        return 1;
+    }
+    if (reserve(l) != HEARTYFS_OK) {
+        return 0;
+    }
+    int err = pthread_mutex_trylock(&l->table->locks[index]);
+    if (err == EBUSY || recover(l->table, index, err) != HEARTYFS_OK) {
+        return 0;
+    }
+    record(l, index);
+    return 1;
+}
+
+/**
+ * @brief Lock a directory inside one that is already locked
+ * @param[in] fs Mounted filesystem
+ * @param[in] parent Locked directory
+ * @param[in] block Directory to lock as well
+ * @param[out] relocked Set to 1 if the parent had to be let go for a
+ *                      moment to keep the stripes in order, so whatever
+ *                      was checked under it must be checked again
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int hfs_lock_child_dir(struct heartyfs *fs, int parent, int block,
+                       int *relocked) {
+    struct hfs_locks *l = fs->locks;
+    *relocked = 0;
+    if (!l) {
+        return HEARTYFS_OK;
+    }
+    int outer = LOCK_DIRS + stripe(parent);
+    int inner = LOCK_DIRS + stripe(block);
+    if (inner >= outer) {
+        return take(fs, inner);
+    }
+    if (hfs_trylock_dir(fs, block)) {
+        return HEARTYFS_OK;
+    }
+
+    // Busy at a lower stripe: let the parent go and take both in order
+    int count = l->held[outer];
+    l->held[outer] = 0;
+    pthread_mutex_unlock(&l->table->locks[outer]);
+    int ret = take(fs, inner);
+    if (ret == HEARTYFS_OK) {
+        ret = acquire(l->table, outer);
+    }
+    if (ret == HEARTYFS_OK) {
+        l->held[outer] = count;
+        *relocked = 1;
+    }
+    return ret;
+}
+
+/**
+ * @brief Lock a file for the running operation
+ * @param[in] fs Mounted filesystem
+ * @param[in] block Inode block
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Only one file may be locked at a time unless the image lock is held.
+ */
+int hfs_lock_inode(struct heartyfs *fs, int block) {
+    return fs->locks ? take(fs, LOCK_INODES + stripe(block)) : HEARTYFS_OK;
+}
+
+void hfs_unlock_inode(struct heartyfs *fs, int block) {
+    if (fs->locks) {
+        give(fs, LOCK_INODES + stripe(block));
+    }
+}
+
+/**
+ * @brief Lock the tail blocks while a fragment is carved out or freed
+ * @param[in] fs Mounted filesystem
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int hfs_lock_tail(struct heartyfs *fs) {
+    return fs->locks ? take(fs, LOCK_TAIL) : HEARTYFS_OK;
+}
+
+void hfs_unlock_tail(struct heartyfs *fs) {
+    if (fs->locks) {
+        give(fs, LOCK_TAIL);
+    }
+}
+
+/**
+ * @brief Lock every directory, file and tail block of the image
+ * @param[in] fs Mounted filesystem holding the image lock
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Once everything is held every directory counts as being changed, so
+ * that lookups in other processes wait until the operation ends.
+ */
+int hfs_lock_all(struct heartyfs *fs) {
+    struct hfs_locks *l = fs->locks;
+    if (!l) {
+        return HEARTYFS_OK;
+    }
+    for (int index = LOCK_DIRS; index < LOCK_COUNT; index++) {
+        int ret = take(fs, index);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+    }
+    for (int s = 0; s < LOCK_STRIPES; s++) {
+        __atomic_fetch_add(&l->table->seqs[s], 1, __ATOMIC_SEQ_CST);
+    }
+    l->all = 1;
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Start reading a directory without locking it
+ * @param[in] fs Mounted filesystem
+ * @param[in] block Directory head
+ * @return Sequence count to hand to hfs_dir_read_retry()
+ *
+ * Waits for a change in progress to finish first.
+ */
+unsigned hfs_dir_read_begin(const struct heartyfs *fs, int block) {
+    const struct hfs_locks *l = fs->locks;
+    int s = stripe(block);
+    if (!l || l->held[LOCK_DIRS + s] > 0) {
+        return 0;
+    }
+
+    for (;;) {
+        unsigned seq = __atomic_load_n(&l->table->seqs[s], __ATOMIC_ACQUIRE);
+        if (!(seq & 1)) {
+            return seq;
+        }
+        // The writer holds the stripe until it is done
+        if (acquire(l->table, LOCK_DIRS + s) != HEARTYFS_OK) {
+            return seq;
+        }
+        pthread_mutex_unlock(&l->table->locks[LOCK_DIRS + s]);
+    }
+}
+
+/**
+ * @brief Check whether a directory read raced with a change
+ * @param[in] fs Mounted filesystem
+ * @param[in] block Directory head
+ * @param[in] seq Value returned by hfs_dir_read_begin()
+ * @return 1 if what was read may be torn and must be read again
+ */
+int hfs_dir_read_retry(const struct heartyfs *fs, int block, unsigned seq) {
+    const struct hfs_locks *l = fs->locks;
+    int s = stripe(block);
+    if (!l || l->held[LOCK_DIRS + s] > 0) {
+        return 0;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&l->table->seqs[s], __ATOMIC_RELAXED) != seq;
+}
+
+/**
+ * @brief Start changing a locked directory
+ * @param[in] fs Mounted filesystem
+ * @param[in] block Directory head
+ *
+ * Must not be followed by taking another lock before hfs_dir_write_end().
+ */
+void hfs_dir_write_begin(struct heartyfs *fs, int block) {
+    if (fs->locks && !fs->locks->all) {
+        __atomic_fetch_add(&fs->locks->table->seqs[stripe(block)], 1,
+                           __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * @brief Finish changing a directory
+ * @param[in] fs Mounted filesystem
+ * @param[in] block Directory head
+ */
+void hfs_dir_write_end(struct heartyfs *fs, int block) {
+    struct hfs_locks *l = fs->locks;
+    if (l && !l->all) {
+        __atomic_fetch_add(&l->table->seqs[stripe(block)], 1,
+                           __ATOMIC_SEQ_CST);
+        bump_gen(l);
+    }
+}
@@ -0,0 +1,226 @@
+#include "heartyfs_internal.h"
+
+/*
+ * A small LZ77 codec in the style of LZ4, used for compressed files.
+ *
+ * The compressed form is a series of sequences. Each starts with a token
+ * byte whose high nibble is the number of literals and low nibble the
+ * match length minus LZ_MIN_MATCH; a nibble of 15 is followed by bytes
+ * that add to it, 255 meaning that another byte follows. Then come the
+ * literals, a 2-byte little-endian offset back into the output, and any
+ * extra match length bytes. The last sequence stops after its literals.
+ *
+ * Matches are found through a hash table of the last position at which
+ * each 4-byte prefix was seen, so compression is a single greedy pass.
+ * The search steps further ahead the longer it goes without a match,
+ * which keeps incompressible data cheap. Decompression checks every
+ * length and offset against both buffers.
+ */
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xFFFF
+#define LZ_RUN_MASK 15
+#define LZ_SKIP_SHIFT 6  // Search step grows by one every 64 misses
+#define LZ_HASH_MULT 2654435761u
+
+/**
+ * @brief Load 4 bytes from a possibly unaligned address
+ */
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+ * @brief Hash a 4-byte prefix into the match table
+ */
+static unsigned hash4(uint32_t v) {
+    return (v * LZ_HASH_MULT) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * @brief Write the extra bytes of a length that did not fit its nibble
+ * @param[out] op Output position
+ * @param[in] len Length minus LZ_RUN_MASK
+ * @return Output position after the bytes
+ */
+static unsigned char *put_length(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/**
+ * @brief Emit one sequence
+ * @param[out] op Output position
+ * @param[in] oend End of the output buffer
+ * @param[in] lit Literals
+ * @param[in] lit_len Number of literals
+ * @param[in] offset Match offset, or 0 for the last sequence
+ * @param[in] match_len Match length minus LZ_MIN_MATCH
+ * @return Output position after the sequence, or NULL if it does not fit
+ */
+static unsigned char *emit(unsigned char *op, const unsigned char *oend,
+                           const unsigned char *lit, size_t lit_len,
+                           size_t offset, size_t match_len) {
+    size_t worst = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+    if (worst > (size_t)(oend - op)) {
+        return NULL;
+    }
+
+    unsigned char *token = op++;
+    *token = (lit_len < LZ_RUN_MASK ? lit_len : LZ_RUN_MASK) << 4;
+    if (lit_len >= LZ_RUN_MASK) {
+        op = put_length(op, lit_len - LZ_RUN_MASK);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (offset == 0) {
+        return op;
+    }
+
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    *token |= match_len < LZ_RUN_MASK ? match_len : LZ_RUN_MASK;
+    if (match_len >= LZ_RUN_MASK) {
+        op = put_length(op, match_len - LZ_RUN_MASK);
+    }
+    return op;
+}
+
+/**
+ * @brief Compress a buffer
+ * @param[in] src Data to compress
+ * @param[in] len Length of src
+ * @param[out] dst Output buffer
+ * @param[in] cap Size of dst
+ * @return Compressed length, or 0 if it would not fit in cap bytes
+ */
+size_t hfs_lz_compress(const void *src, size_t len, void *dst, size_t cap) {
+    const unsigned char *in = src;
+    const unsigned char *ip = in;
+    const unsigned char *anchor = in;
+    const unsigned char *iend = in + len;
+    unsigned char *op = dst;
+    const unsigned char *oend = op + cap;
+    int table[1 << LZ_HASH_BITS];
+
+    memset(table, -1, sizeof(table));
+    while (len >= LZ_MIN_MATCH && ip <= iend - LZ_MIN_MATCH) {
+        uint32_t seq = read32(ip);
+        unsigned h = hash4(seq);
+        int ref = table[h];
+        table[h] = ip - in;
+        if (ref < 0 || ip - in - ref > LZ_MAX_OFFSET ||
+            read32(in + ref) != seq) {
+            size_t step = 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+            if (step > (size_t)(iend - ip)) {
+                break;
+            }
+            ip += step;
+            continue;
+        }
+
+        const unsigned char *mp = in + ref + LZ_MIN_MATCH;
+        const unsigned char *end = ip + LZ_MIN_MATCH;
+        while (end < iend && *end == *mp) {
+            end++;
+            mp++;
+        }
+        op = emit(op, oend, anchor, ip - anchor, ip - (in + ref),
+                  end - ip - LZ_MIN_MATCH);
+        if (!op) {
+            return 0;
+        }
+        ip = anchor = end;
+    }
+
+    op = emit(op, oend, anchor, iend - anchor, 0, 0);
+    return op ? (size_t)(op - (unsigned char *)dst) : 0;
+}
+
+/**
+ * @brief Read the extra bytes of a length whose nibble was LZ_RUN_MASK
+ * @param[in,out] ip Input position; advanced past the bytes
+ * @param[in] iend End of the input
+ * @param[in,out] len Length to add to
+ * @return 0 on success, -1 if the input ends first
+ */
+static int get_length(const unsigned char **ip, const unsigned char *iend,
+                      size_t *len) {
+    unsigned char b;
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/**
+ * @brief Decompress a buffer
+ * @param[in] src Compressed data
+ * @param[in] len Length of src
+ * @param[out] dst Output buffer
+ * @param[in] cap Size of dst
+ * @return Decompressed length, or -1 if the input is malformed or does not
+ *         fit in cap bytes
+ */
+ssize_t hfs_lz_decompress(const void *src, size_t len, void *dst,
+                          size_t cap) {
+    const unsigned char *ip = src;
+    const unsigned char *iend = ip + len;
+    unsigned char *out = dst;
+    unsigned char *op = out;
+    unsigned char *oend = out + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == LZ_RUN_MASK && get_length(&ip, iend, &lit_len) != 0) {
+            return -1;
+        }
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+        if (ip == iend) {
+            break;  // Last sequence
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match_len = token & LZ_RUN_MASK;
+        if (match_len == LZ_RUN_MASK &&
+            get_length(&ip, iend, &match_len) != 0) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - out) ||
+            match_len > (size_t)(oend - op)) {
+            return -1;
+        }
+
+        const unsigned char *mp = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, mp, match_len);
+        } else {
+            for (size_t i = 0; i < match_len; i++) {
+                op[i] = mp[i];  // Overlapping: repeats the last offset bytes
+            }
+        }
+        op += match_len;
+    }
+    return op - out;
+}
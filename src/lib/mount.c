@@ -0,0 +1,333 @@
+#include "heartyfs_internal.h"
+#include <errno.h>
+#include <sys/stat.h>
+
+/**
+ * @brief Check that the image carries an initialized root directory
+ * @param[in] fs Mounted filesystem
+ * @return 1 if the superblock looks valid, 0 otherwise
+ */
+static int superblock_valid(const struct heartyfs *fs) {
+    const struct heartyfs_directory *root = hfs_block(fs, SUPERBLOCK_ID);
+
+    return root->type == DIR_TYPE &&
+           strcmp(root->name, ROOT_DIR_NAME) == 0 &&
+           root->size >= MIN_DIR_ENTRIES &&
+           (root->index_block != 0 || root->size <= MAX_DIR_ENTRIES);
+}
+
+/**
+ * @brief Read the image geometry recorded by heartyfs_init
+ * @param[out] fs Filesystem whose disk mapping is set up; geometry fields
+ *                are filled in
+ * @return 1 if the geometry is consistent with the mapping, 0 otherwise
+ */
+static int load_geometry(struct heartyfs *fs) {
+    const struct heartyfs_superblock *sb = fs->data;
+    int block_size = sb->block_size;
+
+    if (sb->magic != HEARTYFS_MAGIC || block_size < MIN_BLOCK_SIZE ||
+        block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) {
+        return 0;
+    }
+
+    long long bitmap_bits = (long long)sb->bitmap_blocks * block_size * 8;
+    if (sb->num_blocks <= 0 || sb->bitmap_blocks <= 0 ||
+        bitmap_bits < sb->num_blocks ||
+        (size_t)sb->num_blocks * block_size > fs->disk_size ||
+        BITMAP_BLOCK_ID + sb->bitmap_blocks >= sb->num_blocks) {
+        return 0;
+    }
+
+    fs->block_size = block_size;
+    fs->block_shift = __builtin_ctz(block_size);
+    fs->num_blocks = sb->num_blocks;
+    fs->first_data_block = BITMAP_BLOCK_ID + sb->bitmap_blocks;
+    fs->extents_per_block = block_size / sizeof(struct heartyfs_extent);
+    fs->pointers_per_block = block_size / sizeof(int);
+    fs->max_extents = MAX_DIRECT_EXTENTS + fs->extents_per_block +
+                      fs->pointers_per_block * fs->extents_per_block;
+    return 1;
+}
+
+/**
+ * @brief Read the extension block and set up the features it enables
+ * @param[in,out] fs Filesystem with its geometry loaded
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * The extension block, when present, directly follows the bitmap. A
+ * journal comes next and is replayed here, before anything else reads the
+ * metadata. The snapshot directory and share count table, if any, follow
+ * the journal, then the checksum table; data blocks start after them.
+ * Tail packing needs no room of its own.
+ */
+static int load_extensions(struct heartyfs *fs) {
+    const struct heartyfs_superblock *sb = fs->data;
+    if (sb->ext_block == 0) {
+        return HEARTYFS_OK;
+    }
+    if (sb->ext_block != fs->first_data_block) {
+        return HEARTYFS_ERR_NOT_INIT;
+    }
+
+    const struct heartyfs_sb_ext *ext = hfs_data(fs, sb->ext_block);
+    int journal_start = sb->ext_block + 1;
+    if (ext->magic != HEARTYFS_EXT_MAGIC || ext->journal_blocks < 0 ||
+        ext->journal_blocks >= fs->num_blocks - journal_start) {
+        return HEARTYFS_ERR_NOT_INIT;
+    }
+    fs->first_data_block = journal_start + ext->journal_blocks;
+
+    if (ext->snapshot_dir) {
+        int share_blocks = (fs->num_blocks + fs->block_size - 1) /
+                           fs->block_size;
+        if (ext->snapshot_dir != fs->first_data_block ||
+            ext->share_blocks != share_blocks ||
+            fs->first_data_block + 1 + share_blocks >= fs->num_blocks) {
+            return HEARTYFS_ERR_NOT_INIT;
+        }
+        fs->snapshot_dir = ext->snapshot_dir;
+        fs->first_data_block += 1 + share_blocks;
+    }
+    if (ext->csum_blocks) {
+        int csum_blocks = ((long long)fs->num_blocks * sizeof(uint32_t) +
+                           fs->block_size - 1) / fs->block_size;
+        if (ext->csum_blocks != csum_blocks ||
+            fs->first_data_block + 1 + csum_blocks >= fs->num_blocks) {
+            return HEARTYFS_ERR_NOT_INIT;
+        }
+        fs->csum_table = fs->first_data_block;
+        fs->first_data_block += csum_blocks;
+    }
+    fs->tail_packing = ext->tail_packing != 0;
+    if (ext->journal_blocks == 0) {
+        return HEARTYFS_OK;
+    }
+    return hfs_journal_open(fs, journal_start, ext->journal_blocks);
+}
+
+/**
+ * @brief Release the mappings and descriptor of a mount handle
+ * @param[in] fs Filesystem being torn down
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_IO if unmapping failed
+ */
+static int release_mount(struct heartyfs *fs) {
+    int ret = HEARTYFS_OK;
+    hfs_journal_close(fs);
+    hfs_csum_close(fs);
+    hfs_locks_close(fs);
+    if (fs->disk && fs->disk != fs->data &&
+        munmap(fs->disk, fs->disk_size) == -1) {
+        ret = HEARTYFS_ERR_IO;
+    }
+    if (munmap(fs->data, fs->disk_size) == -1) {
+        ret = HEARTYFS_ERR_IO;
+    }
+    close(fs->fd);
+    hfs_dcache_destroy(fs);
+    hfs_writeback_destroy(fs);
+    free(fs);
+    return ret;
+}
+
+/**
+ * @brief Open and map a heartyfs disk file
+ * @param[in] image_path Path of the disk file, or NULL for DISK_FILE_PATH
+ * @param[in] flags HEARTYFS_* mount flags
+ * @param[out] fsp Receives the mount handle on success
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * The whole file is mapped; its geometry comes from the superblock. On a
+ * journaled image the log is replayed first, and a writable mount then
+ * gets a second, private mapping for metadata so that changes reach the
+ * disk only through the journal. HEARTYFS_SYNC or HEARTYFS_ASYNC make
+ * every operation flush its changes before returning; see
+ * heartyfs_set_durability().
+ */
+int heartyfs_mount(const char *image_path, int flags, struct heartyfs **fsp) {
+    if (!fsp) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    if (!image_path) {
+        image_path = DISK_FILE_PATH;
+    }
+
+    struct heartyfs *fs = calloc(1, sizeof(struct heartyfs));
+    if (!fs) {
+        return HEARTYFS_ERR_NO_MEMORY;
+    }
+    fs->flags = flags;
+    if (flags & HEARTYFS_SYNC) {
+        fs->durability = HEARTYFS_DURABLE_SYNC;
+    } else if (flags & HEARTYFS_ASYNC) {
+        fs->durability = HEARTYFS_DURABLE_ASYNC;
+    }
+
+    int rdonly = flags & HEARTYFS_RDONLY;
+    fs->fd = open(image_path, rdonly ? O_RDONLY : O_RDWR);
+    if (fs->fd < 0) {
+        free(fs);
+        return HEARTYFS_ERR_IO;
+    }
+
+    // Too small to even hold a superblock
+    struct stat st;
+    if (fstat(fs->fd, &st) != 0 || st.st_size < MIN_BLOCK_SIZE) {
+        close(fs->fd);
+        free(fs);
+        return HEARTYFS_ERR_NOT_INIT;
+    }
+    fs->disk_size = st.st_size;
+
+    fs->data = mmap(NULL, fs->disk_size,
+                    rdonly ? PROT_READ : PROT_READ | PROT_WRITE,
+                    rdonly ? MAP_PRIVATE : MAP_SHARED, fs->fd, 0);
+    if (fs->data == MAP_FAILED) {
+        int saved_errno = errno;
+        close(fs->fd);
+        free(fs);
+        errno = saved_errno;
+        return HEARTYFS_ERR_IO;
+    }
+    fs->disk = fs->data;
+
+    if (!load_geometry(fs)) {
+        release_mount(fs);
+        return HEARTYFS_ERR_NOT_INIT;
+    }
+    int ret = load_extensions(fs);
+    if (ret == HEARTYFS_OK && !rdonly) {
+        ret = hfs_writeback_init(fs);
+    }
+    if (ret == HEARTYFS_OK && fs->journal && !rdonly) {
+        fs->disk = mmap(NULL, fs->disk_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE, fs->fd, 0);
+        if (fs->disk == MAP_FAILED) {
+            fs->disk = NULL;
+            ret = HEARTYFS_ERR_IO;
+        }
+    }
+    if (ret == HEARTYFS_OK && !superblock_valid(fs)) {
+        ret = HEARTYFS_ERR_NOT_INIT;
+    }
+    if (ret != HEARTYFS_OK) {
+        int saved_errno = errno;
+        release_mount(fs);
+        errno = saved_errno;
+        return ret;
+    }
+
+    // The cache is only an accelerator; run without it if memory is short
+    if (!(flags & HEARTYFS_NOCACHE)) {
+        hfs_dcache_init(fs);
+    }
+
+    fs->sb = hfs_block(fs, SUPERBLOCK_ID);
+    fs->bitmap = hfs_block(fs, BITMAP_BLOCK_ID);
+    if (fs->snapshot_dir) {
+        fs->shares = hfs_block(fs, fs->snapshot_dir + 1);
+    }
+    if (!fs->journal) {
+        ret = hfs_locks_open(fs);
+    }
+    if (ret == HEARTYFS_OK && fs->csum_table) {
+        ret = hfs_op_begin(fs, 1);
+        if (ret == HEARTYFS_OK) {
+            ret = hfs_op_end(fs, hfs_csum_open(fs));
+        }
+    }
+    if (ret != HEARTYFS_OK) {
+        release_mount(fs);
+        return ret;
+    }
+    *fsp = fs;
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Unmap the disk file and release the mount handle
+ * @param[in] fs Mounted filesystem (may be NULL)
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_IO if unmapping failed, or
+ *         the error of the final journal commit
+ *
+ * A journaled image commits whatever the handle has not committed yet.
+ */
+int heartyfs_unmount(struct heartyfs *fs) {
+    if (!fs) {
+        return HEARTYFS_OK;
+    }
+
+    int ret = hfs_op_begin(fs, 0);
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_op_end(fs, hfs_csum_update(fs));
+    }
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_journal_commit(fs);
+    }
+    int unmap_ret = release_mount(fs);
+    return ret != HEARTYFS_OK ? ret : unmap_ret;
+}
+
+/**
+ * @brief Describe a HEARTYFS_ERR_* code
+ * @param[in] err Error code returned by a libheartyfs call
+ * @return Static, human-readable message
+ */
+const char *heartyfs_strerror(int err) {
+    switch (err) {
+    case HEARTYFS_OK:
+        return "Success";
+    case HEARTYFS_ERR_IO:
+        return "Cannot access the disk file";
+    case HEARTYFS_ERR_NOT_INIT:
+        return "heartyfs is not initialized";
+    case HEARTYFS_ERR_NOT_FOUND:
+        return "No such file or directory";
+    case HEARTYFS_ERR_PARENT_NOT_FOUND:
+        return "Parent directory not found";
+    case HEARTYFS_ERR_EXISTS:
+        return "File or directory already exists";
+    case HEARTYFS_ERR_DIR_FULL:
+        return "Parent directory is full";
+    case HEARTYFS_ERR_NO_SPACE:
+        return "No free blocks available";
+    case HEARTYFS_ERR_NOT_DIR:
+        return "Not a directory";
+    case HEARTYFS_ERR_NOT_FILE:
+        return "Not a regular file";
+    case HEARTYFS_ERR_NOT_EMPTY:
+        return "Directory is not empty";
+    case HEARTYFS_ERR_NAME_TOO_LONG:
+        return "Name too long";
+    case HEARTYFS_ERR_TOO_LARGE:
+        return "File is too large for heartyfs";
+    case HEARTYFS_ERR_INVALID:
+        return "Invalid argument";
+    case HEARTYFS_ERR_CORRUPT:
+        return "Corrupted filesystem structure";
+    case HEARTYFS_ERR_RDONLY:
+        return "Filesystem is mounted read-only";
+    case HEARTYFS_ERR_NO_MEMORY:
+        return "Out of memory";
+    case HEARTYFS_ERR_UNSUPPORTED:
+        return "Not supported by this image";
+    case HEARTYFS_ERR_CHECKSUM:
+        return "Block checksum mismatch";
+    default:
+        return "Unknown error";
+    }
+}
+
+/**
+ * @brief Print a HEARTYFS_ERR_* code to stderr
+ * @param[in] err Error code returned by a libheartyfs call
+ *
+ * I/O errors also include the errno description of the failing syscall.
+ */
+void heartyfs_perror(int err) {
+    if (err == HEARTYFS_ERR_IO && errno != 0) {
+        fprintf(stderr, "%s: %s\n", heartyfs_strerror(err), strerror(errno));
+    } else {
+        fprintf(stderr, "%s\n", heartyfs_strerror(err));
+    }
+}
@@ -0,0 +1,309 @@
+#include "heartyfs_internal.h"
+
+/**
+ * @brief Look up one path component inside a directory block
+ * @param[in] fs Mounted filesystem
+ * @param[in] dir_block Block id of the directory to search
+ * @param[in] name Component to look for
+ * @param[out] block Receives the block id of the entry
+ * @return HEARTYFS_OK if found, HEARTYFS_ERR_NOT_FOUND if not,
+ *         HEARTYFS_ERR_NOT_DIR if dir_block is not a directory,
+ *         HEARTYFS_ERR_CORRUPT or HEARTYFS_ERR_CHECKSUM
+ *
+ * Hits in the dentry cache, positive or negative, skip the directory scan.
+ * A scan that raced with another process changing the directory is done
+ * again.
+ */
+int hfs_lookup(struct heartyfs *fs, int dir_block, const char *name,
+               int *block) {
+    int cached;
+    if (hfs_dcache_lookup(fs, dir_block, name, &cached)) {
+        if (cached < 0) {
+            return HEARTYFS_ERR_NOT_FOUND;
+        }
+        *block = cached;
+        return HEARTYFS_OK;
+    }
+
+    const struct heartyfs_directory *dir = hfs_block(fs, dir_block);
+    int next;
+    int ret;
+    unsigned seq;
+    do {
+        seq = hfs_dir_read_begin(fs, dir_block);
+        ret = hfs_csum_check(fs, dir, fs->block_size);
+        if (ret == HEARTYFS_OK && dir->type != DIR_TYPE) {
+            ret = HEARTYFS_ERR_NOT_DIR;
+        }
+        if (ret == HEARTYFS_OK) {
+            ret = hfs_dir_lookup(fs, dir, name, &next);
+        }
+    } while (hfs_dir_read_retry(fs, dir_block, seq));
+
+    if (ret == HEARTYFS_ERR_NOT_FOUND) {
+        hfs_dcache_insert(fs, dir_block, name, -1);
+    }
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+    if (next != SUPERBLOCK_ID && !hfs_block_in_range(fs, next)) {
+        return HEARTYFS_ERR_CORRUPT;
+    }
+    hfs_dcache_insert(fs, dir_block, name, next);
+    *block = next;
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Check whether a name is the snapshot directory seen from the root
+ * @param[in] fs Mounted filesystem
+ * @param[in] parent Block id of the directory holding the name
+ * @param[in] name Entry name
+ * @return 1 if parent is the live root and name is SNAPSHOT_DIR_NAME on
+ *         an image with snapshots, 0 otherwise
+ */
+int hfs_snapshot_name(const struct heartyfs *fs, int parent,
+                      const char *name) {
+    return fs->snapshot_dir && parent == SUPERBLOCK_ID &&
+           strcmp(name, SNAPSHOT_DIR_NAME) == 0;
+}
+
+/**
+ * @brief Walk every component of a path starting at the root directory
+ * @param[in] fs Mounted filesystem
+ * @param[in,out] path Writable copy of the path; strtok() modifies it
+ * @param[in] writable 1 to copy every block on the way that is shared
+ *                     with a snapshot
+ * @param[out] block Receives the block id the path resolves to
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * . and .. are resolved against the directories already walked rather
+ * than through the entries on disk, since a directory copied away from a
+ * snapshot leaves its children's .. entries pointing at the original.
+ * SNAPSHOT_DIR_NAME in the root leads to the snapshots, which are
+ * read-only.
+ */
+static int walk_path(struct heartyfs *fs, char *path, int writable,
+                     int *block) {
+    int walked[MAX_PATH_LENGTH / 2 + 1];  // Blocks from the root down
+    int depth = 0;
+    char *saveptr;
+
+    walked[0] = SUPERBLOCK_ID;
+    for (char *token = strtok_r(path, "/", &saveptr); token != NULL;
+         token = strtok_r(NULL, "/", &saveptr)) {
+        int current = walked[depth];
+        int dot = strcmp(token, CURRENT_DIR) == 0;
+        if (dot || strcmp(token, PARENT_DIR) == 0) {
+            const struct heartyfs_directory *dir = hfs_block(fs, current);
+            if (dir->type != DIR_TYPE) {
+                return HEARTYFS_ERR_NOT_DIR;
+            }
+            if (!dot && depth > 0) {
+                depth--;
+            }
+            continue;
+        }
+
+        int next;
+        if (hfs_snapshot_name(fs, current, token)) {
+            if (writable) {
+                return HEARTYFS_ERR_RDONLY;
+            }
+            next = fs->snapshot_dir;
+        } else {
+            int ret = hfs_lookup(fs, current, token, &next);
+            if (ret == HEARTYFS_OK && writable && fs->shares) {
+                ret = hfs_unshare_entry(fs, current, token, &next);
+            }
+            if (ret != HEARTYFS_OK) {
+                return ret;
+            }
+        }
+        walked[++depth] = next;
+    }
+
+    *block = walked[depth];
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Resolve a path through the path cache, then by walking it
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path to resolve
+ * @param[in] writable 1 if the caller is about to change the block
+ * @param[out] block Receives the block id
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+static int resolve(struct heartyfs *fs, const char *path, int writable,
+                   int *block) {
+    char path_copy[MAX_PATH_LENGTH];
+    if (strlen(path) >= MAX_PATH_LENGTH) {
+        return HEARTYFS_ERR_NAME_TOO_LONG;
+    }
+
+    // A cached block is only known to be unshared if nothing is
+    int ret = HEARTYFS_OK;
+    int use_cache = !writable || !hfs_has_snapshots(fs);
+    if (!use_cache || !hfs_dcache_path_lookup(fs, path, block)) {
+        strcpy(path_copy, path);
+        ret = walk_path(fs, path_copy, writable, block);
+        if (ret == HEARTYFS_OK) {
+            hfs_dcache_path_insert(fs, path, *block);
+        }
+    }
+    if (ret == HEARTYFS_OK && writable && fs->snapshot_dir &&
+        *block == fs->snapshot_dir) {
+        return HEARTYFS_ERR_RDONLY;
+    }
+    return ret;
+}
+
+/**
+ * @brief Resolve a path and lock the block it names
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path to resolve
+ * @param[in] writable 1 if the caller is about to change the block
+ * @param[in] dir 1 to take the directory lock, 0 for the inode lock
+ * @param[out] block Receives the block id, locked until the operation ends
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * The walk takes no locks, so if another process changed a directory
+ * meanwhile the path is walked again with the lock held; the lock is
+ * kept only if the path still leads to the same block.
+ */
+static int resolve_locked(struct heartyfs *fs, const char *path,
+                          int writable, int dir, int *block) {
+    unsigned gen = hfs_locks_sync(fs);
+    int ret = resolve(fs, path, writable, block);
+    while (ret == HEARTYFS_OK) {
+        ret = dir ? hfs_lock_dir(fs, *block) : hfs_lock_inode(fs, *block);
+        if (ret != HEARTYFS_OK || hfs_locks_unchanged(fs, gen)) {
+            break;
+        }
+
+        gen = hfs_locks_sync(fs);
+        int again;
+        ret = resolve(fs, path, writable, &again);
+        if (ret == HEARTYFS_OK && again == *block) {
+            break;
+        }
+        if (dir) {
+            hfs_unlock_dir(fs, *block);
+        } else {
+            hfs_unlock_inode(fs, *block);
+        }
+        *block = again;
+    }
+    return ret;
+}
+
+/**
+ * @brief Resolve a full path to the block id it names
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path to resolve, e.g. "/dir1/file"
+ * @param[out] block Receives the block id of the inode or directory
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int hfs_resolve(struct heartyfs *fs, const char *path, int *block) {
+    return resolve(fs, path, 0, block);
+}
+
+/**
+ * @brief Resolve a path whose block the caller is about to change
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path to resolve
+ * @param[out] block Receives the block id of the inode or directory
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Every block on the way that the live tree shares with a snapshot is
+ * copied first, so the block returned, and every directory above it, may
+ * be changed in place. Paths into the snapshots fail with
+ * HEARTYFS_ERR_RDONLY.
+ */
+int hfs_resolve_writable(struct heartyfs *fs, const char *path, int *block) {
+    return resolve(fs, path, 1, block);
+}
+
+/**
+ * @brief Resolve a path to a file and lock it against other writers
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path to resolve
+ * @param[in] writable 1 if the caller is about to change the file
+ * @param[out] block Receives the block id, locked until the operation ends
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int hfs_resolve_locked(struct heartyfs *fs, const char *path, int writable,
+                       int *block) {
+    return resolve_locked(fs, path, writable, 0, block);
+}
+
+/**
+ * @brief Resolve the parent directory of a path and split off its last name
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path whose parent should be resolved
+ * @param[out] parent Receives the block id of the parent directory
+ * @param[out] name Receives the final component (MAX_NAME_LENGTH + 1 bytes)
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Trailing slashes are ignored, so "/dir1/dir2/" names "dir2" in "/dir1".
+ * The parent is locked until the operation ends.
+ */
+int hfs_resolve_parent(struct heartyfs *fs, const char *path, int *parent,
+                       char *name) {
+    char path_copy[MAX_PATH_LENGTH];
+    if (strlen(path) >= MAX_PATH_LENGTH) {
+        return HEARTYFS_ERR_NAME_TOO_LONG;
+    }
+    strcpy(path_copy, path);
+
+    // Strip trailing slashes
+    size_t len = strlen(path_copy);
+    while (len > 0 && path_copy[len - 1] == '/') {
+        path_copy[--len] = '\0';
+    }
+
+    char *slash = strrchr(path_copy, '/');
+    char *base = slash ? slash + 1 : path_copy;
+    if (*base == '\0' || strcmp(base, CURRENT_DIR) == 0 ||
+        strcmp(base, PARENT_DIR) == 0) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    if (strlen(base) > MAX_NAME_LENGTH) {
+        return HEARTYFS_ERR_NAME_TOO_LONG;
+    }
+    strcpy(name, base);
+    *base = '\0';
+
+    // The parent prefix is itself a path worth caching
+    int ret = resolve_locked(fs, path_copy, 1, 1, parent);
+    if (ret == HEARTYFS_ERR_NOT_FOUND || ret == HEARTYFS_ERR_NOT_DIR) {
+        return HEARTYFS_ERR_PARENT_NOT_FOUND;
+    }
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    if (((struct heartyfs_directory *)hfs_block(fs, *parent))->type != DIR_TYPE) {
+        return HEARTYFS_ERR_PARENT_NOT_FOUND;
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Resolve a path to a block id
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path to resolve
+ * @param[out] block Receives the block id
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int heartyfs_lookup(struct heartyfs *fs, const char *path, int *block) {
+    if (!fs || !path || !block) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    int ret = hfs_op_begin(fs, 0);
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_resolve(fs, path, block);
+    }
+    return hfs_op_end(fs, ret);
+}
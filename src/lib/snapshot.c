@@ -0,0 +1,392 @@
+#include "heartyfs_internal.h"
+
+/*
+ * Copy-on-write snapshots; see heartyfs.h for the share count table.
+ *
+ * Taking a snapshot copies the root directory and takes a reference on
+ * each of its entries, so it costs the same whatever the size of the
+ * tree. Counts are pushed down lazily: a block below a shared directory
+ * is shared too, even while its own count is still zero. Changes to the
+ * live tree therefore walk down from the root with hfs_resolve_writable(),
+ * which copies every shared block on the way and points its parent at the
+ * copy. The copy takes a reference on each of its children and the
+ * original gives one up, so below an unshared path a count of zero means
+ * that the live tree is the only owner.
+ *
+ * Dropping a reference to a block that has others only decrements its
+ * count. Dropping the last one frees the block and drops its references
+ * to its children in turn, so deleting a snapshot frees exactly the
+ * blocks that nothing else uses any more.
+ */
+
+/**
+ * @brief Note that the share counts of a run of blocks are about to change
+ * @param[in] fs Mounted filesystem with snapshots
+ * @param[in] start First block of the run
+ * @param[in] length Number of blocks in the run
+ */
+static void dirty_shares(struct heartyfs *fs, int start, int length) {
+    int first = start >> fs->block_shift;
+    int last = (start + length - 1) >> fs->block_shift;
+    for (int b = first; b <= last; b++) {
+        hfs_dirty_block(fs, fs->snapshot_dir + 1 + b);
+    }
+}
+
+/**
+ * @brief Take one more reference on a run of blocks
+ * @param[in] fs Mounted filesystem
+ * @param[in] start First block of the run
+ * @param[in] length Number of blocks in the run
+ */
+void hfs_ref_run(struct heartyfs *fs, int start, int length) {
+    if (!fs->shares || length <= 0 || !hfs_block_in_range(fs, start) ||
+        !hfs_block_in_range(fs, start + length - 1)) {
+        return;
+    }
+    dirty_shares(fs, start, length);
+    for (int b = start; b < start + length; b++) {
+        fs->shares[b]++;
+    }
+}
+
+/**
+ * @brief Drop one reference on a run of blocks
+ * @param[in] fs Mounted filesystem
+ * @param[in] start First block of the run
+ * @param[in] length Number of blocks in the run
+ *
+ * Blocks that were referenced only once are freed; the others just lose
+ * a reference.
+ */
+void hfs_unref_run(struct heartyfs *fs, int start, int length) {
+    if (!fs->shares) {
+        hfs_free_run(fs, start, length);
+        return;
+    }
+    if (length <= 0 || !hfs_block_in_range(fs, start) ||
+        !hfs_block_in_range(fs, start + length - 1)) {
+        return;
+    }
+
+    int run = 0;  // Unshared blocks just before b
+    for (int b = start; b < start + length; b++) {
+        if (fs->shares[b] == 0) {
+            run++;
+            continue;
+        }
+        if (run > 0) {
+            hfs_free_run(fs, b - run, run);
+            run = 0;
+        }
+        dirty_shares(fs, b, 1);
+        fs->shares[b]--;
+    }
+    if (run > 0) {
+        hfs_free_run(fs, start + length - run, run);
+    }
+}
+
+/**
+ * @brief Check whether the image holds any snapshot
+ * @param[in] fs Mounted filesystem
+ * @return 1 if at least one snapshot exists, 0 otherwise
+ *
+ * Without snapshots every share count is zero, so nothing needs copying.
+ */
+int hfs_has_snapshots(const struct heartyfs *fs) {
+    if (!fs->snapshot_dir) {
+        return 0;
+    }
+    const struct heartyfs_directory *dir = hfs_block(fs, fs->snapshot_dir);
+    return dir->size > MIN_DIR_ENTRIES;
+}
+
+/**
+ * @brief Copy a directory head into a new block
+ * @param[in] fs Mounted filesystem
+ * @param[in] block Directory to copy; the root if SUPERBLOCK_ID
+ * @return Block id of the copy, or HEARTYFS_ERR_NO_SPACE
+ *
+ * The copy takes a reference on each of its entries and on the hash
+ * index, which it shares with the original until either side changes it.
+ */
+static int copy_directory(struct heartyfs *fs, int block) {
+    int copy = hfs_alloc_block(fs);
+    if (copy < 0) {
+        return copy;
+    }
+
+    struct heartyfs_directory *dir = hfs_block(fs, copy);
+    hfs_dirty(fs, dir);
+    memset(dir, 0, fs->block_size);
+    memcpy(dir, hfs_block(fs, block), sizeof(*dir));
+    dir->entries[0].block_id = copy;
+
+    int size = dir->size < MAX_DIR_ENTRIES ? dir->size : MAX_DIR_ENTRIES;
+    if (dir->index_block) {
+        size = MIN_DIR_ENTRIES;
+        hfs_ref_run(fs, dir->index_block, 1);
+    }
+    for (int i = MIN_DIR_ENTRIES; i < size; i++) {
+        hfs_ref_run(fs, dir->entries[i].block_id, 1);
+    }
+    return copy;
+}
+
+/**
+ * @brief Copy an inode, with its extent blocks, into a new block
+ * @param[in] fs Mounted filesystem
+ * @param[in] block Inode to copy
+ * @return Block id of the copy, or a HEARTYFS_ERR_* code on failure
+ *
+ * The data blocks are not copied; the copy takes a reference on them.
+ */
+static int copy_inode(struct heartyfs *fs, int block) {
+    int copy = hfs_alloc_block(fs);
+    if (copy < 0) {
+        return copy;
+    }
+
+    struct heartyfs_inode *inode = hfs_block(fs, copy);
+    hfs_dirty(fs, inode);
+    memcpy(inode, hfs_block(fs, block), fs->block_size);
+    int ret = hfs_extents_clone(fs, inode);
+    if (ret != HEARTYFS_OK) {
+        memset(inode, 0, fs->block_size);
+        hfs_free_block(fs, copy);
+        return ret;
+    }
+    return copy;
+}
+
+/**
+ * @brief Give the live tree its own copy of a directory entry
+ * @param[in] fs Mounted filesystem
+ * @param[in] parent Unshared directory holding the entry
+ * @param[in] name Entry name
+ * @param[in,out] block Block the entry points to; receives the copy
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * In a hashed directory the leaf holding the entry is copied first if it
+ * is shared, since only then does the entry's own count tell whether the
+ * block is shared. Blocks that turn out not to be are left alone.
+ */
+int hfs_unshare_entry(struct heartyfs *fs, int parent, const char *name,
+                      int *block) {
+    struct heartyfs_directory *dir = hfs_block(fs, parent);
+    if (dir->index_block) {
+        int ret = hfs_htree_unshare(fs, dir, name);
+        if (ret != HEARTYFS_OK) {
+            return ret;
+        }
+    }
+    if (!hfs_shared(fs, *block)) {
+        return HEARTYFS_OK;
+    }
+
+    const struct heartyfs_directory *node = hfs_block(fs, *block);
+    int copy;
+    if (node->type == DIR_TYPE) {
+        copy = copy_directory(fs, *block);
+    } else if (node->type == FILE_TYPE) {
+        copy = copy_inode(fs, *block);
+    } else {
+        return HEARTYFS_ERR_CORRUPT;
+    }
+    if (copy < 0) {
+        return copy;
+    }
+
+    int ret = hfs_dir_relink(fs, dir, name, copy);
+    if (ret != HEARTYFS_OK) {
+        hfs_drop_node(fs, copy);
+        return ret;
+    }
+    hfs_unref_run(fs, *block, 1);
+    hfs_dcache_relink(fs, parent, name, copy);
+    *block = copy;
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Drop one reference to a directory or inode
+ * @param[in] fs Mounted filesystem
+ * @param[in] block Block id of the directory or inode
+ *
+ * If this was the last reference, the node is freed together with its
+ * extent or index blocks, and every data block or entry below it loses
+ * a reference in turn.
+ */
+void hfs_drop_node(struct heartyfs *fs, int block) {
+    if (!hfs_block_in_range(fs, block)) {
+        return;
+    }
+    if (hfs_shared(fs, block)) {
+        hfs_unref_run(fs, block, 1);
+        return;
+    }
+
+    struct heartyfs_directory *dir = hfs_block(fs, block);
+    hfs_dirty(fs, dir);
+    if (dir->type == DIR_TYPE && dir->index_block) {
+        hfs_htree_free(fs, dir);
+    } else if (dir->type == DIR_TYPE) {
+        int size = dir->size < MAX_DIR_ENTRIES ? dir->size : MAX_DIR_ENTRIES;
+        for (int i = MIN_DIR_ENTRIES; i < size; i++) {
+            hfs_drop_node(fs, dir->entries[i].block_id);
+        }
+    } else if (dir->type == FILE_TYPE) {
+        hfs_free_file_blocks(fs, (struct heartyfs_inode *)dir);
+    } else {
+        return;  // Corrupted; leak rather than free random blocks
+    }
+    memset(dir, 0, fs->block_size);
+    hfs_free_block(fs, block);
+}
+
+/**
+ * @brief Check that a snapshot name can be used as a directory entry
+ * @param[in] name Snapshot name
+ * @return HEARTYFS_OK, HEARTYFS_ERR_INVALID or HEARTYFS_ERR_NAME_TOO_LONG
+ */
+static int check_name(const char *name) {
+    if (!name || *name == '\0' || strchr(name, '/') ||
+        strcmp(name, CURRENT_DIR) == 0 || strcmp(name, PARENT_DIR) == 0) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    return strlen(name) > MAX_NAME_LENGTH ? HEARTYFS_ERR_NAME_TOO_LONG
+                                          : HEARTYFS_OK;
+}
+
+/**
+ * @brief Look up a snapshot before creating or deleting one
+ * @param[in] fs Mounted filesystem
+ * @param[in] name Snapshot name
+ * @param[out] root Receives the snapshot's root directory, if it exists
+ * @return HEARTYFS_OK if it exists, HEARTYFS_ERR_NOT_FOUND if not, or
+ *         another HEARTYFS_ERR_* code
+ */
+static int prepare_snapshot(struct heartyfs *fs, const char *name,
+                            int *root) {
+    if (!fs) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    int ret = check_name(name);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+    if (!fs->snapshot_dir) {
+        return HEARTYFS_ERR_UNSUPPORTED;
+    }
+    if (!hfs_writable(fs)) {
+        return HEARTYFS_ERR_RDONLY;
+    }
+
+    ret = hfs_journal_begin_op(fs);
+    if (ret == HEARTYFS_OK) {
+        ret = hfs_lookup(fs, fs->snapshot_dir, name, root);
+    }
+    return ret;
+}
+
+/**
+ * @brief Copy the root into the snapshots; the image is ours alone
+ */
+static int take_snapshot(struct heartyfs *fs, const char *name) {
+    int root;
+    int ret = prepare_snapshot(fs, name, &root);
+    if (ret == HEARTYFS_OK) {
+        return HEARTYFS_ERR_EXISTS;
+    }
+    if (ret != HEARTYFS_ERR_NOT_FOUND) {
+        return ret;
+    }
+
+    struct heartyfs_directory *snapshots = hfs_block(fs, fs->snapshot_dir);
+    if (snapshots->size - MIN_DIR_ENTRIES >= MAX_SNAPSHOTS) {
+        return HEARTYFS_ERR_DIR_FULL;
+    }
+
+    root = copy_directory(fs, SUPERBLOCK_ID);
+    if (root < 0) {
+        return root;
+    }
+    struct heartyfs_directory *dir = hfs_block(fs, root);
+    memset(dir->name, 0, sizeof(dir->name));
+    strcpy(dir->name, name);
+    dir->entries[1].block_id = fs->snapshot_dir;
+
+    ret = hfs_dir_add(fs, snapshots, name, root);
+    if (ret != HEARTYFS_OK) {
+        hfs_drop_node(fs, root);
+        return ret;
+    }
+    hfs_dcache_insert(fs, fs->snapshot_dir, name, root);
+    return hfs_end_op(fs);
+}
+
+/**
+ * @brief Take a read-only, point-in-time snapshot of the whole tree
+ * @param[in] fs Mounted filesystem
+ * @param[in] name Name of the snapshot
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Only the root directory is copied, so this takes constant time. The
+ * snapshot then appears as /.snapshots/<name>, and later changes to the
+ * live tree copy just the blocks they touch. The image must have been
+ * formatted with heartyfs_init -S. Share counts are global state, so on
+ * such an image every operation, this one included, holds the image
+ * lock: operations from different processes take turns rather than run
+ * side by side.
+ */
+int heartyfs_snapshot(struct heartyfs *fs, const char *name) {
+    if (!fs) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    int ret = hfs_op_begin(fs, 1);
+    if (ret == HEARTYFS_OK) {
+        ret = take_snapshot(fs, name);
+    }
+    return hfs_op_end(fs, ret);
+}
+
+/**
+ * @brief Unlink a snapshot and drop what only it held
+ */
+static int drop_snapshot(struct heartyfs *fs, const char *name) {
+    int root;
+    int ret = prepare_snapshot(fs, name, &root);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    ret = hfs_dir_remove(fs, hfs_block(fs, fs->snapshot_dir), name);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+    hfs_dcache_remove(fs, fs->snapshot_dir, name, 1);
+    hfs_drop_node(fs, root);
+    return hfs_end_op(fs);
+}
+
+/**
+ * @brief Delete a snapshot
+ * @param[in] fs Mounted filesystem
+ * @param[in] name Name of the snapshot
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Blocks that the live tree or another snapshot still uses are kept;
+ * the cost grows with the number of blocks only this snapshot held.
+ * Other processes wait until it is done.
+ */
+int heartyfs_rmsnapshot(struct heartyfs *fs, const char *name) {
+    if (!fs) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    int ret = hfs_op_begin(fs, 1);
+    if (ret == HEARTYFS_OK) {
+        ret = drop_snapshot(fs, name);
+    }
+    return hfs_op_end(fs, ret);
+}
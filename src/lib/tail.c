@@ -0,0 +1,228 @@
+#include "heartyfs_internal.h"
+
+/*
+ * Tail packing; see heartyfs.h for the layout of a tail block.
+ *
+ * Fragments are carved out of the tail block named in the extension
+ * block, and a new tail block is started once that one has no run of
+ * free slots long enough; whichever of the two has more room left is the
+ * one to pack into next. Freeing a fragment likewise makes its block the
+ * one to pack into if it now has the most room, and frees the block once
+ * its last fragment is gone.
+ *
+ * Tail blocks are metadata: they are changed through the metadata
+ * mapping and journaled. A fragment belongs to a single inode, and a
+ * copy of an inode gets a copy of its fragment, so tail blocks are never
+ * shared with a snapshot.
+ */
+
+/**
+ * @brief Bytes per slot of a tail block
+ */
+static int slot_size(const struct heartyfs *fs) {
+    return fs->block_size / TAIL_SLOTS;
+}
+
+/**
+ * @brief Bit mask covering a run of slots
+ */
+static unsigned long long slot_mask(int slot, int count) {
+    return ((1ULL << count) - 1) << slot;
+}
+
+/**
+ * @brief Extension block, in the metadata mapping
+ */
+static struct heartyfs_sb_ext *sb_ext(const struct heartyfs *fs) {
+    return hfs_block(fs, fs->sb->ext_block);
+}
+
+/**
+ * @brief Find a run of free slots in a tail block
+ * @param[in] tb Tail block
+ * @param[in] count Slots wanted
+ * @return First slot of the run, or -1 if there is none
+ */
+static int find_slots(const struct heartyfs_tail_block *tb, int count) {
+    int run = 0;
+    for (int slot = 1; slot < TAIL_SLOTS; slot++) {
+        run = tb->used & (1ULL << slot) ? 0 : run + 1;
+        if (run == count) {
+            return slot - count + 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Largest fragment a tail block can hold
+ * @param[in] fs Mounted filesystem
+ * @return Length in bytes, or 0 if the image does not pack tails
+ */
+long long hfs_tail_max(const struct heartyfs *fs) {
+    return fs->tail_packing ? (long long)(TAIL_SLOTS - 1) * slot_size(fs)
+                            : 0;
+}
+
+/**
+ * @brief Carve out a fragment with the tail lock held
+ */
+static int tail_alloc(struct heartyfs *fs, long long len,
+                      struct heartyfs_tail *tail) {
+    int count = (len + slot_size(fs) - 1) / slot_size(fs);
+    struct heartyfs_sb_ext *ext = sb_ext(fs);
+    int block = ext->tail_block;
+    int slot = hfs_block_in_range(fs, block)
+                   ? find_slots(hfs_block(fs, block), count)
+                   : -1;
+    if (slot < 0) {
+        block = hfs_alloc_block(fs);
+        if (block < 0) {
+            return block;
+        }
+        struct heartyfs_tail_block *tb = hfs_block(fs, block);
+        hfs_dirty(fs, tb);
+        memset(tb, 0, fs->block_size);
+        tb->used = 1;  // The header
+        slot = 1;
+
+        // Keep packing into the old block if it still has more room
+        const struct heartyfs_tail_block *old =
+            hfs_block_in_range(fs, ext->tail_block)
+                ? hfs_block(fs, ext->tail_block)
+                : NULL;
+        if (!old || __builtin_popcountll(old->used) > count + 1) {
+            hfs_dirty(fs, ext);
+            ext->tail_block = block;
+        }
+    }
+
+    struct heartyfs_tail_block *tb = hfs_block(fs, block);
+    hfs_dirty(fs, tb);
+    tb->used |= slot_mask(slot, count);
+    tail->block = block;
+    tail->offset = slot * slot_size(fs);
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Allocate a fragment in a tail block
+ * @param[in] fs Mounted filesystem
+ * @param[in] len Length of the fragment, at most hfs_tail_max()
+ * @param[out] tail Receives the block and offset of the fragment
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * The tail block is marked dirty; the caller fills the fragment through
+ * the metadata mapping.
+ */
+int hfs_tail_alloc(struct heartyfs *fs, long long len,
+                   struct heartyfs_tail *tail) {
+    if (len <= 0 || len > hfs_tail_max(fs)) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    int ret = hfs_lock_tail(fs);
+    if (ret == HEARTYFS_OK) {
+        ret = tail_alloc(fs, len, tail);
+        hfs_unlock_tail(fs);
+    }
+    return ret;
+}
+
+/**
+ * @brief Give back slots of a tail block with the tail lock held
+ */
+static void tail_free(struct heartyfs *fs, const struct heartyfs_tail *tail,
+                      int slot, int count) {
+
+    struct heartyfs_tail_block *tb = hfs_block(fs, tail->block);
+    struct heartyfs_sb_ext *ext = sb_ext(fs);
+    hfs_dirty(fs, tb);
+    tb->used &= ~slot_mask(slot, count);
+    if (tb->used == 1) {
+        if (ext->tail_block == tail->block) {
+            hfs_dirty(fs, ext);
+            ext->tail_block = 0;
+        }
+        memset(tb, 0, fs->block_size);
+        hfs_free_block(fs, tail->block);
+        return;
+    }
+
+    // Pack into whichever block has the most room
+    if (ext->tail_block != tail->block) {
+        const struct heartyfs_tail_block *current =
+            hfs_block_in_range(fs, ext->tail_block)
+                ? hfs_block(fs, ext->tail_block)
+                : NULL;
+        if (!current || __builtin_popcountll(tb->used) <
+                            __builtin_popcountll(current->used)) {
+            hfs_dirty(fs, ext);
+            ext->tail_block = tail->block;
+        }
+    }
+}
+
+/**
+ * @brief Release a fragment
+ * @param[in] fs Mounted filesystem
+ * @param[in] tail Fragment to release
+ * @param[in] len Length of the fragment
+ */
+void hfs_tail_free(struct heartyfs *fs, const struct heartyfs_tail *tail,
+                   long long len) {
+    int slot = tail->offset / slot_size(fs);
+    int count = (len + slot_size(fs) - 1) / slot_size(fs);
+    if (!fs->tail_packing || !hfs_block_in_range(fs, tail->block) ||
+        slot < 1 || count < 1 || slot + count > TAIL_SLOTS) {
+        return;  // Corrupted; leak rather than free random slots
+    }
+    if (hfs_lock_tail(fs) != HEARTYFS_OK) {
+        return;  // Leak rather than race another writer
+    }
+    tail_free(fs, tail, slot, count);
+    hfs_unlock_tail(fs);
+}
+
+/**
+ * @brief Check the tail fragment descriptor of a packed file
+ * @param[in] fs Mounted filesystem
+ * @param[in] inode Packed file inode
+ * @return 1 if the descriptor is plausible, 0 otherwise
+ */
+int hfs_tail_valid(const struct heartyfs *fs,
+                   const struct heartyfs_inode *inode) {
+    if (!fs->tail_packing || inode->num_extents < 1 ||
+        inode->num_extents >= MAX_DIRECT_EXTENTS) {
+        return 0;
+    }
+
+    const struct heartyfs_tail *tail = hfs_file_tail(inode);
+    long long len = hfs_tail_length(fs, inode);
+    return tail->logical == inode->size &&
+           hfs_block_in_range(fs, tail->block) && len <= hfs_tail_max(fs) &&
+           tail->offset >= slot_size(fs) && tail->offset % slot_size(fs) == 0 &&
+           tail->offset + len <= fs->block_size;
+}
+
+/**
+ * @brief Give a copied inode its own copy of its tail fragment
+ * @param[in] fs Mounted filesystem
+ * @param[out] inode Copy of a packed inode, still naming the original's
+ *                   fragment
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int hfs_tail_copy(struct heartyfs *fs, struct heartyfs_inode *inode) {
+    struct heartyfs_tail *tail = hfs_file_tail(inode);
+    long long len = hfs_tail_length(fs, inode);
+    struct heartyfs_tail copy = *tail;
+    int ret = hfs_tail_alloc(fs, len, &copy);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+
+    memcpy((char *)hfs_block(fs, copy.block) + copy.offset,
+           (const char *)hfs_block(fs, tail->block) + tail->offset, len);
+    hfs_dirty(fs, inode);
+    *tail = copy;
+    return HEARTYFS_OK;
+}
@@ -0,0 +1,307 @@
+#define _GNU_SOURCE  // sync_file_range()
+#include "heartyfs_internal.h"
+#include <errno.h>
+
+/*
+ * Dirty-range tracking for explicit flushes. Every block an operation
+ * changes through the shared mapping is recorded as a run of blocks:
+ * metadata through hfs_dirty() on images without a journal, file data
+ * through hfs_dirty_data() on every image. A flush then writes back just
+ * those runs instead of the whole image.
+ *
+ * Runs are appended in the order they are dirtied and merged with the
+ * previous one when they touch, which covers sequential writes. When the
+ * list fills up it is sorted and coalesced; if that does not free enough
+ * room, writeback of the runs tracked so far is started and the next
+ * flush covers the whole file.
+ */
+#define MIN_RANGES 64
+#define MAX_RANGES 4096
+
+struct block_range {
+    int start;              // First dirty block
+    int length;             // Dirty blocks in the run
+};
+
+struct hfs_writeback {
+    struct block_range *ranges;  // Dirty runs since the last flush
+    int count;
+    int capacity;
+    int whole;              // Too many runs; flush the whole file instead
+};
+
+/**
+ * @brief Allocate an empty tracker for a writable mount
+ * @param[in,out] fs Filesystem being mounted
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_NO_MEMORY on failure
+ */
+int hfs_writeback_init(struct heartyfs *fs) {
+    fs->writeback = calloc(1, sizeof(struct hfs_writeback));
+    return fs->writeback ? HEARTYFS_OK : HEARTYFS_ERR_NO_MEMORY;
+}
+
+/**
+ * @brief Release the tracker of a mount handle
+ * @param[in,out] fs Filesystem being unmounted
+ */
+void hfs_writeback_destroy(struct heartyfs *fs) {
+    if (fs->writeback) {
+        free(fs->writeback->ranges);
+        free(fs->writeback);
+        fs->writeback = NULL;
+    }
+}
+
+static int compare_ranges(const void *a, const void *b) {
+    const struct block_range *x = a;
+    const struct block_range *y = b;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+/**
+ * @brief Sort the dirty runs and merge those that overlap or touch
+ * @param[in,out] wb Tracker
+ */
+static void coalesce(struct hfs_writeback *wb) {
+    if (wb->count < 2) {
+        return;
+    }
+    qsort(wb->ranges, wb->count, sizeof(*wb->ranges), compare_ranges);
+
+    int out = 0;
+    for (int i = 1; i < wb->count; i++) {
+        struct block_range *last = &wb->ranges[out];
+        struct block_range *cur = &wb->ranges[i];
+        if (cur->start <= last->start + last->length) {
+            int end = cur->start + cur->length;
+            if (end > last->start + last->length) {
+                last->length = end - last->start;
+            }
+        } else {
+            wb->ranges[++out] = *cur;
+        }
+    }
+    wb->count = out + 1;
+}
+
+/**
+ * @brief Start writeback of every tracked run
+ * @param[in] fs Mounted filesystem
+ * @param[in,out] wb Tracker; its runs are sorted and coalesced
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_IO on failure
+ */
+static int start_ranges(struct heartyfs *fs, struct hfs_writeback *wb) {
+    coalesce(wb);
+    for (int i = 0; i < wb->count; i++) {
+        off_t offset = (off_t)wb->ranges[i].start << fs->block_shift;
+        off_t len = (off_t)wb->ranges[i].length << fs->block_shift;
+        if (sync_file_range(fs->fd, offset, len, SYNC_FILE_RANGE_WRITE) != 0) {
+            return HEARTYFS_ERR_IO;
+        }
+    }
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Stop tracking runs; the next flush covers the whole file
+ * @param[in] fs Mounted filesystem
+ * @param[in,out] wb Tracker
+ *
+ * Writeback of the runs tracked so far starts now, so the whole-file
+ * flush does not find all of them still dirty. An error here shows up
+ * again when that flush runs.
+ */
+static void give_up(struct heartyfs *fs, struct hfs_writeback *wb) {
+    start_ranges(fs, wb);
+    wb->whole = 1;
+    wb->count = 0;
+}
+
+/**
+ * @brief Record that a run of blocks in the shared mapping has changed
+ * @param[in] fs Mounted filesystem
+ * @param[in] start First block of the run
+ * @param[in] length Number of blocks in the run
+ */
+void hfs_writeback_mark(struct heartyfs *fs, int start, int length) {
+    struct hfs_writeback *wb = fs->writeback;
+    if (!wb || wb->whole || length <= 0) {
+        return;
+    }
+
+    if (wb->count > 0) {
+        struct block_range *last = &wb->ranges[wb->count - 1];
+        if (start >= last->start && start <= last->start + last->length) {
+            if (start + length > last->start + last->length) {
+                last->length = start + length - last->start;
+            }
+            return;
+        }
+    }
+
+    if (wb->count == wb->capacity) {
+        if (wb->capacity == MAX_RANGES) {
+            coalesce(wb);
+        }
+        if (wb->count > MAX_RANGES / 2) {
+            give_up(fs, wb);
+            return;
+        }
+        if (wb->count == wb->capacity) {
+            int capacity = wb->capacity ? 2 * wb->capacity : MIN_RANGES;
+            struct block_range *grown =
+                realloc(wb->ranges, capacity * sizeof(*grown));
+            if (!grown) {
+                give_up(fs, wb);
+                return;
+            }
+            wb->ranges = grown;
+            wb->capacity = capacity;
+        }
+    }
+    wb->ranges[wb->count++] = (struct block_range){start, length};
+}
+
+/**
+ * @brief Record that a byte range of the data mapping has changed
+ * @param[in] fs Mounted filesystem
+ * @param[in] ptr Start of the range inside fs->data
+ * @param[in] len Length of the range
+ */
+void hfs_dirty_data(struct heartyfs *fs, const void *ptr, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    size_t offset = (const char *)ptr - (const char *)fs->data;
+    int first = offset >> fs->block_shift;
+    int last = (offset + len - 1) >> fs->block_shift;
+    hfs_writeback_mark(fs, first, last - first + 1);
+    if (fs->csum) {
+        hfs_csum_dirty(fs, first, last - first + 1, CSUM_DATA);
+    }
+}
+
+/**
+ * @brief Write back the dirty runs of the shared mapping
+ * @param[in] fs Mounted filesystem
+ * @param[in] wait 1 to wait until they are durable, 0 to only start I/O
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_IO on failure
+ *
+ * Every run is queued with sync_file_range() first, so the device sees
+ * them all at once. Waiting then goes over the runs again, waiting for
+ * each one's writeback, and ends with a single fdatasync() that flushes
+ * the device cache. Clean blocks between the runs are never touched.
+ */
+static int flush_ranges(struct heartyfs *fs, int wait) {
+    struct hfs_writeback *wb = fs->writeback;
+    if (wb->whole) {
+        if (wait ? fdatasync(fs->fd) != 0
+                 : sync_file_range(fs->fd, 0, 0, SYNC_FILE_RANGE_WRITE) != 0) {
+            return HEARTYFS_ERR_IO;
+        }
+        wb->whole = 0;
+        return HEARTYFS_OK;
+    }
+    if (wb->count == 0) {
+        return HEARTYFS_OK;
+    }
+
+    if (start_ranges(fs, wb) != HEARTYFS_OK) {
+        return HEARTYFS_ERR_IO;
+    }
+    if (wait) {
+        unsigned flags = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                         SYNC_FILE_RANGE_WAIT_AFTER;
+        for (int i = 0; i < wb->count; i++) {
+            off_t offset = (off_t)wb->ranges[i].start << fs->block_shift;
+            off_t len = (off_t)wb->ranges[i].length << fs->block_shift;
+            if (sync_file_range(fs->fd, offset, len, flags) != 0) {
+                return HEARTYFS_ERR_IO;
+            }
+        }
+        if (fdatasync(fs->fd) != 0) {
+            return HEARTYFS_ERR_IO;
+        }
+    }
+    wb->count = 0;
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Flush the changes made since the last flush
+ * @param[in] fs Mounted filesystem
+ * @param[in] level HEARTYFS_DURABLE_* level to flush at
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * With HEARTYFS_DURABLE_SYNC every change is on stable storage when this
+ * returns; a journaled image commits, which flushes file data too. With
+ * HEARTYFS_DURABLE_ASYNC writeback of the changed blocks is only started,
+ * and a journaled image keeps committing on its usual schedule.
+ * HEARTYFS_DURABLE_NONE does nothing.
+ */
+int hfs_flush(struct heartyfs *fs, int level) {
+    if (!hfs_writable(fs) || level == HEARTYFS_DURABLE_NONE) {
+        return HEARTYFS_OK;
+    }
+
+    if (fs->journal && level == HEARTYFS_DURABLE_SYNC) {
+        int ret = hfs_journal_commit(fs);
+        if (ret == HEARTYFS_OK) {
+            fs->writeback->count = 0;
+            fs->writeback->whole = 0;
+        }
+        return ret;
+    }
+    return flush_ranges(fs, level == HEARTYFS_DURABLE_SYNC);
+}
+
+/**
+ * @brief Finish an operation: update checksums, then apply the mount's
+ *        durability level
+ * @param[in] fs Mounted filesystem
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int hfs_end_op(struct heartyfs *fs) {
+    hfs_csum_update(fs);
+    return hfs_flush(fs, fs->durability);
+}
+
+/**
+ * @brief Flush every change made through a mount handle so far
+ * @param[in] fs Mounted filesystem
+ * @param[in] level HEARTYFS_DURABLE_ASYNC or HEARTYFS_DURABLE_SYNC
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Only the blocks changed since the previous flush are written back.
+ */
+int heartyfs_flush(struct heartyfs *fs, int level) {
+    if (!fs || level < HEARTYFS_DURABLE_NONE || level > HEARTYFS_DURABLE_SYNC) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    return hfs_flush(fs, level);
+}
+
+/**
+ * @brief Make every completed operation durable
+ * @param[in] fs Mounted filesystem
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ *
+ * Same as heartyfs_flush() with HEARTYFS_DURABLE_SYNC.
+ */
+int heartyfs_sync(struct heartyfs *fs) {
+    return heartyfs_flush(fs, HEARTYFS_DURABLE_SYNC);
+}
+
+/**
+ * @brief Choose how durable each later operation is when it returns
+ * @param[in] fs Mounted filesystem
+ * @param[in] level HEARTYFS_DURABLE_NONE, _ASYNC or _SYNC
+ * @return HEARTYFS_OK on success, HEARTYFS_ERR_INVALID on a bad level
+ */
+int heartyfs_set_durability(struct heartyfs *fs, int level) {
+    if (!fs || level < HEARTYFS_DURABLE_NONE || level > HEARTYFS_DURABLE_SYNC) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    fs->durability = level;
+    return HEARTYFS_OK;
+}
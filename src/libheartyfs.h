@@ -0,0 +1,162 @@
+#ifndef LIBHEARTYFS_H
+#define LIBHEARTYFS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * libheartyfs - embeddable heartyfs core
+ *
+ * A mount handle keeps the disk file open and mapped, so any number of
+ * operations can run against one mapping. All calls return HEARTYFS_OK
+ * (or a non-negative value) on success and one of the negative
+ * HEARTYFS_ERR_* codes on failure.
+ */
+
+/* Mount flags */
+#define HEARTYFS_RDONLY 0x1
+#define HEARTYFS_NOCACHE 0x2    // Resolve every path from the root
+#define HEARTYFS_ASYNC 0x4      // Start writeback after every operation
+#define HEARTYFS_SYNC 0x8       // Make every operation durable on return
+#define HEARTYFS_COMPRESS 0x10  // Compress files written as a whole
+
+/* Durability levels for heartyfs_set_durability() and heartyfs_flush() */
+#define HEARTYFS_DURABLE_NONE 0     // Leave writeback to the kernel
+#define HEARTYFS_DURABLE_ASYNC 1    // Start writing the changed blocks
+#define HEARTYFS_DURABLE_SYNC 2     // Wait until they are on stable storage
+
+/* Error codes */
+#define HEARTYFS_OK 0
+#define HEARTYFS_ERR_IO -1
+#define HEARTYFS_ERR_NOT_INIT -2
+#define HEARTYFS_ERR_NOT_FOUND -3
+#define HEARTYFS_ERR_PARENT_NOT_FOUND -4
+#define HEARTYFS_ERR_EXISTS -5
+#define HEARTYFS_ERR_DIR_FULL -6
+#define HEARTYFS_ERR_NO_SPACE -7
+#define HEARTYFS_ERR_NOT_DIR -8
+#define HEARTYFS_ERR_NOT_FILE -9
+#define HEARTYFS_ERR_NOT_EMPTY -10
+#define HEARTYFS_ERR_NAME_TOO_LONG -11
+#define HEARTYFS_ERR_TOO_LARGE -12
+#define HEARTYFS_ERR_INVALID -13
+#define HEARTYFS_ERR_CORRUPT -14
+#define HEARTYFS_ERR_RDONLY -15
+#define HEARTYFS_ERR_NO_MEMORY -16
+#define HEARTYFS_ERR_UNSUPPORTED -17
+#define HEARTYFS_ERR_CHECKSUM -18
+
+/* Node types reported by heartyfs_stat() */
+#define HEARTYFS_TYPE_FILE 0
+#define HEARTYFS_TYPE_DIR 1
+
+struct heartyfs;
+
+struct heartyfs_stat {
+    int block;              // Block id of the inode or directory
+    int type;               // HEARTYFS_TYPE_FILE or HEARTYFS_TYPE_DIR
+    off_t size;             // Bytes for files, entries for directories
+    int blocks;             // Data blocks used by a file
+};
+
+/* Mount handle */
+int heartyfs_mount(const char *image_path, int flags, struct heartyfs **fsp);
+int heartyfs_unmount(struct heartyfs *fs);
+int heartyfs_sync(struct heartyfs *fs);
+int heartyfs_flush(struct heartyfs *fs, int level);
+int heartyfs_set_durability(struct heartyfs *fs, int level);
+const char *heartyfs_strerror(int err);
+void heartyfs_perror(int err);
+
+/* Path resolution */
+int heartyfs_lookup(struct heartyfs *fs, const char *path, int *block);
+int heartyfs_stat(struct heartyfs *fs, const char *path,
+                  struct heartyfs_stat *st);
+
+struct heartyfs_statfs {
+    int block_size;         // Bytes per block
+    int num_blocks;         // Blocks in the image
+    int free_blocks;        // Blocks currently free
+    int journal_blocks;     // Blocks in the metadata journal, or 0
+};
+
+int heartyfs_statfs(struct heartyfs *fs, struct heartyfs_statfs *sfs);
+
+/* Block allocation */
+int heartyfs_alloc_block(struct heartyfs *fs);
+int heartyfs_free_block(struct heartyfs *fs, int block);
+int heartyfs_alloc_run(struct heartyfs *fs, int want, int *length);
+int heartyfs_free_run(struct heartyfs *fs, int start, int length);
+
+/* Namespace operations */
+int heartyfs_mkdir(struct heartyfs *fs, const char *path);
+int heartyfs_rmdir(struct heartyfs *fs, const char *path);
+int heartyfs_creat(struct heartyfs *fs, const char *path);
+int heartyfs_rm(struct heartyfs *fs, const char *path);
+
+/* File I/O */
+ssize_t heartyfs_pread(struct heartyfs *fs, const char *path, void *buf,
+                       size_t len, off_t offset);
+int heartyfs_write_file(struct heartyfs *fs, const char *path,
+                        const void *buf, size_t len);
+ssize_t heartyfs_pwrite(struct heartyfs *fs, const char *path,
+                        const void *buf, size_t len, off_t offset);
+ssize_t heartyfs_append(struct heartyfs *fs, const char *path,
+                        const void *buf, size_t len);
+int heartyfs_read_to_fd(struct heartyfs *fs, const char *path, int out_fd);
+int heartyfs_read_range_to_fd(struct heartyfs *fs, const char *path,
+                              int out_fd, off_t offset, size_t length);
+int heartyfs_write_from_fd(struct heartyfs *fs, const char *path, int in_fd);
+
+/* Snapshots, readable under /.snapshots/<name> */
+int heartyfs_snapshot(struct heartyfs *fs, const char *name);
+int heartyfs_rmsnapshot(struct heartyfs *fs, const char *name);
+
+/* Bulk import of a host directory tree */
+struct heartyfs_import_report {
+    int threads;            // Threads that copied file contents
+    int dirs;               // Directories created or merged into
+    int files;              // Files written
+    long long bytes;        // Bytes written to those files
+    int skipped;            // Host entries left out
+};
+
+int heartyfs_import(struct heartyfs *fs, const char *host_dir,
+                    const char *path, int threads,
+                    void (*skip)(void *arg, const char *host_path, int err),
+                    void *arg, struct heartyfs_import_report *report);
+
+/* Export of a subtree as a tar archive */
+struct heartyfs_export_report {
+    int dirs;               // Directories archived
+    int files;              // Files archived
+    long long bytes;        // Bytes of file data archived
+};
+
+int heartyfs_export(struct heartyfs *fs, const char *path, int out_fd,
+                    struct heartyfs_export_report *report);
+
+/* Consistency check */
+#define HEARTYFS_FSCK_REPAIR 0x1    // Fix what can be fixed
+
+struct heartyfs_fsck_report {
+    int threads;            // Threads that walked the tree
+    int nodes;              // Directories and files walked
+    int blocks;             // Blocks reachable from the root or a snapshot
+    int leaked;             // Blocks marked in use but unreachable
+    int unmarked;           // Blocks in use but marked free
+    int dangling;           // Entries that name no file or directory
+    int cross_linked;       // Blocks with more owners than they may have
+    int bad_shares;         // Share counts that disagree with the tree
+    int bad_tails;          // Tail blocks whose slot map is wrong
+    int bad_dirs;           // Directories whose . entry or size is wrong
+    int corrupt;            // Nodes that could not be walked in full
+    int bad_checksums;      // Blocks that fail their checksum
+    int repaired;           // Problems fixed
+};
+
+int heartyfs_fsck(struct heartyfs *fs, int threads, int flags,
+                  void (*note)(void *arg, int block, const char *problem),
+                  void *arg, struct heartyfs_fsck_report *report);
+
+#endif
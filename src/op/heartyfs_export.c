@@ -0,0 +1,68 @@
+#include "../heartyfs.h"
+#include "../libheartyfs.h"
+#include <getopt.h>
+#include <string.h>
+
+/**
+ * @brief Print usage information
+ * @param[in] prog Program name
+ */
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-v] <path>\n", prog);
+}
+
+/**
+ * @brief Main function to write a subtree to stdout as a tar archive
+ * @param[in] argc Number of command line arguments
+ * @param[in] argv Array of command line arguments
+ * @return 0 on success, 1 on failure
+ *
+ * The archive is meant for a pipe or a file, so a terminal is refused.
+ * With -v a summary goes to stderr once the archive is complete.
+ */
+int main(int argc, char *argv[]) {
+    int verbose = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *path = argv[optind];
+    if (isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "Refusing to write an archive to a terminal\n");
+        return 1;
+    }
+
+    // Mount filesystem read-only
+    struct heartyfs *fs;
+    int ret = heartyfs_mount(DISK_FILE_PATH, HEARTYFS_RDONLY, &fs);
+    if (ret != HEARTYFS_OK) {
+        heartyfs_perror(ret);
+        return 1;
+    }
+
+    struct heartyfs_export_report r;
+    ret = heartyfs_export(fs, path, STDOUT_FILENO, &r);
+    heartyfs_unmount(fs);
+    if (ret != HEARTYFS_OK) {
+        heartyfs_perror(ret);
+        return 1;
+    }
+
+    if (verbose) {
+        fprintf(stderr, "Exported %d directories and %d files (%lld bytes) "
+                "from '%s'\n", r.dirs, r.files, r.bytes, path);
+    }
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include "../heartyfs.h"
+#include "../libheartyfs.h"
+#include <getopt.h>
+#include <string.h>
+
+/* Exit codes, as fsck(8) uses them */
+#define FSCK_CLEAN 0
+#define FSCK_FIXED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_FAILED 8
+
+/**
+ * @brief Print usage information
+ * @param[in] prog Program name
+ */
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-y] [-t threads]\n", prog);
+}
+
+/**
+ * @brief Print one problem found by the check
+ * @param[in] arg Unused
+ * @param[in] block Block the problem is about
+ * @param[in] problem Description
+ */
+static void print_problem(void *arg, int block, const char *problem) {
+    (void)arg;
+    printf("Block %d: %s\n", block, problem);
+}
+
+/**
+ * @brief Main function to check the consistency of the filesystem
+ * @param[in] argc Number of command line arguments
+ * @param[in] argv Array of command line arguments
+ * @return 0 if the image is clean, 1 if problems were fixed, 4 if some
+ *         were left, 8 if the check could not run
+ *
+ * Only reports by default; -y repairs what can be repaired. -t sets the
+ * number of threads, one per CPU by default.
+ */
+int main(int argc, char *argv[]) {
+    int flags = 0;
+    int threads = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "yt:")) != -1) {
+        switch (opt) {
+        case 'y':
+            flags |= HEARTYFS_FSCK_REPAIR;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            if (threads <= 0) {
+                usage(argv[0]);
+                return FSCK_FAILED;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return FSCK_FAILED;
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+        return FSCK_FAILED;
+    }
+
+    // Mount filesystem; a check alone never writes
+    struct heartyfs *fs;
+    int mount_flags = HEARTYFS_NOCACHE;
+    if (!(flags & HEARTYFS_FSCK_REPAIR)) {
+        mount_flags |= HEARTYFS_RDONLY;
+    }
+    int ret = heartyfs_mount(DISK_FILE_PATH, mount_flags, &fs);
+    if (ret != HEARTYFS_OK) {
+        heartyfs_perror(ret);
+        return FSCK_FAILED;
+    }
+
+    struct heartyfs_fsck_report r;
+    ret = heartyfs_fsck(fs, threads, flags, print_problem, NULL, &r);
+    if (ret == HEARTYFS_OK) {
+        ret = heartyfs_unmount(fs);
+    } else {
+        heartyfs_unmount(fs);
+    }
+    if (ret != HEARTYFS_OK) {
+        heartyfs_perror(ret);
+        return FSCK_FAILED;
+    }
+
+    int problems = r.leaked + r.unmarked + r.dangling + r.cross_linked +
+                   r.bad_shares + r.bad_tails + r.bad_dirs + r.corrupt +
+                   r.bad_checksums;
+    printf("%d nodes, %d blocks in use, checked with %d thread%s\n", r.nodes,
+           r.blocks, r.threads, r.threads == 1 ? "" : "s");
+    if (problems == 0) {
+        printf("No problems found\n");
+        return FSCK_CLEAN;
+    }
+    printf("%d leaked, %d unmarked, %d dangling, %d cross-linked, "
+           "%d bad share counts, %d bad tails, %d bad directories, "
+           "%d corrupted, %d checksum mismatches\n",
+           r.leaked, r.unmarked, r.dangling, r.cross_linked, r.bad_shares,
+           r.bad_tails, r.bad_dirs, r.corrupt, r.bad_checksums);
+    if (r.repaired > 0) {
+        printf("%d repairs made\n", r.repaired);
+    }
+    if (!(flags & HEARTYFS_FSCK_REPAIR)) {
+        return FSCK_UNCORRECTED;
+    }
+    int left = r.cross_linked + r.corrupt + r.bad_checksums;
+    return left > 0 ? FSCK_UNCORRECTED : FSCK_FIXED;
+}
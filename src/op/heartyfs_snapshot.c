@@ -0,0 +1,67 @@
+#include "../heartyfs.h"
+#include "../libheartyfs.h"
+#include <getopt.h>
+#include <string.h>
+
+/**
+ * @brief Print usage information
+ * @param[in] prog Program name
+ */
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d] <snapshot_name>\n", prog);
+}
+
+/**
+ * @brief Main function to take or delete a snapshot of the filesystem
+ * @param[in] argc Number of command line arguments
+ * @param[in] argv Array of command line arguments
+ * @return 0 on success, 1 on failure
+ *
+ * The snapshot can then be read under /.snapshots/<snapshot_name>; -d
+ * deletes it instead. The image must have been formatted with
+ * heartyfs_init -S.
+ */
+int main(int argc, char *argv[]) {
+    int delete = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d")) != -1) {
+        switch (opt) {
+        case 'd':
+            delete = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *name = argv[optind];
+
+    // Mount filesystem
+    struct heartyfs *fs;
+    int ret = heartyfs_mount(DISK_FILE_PATH, 0, &fs);
+    if (ret != HEARTYFS_OK) {
+        heartyfs_perror(ret);
+        return 1;
+    }
+
+    ret = delete ? heartyfs_rmsnapshot(fs, name)
+                 : heartyfs_snapshot(fs, name);
+    if (ret != HEARTYFS_OK) {
+        heartyfs_perror(ret);
+        heartyfs_unmount(fs);
+        return 1;
+    }
+
+    if (delete) {
+        printf("Snapshot '%s' deleted successfully\n", name);
+    } else {
+        printf("Snapshot '%s' taken successfully\n", name);
+    }
+    heartyfs_unmount(fs);
+    return 0;
+}
@@ -1,161 +1,89 @@
 #include "../heartyfs.h"
+#include "../libheartyfs.h"
+#include <errno.h>
+#include <getopt.h>
 #include <string.h>
-#include <sys/stat.h>
 
 /* Constants */
 #define MAX_PATH_LENGTH 256
-#define FILE_TYPE 0
-#define DATA_BLOCK_HEADER_SIZE sizeof(int)
-#define MAX_DATA_BLOCK_SIZE (BLOCK_SIZE - DATA_BLOCK_HEADER_SIZE)
-#define MAX_FILE_SIZE (119 * MAX_DATA_BLOCK_SIZE)  // Based on inode structure
-#define WRITE_ERROR -1
-#define WRITE_SUCCESS 0
+#define COPY_CHUNK_SIZE (1 << 20)  // Bytes read per heartyfs_pwrite()
 
 /**
- * @brief Find the first available free block in the bitmap
- * @param[in] bitmap Pointer to the filesystem bitmap
- * @return Block number of first free block, or -1 if no blocks available
+ * @brief Parse a non-negative byte offset from the command line
+ * @param[in] text Number as given on the command line
+ * @param[out] value Receives the parsed number
+ * @return 0 on success, -1 if the text is not a valid offset
  */
-int find_free_block(const char *bitmap) {
-    if (!bitmap) {
-        return WRITE_ERROR;
-    }
-
-    for (int block_num = 2; block_num < NUM_BLOCK; block_num++) {
-        int byte_index = block_num / 8;
-        int bit_position = block_num % 8;
-        
-        if (bitmap[byte_index] & (1 << bit_position)) {
-            return block_num;
-        }
-    }
-    return WRITE_ERROR;
+static int parse_offset(const char *text, long long *value) {
+    char *end;
+    if (*text == '\0' || *text == '-') {
+        return -1;
+    }
+    errno = 0;
+    *value = strtoll(text, &end, 10);
+    return *end == '\0' && errno == 0 ? 0 : -1;
 }
 
 /**
- * @brief Mark a block as used in the bitmap
- * @param[out] bitmap Pointer to the filesystem bitmap
- * @param[in] block Block number to mark as used
+ * @brief Print usage information
+ * @param[in] prog Program name
  */
-void mark_block_used(char *bitmap, int block) {
-    if (!bitmap || block < 0) {
-        return;
-    }
-
-    int byte_index = block / 8;
-    int bit_position = block % 8;
-    bitmap[byte_index] &= ~(1 << bit_position);
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--offset N | --append | --compress] "
+            "<heartyfs_file_path> "
+            "<external_file_path | ->\n",
+            prog);
 }
 
 /**
- * @brief Find a file in the filesystem
- * @param[in] disk Pointer to the filesystem in memory
- * @param[in] path Path to the file
- * @return Pointer to the file's inode, or NULL if not found
+ * @brief Write the contents of a descriptor into part of a heartyfs file
+ * @param[in] fs Mounted filesystem
+ * @param[in] path Path of the file inside heartyfs
+ * @param[in] in_fd Source descriptor
+ * @param[in] offset File offset to write at, or -1 to append
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
  */
-struct heartyfs_inode *find_file(void *disk, const char *path) {
-    if (!disk || !path) {
-        return NULL;
+static int write_range(struct heartyfs *fs, const char *path, int in_fd,
+                       long long offset) {
+    struct heartyfs_stat st;
+    int ret = heartyfs_stat(fs, path, &st);
+    if (ret != HEARTYFS_OK) {
+        return ret;
     }
-
-    struct heartyfs_directory *current_dir = (struct heartyfs_directory *)disk;
-    char path_copy[MAX_PATH_LENGTH];
-    strncpy(path_copy, path, MAX_PATH_LENGTH - 1);
-    path_copy[MAX_PATH_LENGTH - 1] = '\0';
-
-    char *token = strtok(path_copy, "/");
-    char *next_token;
-
-    while (token != NULL) {
-        next_token = strtok(NULL, "/");
-        int found = 0;
-
-        for (int i = 0; i < current_dir->size; i++) {
-            if (strcmp(current_dir->entries[i].file_name, token) == 0) {
-                if (next_token == NULL) {
-                    // This is the target file
-                    return (struct heartyfs_inode *)(disk + 
-                        current_dir->entries[i].block_id * BLOCK_SIZE);
-                }
-                current_dir = (struct heartyfs_directory *)(disk + 
-                    current_dir->entries[i].block_id * BLOCK_SIZE);
-                found = 1;
-                break;
-            }
-        }
-
-        if (!found) {
-            return NULL;
-        }
-        token = next_token;
+    if (st.type != HEARTYFS_TYPE_FILE) {
+        return HEARTYFS_ERR_NOT_FILE;
     }
 
-    return NULL;
-}
-
-/**
- * @brief Free existing data blocks of a file
- * @param[in] disk Pointer to the filesystem in memory
- * @param[in] file_inode Pointer to the file's inode
- * @param[out] bitmap Pointer to the filesystem bitmap
- */
-void free_existing_blocks(void *disk, struct heartyfs_inode *file_inode, char *bitmap) {
-    if (!disk || !file_inode || !bitmap) {
-        return;
-    }
-
-    for (int i = 0; i < file_inode->size; i++) {
-        mark_block_used(bitmap, file_inode->data_blocks[i]);
-        memset(disk + file_inode->data_blocks[i] * BLOCK_SIZE, 0, BLOCK_SIZE);
-    }
-}
-
-/**
- * @brief Write file contents from external file to heartyfs
- * @param[in] disk Pointer to the filesystem in memory
- * @param[in] file_inode Pointer to the file's inode
- * @param[in] ext_file File pointer to external file
- * @param[in] file_size Size of the external file
- * @param[out] bitmap Pointer to the filesystem bitmap
- * @return WRITE_SUCCESS on success, WRITE_ERROR on failure
- */
-int write_file_contents(void *disk, struct heartyfs_inode *file_inode, 
-                       FILE *ext_file, off_t file_size, char *bitmap) {
-    if (!disk || !file_inode || !ext_file || !bitmap) {
-        return WRITE_ERROR;
+    char *buf = malloc(COPY_CHUNK_SIZE);
+    if (!buf) {
+        return HEARTYFS_ERR_NO_MEMORY;
     }
 
-    size_t bytes_written = 0;
-    int block_index = 0;
-
-    while (bytes_written < file_size) {
-        // Allocate new block
-        int new_block = find_free_block(bitmap);
-        if (new_block == WRITE_ERROR) {
-            fprintf(stderr, "No free blocks available\n");
-            return WRITE_ERROR;
+    for (;;) {
+        ssize_t n = read(in_fd, buf, COPY_CHUNK_SIZE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ret = n < 0 ? HEARTYFS_ERR_IO : HEARTYFS_OK;
+            break;
         }
-        mark_block_used(bitmap, new_block);
-        file_inode->data_blocks[block_index] = new_block;
 
-        // Write data to block
-        struct heartyfs_data_block *data_block = 
-            (struct heartyfs_data_block *)(disk + new_block * BLOCK_SIZE);
-        size_t bytes_to_write = (file_size - bytes_written < MAX_DATA_BLOCK_SIZE) ? 
-                               (file_size - bytes_written) : MAX_DATA_BLOCK_SIZE;
-        
-        data_block->size = bytes_to_write;
-        if (fread(data_block->data, 1, bytes_to_write, ext_file) != bytes_to_write) {
-            fprintf(stderr, "Error reading from external file\n");
-            return WRITE_ERROR;
+        ssize_t written = offset < 0
+                              ? heartyfs_append(fs, path, buf, n)
+                              : heartyfs_pwrite(fs, path, buf, n, offset);
+        if (written < 0) {
+            ret = written;
+            break;
+        }
+        if (offset >= 0) {
+            offset += written;
         }
-        
-        bytes_written += bytes_to_write;
-        block_index++;
     }
 
-    file_inode->size = block_index;
-    return WRITE_SUCCESS;
+    free(buf);
+    return ret;
 }
 
 /**
@@ -163,94 +91,91 @@ int write_file_contents(void *disk, struct heartyfs_inode *file_inode,
  * @param[in] argc Number of command line arguments
  * @param[in] argv Array of command line arguments
  * @return 0 on success, 1 on failure
+ *
+ * By default the heartyfs file is replaced. With --offset the external
+ * file is written at that offset and with --append at the end of the
+ * file; either way the rest of the file is kept. With --compress the
+ * replaced file is stored compressed when that saves space.
  */
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <heartyfs_file_path> <external_file_path>\n", 
-                argv[0]);
+    static const struct option long_opts[] = {
+        {"offset", required_argument, NULL, 'o'},
+        {"append", no_argument, NULL, 'a'},
+        {"compress", no_argument, NULL, 'z'},
+        {NULL, 0, NULL, 0},
+    };
+    long long offset = -1;
+    int partial = 0;
+    int flags = 0;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "o:az", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'o':
+            if (partial || parse_offset(optarg, &offset) != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            partial = 1;
+            break;
+        case 'a':
+            if (partial) {
+                usage(argv[0]);
+                return 1;
+            }
+            partial = 1;
+            break;
+        case 'z':
+            flags |= HEARTYFS_COMPRESS;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2 || (partial && flags)) {
+        usage(argv[0]);
         return 1;
     }
 
     // Validate and copy heartyfs path
     char heartyfs_path[MAX_PATH_LENGTH];
-    if (strlen(argv[1]) >= MAX_PATH_LENGTH) {
+    if (strlen(argv[optind]) >= MAX_PATH_LENGTH) {
         fprintf(stderr, "Path too long\n");
         return 1;
     }
-    strncpy(heartyfs_path, argv[1], MAX_PATH_LENGTH - 1);
+    strncpy(heartyfs_path, argv[optind], MAX_PATH_LENGTH - 1);
     heartyfs_path[MAX_PATH_LENGTH - 1] = '\0';
 
-    // Open and validate external file
-    const char *external_path = argv[2];
-    FILE *ext_file = fopen(external_path, "rb");
-    if (!ext_file) {
+    // Open external file; - streams from stdin
+    const char *external_path = argv[optind + 1];
+    int ext_fd = strcmp(external_path, "-") == 0
+                     ? dup(STDIN_FILENO)
+                     : open(external_path, O_RDONLY);
+    if (ext_fd < 0) {
         perror("Cannot open external file");
         return 1;
     }
 
-    // Get external file size
-    struct stat st;
-    if (stat(external_path, &st) != 0) {
-        perror("Cannot get external file size");
-        fclose(ext_file);
-        return 1;
-    }
-
-    // Validate file size
-    off_t file_size = st.st_size;
-    if (file_size > MAX_FILE_SIZE) {
-        fprintf(stderr, "External file is too large for heartyfs\n");
-        fclose(ext_file);
+    // Mount filesystem
+    struct heartyfs *fs;
+    int ret = heartyfs_mount(DISK_FILE_PATH, flags, &fs);
+    if (ret != HEARTYFS_OK) {
+        heartyfs_perror(ret);
+        close(ext_fd);
         return 1;
     }
 
-    // Open filesystem
-    int fd = open(DISK_FILE_PATH, O_RDWR);
-    if (fd < 0) {
-        perror("Cannot open the disk file");
-        fclose(ext_file);
+    ret = partial ? write_range(fs, heartyfs_path, ext_fd, offset)
+                  : heartyfs_write_from_fd(fs, heartyfs_path, ext_fd);
+    close(ext_fd);
+    if (ret != HEARTYFS_OK) {
+        heartyfs_perror(ret);
+        heartyfs_unmount(fs);
         return 1;
     }
 
-    // Map filesystem to memory
-    void *disk = mmap(NULL, DISK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (disk == MAP_FAILED) {
-        perror("Cannot map the disk file onto memory");
-        close(fd);
-        fclose(ext_file);
-        return 1;
-    }
-
-    // Find and validate the file
-    struct heartyfs_inode *file_inode = find_file(disk, heartyfs_path);
-    if (!file_inode) {
-        fprintf(stderr, "File not found in heartyfs\n");
-        goto cleanup;
-    }
-
-    if (file_inode->type != FILE_TYPE) {
-        fprintf(stderr, "Not a regular file\n");
-        goto cleanup;
-    }
-
-    // Clear existing data blocks and write new content
-    char *bitmap = (char *)(disk + BLOCK_SIZE);
-    free_existing_blocks(disk, file_inode, bitmap);
-    
-    if (write_file_contents(disk, file_inode, ext_file, file_size, bitmap) != 
-        WRITE_SUCCESS) {
-        goto cleanup;
-    }
-
     printf("File '%s' written successfully to heartyfs\n", heartyfs_path);
-    munmap(disk, DISK_SIZE);
-    close(fd);
-    fclose(ext_file);
+    heartyfs_unmount(fs);
     return 0;
-
-cleanup:
-    munmap(disk, DISK_SIZE);
-    close(fd);
-    fclose(ext_file);
-    return 1;
-}
\ No newline at end of file
+}
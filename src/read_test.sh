@@ -39,7 +39,35 @@ echo "Test case 4: Try to read a directory (should fail)"
 ./bin/heartyfs_read /test_dir
 echo
 
+echo "Test case 5: Read a byte range of a file"
+./bin/heartyfs_read --offset 10 --length 9 /test_dir/nested_file.txt
+echo
+
+echo "Test case 6: Read a range of a multi-block file"
+head -c 200000 /dev/urandom > external_file_multi.bin
+./bin/heartyfs_write /test_file.txt external_file_multi.bin
+./bin/heartyfs_read --offset 123457 --length 4096 /test_file.txt |
+    cmp - <(tail -c +123458 external_file_multi.bin | head -c 4096) &&
+    echo "Contents match"
+echo
+
+echo "Test case 7: Read a range that runs past the end of the file"
+./bin/heartyfs_read --offset 199990 --length 4096 /test_file.txt | wc -c
+echo
+
+echo "Test case 8: Detect a corrupted block on an image with checksums"
+./bin/heartyfs_init -C
+./bin/heartyfs_creat /sum_file.txt
+echo "checksummed contents" > external_file_sum.txt
+./bin/heartyfs_write /sum_file.txt external_file_sum.txt
+./bin/heartyfs_read /sum_file.txt
+offset=$(grep -obUa "checksummed" /tmp/heartyfs | head -1 | cut -d: -f1)
+printf 'C' | dd of=/tmp/heartyfs bs=1 seek="$offset" conv=notrunc 2>/dev/null
+./bin/heartyfs_read /sum_file.txt
+echo
+
 # Clean up
-rm external_file.txt external_file_large.txt
+rm external_file.txt external_file_large.txt external_file_multi.bin \
+    external_file_sum.txt
 
 echo "Test completed."
\ No newline at end of file
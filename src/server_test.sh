@@ -0,0 +1,58 @@
+#!/bin/bash
+
+# Change to the root directory of the project
+cd "$(dirname "$0")/.." || exit
+
+# Ensure the disk file is created and initialized
+rm -rf bin
+bash script/init_diskfile.sh
+make
+./bin/heartyfs_init
+
+# Start the daemon on a private socket
+SOCKET=/tmp/heartyfs_test.sock
+./bin/heartyfsd -s $SOCKET &
+SERVER_PID=$!
+sleep 0.5
+
+# Create test content
+echo "This is a test file for heartyfsd." > external_file.txt
+
+# Test cases
+echo "Test case 1: Pipeline a script through the daemon"
+./bin/heartyfs_client -s $SOCKET -v <<SCRIPT
+mkdir /test_dir
+creat /test_dir/file.txt
+write /test_dir/file.txt external_file.txt
+read /test_dir/file.txt
+stat /test_dir/file.txt
+SCRIPT
+echo
+
+echo "Test case 2: Report failing requests"
+./bin/heartyfs_client -s $SOCKET <<SCRIPT
+mkdir /test_dir
+rm /nonexistent_file.txt
+read /test_dir
+SCRIPT
+echo "Exit status: $?"
+echo
+
+echo "Test case 3: Serve several clients at once"
+for i in 1 2 3 4; do
+    printf 'mkdir /client%s\ncreat /client%s/file.txt\nrm /client%s/file.txt\nrmdir /client%s\n' \
+        $i $i $i $i | ./bin/heartyfs_client -s $SOCKET -v &
+done
+wait $(jobs -p | grep -v $SERVER_PID)
+echo
+
+echo "Test case 4: State persists after the daemon exits"
+kill $SERVER_PID
+wait $SERVER_PID
+./bin/heartyfs_read /test_dir/file.txt
+echo
+
+# Clean up
+rm external_file.txt
+
+echo "Test completed."
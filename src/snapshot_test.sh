@@ -0,0 +1,82 @@
+#!/bin/bash
+
+# Change to the root directory of the project
+cd "$(dirname "$0")/.." || exit
+
+# Ensure the disk file is created and initialized with room for snapshots
+rm -rf bin
+sh script/init_diskfile.sh
+make
+./bin/heartyfs_init -S
+
+# Count the set bits of the bitmap in block 1, i.e. the free blocks
+free_blocks() {
+    od -An -v -tu1 -j 512 -N 256 /tmp/heartyfs |
+        awk '{ for (i = 1; i <= NF; i++) for (v = $i; v; v = int(v / 2)) n += v % 2 }
+             END { print n }'
+}
+
+# Create test content
+echo "This is the original content of the file." > original.txt
+echo "This is the changed content of the file." > changed.txt
+echo "PATCHED" > patch.txt
+EMPTY_FREE=$(free_blocks)
+
+# Test cases
+echo "Test case 1: Take a snapshot and change the live tree"
+./bin/heartyfs_batch -v <<SCRIPT
+mkdir /test_dir
+creat /test_dir/file.txt
+write /test_dir/file.txt original.txt
+creat /keep.txt
+snapshot nightly
+write /test_dir/file.txt changed.txt
+SCRIPT
+./bin/heartyfs_read /test_dir/file.txt
+./bin/heartyfs_read /.snapshots/nightly/test_dir/file.txt
+echo
+
+echo "Test case 2: Write into a shared file at an offset"
+./bin/heartyfs_snapshot hourly
+./bin/heartyfs_write --offset 8 /test_dir/file.txt patch.txt
+./bin/heartyfs_read /test_dir/file.txt
+./bin/heartyfs_read /.snapshots/hourly/test_dir/file.txt
+echo
+
+echo "Test case 3: Remove files the snapshots still hold"
+./bin/heartyfs_rm /test_dir/file.txt
+./bin/heartyfs_rmdir /test_dir
+./bin/heartyfs_read /.snapshots/nightly/test_dir/file.txt
+./bin/heartyfs_read /.snapshots/hourly/test_dir/../test_dir/./file.txt
+echo
+
+echo "Test case 4: Snapshots are read-only"
+./bin/heartyfs_creat /.snapshots/nightly/new.txt
+./bin/heartyfs_rm /.snapshots/nightly/keep.txt
+./bin/heartyfs_write /.snapshots/nightly/keep.txt changed.txt
+./bin/heartyfs_mkdir /.snapshots
+./bin/heartyfs_snapshot nightly
+echo
+
+echo "Test case 5: Delete the snapshots and get every block back"
+./bin/heartyfs_snapshot -d nightly
+./bin/heartyfs_snapshot -d hourly
+./bin/heartyfs_snapshot -d hourly
+./bin/heartyfs_read /.snapshots/nightly/test_dir/file.txt
+./bin/heartyfs_rm /keep.txt
+if [ "$(free_blocks)" -eq "$EMPTY_FREE" ]; then
+    echo "All blocks are free again"
+else
+    echo "Leaked $((EMPTY_FREE - $(free_blocks))) blocks"
+fi
+echo
+
+echo "Test case 6: Reject snapshots on an image formatted without -S"
+./bin/heartyfs_init > /dev/null
+./bin/heartyfs_snapshot nightly
+echo
+
+# Clean up
+rm original.txt changed.txt patch.txt
+
+echo "Test completed."
@@ -1,7 +1,10 @@
 #include "heartyfs.h"
 #include <assert.h>
+#include <sys/stat.h>
+
+void test_superblock(struct heartyfs_superblock *sb) {
+    struct heartyfs_directory *superblock = &sb->root;
 
-void test_superblock(struct heartyfs_directory *superblock) {
     assert(superblock->type == 1);
     assert(strcmp(superblock->name, "/") == 0);
     assert(superblock->size == 2);
@@ -9,14 +12,22 @@ void test_superblock(struct heartyfs_directory *superblock) {
     assert(strcmp(superblock->entries[0].file_name, ".") == 0);
     assert(superblock->entries[1].block_id == 0);
     assert(strcmp(superblock->entries[1].file_name, "..") == 0);
+    assert(sb->magic == HEARTYFS_MAGIC);
+    assert(sb->block_size == BLOCK_SIZE);
+    assert(sb->num_blocks == NUM_BLOCK);
+    assert(sb->bitmap_blocks == 1);
+    assert(sb->alloc_cursor == 2);
     printf("Superblock initialization: PASSED\n");
 }
 
 void test_bitmap(char *bitmap) {
     assert((unsigned char)bitmap[0] == 0xFC);
-    for (int i = 1; i < BLOCK_SIZE; i++) {
+    for (int i = 1; i < NUM_BLOCK / 8; i++) {
         assert((unsigned char)bitmap[i] == 0xFF);
     }
+    for (int i = NUM_BLOCK / 8; i < BLOCK_SIZE; i++) {
+        assert(bitmap[i] == 0);
+    }
     printf("Bitmap initialization: PASSED\n");
 }
 
@@ -34,7 +45,7 @@ int main() {
         exit(1);
     }
 
-    test_superblock((struct heartyfs_directory *)buffer);
+    test_superblock((struct heartyfs_superblock *)buffer);
     test_bitmap((char *)(buffer + BLOCK_SIZE));
 
     if (munmap(buffer, DISK_SIZE) == -1) {
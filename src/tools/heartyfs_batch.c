@@ -0,0 +1,263 @@
+#include "../heartyfs.h"
+#include "../libheartyfs.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+/* Constants */
+#define MAX_LINE_LENGTH 1024
+#define MAX_ARGS 3
+#define BATCH_SUCCESS 0
+#define BATCH_ERROR -1
+
+/* Command-line options */
+struct batch_options {
+    int verbose;            // Report every successful operation
+    int stop_on_error;      // Abort the batch at the first failing command
+    int mount_flags;        // HEARTYFS_SYNC or HEARTYFS_ASYNC, if any, and
+                            // HEARTYFS_COMPRESS
+};
+
+/**
+ * @brief Translate a durability level name into mount flags
+ * @param[in] name none, async or sync
+ * @return Mount flags, or -1 if the name is unknown
+ */
+int durability_flags(const char *name) {
+    if (strcmp(name, "none") == 0) {
+        return 0;
+    }
+    if (strcmp(name, "async") == 0) {
+        return HEARTYFS_ASYNC;
+    }
+    if (strcmp(name, "sync") == 0) {
+        return HEARTYFS_SYNC;
+    }
+    return -1;
+}
+
+/**
+ * @brief Split a command line into whitespace-separated words
+ * @param[in,out] line Command line; modified in place
+ * @param[out] argv Receives up to MAX_ARGS words
+ * @return Number of words, or -1 if there are too many
+ */
+int split_command(char *line, char *argv[]) {
+    int argc = 0;
+    char *saveptr;
+
+    for (char *word = strtok_r(line, " \t\r\n", &saveptr); word != NULL;
+         word = strtok_r(NULL, " \t\r\n", &saveptr)) {
+        if (argc == MAX_ARGS) {
+            return -1;
+        }
+        argv[argc++] = word;
+    }
+    return argc;
+}
+
+/**
+ * @brief Copy a host file into a heartyfs file
+ * @param[in] fs Mounted filesystem
+ * @param[in] heartyfs_path Destination inside heartyfs
+ * @param[in] external_path Source file on the host
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int write_command(struct heartyfs *fs, const char *heartyfs_path,
+                  const char *external_path) {
+    int ext_fd = open(external_path, O_RDONLY);
+    if (ext_fd < 0) {
+        return HEARTYFS_ERR_IO;
+    }
+
+    int ret = heartyfs_write_from_fd(fs, heartyfs_path, ext_fd);
+    close(ext_fd);
+    return ret;
+}
+
+/**
+ * @brief Check the image through the batch's own mount
+ * @param[in] fs Mounted filesystem
+ * @return HEARTYFS_OK if the image is clean, HEARTYFS_ERR_CORRUPT if the
+ *         check found problems, another HEARTYFS_ERR_* code if it failed
+ */
+int fsck_command(struct heartyfs *fs) {
+    struct heartyfs_fsck_report r;
+    int ret = heartyfs_fsck(fs, 0, 0, NULL, NULL, &r);
+    if (ret != HEARTYFS_OK) {
+        return ret;
+    }
+    int problems = r.leaked + r.unmarked + r.dangling + r.cross_linked +
+                   r.bad_shares + r.bad_tails + r.bad_dirs + r.corrupt +
+                   r.bad_checksums;
+    return problems == 0 ? HEARTYFS_OK : HEARTYFS_ERR_CORRUPT;
+}
+
+/**
+ * @brief Execute one batch command against the mounted filesystem
+ * @param[in] fs Mounted filesystem
+ * @param[in] argc Number of words in the command
+ * @param[in] argv Command words; argv[0] is the operation name
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+int run_command(struct heartyfs *fs, int argc, char *argv[]) {
+    const char *op = argv[0];
+
+    if (argc == 2 && strcmp(op, "mkdir") == 0) {
+        return heartyfs_mkdir(fs, argv[1]);
+    }
+    if (argc == 2 && strcmp(op, "rmdir") == 0) {
+        return heartyfs_rmdir(fs, argv[1]);
+    }
+    if (argc == 2 && strcmp(op, "creat") == 0) {
+        return heartyfs_creat(fs, argv[1]);
+    }
+    if (argc == 2 && strcmp(op, "rm") == 0) {
+        return heartyfs_rm(fs, argv[1]);
+    }
+    if (argc == 2 && strcmp(op, "read") == 0) {
+        fflush(stdout);
+        return heartyfs_read_to_fd(fs, argv[1], STDOUT_FILENO);
+    }
+    if (argc == 3 && strcmp(op, "write") == 0) {
+        return write_command(fs, argv[1], argv[2]);
+    }
+    if (argc == 2 && strcmp(op, "snapshot") == 0) {
+        return heartyfs_snapshot(fs, argv[1]);
+    }
+    if (argc == 2 && strcmp(op, "rmsnapshot") == 0) {
+        return heartyfs_rmsnapshot(fs, argv[1]);
+    }
+    if (argc == 1 && strcmp(op, "fsck") == 0) {
+        return fsck_command(fs);
+    }
+    return HEARTYFS_ERR_INVALID;
+}
+
+/**
+ * @brief Run every command of a script against one mount
+ * @param[in] fs Mounted filesystem
+ * @param[in] script Stream of commands, one per line
+ * @param[in] name Script name used in error messages
+ * @param[in] opts Command-line options
+ * @return BATCH_SUCCESS if every command succeeded, BATCH_ERROR otherwise
+ */
+int run_batch(struct heartyfs *fs, FILE *script, const char *name,
+              const struct batch_options *opts) {
+    char line[MAX_LINE_LENGTH];
+    int line_num = 0;
+    int executed = 0;
+    int failed = 0;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (fgets(line, sizeof(line), script) != NULL) {
+        line_num++;
+
+        char *argv[MAX_ARGS];
+        line[strcspn(line, "#")] = '\0';  // Strip comments
+        int argc = split_command(line, argv);
+        if (argc == 0) {
+            continue;  // Blank line
+        }
+
+        executed++;
+        int ret = argc < 0 ? HEARTYFS_ERR_INVALID : run_command(fs, argc, argv);
+        if (ret != HEARTYFS_OK) {
+            failed++;
+            fprintf(stderr, "%s:%d: %s: %s%s%s\n", name, line_num,
+                    argc > 0 ? argv[0] : "?", heartyfs_strerror(ret),
+                    ret == HEARTYFS_ERR_IO ? ": " : "",
+                    ret == HEARTYFS_ERR_IO ? strerror(errno) : "");
+            if (opts->stop_on_error) {
+                break;
+            }
+        } else if (opts->verbose) {
+            printf("%s%s%s: OK\n", argv[0], argc > 1 ? " " : "",
+                   argc > 1 ? argv[1] : "");
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (opts->verbose) {
+        double elapsed = (end.tv_sec - start.tv_sec) +
+                         (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "%d operations, %d failed, %.3f s (%.0f ops/sec)\n",
+                executed, failed, elapsed,
+                elapsed > 0 ? executed / elapsed : 0.0);
+    }
+
+    return failed == 0 ? BATCH_SUCCESS : BATCH_ERROR;
+}
+
+/**
+ * @brief Main function to run a script of heartyfs operations in one mount
+ * @param[in] argc Number of command line arguments
+ * @param[in] argv Array of command line arguments
+ * @return 0 if every command succeeded, 1 otherwise
+ */
+int main(int argc, char *argv[]) {
+    struct batch_options opts = {0, 0, 0};
+    int durability;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vezD:")) != -1) {
+        switch (opt) {
+        case 'v':
+            opts.verbose = 1;
+            break;
+        case 'e':
+            opts.stop_on_error = 1;
+            break;
+        case 'z':
+            opts.mount_flags |= HEARTYFS_COMPRESS;
+            break;
+        case 'D':
+            durability = durability_flags(optarg);
+            if (durability < 0) {
+                fprintf(stderr, "Unknown durability level '%s'\n", optarg);
+                return 1;
+            }
+            opts.mount_flags |= durability;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-v] [-e] [-z] [-D none|async|sync] [script_file]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind > 1) {
+        fprintf(stderr, "Usage: %s [-v] [-e] [-z] [-D none|async|sync] [script_file]\n", argv[0]);
+        return 1;
+    }
+
+    // Open the script, defaulting to stdin
+    const char *script_name = "<stdin>";
+    FILE *script = stdin;
+    if (optind < argc && strcmp(argv[optind], "-") != 0) {
+        script_name = argv[optind];
+        script = fopen(script_name, "r");
+        if (!script) {
+            perror("Cannot open script file");
+            return 1;
+        }
+    }
+
+    // Mount filesystem once for the whole batch
+    struct heartyfs *fs;
+    int ret = heartyfs_mount(DISK_FILE_PATH, opts.mount_flags, &fs);
+    if (ret != HEARTYFS_OK) {
+        heartyfs_perror(ret);
+        if (script != stdin) {
+            fclose(script);
+        }
+        return 1;
+    }
+
+    int status = run_batch(fs, script, script_name, &opts);
+
+    heartyfs_unmount(fs);
+    if (script != stdin) {
+        fclose(script);
+    }
+    return status == BATCH_SUCCESS ? 0 : 1;
+}
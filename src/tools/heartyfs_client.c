@@ -0,0 +1,464 @@
+#include "../heartyfs.h"
+#include "../heartyfs_proto.h"
+#include "../libheartyfs.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+
+/* Constants */
+#define MAX_LINE_LENGTH 1024
+#define MAX_ARGS 3
+#define MAX_OP_NAME 16
+#define DEFAULT_DEPTH 64
+#define RECV_CHUNK_SIZE (1 << 16)
+#define CLIENT_ERROR -1
+#define CLIENT_SUCCESS 0
+
+/* Growable byte buffer; live data is data[start, len) */
+struct buffer {
+    char *data;
+    size_t start;
+    size_t len;
+    size_t cap;
+};
+
+/* A request that has been sent but not yet answered */
+struct in_flight {
+    int line_num;
+    char op[MAX_OP_NAME];
+};
+
+/* Client session state */
+struct session {
+    int fd;
+    FILE *script;
+    const char *script_name;
+    int line_num;
+    int eof;                    // No more commands to send
+    struct buffer out;          // Encoded requests not yet sent
+    struct buffer in;           // Received bytes not yet parsed
+    struct in_flight *ring;     // Outstanding requests, oldest first
+    int depth;                  // Maximum outstanding requests
+    int head;
+    int outstanding;
+    uint32_t next_id;
+    int executed;
+    int failed;
+    int verbose;
+};
+
+/**
+ * @brief Make room for at least extra more bytes at the end of a buffer
+ * @param[in,out] buf Buffer to grow
+ * @param[in] extra Number of bytes the caller is about to append
+ * @return CLIENT_SUCCESS on success, CLIENT_ERROR if out of memory
+ */
+static int buffer_reserve(struct buffer *buf, size_t extra) {
+    if (buf->start > 0) {
+        memmove(buf->data, buf->data + buf->start, buf->len - buf->start);
+        buf->len -= buf->start;
+        buf->start = 0;
+    }
+    if (buf->len + extra <= buf->cap) {
+        return CLIENT_SUCCESS;
+    }
+
+    size_t new_cap = buf->cap ? buf->cap : RECV_CHUNK_SIZE;
+    while (new_cap < buf->len + extra) {
+        new_cap *= 2;
+    }
+    char *data = realloc(buf->data, new_cap);
+    if (!data) {
+        return CLIENT_ERROR;
+    }
+    buf->data = data;
+    buf->cap = new_cap;
+    return CLIENT_SUCCESS;
+}
+
+/**
+ * @brief Split a command line into whitespace-separated words
+ * @param[in,out] line Command line; modified in place
+ * @param[out] argv Receives up to MAX_ARGS words
+ * @return Number of words, or -1 if there are too many
+ */
+static int split_command(char *line, char *argv[]) {
+    int argc = 0;
+    char *saveptr;
+
+    for (char *word = strtok_r(line, " \t\r\n", &saveptr); word != NULL;
+         word = strtok_r(NULL, " \t\r\n", &saveptr)) {
+        if (argc == MAX_ARGS) {
+            return -1;
+        }
+        argv[argc++] = word;
+    }
+    return argc;
+}
+
+/**
+ * @brief Map a command name and word count to a protocol opcode
+ * @param[in] argc Number of words in the command
+ * @param[in] op Command name
+ * @return HFS_OP_* code, or -1 if the command is not valid
+ */
+static int command_opcode(int argc, const char *op) {
+    if (argc == 2 && strcmp(op, "mkdir") == 0) {
+        return HFS_OP_MKDIR;
+    }
+    if (argc == 2 && strcmp(op, "rmdir") == 0) {
+        return HFS_OP_RMDIR;
+    }
+    if (argc == 2 && strcmp(op, "creat") == 0) {
+        return HFS_OP_CREAT;
+    }
+    if (argc == 2 && strcmp(op, "rm") == 0) {
+        return HFS_OP_RM;
+    }
+    if (argc == 2 && strcmp(op, "read") == 0) {
+        return HFS_OP_READ;
+    }
+    if (argc == 2 && strcmp(op, "stat") == 0) {
+        return HFS_OP_STAT;
+    }
+    if (argc == 3 && strcmp(op, "write") == 0) {
+        return HFS_OP_WRITE;
+    }
+    if (argc == 2 && strcmp(op, "snapshot") == 0) {
+        return HFS_OP_SNAPSHOT;
+    }
+    if (argc == 2 && strcmp(op, "rmsnapshot") == 0) {
+        return HFS_OP_RMSNAPSHOT;
+    }
+    return -1;
+}
+
+/**
+ * @brief Append the contents of a host file to the send buffer
+ * @param[in,out] out Send buffer
+ * @param[in] external_path Host file to load
+ * @return Number of bytes appended, or -1 on failure
+ */
+static ssize_t append_host_file(struct buffer *out, const char *external_path) {
+    int fd = open(external_path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size > HEARTYFS_MAX_REQUEST ||
+        buffer_reserve(out, st.st_size) != CLIENT_SUCCESS) {
+        close(fd);
+        return -1;
+    }
+
+    size_t loaded = 0;
+    while (loaded < (size_t)st.st_size) {
+        ssize_t n = read(fd, out->data + out->len + loaded,
+                         st.st_size - loaded);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        loaded += n;
+    }
+    close(fd);
+    out->len += loaded;
+    return loaded;
+}
+
+/**
+ * @brief Encode the next script command into the send buffer
+ * @param[in,out] s Client session
+ * @return CLIENT_SUCCESS on success, CLIENT_ERROR if out of memory
+ *
+ * Commands that cannot be encoded are reported and skipped.
+ */
+static int queue_next_command(struct session *s) {
+    char line[MAX_LINE_LENGTH];
+
+    while (fgets(line, sizeof(line), s->script) != NULL) {
+        s->line_num++;
+
+        char *argv[MAX_ARGS];
+        line[strcspn(line, "#")] = '\0';  // Strip comments
+        int argc = split_command(line, argv);
+        if (argc == 0) {
+            continue;
+        }
+
+        int op = argc > 0 ? command_opcode(argc, argv[0]) : -1;
+        if (op < 0) {
+            fprintf(stderr, "%s:%d: %s: %s\n", s->script_name, s->line_num,
+                    argc > 0 ? argv[0] : "?",
+                    heartyfs_strerror(HEARTYFS_ERR_INVALID));
+            s->executed++;
+            s->failed++;
+            continue;
+        }
+
+        struct heartyfs_req req;
+        memset(&req, 0, sizeof(req));
+        req.id = s->next_id++;
+        req.op = op;
+        req.path_len = strlen(argv[1]);
+        req.count = UINT64_MAX;
+
+        if (buffer_reserve(&s->out, sizeof(req) + req.path_len) !=
+            CLIENT_SUCCESS) {
+            return CLIENT_ERROR;
+        }
+        size_t header_pos = s->out.len;
+        s->out.len += sizeof(req);
+        memcpy(s->out.data + s->out.len, argv[1], req.path_len);
+        s->out.len += req.path_len;
+
+        ssize_t payload_len = 0;
+        if (op == HFS_OP_WRITE) {
+            payload_len = append_host_file(&s->out, argv[2]);
+            if (payload_len < 0) {
+                fprintf(stderr, "%s:%d: write: Cannot read external file %s\n",
+                        s->script_name, s->line_num, argv[2]);
+                s->out.len = header_pos;
+                s->executed++;
+                s->failed++;
+                continue;
+            }
+        }
+        req.length = req.path_len + payload_len;
+        memcpy(s->out.data + header_pos, &req, sizeof(req));
+
+        struct in_flight *slot = &s->ring[(s->head + s->outstanding) % s->depth];
+        slot->line_num = s->line_num;
+        snprintf(slot->op, sizeof(slot->op), "%s", argv[0]);
+        s->outstanding++;
+        return CLIENT_SUCCESS;
+    }
+
+    s->eof = 1;
+    return CLIENT_SUCCESS;
+}
+
+/**
+ * @brief Handle every complete response in the receive buffer
+ * @param[in,out] s Client session
+ * @return CLIENT_SUCCESS on success, CLIENT_ERROR on a protocol error
+ */
+static int handle_responses(struct session *s) {
+    struct buffer *in = &s->in;
+
+    while (in->len - in->start >= sizeof(struct heartyfs_resp)) {
+        struct heartyfs_resp resp;
+        memcpy(&resp, in->data + in->start, sizeof(resp));
+        if (in->len - in->start < sizeof(resp) + resp.length) {
+            break;
+        }
+        if (s->outstanding == 0) {
+            fprintf(stderr, "Unexpected response from server\n");
+            return CLIENT_ERROR;
+        }
+
+        struct in_flight *slot = &s->ring[s->head];
+        const char *payload = in->data + in->start + sizeof(resp);
+        s->executed++;
+        if (resp.status != HEARTYFS_OK) {
+            s->failed++;
+            fprintf(stderr, "%s:%d: %s: %s\n", s->script_name, slot->line_num,
+                    slot->op, heartyfs_strerror(resp.status));
+        } else if (strcmp(slot->op, "read") == 0) {
+            fwrite(payload, 1, resp.length, stdout);
+        } else if (strcmp(slot->op, "stat") == 0 &&
+                   resp.length == sizeof(struct heartyfs_stat_reply)) {
+            struct heartyfs_stat_reply reply;
+            memcpy(&reply, payload, sizeof(reply));
+            printf("%s block=%d size=%lld blocks=%d\n",
+                   reply.type == HEARTYFS_TYPE_DIR ? "directory" : "file",
+                   reply.block, (long long)reply.size, reply.blocks);
+        }
+
+        in->start += sizeof(resp) + resp.length;
+        s->head = (s->head + 1) % s->depth;
+        s->outstanding--;
+    }
+    return CLIENT_SUCCESS;
+}
+
+/**
+ * @brief Stream the whole script to the daemon, keeping depth requests in flight
+ * @param[in,out] s Client session
+ * @return CLIENT_SUCCESS on success, CLIENT_ERROR on connection failure
+ */
+static int run_session(struct session *s) {
+    while (!s->eof || s->outstanding > 0) {
+        while (!s->eof && s->outstanding < s->depth) {
+            if (queue_next_command(s) != CLIENT_SUCCESS) {
+                return CLIENT_ERROR;
+            }
+        }
+
+        struct pollfd pfd = {s->fd, POLLIN, 0};
+        if (s->out.len > s->out.start) {
+            pfd.events |= POLLOUT;
+        }
+        if (s->outstanding == 0 && s->out.len == s->out.start) {
+            continue;
+        }
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return CLIENT_ERROR;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            ssize_t n = send(s->fd, s->out.data + s->out.start,
+                             s->out.len - s->out.start,
+                             MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("Cannot send request");
+                return CLIENT_ERROR;
+            }
+            if (n > 0) {
+                s->out.start += n;
+            }
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (buffer_reserve(&s->in, RECV_CHUNK_SIZE) != CLIENT_SUCCESS) {
+                return CLIENT_ERROR;
+            }
+            ssize_t n = recv(s->fd, s->in.data + s->in.len,
+                             s->in.cap - s->in.len, MSG_DONTWAIT);
+            if (n == 0) {
+                fprintf(stderr, "Server closed the connection\n");
+                return CLIENT_ERROR;
+            }
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("Cannot receive response");
+                return CLIENT_ERROR;
+            }
+            if (n > 0) {
+                s->in.len += n;
+                if (handle_responses(s) != CLIENT_SUCCESS) {
+                    return CLIENT_ERROR;
+                }
+            }
+        }
+    }
+    return CLIENT_SUCCESS;
+}
+
+/**
+ * @brief Connect to the daemon's socket
+ * @param[in] socket_path Filesystem path of the socket
+ * @return Connected descriptor, or -1 on failure
+ */
+static int connect_server(const char *socket_path) {
+    struct sockaddr_un addr;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Cannot create socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("Cannot connect to heartyfsd");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Main function to run a batch script through heartyfsd
+ * @param[in] argc Number of command line arguments
+ * @param[in] argv Array of command line arguments
+ * @return 0 if every command succeeded, 1 otherwise
+ */
+int main(int argc, char *argv[]) {
+    const char *socket_path = HEARTYFS_SOCKET_PATH;
+    struct session s;
+    memset(&s, 0, sizeof(s));
+    s.depth = DEFAULT_DEPTH;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:d:v")) != -1) {
+        switch (opt) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'd':
+            s.depth = atoi(optarg);
+            break;
+        case 'v':
+            s.verbose = 1;
+            break;
+        default:
+            s.depth = 0;
+            break;
+        }
+    }
+    if (s.depth <= 0 || argc - optind > 1) {
+        fprintf(stderr, "Usage: %s [-s socket_path] [-d depth] [-v] "
+                "[script_file]\n", argv[0]);
+        return 1;
+    }
+
+    s.script_name = "<stdin>";
+    s.script = stdin;
+    if (optind < argc && strcmp(argv[optind], "-") != 0) {
+        s.script_name = argv[optind];
+        s.script = fopen(s.script_name, "r");
+        if (!s.script) {
+            perror("Cannot open script file");
+            return 1;
+        }
+    }
+
+    s.ring = calloc(s.depth, sizeof(struct in_flight));
+    s.fd = connect_server(socket_path);
+    if (!s.ring || s.fd < 0) {
+        free(s.ring);
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = run_session(&s);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    fflush(stdout);
+    if (s.verbose) {
+        double elapsed = (end.tv_sec - start.tv_sec) +
+                         (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "%d operations, %d failed, %.3f s (%.0f ops/sec)\n",
+                s.executed, s.failed, elapsed,
+                elapsed > 0 ? s.executed / elapsed : 0.0);
+    }
+
+    close(s.fd);
+    free(s.ring);
+    free(s.in.data);
+    free(s.out.data);
+    if (s.script != stdin) {
+        fclose(s.script);
+    }
+    return status == CLIENT_SUCCESS && s.failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,595 @@
+#define _GNU_SOURCE  // accept4()
+#include "../heartyfs.h"
+#include "../heartyfs_proto.h"
+#include "../libheartyfs.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Constants */
+#define MAX_PATH_LENGTH 256
+#define LISTEN_BACKLOG 64
+#define RECV_CHUNK_SIZE (1 << 16)
+#define MAX_PENDING_OUTPUT (8 << 20)  // Stop reading while this much is queued
+#define SERVER_ERROR -1
+#define SERVER_SUCCESS 0
+
+/* Growable byte buffer; live data is data[start, len) */
+struct buffer {
+    char *data;
+    size_t start;
+    size_t len;
+    size_t cap;
+};
+
+/* One connected client */
+struct client {
+    int fd;
+    struct buffer in;       // Bytes received but not yet parsed
+    struct buffer out;      // Responses not yet sent
+    int closing;            // Peer hung up; drop once out is flushed
+};
+
+/* Daemon state */
+struct server {
+    struct heartyfs *fs;
+    int listen_fd;
+    struct client *clients;
+    int num_clients;
+    int cap_clients;
+    int durability;         // HEARTYFS_DURABLE_* flush before each round
+                            // of replies, or -1 for the default
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+/**
+ * @brief Signal handler that asks the main loop to exit
+ * @param[in] sig Signal number (unused)
+ */
+static void handle_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+/**
+ * @brief Make room for at least extra more bytes at the end of a buffer
+ * @param[in,out] buf Buffer to grow
+ * @param[in] extra Number of bytes the caller is about to append
+ * @return SERVER_SUCCESS on success, SERVER_ERROR if out of memory
+ */
+static int buffer_reserve(struct buffer *buf, size_t extra) {
+    // Reclaim consumed space before growing
+    if (buf->start > 0 && buf->start == buf->len) {
+        buf->start = buf->len = 0;
+    } else if (buf->start > buf->cap / 2) {
+        memmove(buf->data, buf->data + buf->start, buf->len - buf->start);
+        buf->len -= buf->start;
+        buf->start = 0;
+    }
+
+    if (buf->len + extra <= buf->cap) {
+        return SERVER_SUCCESS;
+    }
+
+    size_t new_cap = buf->cap ? buf->cap : RECV_CHUNK_SIZE;
+    while (new_cap < buf->len + extra) {
+        new_cap *= 2;
+    }
+    char *data = realloc(buf->data, new_cap);
+    if (!data) {
+        return SERVER_ERROR;
+    }
+    buf->data = data;
+    buf->cap = new_cap;
+    return SERVER_SUCCESS;
+}
+
+/**
+ * @brief Number of unconsumed bytes in a buffer
+ */
+static size_t buffer_pending(const struct buffer *buf) {
+    return buf->len - buf->start;
+}
+
+/**
+ * @brief Copy a wire path into a NUL-terminated string
+ * @param[in] req Request header
+ * @param[in] body Request body; the path comes first
+ * @param[out] path Receives the path (MAX_PATH_LENGTH bytes)
+ * @return HEARTYFS_OK on success, a HEARTYFS_ERR_* code on failure
+ */
+static int request_path(const struct heartyfs_req *req, const char *body,
+                        char *path) {
+    if (req->path_len > req->length) {
+        return HEARTYFS_ERR_INVALID;
+    }
+    if (req->path_len >= MAX_PATH_LENGTH) {
+        return HEARTYFS_ERR_NAME_TOO_LONG;
+    }
+    memcpy(path, body, req->path_len);
+    path[req->path_len] = '\0';
+    return HEARTYFS_OK;
+}
+
+/**
+ * @brief Execute one request and queue its response
+ * @param[in] fs Mounted filesystem
+ * @param[in] req Request header
+ * @param[in] body Request body (path followed by payload)
+ * @param[out] out Output buffer of the requesting client
+ * @return SERVER_SUCCESS on success, SERVER_ERROR if out of memory
+ */
+static int execute_request(struct heartyfs *fs, const struct heartyfs_req *req,
+                           const char *body, struct buffer *out) {
+    char path[MAX_PATH_LENGTH];
+    struct heartyfs_resp resp = {0, req->id, HEARTYFS_OK, 0};
+
+    // Reserve the response header; the payload (if any) follows it
+    if (buffer_reserve(out, sizeof(resp)) != SERVER_SUCCESS) {
+        return SERVER_ERROR;
+    }
+    // Track the header relative to start; buffer_reserve() may compact
+    size_t header_off = out->len - out->start;
+    out->len += sizeof(resp);
+
+    int ret = request_path(req, body, path);
+    if (ret != HEARTYFS_OK) {
+        resp.status = ret;
+        goto reply;
+    }
+
+    const char *payload = body + req->path_len;
+    size_t payload_len = req->length - req->path_len;
+
+    switch (req->op) {
+    case HFS_OP_PING:
+        break;
+    case HFS_OP_MKDIR:
+        resp.status = heartyfs_mkdir(fs, path);
+        break;
+    case HFS_OP_RMDIR:
+        resp.status = heartyfs_rmdir(fs, path);
+        break;
+    case HFS_OP_CREAT:
+        resp.status = heartyfs_creat(fs, path);
+        break;
+    case HFS_OP_RM:
+        resp.status = heartyfs_rm(fs, path);
+        break;
+    case HFS_OP_WRITE:
+        resp.status = heartyfs_write_file(fs, path, payload, payload_len);
+        break;
+    case HFS_OP_SNAPSHOT:
+        resp.status = heartyfs_snapshot(fs, path);
+        break;
+    case HFS_OP_RMSNAPSHOT:
+        resp.status = heartyfs_rmsnapshot(fs, path);
+        break;
+    case HFS_OP_STAT: {
+        struct heartyfs_stat st;
+        resp.status = heartyfs_stat(fs, path, &st);
+        if (resp.status == HEARTYFS_OK) {
+            struct heartyfs_stat_reply reply = {
+                st.block, st.type, st.size, st.blocks, 0
+            };
+            if (buffer_reserve(out, sizeof(reply)) != SERVER_SUCCESS) {
+                return SERVER_ERROR;
+            }
+            memcpy(out->data + out->len, &reply, sizeof(reply));
+            out->len += sizeof(reply);
+            resp.length = sizeof(reply);
+        }
+        break;
+    }
+    case HFS_OP_READ: {
+        struct heartyfs_stat st;
+        resp.status = heartyfs_stat(fs, path, &st);
+        if (resp.status != HEARTYFS_OK) {
+            break;
+        }
+        if (st.type != HEARTYFS_TYPE_FILE) {
+            resp.status = HEARTYFS_ERR_NOT_FILE;
+            break;
+        }
+
+        uint64_t count = req->count;
+        uint64_t remaining = (uint64_t)st.size > req->offset ?
+                             st.size - req->offset : 0;
+        if (count > remaining) {
+            count = remaining;
+        }
+        if (buffer_reserve(out, count) != SERVER_SUCCESS) {
+            return SERVER_ERROR;
+        }
+
+        ssize_t n = heartyfs_pread(fs, path, out->data + out->len, count,
+                                   req->offset);
+        if (n < 0) {
+            resp.status = n;
+            break;
+        }
+        out->len += n;
+        resp.length = n;
+        break;
+    }
+    default:
+        resp.status = HEARTYFS_ERR_INVALID;
+        break;
+    }
+
+reply:
+    memcpy(out->data + out->start + header_off, &resp, sizeof(resp));
+    return SERVER_SUCCESS;
+}
+
+/**
+ * @brief Execute every complete request waiting in a client's input buffer
+ * @param[in] server Daemon state
+ * @param[in,out] client Client whose requests should run
+ * @return SERVER_SUCCESS on success, SERVER_ERROR to drop the client
+ */
+static int process_requests(struct server *server, struct client *client) {
+    struct buffer *in = &client->in;
+
+    while (buffer_pending(in) >= sizeof(struct heartyfs_req) &&
+           buffer_pending(&client->out) < MAX_PENDING_OUTPUT) {
+        struct heartyfs_req req;
+        memcpy(&req, in->data + in->start, sizeof(req));
+        if (req.length > HEARTYFS_MAX_REQUEST) {
+            return SERVER_ERROR;
+        }
+        if (buffer_pending(in) < sizeof(req) + req.length) {
+            break;  // Wait for the rest of the body
+        }
+
+        const char *body = in->data + in->start + sizeof(req);
+        if (execute_request(server->fs, &req, body, &client->out) !=
+            SERVER_SUCCESS) {
+            return SERVER_ERROR;
+        }
+        in->start += sizeof(req) + req.length;
+    }
+    return SERVER_SUCCESS;
+}
+
+/**
+ * @brief Read whatever a client has sent and run the complete requests
+ * @param[in] server Daemon state
+ * @param[in,out] client Readable client
+ * @return SERVER_SUCCESS on success, SERVER_ERROR to drop the client
+ */
+static int client_readable(struct server *server, struct client *client) {
+    for (;;) {
+        if (buffer_reserve(&client->in, RECV_CHUNK_SIZE) != SERVER_SUCCESS) {
+            return SERVER_ERROR;
+        }
+        ssize_t n = recv(client->fd, client->in.data + client->in.len,
+                         client->in.cap - client->in.len, 0);
+        if (n > 0) {
+            client->in.len += n;
+            if ((size_t)n < RECV_CHUNK_SIZE) {
+                break;
+            }
+            continue;
+        }
+        if (n == 0) {
+            client->closing = 1;
+            break;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        }
+        return SERVER_ERROR;
+    }
+    return process_requests(server, client);
+}
+
+/**
+ * @brief Send as much queued output as the socket accepts
+ * @param[in,out] client Client with pending responses
+ * @return SERVER_SUCCESS on success, SERVER_ERROR to drop the client
+ */
+static int client_flush(struct client *client) {
+    struct buffer *out = &client->out;
+
+    while (buffer_pending(out) > 0) {
+        ssize_t n = send(client->fd, out->data + out->start,
+                         buffer_pending(out), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return SERVER_SUCCESS;
+            }
+            return SERVER_ERROR;
+        }
+        out->start += n;
+    }
+    out->start = out->len = 0;
+    return SERVER_SUCCESS;
+}
+
+/**
+ * @brief Accept every pending connection on the listening socket
+ * @param[in,out] server Daemon state
+ */
+static void accept_clients(struct server *server) {
+    for (;;) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
+            return;
+        }
+
+        if (server->num_clients == server->cap_clients) {
+            int cap = server->cap_clients ? server->cap_clients * 2 : 16;
+            struct client *clients = realloc(server->clients,
+                                             cap * sizeof(struct client));
+            if (!clients) {
+                close(fd);
+                continue;
+            }
+            server->clients = clients;
+            server->cap_clients = cap;
+        }
+
+        struct client *client = &server->clients[server->num_clients++];
+        memset(client, 0, sizeof(*client));
+        client->fd = fd;
+    }
+}
+
+/**
+ * @brief Close a client and remove it from the client table
+ * @param[in,out] server Daemon state
+ * @param[in] index Index of the client to drop
+ */
+static void drop_client(struct server *server, int index) {
+    struct client *client = &server->clients[index];
+
+    close(client->fd);
+    free(client->in.data);
+    free(client->out.data);
+    server->clients[index] = server->clients[--server->num_clients];
+}
+
+/**
+ * @brief Create the listening socket, replacing a stale socket file
+ * @param[in] socket_path Filesystem path of the socket
+ * @return Listening descriptor, or -1 on failure
+ */
+static int open_listener(const char *socket_path) {
+    struct sockaddr_un addr;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        perror("Cannot create socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, LISTEN_BACKLOG) != 0) {
+        perror("Cannot listen on socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Serve clients until SIGINT or SIGTERM arrives
+ * @param[in,out] server Daemon state with an open listening socket
+ * @return SERVER_SUCCESS on clean shutdown, SERVER_ERROR on failure
+ *
+ * Each round runs the requests of every ready client before sending any
+ * reply. The round then ends with one flush at the chosen durability
+ * level: with sync, every request in it shares a single flush (one commit
+ * on a journaled image) and none is acknowledged before it is durable.
+ */
+static int serve(struct server *server) {
+    struct pollfd *fds = NULL;
+    int cap_fds = 0;
+
+    while (!stop_requested) {
+        // One slot for the listener plus one per client
+        if (server->num_clients + 1 > cap_fds) {
+            cap_fds = (server->num_clients + 1) * 2;
+            struct pollfd *grown = realloc(fds, cap_fds * sizeof(*fds));
+            if (!grown) {
+                free(fds);
+                return SERVER_ERROR;
+            }
+            fds = grown;
+        }
+
+        fds[0].fd = server->listen_fd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < server->num_clients; i++) {
+            struct client *client = &server->clients[i];
+            fds[i + 1].fd = client->fd;
+            fds[i + 1].events = 0;
+            if (!client->closing &&
+                buffer_pending(&client->out) < MAX_PENDING_OUTPUT) {
+                fds[i + 1].events |= POLLIN;
+            }
+            if (buffer_pending(&client->out) > 0) {
+                fds[i + 1].events |= POLLOUT;
+            }
+        }
+
+        int nfds = server->num_clients + 1;
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            free(fds);
+            return SERVER_ERROR;
+        }
+
+        // Walk clients backwards so drop_client() can swap in the last one
+        for (int i = nfds - 2; i >= 0; i--) {
+            struct client *client = &server->clients[i];
+            short revents = fds[i + 1].revents;
+            int ok = SERVER_SUCCESS;
+
+            if (revents & (POLLIN | POLLHUP)) {
+                ok = client_readable(server, client);
+            } else if (revents & POLLERR) {
+                ok = SERVER_ERROR;
+            }
+            if (ok == SERVER_SUCCESS) {
+                // Requests held back by MAX_PENDING_OUTPUT may run now
+                ok = client_flush(client);
+                if (ok == SERVER_SUCCESS) {
+                    ok = process_requests(server, client);
+                }
+            }
+            if (ok != SERVER_SUCCESS) {
+                drop_client(server, i);
+            }
+        }
+
+        if (server->durability != HEARTYFS_DURABLE_NONE) {
+            int ret = heartyfs_flush(server->fs, server->durability);
+            if (ret != HEARTYFS_OK) {
+                heartyfs_perror(ret);
+                free(fds);
+                return SERVER_ERROR;
+            }
+        }
+
+        for (int i = server->num_clients - 1; i >= 0; i--) {
+            struct client *client = &server->clients[i];
+            if (client_flush(client) != SERVER_SUCCESS ||
+                (client->closing && buffer_pending(&client->out) == 0)) {
+                drop_client(server, i);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            accept_clients(server);
+        }
+    }
+
+    free(fds);
+    return SERVER_SUCCESS;
+}
+
+/**
+ * @brief Translate a durability level name
+ * @param[in] name none, async or sync
+ * @return HEARTYFS_DURABLE_* level, or -1 if the name is unknown
+ */
+static int parse_durability(const char *name) {
+    if (strcmp(name, "none") == 0) {
+        return HEARTYFS_DURABLE_NONE;
+    }
+    if (strcmp(name, "async") == 0) {
+        return HEARTYFS_DURABLE_ASYNC;
+    }
+    if (strcmp(name, "sync") == 0) {
+        return HEARTYFS_DURABLE_SYNC;
+    }
+    return -1;
+}
+
+/**
+ * @brief Main function of the heartyfs daemon
+ * @param[in] argc Number of command line arguments
+ * @param[in] argv Array of command line arguments
+ * @return 0 on clean shutdown, 1 on failure
+ */
+int main(int argc, char *argv[]) {
+    const char *socket_path = HEARTYFS_SOCKET_PATH;
+    const char *image_path = DISK_FILE_PATH;
+    struct server server;
+    memset(&server, 0, sizeof(server));
+    server.durability = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:i:D:")) != -1) {
+        switch (opt) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'i':
+            image_path = optarg;
+            break;
+        case 'D':
+            server.durability = parse_durability(optarg);
+            if (server.durability < 0) {
+                fprintf(stderr, "Unknown durability level '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-s socket_path] [-i image_path] "
+                    "[-D none|async|sync]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+
+    int ret = heartyfs_mount(image_path, 0, &server.fs);
+    if (ret != HEARTYFS_OK) {
+        heartyfs_perror(ret);
+        return 1;
+    }
+
+    // Journaled images default to sync: one commit per round costs little
+    struct heartyfs_statfs sfs;
+    if (server.durability < 0) {
+        server.durability = heartyfs_statfs(server.fs, &sfs) == HEARTYFS_OK &&
+                                    sfs.journal_blocks > 0
+                                ? HEARTYFS_DURABLE_SYNC
+                                : HEARTYFS_DURABLE_NONE;
+    }
+
+    server.listen_fd = open_listener(socket_path);
+    if (server.listen_fd < 0) {
+        heartyfs_unmount(server.fs);
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("heartyfsd serving %s on %s\n", image_path, socket_path);
+    fflush(stdout);
+    int status = serve(&server);
+
+    while (server.num_clients > 0) {
+        drop_client(&server, server.num_clients - 1);
+    }
+    free(server.clients);
+    close(server.listen_fd);
+    unlink(socket_path);
+    heartyfs_unmount(server.fs);
+    return status == SERVER_SUCCESS ? 0 : 1;
+}
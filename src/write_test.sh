@@ -38,7 +38,72 @@ echo "Test case 5: Try to write from a non-existent external file"
 ./bin/heartyfs_write /test_file.txt nonexistent_external_file.txt
 echo
 
+echo "Test case 6: Write and read back a multi-block file"
+head -c 200000 /dev/urandom > external_file_multi.bin
+./bin/heartyfs_write /test_file.txt external_file_multi.bin
+./bin/heartyfs_read /test_file.txt | cmp - external_file_multi.bin && echo "Contents match"
+echo
+
+echo "Test case 7: Stream a file of unknown length from stdin"
+head -c 300000 /dev/urandom > external_file_stream.bin
+cat external_file_stream.bin | ./bin/heartyfs_write /test_file.txt -
+./bin/heartyfs_read /test_file.txt | cmp - external_file_stream.bin && echo "Contents match"
+echo
+
+echo "Test case 8: Overwrite part of a file in place"
+printf 'TEST' > external_file_patch.txt
+./bin/heartyfs_write /test_dir/nested_file.txt external_file.txt
+./bin/heartyfs_write --offset 10 /test_dir/nested_file.txt external_file_patch.txt
+./bin/heartyfs_read /test_dir/nested_file.txt
+echo
+
+echo "Test case 9: Append to a file"
+./bin/heartyfs_write --append /test_dir/nested_file.txt external_file.txt
+./bin/heartyfs_read /test_dir/nested_file.txt
+echo
+
+echo "Test case 10: Grow a small inline file past its inode block"
+head -c 400 /dev/urandom > external_file_small.bin
+./bin/heartyfs_write /test_file.txt external_file_small.bin
+./bin/heartyfs_write --append /test_file.txt external_file_small.bin
+./bin/heartyfs_read /test_file.txt | cmp - <(cat external_file_small.bin external_file_small.bin) &&
+    echo "Contents match"
+echo
+
+echo "Test case 11: Pack the tails of small files into shared blocks"
+./bin/heartyfs_init -T > /dev/null
+head -c 1100 /dev/urandom > external_file_tail.bin
+for i in 1 2 3 4; do
+    ./bin/heartyfs_creat /tail_$i.txt > /dev/null
+    ./bin/heartyfs_write /tail_$i.txt external_file_tail.bin > /dev/null
+done
+./bin/heartyfs_read /tail_4.txt | cmp - external_file_tail.bin && echo "Contents match"
+./bin/heartyfs_write --append /tail_1.txt external_file_small.bin
+./bin/heartyfs_read /tail_1.txt |
+    cmp - <(cat external_file_tail.bin external_file_small.bin) &&
+    echo "Contents match"
+echo
+
+echo "Test case 12: Compress a file, then patch it in place"
+for i in $(seq 2000); do
+    echo "{\"seq\": $i, \"level\": \"INFO\", \"msg\": \"request handled\"}"
+done > external_file_log.txt
+./bin/heartyfs_creat /log.txt > /dev/null
+./bin/heartyfs_write --compress /log.txt external_file_log.txt
+./bin/heartyfs_read /log.txt | cmp - external_file_log.txt && echo "Contents match"
+./bin/heartyfs_write --offset 30000 /log.txt external_file_patch.txt
+cp external_file_log.txt external_file_log_patched.txt
+dd if=external_file_patch.txt of=external_file_log_patched.txt bs=1 \
+    seek=30000 conv=notrunc status=none
+./bin/heartyfs_read /log.txt | cmp - external_file_log_patched.txt &&
+    echo "Patched contents match"
+./bin/heartyfs_write --compress /log.txt external_file_small.bin
+./bin/heartyfs_read /log.txt | cmp - external_file_small.bin && echo "Contents match"
+echo
+
 # Clean up
-rm external_file.txt external_file_large.txt
+rm external_file.txt external_file_large.txt external_file_multi.bin \
+   external_file_stream.bin external_file_patch.txt external_file_small.bin \
+   external_file_tail.bin external_file_log.txt external_file_log_patched.txt
 
 echo "Test completed."
\ No newline at end of file